@@ -27,10 +27,35 @@
 #define TILE_TYPE_LINEAR 0
 /* DRI backend decides tiling in this case. */
 #define TILE_TYPE_DRI 1
+/* GFX9+ 64 KiB standard swizzle, laid out here without going through DRI. */
+#define TILE_TYPE_GFX9_64K_S 2
+
+#ifndef AMD_FMT_MOD
+#define AMD_FMT_MOD fourcc_mod_code(AMD, 0)
+#define AMD_FMT_MOD_TILE_VERSION_SHIFT 0
+#define AMD_FMT_MOD_TILE_SHIFT 8
+#define AMD_FMT_MOD_SET(field, value) ((uint64_t)(value) << AMD_FMT_MOD_##field##_SHIFT)
+#define AMD_FMT_MOD_TILE_VER_GFX9 1
+#define AMD_FMT_MOD_TILE_GFX9_64K_S 9
+#endif
+
+#define AMDGPU_MOD_GFX9_64K_S                                                                      \
+	(AMD_FMT_MOD | AMD_FMT_MOD_SET(TILE_VERSION, AMD_FMT_MOD_TILE_VER_GFX9) |                  \
+	 AMD_FMT_MOD_SET(TILE, AMD_FMT_MOD_TILE_GFX9_64K_S))
+
+/* ADDR_SW_64KB_S, the swizzle mode the GEM metadata uses for AMD_FMT_MOD_TILE_GFX9_64K_S. */
+#define AMDGPU_SWIZZLE_64KB_S 9
+#define AMDGPU_GFX9_BLOCK_SIZE 65536
+
+/* From newer <amdgpu_drm.h>. Navi is GFX10, whose 64K_S modifiers are encoded differently. */
+#ifndef AMDGPU_FAMILY_NV
+#define AMDGPU_FAMILY_NV 143
+#endif
 
 struct amdgpu_priv {
 	struct dri_driver dri;
 	int drm_version;
+	uint32_t family;
 };
 
 const static uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -41,10 +66,69 @@ const static uint32_t texture_source_formats[] = { DRM_FORMAT_BGR888, DRM_FORMAT
 						   DRM_FORMAT_R8,     DRM_FORMAT_NV21,
 						   DRM_FORMAT_NV12,   DRM_FORMAT_YVU420_ANDROID };
 
+static int amdgpu_query_family(struct driver *drv, uint32_t *family)
+{
+	int ret;
+	struct drm_amdgpu_info request;
+	struct drm_amdgpu_info_device dev_info;
+
+	memset(&request, 0, sizeof(request));
+	memset(&dev_info, 0, sizeof(dev_info));
+	request.return_pointer = (uintptr_t)&dev_info;
+	request.return_size = sizeof(dev_info);
+	request.query = AMDGPU_INFO_DEV_INFO;
+
+	ret = drmCommandWrite(drv_get_fd(drv), DRM_AMDGPU_INFO, &request, sizeof(request));
+	if (ret) {
+		drv_log("AMDGPU_INFO_DEV_INFO failed with %d\n", ret);
+		return ret;
+	}
+
+	*family = dev_info.family;
+	return 0;
+}
+
+static bool amdgpu_has_gfx9_tiling(struct driver *drv)
+{
+	struct amdgpu_priv *priv = drv->priv;
+	return priv->family >= AMDGPU_FAMILY_AI && priv->family < AMDGPU_FAMILY_NV;
+}
+
+static bool amdgpu_is_render_target_format(uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_SIZE(render_target_formats); i++) {
+		if (render_target_formats[i] == format)
+			return true;
+	}
+
+	return false;
+}
+
+static int amdgpu_add_kms_item(struct driver *drv, const struct kms_item *item)
+{
+	uint32_t i;
+	struct combination *combo;
+
+	/* Only the natively tiled combinations need the planes to say they can scan them out. */
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
+		if (combo->metadata.tiling == TILE_TYPE_GFX9_64K_S &&
+		    combo->format == item->format && combo->metadata.modifier == item->modifier)
+			combo->use_flags |= item->use_flags & BO_USE_SCANOUT;
+	}
+
+	return 0;
+}
+
 static int amdgpu_init(struct driver *drv)
 {
+	int ret;
+	uint32_t i;
 	struct amdgpu_priv *priv;
 	drmVersionPtr drm_version;
+	struct drv_array *kms_items;
 	struct format_metadata metadata;
 	uint64_t use_flags = BO_USE_RENDER_MASK;
 
@@ -61,6 +145,10 @@ static int amdgpu_init(struct driver *drv)
 	priv->drm_version = drm_version->version_minor;
 	drmFreeVersion(drm_version);
 
+	/* Without the family, only the DRI backend picks tiled layouts. */
+	if (amdgpu_query_family(drv, &priv->family))
+		priv->family = 0;
+
 	drv->priv = priv;
 
 	if (dri_init(drv, DRI_PATH, "radeonsi")) {
@@ -119,6 +207,35 @@ static int amdgpu_init(struct driver *drv)
 	drv_modify_combination(drv, DRM_FORMAT_XRGB8888, &metadata, BO_USE_CURSOR | BO_USE_SCANOUT);
 	drv_modify_combination(drv, DRM_FORMAT_ABGR8888, &metadata, BO_USE_SCANOUT);
 	drv_modify_combination(drv, DRM_FORMAT_XBGR8888, &metadata, BO_USE_SCANOUT);
+
+	if (!amdgpu_has_gfx9_tiling(drv))
+		return 0;
+
+	/*
+	 * On GFX9 and later, render targets are tiled natively with one GEM_CREATE instead of a
+	 * round trip through a DRI image. Scanout is only added if the planes report the modifier.
+	 * These bos are mapped without detiling, so buffers the CPU touches stay with DRI.
+	 */
+	metadata.tiling = TILE_TYPE_GFX9_64K_S;
+	metadata.priority = 3;
+	metadata.modifier = AMDGPU_MOD_GFX9_64K_S;
+
+	use_flags &= ~BO_USE_SW_READ_RARELY;
+	use_flags &= ~BO_USE_SW_WRITE_RARELY;
+
+	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
+			     &metadata, use_flags);
+
+	kms_items = drv_query_kms(drv);
+	if (!kms_items)
+		return 0;
+
+	for (i = 0; i < drv_array_size(kms_items); i++) {
+		ret = amdgpu_add_kms_item(drv, (struct kms_item *)drv_array_at_idx(kms_items, i));
+		if (ret)
+			return ret;
+	}
+
 	return 0;
 }
 
@@ -129,18 +246,106 @@ static void amdgpu_close(struct driver *drv)
 	drv->priv = NULL;
 }
 
-static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			    uint64_t use_flags)
+static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags)
 {
 	int ret;
 	uint32_t plane, stride;
-	struct combination *combo;
 	union drm_amdgpu_gem_create gem_create;
 
+	stride = drv_stride_from_format(format, width, 0);
+	stride = ALIGN(stride,256);
+
+	drv_bo_from_format(bo, stride, height, format);
+
+	memset(&gem_create, 0, sizeof(gem_create));
+	gem_create.in.bo_size = bo->total_size;
+	gem_create.in.alignment = 256;
+	gem_create.in.domain_flags = 0;
+
+	if (use_flags & (BO_USE_LINEAR | BO_USE_SW_MASK))
+		gem_create.in.domain_flags |= AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED;
+
+	gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+	if (!(use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SCANOUT)))
+		gem_create.in.domain_flags |= AMDGPU_GEM_CREATE_CPU_GTT_USWC;
+
+	/* Allocate the buffer with the preferred heap. */
+	ret = drmCommandWriteRead(drv_get_fd(bo->drv), DRM_AMDGPU_GEM_CREATE, &gem_create,
+				  sizeof(gem_create));
+	if (ret < 0)
+		return ret;
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->handles[plane].u32 = gem_create.out.handle;
+
+	return 0;
+}
+
+/*
+ * The 64 KiB standard swizzle stores the surface as a row-major grid of 64 KiB blocks, each
+ * covering 2^ceil(n/2) x 2^floor(n/2) pixels for 2^n pixels per block. The pitch and height
+ * are padded to whole blocks.
+ */
+static int amdgpu_create_bo_gfx9(struct bo *bo, uint32_t width, uint32_t height, uint32_t format)
+{
+	int ret;
+	uint32_t plane, bytes_per_pixel, block_bits, block_width, block_height;
+	union drm_amdgpu_gem_create gem_create;
+	struct drm_amdgpu_gem_metadata metadata;
+
+	bytes_per_pixel = drv_bytes_per_pixel_from_format(format, 0);
+	block_bits = __builtin_ctz(AMDGPU_GFX9_BLOCK_SIZE / bytes_per_pixel);
+	block_width = 1 << DIV_ROUND_UP(block_bits, 2);
+	block_height = 1 << (block_bits / 2);
+
+	drv_bo_from_format(bo, ALIGN(width, block_width) * bytes_per_pixel,
+			   ALIGN(height, block_height), format);
+
+	memset(&gem_create, 0, sizeof(gem_create));
+	gem_create.in.bo_size = bo->total_size;
+	gem_create.in.alignment = AMDGPU_GFX9_BLOCK_SIZE;
+	gem_create.in.domains = AMDGPU_GEM_DOMAIN_VRAM;
+
+	ret = drmCommandWriteRead(drv_get_fd(bo->drv), DRM_AMDGPU_GEM_CREATE, &gem_create,
+				  sizeof(gem_create));
+	if (ret < 0)
+		return ret;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		bo->handles[plane].u32 = gem_create.out.handle;
+		bo->format_modifiers[plane] = AMDGPU_MOD_GFX9_64K_S;
+	}
+
+	/* Importers that don't get the modifier find the swizzle mode in the GEM metadata. */
+	memset(&metadata, 0, sizeof(metadata));
+	metadata.handle = gem_create.out.handle;
+	metadata.op = AMDGPU_GEM_METADATA_OP_SET_METADATA;
+	metadata.data.tiling_info = AMDGPU_TILING_SET(SWIZZLE_MODE, AMDGPU_SWIZZLE_64KB_S);
+
+	ret = drmCommandWriteRead(drv_get_fd(bo->drv), DRM_AMDGPU_GEM_METADATA, &metadata,
+				  sizeof(metadata));
+	if (ret < 0) {
+		drv_log("DRM_AMDGPU_GEM_METADATA failed with %d\n", ret);
+		drv_gem_bo_destroy(bo);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags)
+{
+	struct combination *combo;
+
 	combo = drv_get_combination(bo->drv, format, use_flags);
 	if (!combo)
 		return -EINVAL;
 
+	if (combo->metadata.tiling == TILE_TYPE_GFX9_64K_S)
+		return amdgpu_create_bo_gfx9(bo, width, height, format);
+
 	if (combo->metadata.tiling == TILE_TYPE_DRI) {
 		bool needs_alignment = false;
 #ifdef __ANDROID__
@@ -166,46 +371,53 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 		return dri_bo_create(bo, width, height, format, use_flags);
 	}
 
-	stride = drv_stride_from_format(format, width, 0);
-	stride = ALIGN(stride,256);
-
-	drv_bo_from_format(bo, stride, height, format);
-
-	memset(&gem_create, 0, sizeof(gem_create));
-	gem_create.in.bo_size = bo->total_size;
-	gem_create.in.alignment = 256;
-	gem_create.in.domain_flags = 0;
-
-	if (use_flags & (BO_USE_LINEAR | BO_USE_SW_MASK))
-		gem_create.in.domain_flags |= AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED;
-
-	gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
-	if (!(use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SCANOUT)))
-		gem_create.in.domain_flags |= AMDGPU_GEM_CREATE_CPU_GTT_USWC;
+	return amdgpu_create_bo_linear(bo, width, height, format, use_flags);
+}
 
-	/* Allocate the buffer with the preferred heap. */
-	ret = drmCommandWriteRead(drv_get_fd(bo->drv), DRM_AMDGPU_GEM_CREATE, &gem_create,
-				  sizeof(gem_create));
-	if (ret < 0)
-		return ret;
+static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					   uint32_t format, const uint64_t *modifiers,
+					   uint32_t count)
+{
+	bool gfx9 = amdgpu_has_gfx9_tiling(bo->drv) && amdgpu_is_render_target_format(format);
+	bool linear = false;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (gfx9 && modifiers[i] == AMDGPU_MOD_GFX9_64K_S)
+			return amdgpu_create_bo_gfx9(bo, width, height, format);
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			linear = true;
+	}
 
-	for (plane = 0; plane < bo->num_planes; plane++)
-		bo->handles[plane].u32 = gem_create.out.handle;
+	if (!linear) {
+		errno = EINVAL;
+		drv_log("no usable modifier found\n");
+		return -EINVAL;
+	}
 
-	return 0;
+	return amdgpu_create_bo_linear(bo, width, height, format, bo->use_flags);
 }
 
 static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
 {
 	struct combination *combo;
+
+	/* The layout of natively tiled buffers is fully described by the import data. */
+	if (data->format_modifiers[0] == AMDGPU_MOD_GFX9_64K_S)
+		return drv_prime_bo_import(bo, data);
+
 	combo = drv_get_combination(bo->drv, data->format, data->use_flags);
 	if (!combo)
 		return -EINVAL;
 
-	if (combo->metadata.tiling == TILE_TYPE_DRI)
-		return dri_bo_import(bo, data);
-	else
+	/*
+	 * Without the modifier, a buffer that may be tiled is taken to come from DRI, which
+	 * picked a layout only it knows how to map.
+	 */
+	if (combo->metadata.tiling == TILE_TYPE_LINEAR)
 		return drv_prime_bo_import(bo, data);
+	else
+		return dri_bo_import(bo, data);
 }
 
 static int amdgpu_destroy_bo(struct bo *bo)
@@ -235,8 +447,7 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 
 	vma->length = bo->total_size;
 
-	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.out.addr_ptr);
+	return drv_mmap(bo->total_size, map_flags, bo->drv->fd, gem_map.out.addr_ptr, false);
 }
 
 static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
@@ -247,6 +458,12 @@ static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
 		return munmap(vma->addr, vma->length);
 }
 
+static bool amdgpu_bo_unmap_writes_back(struct bo *bo)
+{
+	/* Mesa may map DRI bos through a staging copy that is only written back at unmap. */
+	return bo->priv != NULL;
+}
+
 static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
@@ -273,6 +490,33 @@ static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+static int amdgpu_bo_busy(struct bo *bo, uint32_t map_flags)
+{
+	int ret;
+	union drm_amdgpu_gem_wait_idle wait_idle;
+
+	/* DRI bos have a GEM handle too, checking it keeps their maps from blocking in Mesa. */
+	memset(&wait_idle, 0, sizeof(wait_idle));
+	wait_idle.in.handle = bo->handles[0].u32;
+	wait_idle.in.timeout = 0;
+
+	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_WAIT_IDLE, &wait_idle,
+				  sizeof(wait_idle));
+	if (ret < 0)
+		return ret;
+
+	return wait_idle.out.status ? 1 : 0;
+}
+
+static int amdgpu_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	/* Only DRI images can be blitted, natively allocated bos are copied by the CPU. */
+	if (!dst->priv || !src->priv)
+		return -EOPNOTSUPP;
+
+	return dri_bo_copy(dst, src, rect);
+}
+
 static uint32_t amdgpu_resolve_format(uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -294,11 +538,15 @@ const struct backend backend_amdgpu = {
 	.init = amdgpu_init,
 	.close = amdgpu_close,
 	.bo_create = amdgpu_create_bo,
+	.bo_create_with_modifiers = amdgpu_create_bo_with_modifiers,
 	.bo_destroy = amdgpu_destroy_bo,
 	.bo_import = amdgpu_import_bo,
 	.bo_map = amdgpu_map_bo,
 	.bo_unmap = amdgpu_unmap_bo,
+	.bo_unmap_writes_back = amdgpu_bo_unmap_writes_back,
 	.bo_invalidate = amdgpu_bo_invalidate,
+	.bo_busy = amdgpu_bo_busy,
+	.bo_copy = amdgpu_bo_copy,
 	.resolve_format = amdgpu_resolve_format,
 };
 
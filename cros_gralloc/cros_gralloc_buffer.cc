@@ -7,11 +7,60 @@
 #include "cros_gralloc_buffer.h"
 
 #include <assert.h>
+#include <new>
 #include <sys/mman.h>
 
+/* Upper bound on the number of freed buffers kept for reuse. */
+static const size_t buffer_pool_max = 64;
+
+struct free_buffer {
+	struct free_buffer *next;
+};
+
+static std::mutex buffer_pool_mutex;
+static struct free_buffer *buffer_pool;
+static size_t buffer_pool_size;
+
+void *cros_gralloc_buffer::operator new(size_t size)
+{
+	assert(size == sizeof(cros_gralloc_buffer));
+
+	{
+		std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+		if (buffer_pool) {
+			struct free_buffer *storage = buffer_pool;
+			buffer_pool = storage->next;
+			buffer_pool_size--;
+			return storage;
+		}
+	}
+
+	return ::operator new(size);
+}
+
+void cros_gralloc_buffer::operator delete(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+		if (buffer_pool_size < buffer_pool_max) {
+			auto storage = static_cast<struct free_buffer *>(ptr);
+			storage->next = buffer_pool;
+			buffer_pool = storage;
+			buffer_pool_size++;
+			return;
+		}
+	}
+
+	::operator delete(ptr);
+}
+
 cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 					 struct cros_gralloc_handle *acquire_handle)
-    : id_(id), bo_(acquire_bo), hnd_(acquire_handle), refcount_(1), lockcount_(0)
+    : id_(id), bo_(acquire_bo), hnd_(acquire_handle), refcount_(1), lockcount_(0),
+      flush_pending_(false)
 {
 	assert(bo_);
 	num_planes_ = drv_bo_get_num_planes(bo_);
@@ -21,6 +70,8 @@ cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 
 cros_gralloc_buffer::~cros_gralloc_buffer()
 {
+	unmap();
+
 	drv_bo_destroy(bo_);
 	if (hnd_) {
 		native_handle_close(&hnd_->base);
@@ -44,56 +95,185 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 	return --refcount_;
 }
 
+/*
+ * Returns the first plane that lives in the same kernel buffer as plane. Only that plane gets a
+ * mapping, the others are reached through it.
+ */
+uint32_t cros_gralloc_buffer::get_mapped_plane(uint32_t plane) const
+{
+	uint32_t handle = drv_bo_get_plane_handle(bo_, plane).u32;
+
+	for (uint32_t other = 0; other < plane; other++) {
+		if (drv_bo_get_plane_handle(bo_, other).u32 == handle)
+			return other;
+	}
+
+	return plane;
+}
+
+/*
+ * Writes back every mapping of the bo. Bos that are only written back when unmapping get their
+ * mappings dropped. Assumes the buffer lock is held.
+ */
+void cros_gralloc_buffer::flush()
+{
+	bool drop_mappings = drv_bo_unmap_writes_back(bo_);
+
+	for (uint32_t plane = 0; plane < num_planes_; plane++) {
+		if (!lock_data_[plane])
+			continue;
+
+		if (drop_mappings) {
+			drv_bo_unmap(bo_, lock_data_[plane]);
+			lock_data_[plane] = nullptr;
+		} else {
+			drv_bo_flush(bo_, lock_data_[plane]);
+		}
+	}
+
+	flush_pending_ = false;
+}
+
+/* Unmaps every kernel buffer of the bo. Assumes the buffer lock is held. */
+void cros_gralloc_buffer::unmap()
+{
+	/* A deferred flush must not be lost with the mappings. */
+	if (flush_pending_)
+		flush();
+
+	for (uint32_t plane = 0; plane < num_planes_; plane++) {
+		if (lock_data_[plane]) {
+			drv_bo_unmap(bo_, lock_data_[plane]);
+			lock_data_[plane] = nullptr;
+		}
+	}
+}
+
 int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_flags,
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
-	void *vaddr = nullptr;
+	void *vaddr[DRV_MAX_PLANES] = { nullptr };
+	struct rectangle whole = { 0, 0, drv_bo_get_width(bo_), drv_bo_get_height(bo_) };
+	std::lock_guard<std::mutex> lock(mutex_);
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
-	/*
-	 * Gralloc consumers don't support more than one kernel buffer per buffer object yet, so
-	 * just use the first kernel buffer.
-	 */
-	if (drv_num_buffers_per_bo(bo_) != 1) {
-		drv_log("Can only support one buffer per bo.\n");
-		return -EINVAL;
-	}
+	/* The worker has usually gotten to it already, but the caller may be faster. */
+	if (flush_pending_)
+		flush();
 
 	if (map_flags) {
-		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
-			vaddr = lock_data_[0]->vma->addr;
-		} else {
-			vaddr = drv_bo_map(bo_, rect, map_flags, &lock_data_[0], 0);
+		/* A mapping kept from an earlier lock may lack the access that is asked for now. */
+		for (uint32_t plane = 0; plane < num_planes_ && !lockcount_; plane++) {
+			if (lock_data_[plane] &&
+			    (lock_data_[plane]->vma->map_flags & map_flags) != map_flags) {
+				unmap();
+				break;
+			}
 		}
 
-		if (vaddr == MAP_FAILED) {
-			drv_log("Mapping failed.\n");
-			return -EFAULT;
+		for (uint32_t plane = 0; plane < num_planes_; plane++) {
+			if (get_mapped_plane(plane) != plane)
+				continue;
+
+			/*
+			 * Gralloc callers promise to only modify pixels within the locked rectangle,
+			 * so the flush at unlock time can be limited to the union of the locked
+			 * rectangles. Dirty tracking only follows the first kernel buffer, the
+			 * others are written back whole.
+			 */
+			if (lock_data_[plane]) {
+				drv_bo_invalidate(bo_, lock_data_[plane]);
+				if (map_flags & BO_MAP_WRITE)
+					drv_bo_mark_dirty(bo_, lock_data_[plane],
+							  rect->width && rect->height && !plane
+							      ? rect
+							      : &whole);
+				vaddr[plane] = lock_data_[plane]->vma->addr;
+				continue;
+			}
+
+			vaddr[plane] = drv_bo_map(bo_, rect, map_flags | BO_MAP_DIRTY_RECT,
+						  &lock_data_[plane], plane);
+			if (vaddr[plane] == MAP_FAILED) {
+				drv_log("Mapping failed.\n");
+				if (!lockcount_)
+					unmap();
+				return -EFAULT;
+			}
+
+			vaddr[plane] = lock_data_[plane]->vma->addr;
 		}
-	}
 
-	for (uint32_t plane = 0; plane < num_planes_; plane++)
-		addr[plane] = static_cast<uint8_t *>(vaddr) + drv_bo_get_plane_offset(bo_, plane);
+		for (uint32_t plane = 0; plane < num_planes_; plane++)
+			addr[plane] = static_cast<uint8_t *>(vaddr[get_mapped_plane(plane)]) +
+				      drv_bo_get_plane_offset(bo_, plane);
+	}
 
 	lockcount_++;
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::unlock(bool *flush_deferred)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
 		return -EINVAL;
 	}
 
+	if (flush_deferred)
+		*flush_deferred = false;
+
+	/*
+	 * Unless only unmapping writes the bo back, the mappings are kept for the next lock()
+	 * until cros_gralloc_driver evicts them.
+	 */
 	if (!--lockcount_) {
-		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
-			lock_data_[0] = nullptr;
+		if (flush_deferred) {
+			for (uint32_t plane = 0; plane < num_planes_; plane++)
+				flush_pending_ |= lock_data_[plane] != nullptr;
+			*flush_deferred = flush_pending_;
+		} else {
+			flush();
 		}
 	}
 
 	return 0;
 }
+
+void cros_gralloc_buffer::flush_deferred()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (flush_pending_)
+		flush();
+}
+
+size_t cros_gralloc_buffer::get_idle_mapping_size()
+{
+	size_t size = 0;
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (lockcount_)
+		return 0;
+
+	for (uint32_t plane = 0; plane < num_planes_; plane++) {
+		if (lock_data_[plane])
+			size += lock_data_[plane]->vma->length;
+	}
+
+	return size;
+}
+
+bool cros_gralloc_buffer::evict_mapping()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (lockcount_)
+		return false;
+
+	unmap();
+	return true;
+}
@@ -10,6 +10,8 @@
 #include "../drv.h"
 #include "cros_gralloc_helpers.h"
 
+#include <mutex>
+
 class cros_gralloc_buffer
 {
       public:
@@ -17,6 +19,10 @@ class cros_gralloc_buffer
 			    struct cros_gralloc_handle *acquire_handle);
 	~cros_gralloc_buffer();
 
+	/* Buffers come and go with every import, so freed ones are kept around for reuse. */
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr);
+
 	uint32_t get_id() const;
 
 	/* The new reference count is returned by both these functions. */
@@ -25,12 +31,26 @@ class cros_gralloc_buffer
 
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+	/*
+	 * If flush_deferred is given, the flush of the last unlock is left to flush_deferred() and
+	 * *flush_deferred tells whether there is one.
+	 */
+	int32_t unlock(bool *flush_deferred = nullptr);
+	void flush_deferred();
+
+	/* Size of the mapping kept while the buffer is not locked, or 0. */
+	size_t get_idle_mapping_size();
+	/* Unmaps the kept mapping, unless the buffer got locked again. */
+	bool evict_mapping();
 
       private:
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
 	cros_gralloc_buffer operator=(cros_gralloc_buffer const &);
 
+	uint32_t get_mapped_plane(uint32_t plane) const;
+	void flush();
+	void unmap();
+
 	uint32_t id_;
 	struct bo *bo_;
 	struct cros_gralloc_handle *hnd_;
@@ -38,7 +58,14 @@ class cros_gralloc_buffer
 	int32_t refcount_;
 	int32_t lockcount_;
 	uint32_t num_planes_;
+	bool flush_pending_;
 
+	/*
+	 * Protects lockcount_, flush_pending_ and lock_data_, lock() and unlock() may race with
+	 * each other.
+	 * lock_data_ has one mapping per kernel buffer, at the first plane that lives in it.
+	 */
+	std::mutex mutex_;
 	struct mapping *lock_data_[DRV_MAX_PLANES];
 };
 
@@ -5,18 +5,68 @@
  */
 
 #include "cros_gralloc_driver.h"
+#include "../drv_trace.h"
 #include "../util.h"
 
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <cutils/properties.h>
 #include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
 #include <xf86drm.h>
 
-cros_gralloc_driver::cros_gralloc_driver() : drv_(nullptr)
+/* Upper bound on the memory kept mapped for buffers that are not locked. */
+static const size_t mapping_cache_max_bytes = 64 * 1024 * 1024;
+
+/* Records the calls of drv to the log the property names, if any, see drv_record_start(). */
+static void record_from_property(struct driver *drv)
+{
+	char prefix[PROPERTY_VALUE_MAX];
+	char path[PROPERTY_VALUE_MAX + 16];
+
+	property_get("vendor.minigbm.record", prefix, "");
+	if (!prefix[0])
+		return;
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, static_cast<int>(getpid()));
+	drv_record_start(drv, path);
+}
+
+/* Fills in a record for a call on the buffer of hnd that doesn't go through its bo. */
+static void record_handle(struct drv_record *record, cros_gralloc_handle_t hnd, uint32_t id)
+{
+	record->id = id;
+	record->format = hnd->format;
+	record->width = hnd->width;
+	record->height = hnd->height;
+	record->use_flags = static_cast<uint64_t>(hnd->use_flags[0]) << 32 | hnd->use_flags[1];
+}
+
+cros_gralloc_driver::cros_gralloc_driver()
+    : drv_(nullptr), mapping_cache_bytes_(0), flush_current_(nullptr), flush_seqno_(0),
+      flush_exit_(false), flush_timeline_(-1)
 {
 }
 
 cros_gralloc_driver::~cros_gralloc_driver()
 {
+	if (flush_thread_.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(flush_mutex_);
+			flush_exit_ = true;
+		}
+		flush_cond_.notify_all();
+		flush_thread_.join();
+	}
+
+	if (flush_timeline_ >= 0)
+		close(flush_timeline_);
+
+	mapping_lru_.clear();
+	mapping_cache_.clear();
 	buffers_.clear();
 	handles_.clear();
 
@@ -33,49 +83,54 @@ int cros_gralloc_driver::get_fd() const {
 int32_t cros_gralloc_driver::init()
 {
 	/*
-	 * Create a driver from rendernode while filtering out
-	 * the specified undesired driver.
+	 * Create a driver on the device named by the property, or else on the first render node
+	 * that isn't vgem, see drv_create_for_usage().
 	 *
 	 * TODO(gsingh): Enable render nodes on udl/evdi.
 	 */
 
-	int fd;
-	drmVersionPtr version;
-	char const *str = "%s/renderD%d";
-	const char *undesired[2] = { "vgem", nullptr };
-	uint32_t num_nodes = 63;
-	uint32_t min_node = 128;
-	uint32_t max_node = (min_node + num_nodes);
-
-	for (uint32_t i = 0; i < ARRAY_SIZE(undesired); i++) {
-		for (uint32_t j = min_node; j < max_node; j++) {
-			char *node;
-			if (asprintf(&node, str, DRM_DIR_NAME, j) < 0)
-				continue;
-
-			fd = open(node, O_RDWR | O_CLOEXEC, 0);
-			free(node);
-
-			if (fd < 0)
-				continue;
-
-			version = drmGetVersion(fd);
-			if (!version)
-				continue;
-
-			if (undesired[i] && !strcmp(version->name, undesired[i])) {
-				drmFreeVersion(version);
-				continue;
-			}
-
-			drmFreeVersion(version);
-			drv_ = drv_create(fd);
-			if (drv_)
-				return 0;
+	static std::mutex probe_mutex;
+	static std::string probed_node;
+	std::lock_guard<std::mutex> lock(probe_mutex);
+	char selector[PROPERTY_VALUE_MAX];
+	char *node;
+
+	/* Later drivers in the same process go straight to the node that worked before. */
+	if (!probed_node.empty()) {
+		drv_ = drv_create_for_usage(probed_node.c_str(), BO_USE_NONE);
+		if (drv_) {
+			record_from_property(drv_);
+			return 0;
 		}
+		probed_node.clear();
 	}
 
-	return -ENODEV;
+	/*
+	 * A cold start goes to the node an earlier process of this boot probed, which it left in
+	 * vendor.minigbm.probed_device. That needs sepolicy letting gralloc users set and read
+	 * it. Without that the property stays empty and every process probes.
+	 */
+	bool no_selector = !property_get("vendor.minigbm.device", selector, "");
+	if (no_selector) {
+		property_get("vendor.minigbm.probed_device", selector, "");
+		if (selector[0] && access(selector, R_OK | W_OK))
+			selector[0] = '\0';
+	}
+
+	drv_ = drv_create_for_usage(selector, BO_USE_NONE);
+	if (!drv_)
+		return -ENODEV;
+
+	node = drmGetDeviceNameFromFd2(drv_get_fd(drv_));
+	if (node) {
+		probed_node = node;
+		if (no_selector && strcmp(selector, node))
+			property_set("vendor.minigbm.probed_device", node);
+		free(node);
+	}
+
+	record_from_property(drv_);
+	return 0;
 }
 
 int cros_gralloc_driver::init_master()
@@ -99,47 +154,14 @@ bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descript
 	return (combo != nullptr);
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      buffer_handle_t *out_handle)
+cros_gralloc_handle *cros_gralloc_driver::create_handle(
+    struct bo *bo, const struct cros_gralloc_buffer_descriptor *descriptor)
 {
-	uint32_t id;
 	uint64_t mod;
 	size_t num_planes;
-	uint32_t resolved_format;
 	uint32_t bytes_per_pixel;
-	uint64_t use_flags;
-
-	struct bo *bo;
 	struct cros_gralloc_handle *hnd;
 
-	resolved_format = drv_resolve_format(drv_, descriptor->drm_format, descriptor->use_flags);
-	use_flags = descriptor->use_flags;
-	/*
-	 * TODO(b/79682290): ARC++ assumes NV12 is always linear and doesn't
-	 * send modifiers across Wayland protocol, so we or in the
-	 * BO_USE_LINEAR flag here. We need to fix ARC++ to allocate and work
-	 * with tiled buffers.
-	 */
-	if (resolved_format == DRM_FORMAT_NV12)
-		use_flags |= BO_USE_LINEAR;
-
-	bo = drv_bo_create(drv_, descriptor->width, descriptor->height, resolved_format, use_flags);
-	if (!bo) {
-		drv_log("Failed to create bo.\n");
-		return -ENOMEM;
-	}
-
-	/*
-	 * If there is a desire for more than one kernel buffer, this can be
-	 * removed once the ArcCodec and Wayland service have the ability to
-	 * send more than one fd. GL/Vulkan drivers may also have to modified.
-	 */
-	if (drv_num_buffers_per_bo(bo) != 1) {
-		drv_bo_destroy(bo);
-		drv_log("Can only support one buffer per bo.\n");
-		return -EINVAL;
-	}
-
 	hnd = new cros_gralloc_handle();
 	num_planes = drv_bo_get_num_planes(bo);
 
@@ -151,6 +173,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 		hnd->fds[plane] = drv_bo_get_plane_fd(bo, plane);
 		hnd->strides[plane] = drv_bo_get_plane_stride(bo, plane);
 		hnd->offsets[plane] = drv_bo_get_plane_offset(bo, plane);
+		hnd->sizes[plane] = drv_bo_get_plane_size(bo, plane);
 
 		mod = drv_bo_get_plane_format_modifier(bo, plane);
 		hnd->format_modifiers[2 * plane] = static_cast<uint32_t>(mod >> 32);
@@ -160,6 +183,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->width = drv_bo_get_width(bo);
 	hnd->height = drv_bo_get_height(bo);
 	hnd->format = drv_bo_get_format(bo);
+	hnd->tiling = drv_bo_get_tiling(bo);
 	hnd->use_flags[0] = static_cast<uint32_t>(descriptor->use_flags >> 32);
 	hnd->use_flags[1] = static_cast<uint32_t>(descriptor->use_flags);
 	bytes_per_pixel = drv_bytes_per_pixel_from_format(hnd->format, 0);
@@ -168,19 +192,87 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->droid_format = descriptor->droid_format;
 	hnd->usage = descriptor->producer_usage;
 
-	id = drv_bo_get_plane_handle(bo, 0).u32;
-	auto buffer = new cros_gralloc_buffer(id, bo, hnd);
+	return hnd;
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      buffer_handle_t *out_handle)
+{
+	return allocate_array(descriptor, 1, out_handle);
+}
+
+int32_t cros_gralloc_driver::allocate_array(const struct cros_gralloc_buffer_descriptor *descriptor,
+					    uint32_t count, buffer_handle_t *out_handles)
+{
+	DRV_TRACE_SCOPE("cros_gralloc_driver::allocate_array");
+	int32_t ret;
+	uint32_t id;
+	uint32_t resolved_format;
+	uint64_t use_flags;
+	struct drv_record record;
+	int recording;
+	std::vector<struct bo *> bos(count);
+	std::vector<cros_gralloc_handle *> hnds(count);
+	std::vector<cros_gralloc_buffer *> buffers(count);
+
+	resolved_format = drv_resolve_format(drv_, descriptor->drm_format, descriptor->use_flags);
+	use_flags = descriptor->use_flags;
+	/*
+	 * TODO(b/79682290): ARC++ assumes NV12 is always linear and doesn't
+	 * send modifiers across Wayland protocol, so we or in the
+	 * BO_USE_LINEAR flag here. We need to fix ARC++ to allocate and work
+	 * with tiled buffers.
+	 */
+	if (resolved_format == DRM_FORMAT_NV12)
+		use_flags |= BO_USE_LINEAR;
+
+	recording = drv_record_begin(drv_, &record, DRV_RECORD_CREATE);
+	ret = drv_bo_create_batch(drv_, descriptor->width, descriptor->height, resolved_format,
+				  use_flags, count, bos.data());
+	if (recording && ret) {
+		record.format = resolved_format;
+		record.width = descriptor->width;
+		record.height = descriptor->height;
+		record.use_flags = use_flags;
+		drv_record_end(drv_, &record, ret);
+	} else if (recording) {
+		drv_record_end_batch(drv_, &record, bos.data(), count);
+	}
+
+	if (ret == -EDQUOT) {
+		/* The pool is already empty; give back the memory behind cached mappings too. */
+		std::lock_guard<std::mutex> lock(mapping_cache_mutex_);
+		evict_mappings(0, 0);
+		drv_log("Failed to create bo, over the memory budget.\n");
+		return -EDQUOT;
+	}
+
+	if (ret) {
+		drv_log("Failed to create bo.\n");
+		return -ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		id = drv_bo_get_plane_handle(bos[i], 0).u32;
+		hnds[i] = create_handle(bos[i], descriptor);
+		buffers[i] = new cros_gralloc_buffer(id, bos[i], hnds[i]);
+	}
 
 	std::lock_guard<std::mutex> lock(mutex_);
-	buffers_.emplace(id, buffer);
-	handles_.emplace(hnd, std::make_pair(buffer, 1));
-	*out_handle = &hnd->base;
+	for (uint32_t i = 0; i < count; i++) {
+		buffers_.insert(buffers[i]->get_id(), buffers[i]);
+		handles_.insert(hnds[i], std::make_pair(buffers[i], 1));
+		out_handles[i] = &hnds[i]->base;
+	}
+
 	return 0;
 }
 
 int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 {
+	DRV_TRACE_SCOPE("cros_gralloc_driver::retain");
 	uint32_t id;
+	struct drv_record record;
 	std::lock_guard<std::mutex> lock(mutex_);
 
 	auto hnd = cros_gralloc_convert_handle(handle);
@@ -189,10 +281,15 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (buffer) {
-		handles_[hnd].second++;
-		buffer->increase_refcount();
+	int recording = drv_record_begin(drv_, &record, DRV_RECORD_IMPORT);
+	auto entry = handles_.find(hnd);
+	if (entry) {
+		entry->second++;
+		entry->first->increase_refcount();
+		if (recording) {
+			record_handle(&record, hnd, entry->first->get_id());
+			drv_record_end(drv_, &record, 0);
+		}
 		return 0;
 	}
 
@@ -201,8 +298,10 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return -errno;
 	}
 
-	if (buffers_.count(id)) {
-		buffer = buffers_[id];
+	cros_gralloc_buffer *buffer;
+	auto existing = buffers_.find(id);
+	if (existing) {
+		buffer = *existing;
 		buffer->increase_refcount();
 	} else {
 		struct bo *bo;
@@ -212,10 +311,12 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		data.height = hnd->height;
 		data.use_flags = static_cast<uint64_t>(hnd->use_flags[0]) << 32;
 		data.use_flags |= hnd->use_flags[1];
+		data.tiling = hnd->tiling;
 
 		memcpy(data.fds, hnd->fds, sizeof(data.fds));
 		memcpy(data.strides, hnd->strides, sizeof(data.strides));
 		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
+		memcpy(data.sizes, hnd->sizes, sizeof(data.sizes));
 		for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
 			data.format_modifiers[plane] =
 			    static_cast<uint64_t>(hnd->format_modifiers[2 * plane]) << 32;
@@ -223,21 +324,33 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		}
 
 		bo = drv_bo_import(drv_, &data);
-		if (!bo)
+		if (!bo) {
+			if (recording) {
+				record_handle(&record, hnd, 0);
+				drv_record_end(drv_, &record, -EFAULT);
+			}
 			return -EFAULT;
+		}
 
 		id = drv_bo_get_plane_handle(bo, 0).u32;
 
 		buffer = new cros_gralloc_buffer(id, bo, nullptr);
-		buffers_.emplace(id, buffer);
+		buffers_.insert(id, buffer);
+	}
+
+	handles_.insert(hnd, std::make_pair(buffer, 1));
+	if (recording) {
+		record_handle(&record, hnd, id);
+		drv_record_end(drv_, &record, 0);
 	}
 
-	handles_.emplace(hnd, std::make_pair(buffer, 1));
 	return 0;
 }
 
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
+	DRV_TRACE_SCOPE("cros_gralloc_driver::release");
+	struct drv_record record;
 	std::lock_guard<std::mutex> lock(mutex_);
 
 	auto hnd = cros_gralloc_convert_handle(handle);
@@ -246,19 +359,25 @@ int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
+	auto entry = handles_.find(hnd);
+	if (!entry) {
 		drv_log("Invalid Reference.\n");
 		return -EINVAL;
 	}
 
-	if (!--handles_[hnd].second)
+	int recording = drv_record_begin(drv_, &record, DRV_RECORD_DESTROY);
+	if (recording)
+		record_handle(&record, hnd, entry->first->get_id());
+
+	auto buffer = entry->first;
+	if (!--entry->second)
 		handles_.erase(hnd);
 
-	if (buffer->decrease_refcount() == 0) {
-		buffers_.erase(buffer->get_id());
-		delete buffer;
-	}
+	if (buffer->decrease_refcount() == 0)
+		destroy_buffer(buffer);
+
+	if (recording)
+		drv_record_end(drv_, &record, 0);
 
 	return 0;
 }
@@ -267,40 +386,59 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  const struct rectangle *rect, uint32_t map_flags,
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
+	DRV_TRACE_SCOPE("cros_gralloc_driver::lock");
 	int32_t ret = cros_gralloc_sync_wait(acquire_fence);
 	if (ret)
 		return ret;
 
-	std::lock_guard<std::mutex> lock(mutex_);
-	auto hnd = cros_gralloc_convert_handle(handle);
-	if (!hnd) {
-		drv_log("Invalid handle.\n");
+	/*
+	 * A release of another clone of the handle may race with the lock, so the buffer is kept
+	 * alive by a reference of its own. Mapping only takes the buffer's own lock.
+	 */
+	auto buffer = lookup_buffer(handle);
+	if (!buffer)
 		return -EINVAL;
-	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
-		drv_log("Invalid Reference.\n");
-		return -EINVAL;
+	struct drv_record record;
+	int recording = drv_record_begin(drv_, &record, DRV_RECORD_MAP);
+	uncache_mapping(buffer);
+	ret = buffer->lock(rect, map_flags, addr);
+	if (recording) {
+		record_handle(&record, cros_gralloc_convert_handle(handle), buffer->get_id());
+		record.map_id = buffer->get_id();
+		record.x = rect->x;
+		record.y = rect->y;
+		record.width = rect->width;
+		record.height = rect->height;
+		record.map_flags = map_flags;
+		drv_record_end(drv_, &record, ret);
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	put_buffer(buffer);
+	return ret;
 }
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
-	auto hnd = cros_gralloc_convert_handle(handle);
-	if (!hnd) {
-		drv_log("Invalid handle.\n");
+	DRV_TRACE_SCOPE("cros_gralloc_driver::unlock");
+	auto buffer = lookup_buffer(handle);
+	if (!buffer)
 		return -EINVAL;
+
+	struct drv_record record;
+	int recording = drv_record_begin(drv_, &record, DRV_RECORD_UNMAP);
+	bool flush_deferred = false;
+	int32_t ret = buffer->unlock(release_fence && start_flush_worker() ? &flush_deferred
+									  : nullptr);
+	if (recording) {
+		record_handle(&record, cros_gralloc_convert_handle(handle), buffer->get_id());
+		record.map_id = buffer->get_id();
+		drv_record_end(drv_, &record, ret);
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
-		drv_log("Invalid Reference.\n");
-		return -EINVAL;
+	if (ret) {
+		put_buffer(buffer);
+		return ret;
 	}
 
 	/*
@@ -309,8 +447,80 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
 	 */
-	*release_fence = -1;
-	return buffer->unlock();
+	if (release_fence)
+		*release_fence = flush_deferred ? queue_flush(buffer) : -1;
+
+	cache_mapping(buffer);
+	put_buffer(buffer);
+	return 0;
+}
+
+bool cros_gralloc_driver::start_flush_worker()
+{
+	std::call_once(flush_once_, [this] {
+		flush_timeline_ = cros_gralloc_timeline_create();
+		if (flush_timeline_ >= 0)
+			flush_thread_ = std::thread(&cros_gralloc_driver::flush_worker, this);
+		else
+			drv_log("No sw_sync, unlock flushes stay synchronous.\n");
+	});
+
+	return flush_timeline_ >= 0;
+}
+
+int32_t cros_gralloc_driver::queue_flush(cros_gralloc_buffer *buffer)
+{
+	std::unique_lock<std::mutex> lock(flush_mutex_);
+
+	int32_t fence = cros_gralloc_timeline_create_fence(flush_timeline_, flush_seqno_ + 1);
+	if (fence < 0) {
+		lock.unlock();
+		drv_log("Failed to create release fence, flushing now.\n");
+		buffer->flush_deferred();
+		return -1;
+	}
+
+	flush_seqno_++;
+	flush_queue_.push_back(buffer);
+	flush_cond_.notify_all();
+	return fence;
+}
+
+void cros_gralloc_driver::cancel_flushes(cros_gralloc_buffer *buffer)
+{
+	std::unique_lock<std::mutex> lock(flush_mutex_);
+
+	/* The buffer does its pending flush itself when it goes away. */
+	for (auto &entry : flush_queue_) {
+		if (entry == buffer)
+			entry = nullptr;
+	}
+
+	flush_cond_.wait(lock, [this, buffer] { return flush_current_ != buffer; });
+}
+
+void cros_gralloc_driver::flush_worker()
+{
+	std::unique_lock<std::mutex> lock(flush_mutex_);
+
+	for (;;) {
+		flush_cond_.wait(lock, [this] { return flush_exit_ || !flush_queue_.empty(); });
+		if (flush_queue_.empty())
+			break;
+
+		flush_current_ = flush_queue_.front();
+		flush_queue_.pop_front();
+
+		if (flush_current_) {
+			lock.unlock();
+			flush_current_->flush_deferred();
+			lock.lock();
+		}
+
+		flush_current_ = nullptr;
+		cros_gralloc_timeline_signal(flush_timeline_);
+		flush_cond_.notify_all();
+	}
 }
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
@@ -333,11 +543,127 @@ int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t
 	return 0;
 }
 
-cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+int32_t cros_gralloc_driver::dump_stats(char *buf, size_t size)
+{
+	int32_t len = drv_stats_dump(drv_, buf, size);
+	if (len < 0)
+		return len;
+
+	std::lock_guard<std::mutex> lock(mapping_cache_mutex_);
+	int ret = snprintf(buf + len, size - len, "mapping cache: %zu buffers, %zu bytes\n",
+			   mapping_lru_.size(), mapping_cache_bytes_);
+	if (ret < 0 || static_cast<size_t>(ret) >= size - len)
+		return -ENOSPC;
+
+	return len + ret;
+}
+
+void cros_gralloc_driver::set_memory_budget(uint64_t max_bytes)
+{
+	drv_set_memory_budget(drv_, max_bytes);
+}
+
+void cros_gralloc_driver::get_memory_usage(uint64_t *out_bytes, uint64_t *out_budget)
+{
+	struct drv_stats stats;
+
+	drv_get_stats(drv_, &stats);
+	*out_bytes = stats.live_bytes;
+	*out_budget = stats.budget_bytes;
+}
+
+void cros_gralloc_driver::cache_mapping(cros_gralloc_buffer *buffer)
+{
+	std::lock_guard<std::mutex> lock(mapping_cache_mutex_);
+
+	size_t size = buffer->get_idle_mapping_size();
+	if (!size)
+		return;
+
+	auto entry = mapping_cache_.find(buffer);
+	if (entry != mapping_cache_.end()) {
+		mapping_cache_bytes_ -= entry->second.second;
+		mapping_lru_.erase(entry->second.first);
+		mapping_cache_.erase(entry);
+	}
+
+	mapping_lru_.push_front(buffer);
+	mapping_cache_.emplace(buffer, std::make_pair(mapping_lru_.begin(), size));
+	mapping_cache_bytes_ += size;
+
+	/* Never evict the mapping that was just cached, even if it is larger than the limit. */
+	evict_mappings(mapping_cache_max_bytes, 1);
+}
+
+void cros_gralloc_driver::evict_mappings(size_t max_bytes, size_t min_buffers)
+{
+	while (mapping_cache_bytes_ > max_bytes && mapping_lru_.size() > min_buffers) {
+		auto victim = mapping_lru_.back();
+		auto victim_entry = mapping_cache_.find(victim);
+
+		mapping_cache_bytes_ -= victim_entry->second.second;
+		mapping_cache_.erase(victim_entry);
+		mapping_lru_.pop_back();
+
+		victim->evict_mapping();
+	}
+}
+
+void cros_gralloc_driver::uncache_mapping(cros_gralloc_buffer *buffer)
+{
+	std::lock_guard<std::mutex> lock(mapping_cache_mutex_);
+
+	auto entry = mapping_cache_.find(buffer);
+	if (entry == mapping_cache_.end())
+		return;
+
+	mapping_cache_bytes_ -= entry->second.second;
+	mapping_lru_.erase(entry->second.first);
+	mapping_cache_.erase(entry);
+}
+
+/* Returns the buffer of the handle with a reference taken for the caller. */
+cros_gralloc_buffer *cros_gralloc_driver::lookup_buffer(buffer_handle_t handle)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto hnd = cros_gralloc_convert_handle(handle);
+	if (!hnd) {
+		drv_log("Invalid handle.\n");
+		return nullptr;
+	}
+
+	auto buffer = get_buffer(hnd);
+	if (!buffer) {
+		drv_log("Invalid Reference.\n");
+		return nullptr;
+	}
+
+	buffer->increase_refcount();
+	return buffer;
+}
+
+/* Drops the reference that lookup_buffer() took. */
+void cros_gralloc_driver::put_buffer(cros_gralloc_buffer *buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (buffer->decrease_refcount() == 0)
+		destroy_buffer(buffer);
+}
+
+void cros_gralloc_driver::destroy_buffer(cros_gralloc_buffer *buffer)
 {
 	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].first;
+	buffers_.erase(buffer->get_id());
+	uncache_mapping(buffer);
+	cancel_flushes(buffer);
+	delete buffer;
+}
 
-	return nullptr;
+cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+{
+	/* Assumes driver mutex is held. */
+	auto entry = handles_.find(hnd);
+	return entry ? entry->first : nullptr;
 }
@@ -8,8 +8,13 @@
 #define CROS_GRALLOC_DRIVER_H
 
 #include "cros_gralloc_buffer.h"
+#include "cros_gralloc_flat_map.h"
 
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 class cros_gralloc_driver
@@ -25,26 +30,77 @@ class cros_gralloc_driver
 	bool is_supported(const struct cros_gralloc_buffer_descriptor *descriptor);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 buffer_handle_t *out_handle);
+	/* Allocates count identical buffers, registering all of them at once. */
+	int32_t allocate_array(const struct cros_gralloc_buffer_descriptor *descriptor,
+			       uint32_t count, buffer_handle_t *out_handles);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
 
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, const struct rectangle *rect,
 		     uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES]);
+	/*
+	 * Without release_fence the mappings are flushed before returning. Otherwise the flush may
+	 * be left to a worker thread, and *release_fence signals when it is done.
+	 */
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
+	/* Writes the allocator statistics as text, see drv_stats_dump(). */
+	int32_t dump_stats(char *buf, size_t size);
+	/* See drv_set_memory_budget(). */
+	void set_memory_budget(uint64_t max_bytes);
+	void get_memory_usage(uint64_t *out_bytes, uint64_t *out_budget);
 
       private:
 	cros_gralloc_driver(cros_gralloc_driver const &);
 	cros_gralloc_driver operator=(cros_gralloc_driver const &);
 	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	cros_gralloc_buffer *lookup_buffer(buffer_handle_t handle);
+	void put_buffer(cros_gralloc_buffer *buffer);
+	void destroy_buffer(cros_gralloc_buffer *buffer);
+	cros_gralloc_handle *create_handle(struct bo *bo,
+					   const struct cros_gralloc_buffer_descriptor *descriptor);
+	void cache_mapping(cros_gralloc_buffer *buffer);
+	void uncache_mapping(cros_gralloc_buffer *buffer);
+	/* Assumes mapping_cache_mutex_ is held. */
+	void evict_mappings(size_t max_bytes, size_t min_buffers);
+	bool start_flush_worker();
+	int32_t queue_flush(cros_gralloc_buffer *buffer);
+	void cancel_flushes(cros_gralloc_buffer *buffer);
+	void flush_worker();
 
 	struct driver *drv_;
 	std::mutex mutex_;
-	std::unordered_map<uint32_t, cros_gralloc_buffer *> buffers_;
-	std::unordered_map<cros_gralloc_handle_t, std::pair<cros_gralloc_buffer *, int32_t>>
+	cros_gralloc_flat_map<uint32_t, cros_gralloc_buffer *> buffers_;
+	cros_gralloc_flat_map<cros_gralloc_handle_t, std::pair<cros_gralloc_buffer *, int32_t>>
 	    handles_;
+
+	/*
+	 * Buffers that are unlocked but still mapped, most recently unlocked first. Taken after
+	 * mutex_ and before any buffer's own lock.
+	 */
+	std::mutex mapping_cache_mutex_;
+	std::list<cros_gralloc_buffer *> mapping_lru_;
+	std::unordered_map<cros_gralloc_buffer *,
+			   std::pair<std::list<cros_gralloc_buffer *>::iterator, size_t>>
+	    mapping_cache_;
+	size_t mapping_cache_bytes_;
+
+	/*
+	 * Deferred unlock flushes, oldest first. Every entry signals flush_timeline_ once when it is
+	 * done, so the fence for the nth queued flush is the nth point on the timeline. Entries of
+	 * released buffers are cleared but still signal. Taken after mutex_.
+	 */
+	std::once_flag flush_once_;
+	std::mutex flush_mutex_;
+	std::condition_variable flush_cond_;
+	std::deque<cros_gralloc_buffer *> flush_queue_;
+	cros_gralloc_buffer *flush_current_;
+	uint32_t flush_seqno_;
+	bool flush_exit_;
+	int32_t flush_timeline_;
+	std::thread flush_thread_;
 };
 
 #endif
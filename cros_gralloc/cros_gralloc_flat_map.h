@@ -0,0 +1,129 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CROS_GRALLOC_FLAT_MAP_H
+#define CROS_GRALLOC_FLAT_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/*
+ * Open-addressing hash map with linear probing, for the small integer and pointer keys the driver
+ * looks buffers up by. All entries live in one array, so a lookup is a single hash and usually a
+ * single cache line, and inserting does not allocate until the table grows.
+ */
+template <typename K, typename V> class cros_gralloc_flat_map
+{
+      public:
+	cros_gralloc_flat_map() : slots_(min_capacity), size_(0)
+	{
+	}
+
+	V *find(const K &key)
+	{
+		for (size_t i = index(key);; i = next(i)) {
+			if (!slots_[i].used)
+				return nullptr;
+			if (slots_[i].key == key)
+				return &slots_[i].value;
+		}
+	}
+
+	/* The key must not be in the map yet. */
+	V *insert(const K &key, const V &value)
+	{
+		if (2 * (size_ + 1) > slots_.size())
+			rehash(2 * slots_.size());
+
+		size_t i = index(key);
+		while (slots_[i].used)
+			i = next(i);
+
+		slots_[i].key = key;
+		slots_[i].value = value;
+		slots_[i].used = true;
+		size_++;
+		return &slots_[i].value;
+	}
+
+	bool erase(const K &key)
+	{
+		size_t i = index(key);
+		while (slots_[i].used && !(slots_[i].key == key))
+			i = next(i);
+
+		if (!slots_[i].used)
+			return false;
+
+		/* Shift later entries of the probe sequence back, so that no tombstones are needed. */
+		for (size_t j = next(i); slots_[j].used; j = next(j)) {
+			size_t home = index(slots_[j].key);
+			if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+				slots_[i] = slots_[j];
+				i = j;
+			}
+		}
+
+		slots_[i].used = false;
+		size_--;
+		return true;
+	}
+
+	void clear()
+	{
+		slots_.assign(min_capacity, slot());
+		size_ = 0;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+      private:
+	struct slot {
+		slot() : key(), value(), used(false)
+		{
+		}
+
+		K key;
+		V value;
+		bool used;
+	};
+
+	static const size_t min_capacity = 64;
+
+	size_t index(const K &key) const
+	{
+		/* std::hash is the identity for integers and pointers, so mix the bits first. */
+		uint64_t hash = static_cast<uint64_t>(std::hash<K>()(key)) * 0x9e3779b97f4a7c15ull;
+		return static_cast<size_t>(hash >> 32) & (slots_.size() - 1);
+	}
+
+	size_t next(size_t i) const
+	{
+		return (i + 1) & (slots_.size() - 1);
+	}
+
+	void rehash(size_t capacity)
+	{
+		std::vector<slot> old(capacity);
+		old.swap(slots_);
+		size_ = 0;
+
+		for (auto &entry : old) {
+			if (entry.used)
+				insert(entry.key, entry.value);
+		}
+	}
+
+	std::vector<slot> slots_;
+	size_t size_;
+};
+
+#endif
@@ -34,6 +34,8 @@ struct cros_gralloc_handle {
 	int32_t droid_format;
 	int32_t usage; /* Android usage. */
 	uint32_t fb_id;
+	uint32_t tiling;
+	uint32_t sizes[DRV_MAX_PLANES];
 };
 
 typedef const struct cros_gralloc_handle *cros_gralloc_handle_t;
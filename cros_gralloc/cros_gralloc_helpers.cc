@@ -5,8 +5,22 @@
  */
 
 #include "cros_gralloc_helpers.h"
+#include "../drv_trace.h"
 
+#include <fcntl.h>
 #include <sync/sync.h>
+#include <sys/ioctl.h>
+
+/* From drivers/dma-buf/sw_sync.c, these are not part of the exported uapi headers. */
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
 
 uint32_t cros_gralloc_convert_format(int format)
 {
@@ -55,6 +69,8 @@ extern "C" cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t han
 
 int32_t cros_gralloc_sync_wait(int32_t acquire_fence)
 {
+	DRV_TRACE_SCOPE(__func__);
+
 	if (acquire_fence < 0)
 		return 0;
 
@@ -80,3 +96,34 @@ int32_t cros_gralloc_sync_wait(int32_t acquire_fence)
 
 	return 0;
 }
+
+int32_t cros_gralloc_timeline_create()
+{
+	int32_t fd = open("/dev/sw_sync", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+
+	return fd;
+}
+
+int32_t cros_gralloc_timeline_create_fence(int32_t timeline, uint32_t value)
+{
+	struct sw_sync_create_fence_data data = {};
+
+	data.value = value;
+	strncpy(data.name, "minigbm", sizeof(data.name) - 1);
+	if (ioctl(timeline, SW_SYNC_IOC_CREATE_FENCE, &data))
+		return -errno;
+
+	return data.fence;
+}
+
+int32_t cros_gralloc_timeline_signal(int32_t timeline)
+{
+	uint32_t count = 1;
+
+	if (ioctl(timeline, SW_SYNC_IOC_INC, &count))
+		return -errno;
+
+	return 0;
+}
@@ -24,4 +24,12 @@ extern "C" cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t han
 
 int32_t cros_gralloc_sync_wait(int32_t acquire_fence);
 
+/*
+ * Userspace signaled fences, through sw_sync. A fence created for value signals once the timeline
+ * has been signaled that many times. Creating the timeline fails where sw_sync is not available.
+ */
+int32_t cros_gralloc_timeline_create();
+int32_t cros_gralloc_timeline_create_fence(int32_t timeline, uint32_t value);
+int32_t cros_gralloc_timeline_signal(int32_t timeline);
+
 #endif
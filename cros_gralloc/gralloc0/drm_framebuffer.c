@@ -22,10 +22,15 @@
 
 #define LOG_TAG "drm-fb"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <hardware/gralloc.h>
 #include <log/log.h>
 
@@ -39,15 +44,111 @@
 
 #define SWAP_INTERVAL 1
 
+/* How long to wait for a flip event before assuming it got lost */
+#define FLIP_TIMEOUT_MS 100
+
+#define MAX_PLANES 8
+
+/*
+ * Flips in flight are told apart by their slot, which is handed to the kernel
+ * as the user data of the flip. The kernel keeps one flip pending per CRTC,
+ * so a few slots are more than enough.
+ */
+#define FLIP_SLOTS 4
+
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR DRM_FORMAT_MOD_NONE
+#endif
+
+enum fb0_plane_prop {
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_PROP_COUNT
+};
+
+static const char *fb0_plane_prop_names[PLANE_PROP_COUNT] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+struct fb0_plane {
+	uint32_t id;
+	uint32_t props[PLANE_PROP_COUNT];
+};
+
+/*
+ * A framebuffer shared by all registrations of a buffer. Once the last of
+ * them is gone, gem_handle is cleared so the handle can be reused, and the
+ * framebuffer is removed as soon as it is off screen.
+ */
+struct fb0_fb {
+	uint32_t gem_handle;
+	uint32_t fb_id;
+	int refcount;
+};
+
+struct fb0_flip {
+	struct drm_framebuffer *fb;
+	uint32_t seqno;
+};
+
 struct drm_framebuffer {
 	struct framebuffer_device_t device;
 
 	int fd;
-	uint32_t connector_id, crtc_id;
+	uint32_t connector_id, crtc_id, crtc_pipe;
 	drmModeModeInfo mode;
 
-	uint32_t current_fb, next_fb;
+	/*
+	 * With atomic modesetting the posted buffer goes to the first plane of
+	 * the CRTC that passes a TEST_ONLY commit, primary planes first.
+	 */
+	bool atomic;
+	bool has_modifiers;
+	struct fb0_plane planes[MAX_PLANES];
+	int num_planes;
+	struct fb0_plane *plane;
+	uint32_t mode_blob_id;
+	uint32_t connector_crtc_prop;
+	uint32_t crtc_active_prop, crtc_mode_prop, crtc_out_fence_prop;
+	/*
+	 * The out-fence of the latest atomic commit, which showed out_fence_fb,
+	 * and the buffer that was posted last.
+	 */
+	int out_fence;
+	uint32_t out_fence_fb, posted_fb;
+
+	/*
+	 * current_fb is being scanned out, next_fb has been flipped to but the
+	 * flip has not completed yet and queued_fb will be flipped to as soon as
+	 * it did. All of them are protected by lock.
+	 */
+	uint32_t current_fb, next_fb, queued_fb;
 	drmEventContext evctx;
+
+	/* next_seqno is the flip of next_fb, an event of any other is stale. */
+	struct fb0_flip flips[FLIP_SLOTS];
+	uint32_t flip_seqno, next_seqno;
+
+	/* The framebuffers of registered buffers, also protected by lock. */
+	struct fb0_fb *fbs;
+	int num_fbs, max_fbs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t flip_cond;
+	pthread_t event_thread;
+	int wake_fds[2];
+
+	drm_framebuffer_flip_callback_t flip_callback;
+	void *flip_callback_data;
 };
 
 extern cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t handle);
@@ -71,7 +172,8 @@ static drmModeConnectorPtr fb0_find_connector(int fd, drmModeResPtr res)
 	return connector;
 }
 
-static uint32_t fb0_find_crtc(int fd, drmModeResPtr res, drmModeConnectorPtr connector)
+static uint32_t fb0_find_crtc(int fd, drmModeResPtr res, drmModeConnectorPtr connector,
+	uint32_t *pipe)
 {
 	drmModeEncoderPtr encoder;
 	int i;
@@ -80,6 +182,7 @@ static uint32_t fb0_find_crtc(int fd, drmModeResPtr res, drmModeConnectorPtr con
 	for (i = 0; i < res->count_crtcs; ++i) {
 		if (encoder->possible_crtcs & (1 << i)) {
 			drmModeFreeEncoder(encoder);
+			*pipe = i;
 			return res->crtcs[i];
 		}
 	}
@@ -103,14 +206,340 @@ static drmModeModeInfoPtr fb0_find_preferred_mode(drmModeConnectorPtr connector)
 	return mode;
 }
 
-static void fb0_handle_page_flip(
-	__unused int fd, __unused unsigned int sequence,
-	__unused unsigned int tv_sec, __unused unsigned int tv_usec,
-	__unused void *data)
+static uint32_t fb0_find_prop(int fd, uint32_t object_id, uint32_t object_type,
+	const char *name)
 {
-	struct drm_framebuffer *fb = data;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t prop_id = 0;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props) {
+		return 0;
+	}
+
+	for (i = 0; i < props->count_props && !prop_id; ++i) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (prop) {
+			if (strcmp(prop->name, name) == 0) {
+				prop_id = prop->prop_id;
+			}
+			drmModeFreeProperty(prop);
+		}
+	}
+
+	drmModeFreeObjectProperties(props);
+	return prop_id;
+}
+
+static uint64_t fb0_get_plane_type(int fd, uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props) {
+		return type;
+	}
+
+	for (i = 0; i < props->count_props; ++i) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (prop) {
+			if (strcmp(prop->name, "type") == 0) {
+				type = props->prop_values[i];
+			}
+			drmModeFreeProperty(prop);
+		}
+	}
+
+	drmModeFreeObjectProperties(props);
+	return type;
+}
+
+static bool fb0_add_plane(struct drm_framebuffer *fb, uint32_t plane_id)
+{
+	struct fb0_plane *plane = &fb->planes[fb->num_planes];
+	int i;
+
+	plane->id = plane_id;
+	for (i = 0; i < PLANE_PROP_COUNT; ++i) {
+		plane->props[i] = fb0_find_prop(fb->fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			fb0_plane_prop_names[i]);
+		if (!plane->props[i]) {
+			return false;
+		}
+	}
+
+	fb->num_planes++;
+	return true;
+}
+
+static int fb0_init_atomic(struct drm_framebuffer *fb)
+{
+	drmModePlaneResPtr res;
+	drmModePlanePtr plane;
+	uint64_t type;
+	uint32_t i;
+	int pass;
+
+	if (drmSetClientCap(fb->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(fb->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		return -ENOTSUP;
+	}
+
+	fb->connector_crtc_prop = fb0_find_prop(fb->fd, fb->connector_id,
+		DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	fb->crtc_active_prop = fb0_find_prop(fb->fd, fb->crtc_id,
+		DRM_MODE_OBJECT_CRTC, "ACTIVE");
+	fb->crtc_mode_prop = fb0_find_prop(fb->fd, fb->crtc_id,
+		DRM_MODE_OBJECT_CRTC, "MODE_ID");
+	/* Out-fences are optional, they only appeared in Linux 4.10 */
+	fb->crtc_out_fence_prop = fb0_find_prop(fb->fd, fb->crtc_id,
+		DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+	if (!fb->connector_crtc_prop || !fb->crtc_active_prop || !fb->crtc_mode_prop) {
+		return -ENOTSUP;
+	}
+
+	res = drmModeGetPlaneResources(fb->fd);
+	if (!res) {
+		return -ENOTSUP;
+	}
+
+	/* Primary planes go first, cursor planes are too limited to be useful */
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < res->count_planes && fb->num_planes < MAX_PLANES; ++i) {
+			plane = drmModeGetPlane(fb->fd, res->planes[i]);
+			if (!plane) {
+				continue;
+			}
+
+			if (plane->possible_crtcs & (1 << fb->crtc_pipe)) {
+				type = fb0_get_plane_type(fb->fd, plane->plane_id);
+				if (type == (pass ? DRM_PLANE_TYPE_OVERLAY : DRM_PLANE_TYPE_PRIMARY)) {
+					fb0_add_plane(fb, plane->plane_id);
+				}
+			}
+
+			drmModeFreePlane(plane);
+		}
+	}
+
+	drmModeFreePlaneResources(res);
+	if (!fb->num_planes) {
+		return -ENOTSUP;
+	}
+
+	if (drmModeCreatePropertyBlob(fb->fd, &fb->mode, sizeof(fb->mode),
+			&fb->mode_blob_id)) {
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static void fb0_atomic_add_plane(struct drm_framebuffer *fb, drmModeAtomicReqPtr req,
+	struct fb0_plane *plane, uint32_t fb_id)
+{
+	uint32_t crtc_id = fb_id ? fb->crtc_id : 0;
+	uint32_t width = fb_id ? fb->mode.hdisplay : 0;
+	uint32_t height = fb_id ? fb->mode.vdisplay : 0;
+
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_FB_ID], fb_id);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_ID], crtc_id);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_SRC_X], 0);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_SRC_Y], 0);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_SRC_W], width << 16);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_SRC_H], height << 16);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_X], 0);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_Y], 0);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_W], width);
+	drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_H], height);
+}
+
+/*
+ * Shows fb_id on plane, or turns the CRTC off if fb_id is 0. A modeset also
+ * detaches every other plane of the CRTC, so that an earlier assignment does
+ * not stay on screen.
+ */
+static int fb0_atomic_commit(struct drm_framebuffer *fb, struct fb0_plane *plane,
+	uint32_t fb_id, uint32_t flags, void *user_data)
+{
+	drmModeAtomicReqPtr req;
+	int32_t out_fence = -1;
+	int i, ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+		for (i = 0; i < fb->num_planes; ++i) {
+			if (&fb->planes[i] != plane) {
+				fb0_atomic_add_plane(fb, req, &fb->planes[i], 0);
+			}
+		}
+
+		drmModeAtomicAddProperty(req, fb->connector_id, fb->connector_crtc_prop,
+			fb_id ? fb->crtc_id : 0);
+		drmModeAtomicAddProperty(req, fb->crtc_id, fb->crtc_mode_prop,
+			fb_id ? fb->mode_blob_id : 0);
+		drmModeAtomicAddProperty(req, fb->crtc_id, fb->crtc_active_prop, !!fb_id);
+	}
+
+	fb0_atomic_add_plane(fb, req, plane, fb_id);
+
+	if (fb->crtc_out_fence_prop && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		drmModeAtomicAddProperty(req, fb->crtc_id, fb->crtc_out_fence_prop,
+			(uint64_t)(uintptr_t)&out_fence);
+	}
+
+	ret = drmModeAtomicCommit(fb->fd, req, flags, user_data);
+	drmModeAtomicFree(req);
+
+	if (!ret && out_fence >= 0) {
+		if (fb->out_fence >= 0) {
+			close(fb->out_fence);
+		}
+		fb->out_fence = out_fence;
+		fb->out_fence_fb = fb_id;
+	}
+
+	return ret;
+}
+
+static int fb0_page_flip_locked(struct drm_framebuffer *fb, uint32_t fb_id)
+{
+	struct fb0_flip *flip;
+	int ret;
+
+	flip = &fb->flips[++fb->flip_seqno % FLIP_SLOTS];
+	flip->seqno = fb->flip_seqno;
+
+	if (fb->atomic) {
+		ret = fb0_atomic_commit(fb, fb->plane, fb_id,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, flip);
+	} else {
+		ret = drmModePageFlip(fb->fd, fb->crtc_id, fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, flip);
+	}
+	if (ret) {
+		ALOGE("Failed to perform page flip: %d", ret);
+		if (errno != -EBUSY) {
+			fb->current_fb = 0;
+		}
+		return errno;
+	} else {
+		fb->next_fb = fb_id;
+		fb->next_seqno = flip->seqno;
+	}
+
+	return 0;
+}
+
+static bool fb0_on_screen_locked(struct drm_framebuffer *fb, uint32_t fb_id)
+{
+	return fb_id == fb->current_fb || fb_id == fb->next_fb ||
+		fb_id == fb->queued_fb;
+}
+
+/* Removes the framebuffers of released buffers that are off screen */
+static void fb0_prune_fbs_locked(struct drm_framebuffer *fb)
+{
+	int i;
+
+	for (i = fb->num_fbs - 1; i >= 0; i--) {
+		if (fb->fbs[i].refcount || fb0_on_screen_locked(fb, fb->fbs[i].fb_id)) {
+			continue;
+		}
+
+		drmModeRmFB(fb->fd, fb->fbs[i].fb_id);
+		fb->fbs[i] = fb->fbs[--fb->num_fbs];
+	}
+}
+
+/* Retires the pending flip and starts the queued one, if any */
+static void fb0_complete_page_flip_locked(struct drm_framebuffer *fb)
+{
+	uint32_t fb_id = fb->queued_fb;
+
 	fb->current_fb = fb->next_fb;
 	fb->next_fb = 0;
+	fb->queued_fb = 0;
+
+	if (fb_id && fb->current_fb) {
+		fb0_page_flip_locked(fb, fb_id);
+	}
+
+	fb0_prune_fbs_locked(fb);
+	pthread_cond_broadcast(&fb->flip_cond);
+}
+
+static void fb0_handle_page_flip(
+	__unused int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec,
+	void *data)
+{
+	struct fb0_flip *flip = data;
+	struct drm_framebuffer *fb = flip->fb;
+	drm_framebuffer_flip_callback_t callback;
+	void *callback_data;
+	uint32_t fb_id;
+
+	pthread_mutex_lock(&fb->lock);
+
+	/*
+	 * A flip whose event timed out was retired already, its late event must
+	 * not retire the flip that is pending now.
+	 */
+	if (!fb->next_fb || flip->seqno != fb->next_seqno) {
+		pthread_mutex_unlock(&fb->lock);
+		return;
+	}
+
+	fb_id = fb->next_fb;
+	fb0_complete_page_flip_locked(fb);
+	callback = fb->flip_callback;
+	callback_data = fb->flip_callback_data;
+	pthread_mutex_unlock(&fb->lock);
+
+	if (callback && fb_id) {
+		callback(callback_data, fb_id, sequence,
+			tv_sec * 1000000000ll + tv_usec * 1000ll);
+	}
+}
+
+static void *fb0_event_thread(void *data)
+{
+	struct drm_framebuffer *fb = data;
+	struct pollfd fds[2] = {
+		{ .fd = fb->fd, .events = POLLIN },
+		{ .fd = fb->wake_fds[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			ALOGE("Failed to poll for DRM events: %d", errno);
+			break;
+		}
+
+		if (fds[1].revents) {
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			drmHandleEvent(fb->fd, &fb->evctx);
+		}
+	}
+
+	return NULL;
 }
 
 static int fb0_init(struct drm_framebuffer *fb)
@@ -118,6 +547,8 @@ static int fb0_init(struct drm_framebuffer *fb)
 	drmModeResPtr res;
 	drmModeConnectorPtr connector;
 	drmModeModeInfoPtr mode;
+	uint64_t cap;
+	int i;
 
 	res = drmModeGetResources(fb->fd);
 
@@ -130,7 +561,7 @@ static int fb0_init(struct drm_framebuffer *fb)
 
 	fb->connector_id = connector->connector_id;
 
-	fb->crtc_id = fb0_find_crtc(fb->fd, res, connector);
+	fb->crtc_id = fb0_find_crtc(fb->fd, res, connector, &fb->crtc_pipe);
 	drmModeFreeResources(res);
 	if (!fb->crtc_id) {
 		ALOGE("No CRTC found");
@@ -149,6 +580,10 @@ static int fb0_init(struct drm_framebuffer *fb)
 	fb->mode = *mode;
 	fb->current_fb = 0;
 	fb->next_fb = 0;
+	fb->queued_fb = 0;
+	for (i = 0; i < FLIP_SLOTS; ++i) {
+		fb->flips[i].fb = fb;
+	}
 
 	*(uint32_t*) &fb->device.flags = 0;
 	*(uint32_t*) &fb->device.width = mode->hdisplay;
@@ -166,69 +601,114 @@ static int fb0_init(struct drm_framebuffer *fb)
 	fb->evctx.page_flip_handler = fb0_handle_page_flip;
 
 	drmModeFreeConnector(connector);
+
+	fb->out_fence = -1;
+	fb->has_modifiers = !drmGetCap(fb->fd, DRM_CAP_ADDFB2_MODIFIERS, &cap) && cap;
+	fb->atomic = !fb0_init_atomic(fb);
+	ALOGI("Using %s modesetting", fb->atomic ? "atomic" : "legacy");
 	return 0;
 }
 
-static void fb0_await_page_flip(struct drm_framebuffer *fb)
+/*
+ * Waits until the flip queue has room, or until all flips have completed if
+ * idle is set. Must be called with lock held.
+ */
+static void fb0_await_page_flip_locked(struct drm_framebuffer *fb, bool idle)
 {
-	if (fb->next_fb) {
-		/* There is another flip pending */
-		drmHandleEvent(fb->fd, &fb->evctx);
-		if (fb->next_fb) {
-			ALOGE("drmHandleEvent returned without flipping");
-			fb->current_fb = fb->next_fb;
-			fb->next_fb = 0;
+	struct timespec timeout;
+	int ret;
+
+	while (fb->queued_fb || (idle && fb->next_fb)) {
+		clock_gettime(CLOCK_MONOTONIC, &timeout);
+		timeout.tv_nsec += FLIP_TIMEOUT_MS * 1000000l;
+		timeout.tv_sec += timeout.tv_nsec / 1000000000l;
+		timeout.tv_nsec %= 1000000000l;
+
+		ret = pthread_cond_timedwait(&fb->flip_cond, &fb->lock, &timeout);
+		if (ret == ETIMEDOUT && (fb->queued_fb || (idle && fb->next_fb))) {
+			ALOGE("Timed out waiting for page flip");
+			fb0_complete_page_flip_locked(fb);
 		}
 	}
 }
 
-static int fb0_page_flip(struct drm_framebuffer *fb, int fb_id)
+static int fb0_atomic_enable_crtc(struct drm_framebuffer *fb, uint32_t fb_id)
 {
-	int ret;
-
-	/* Finish current page flip */
-	fb0_await_page_flip(fb);
+	int i;
 
-	ret = drmModePageFlip(fb->fd, fb->crtc_id, fb_id,
-		DRM_MODE_PAGE_FLIP_EVENT, fb);
-	if (ret) {
-		ALOGE("Failed to perform page flip: %d", ret);
-		if (errno != -EBUSY) {
-			fb->current_fb = 0;
+	for (i = 0; i < fb->num_planes; ++i) {
+		if (!fb0_atomic_commit(fb, &fb->planes[i], fb_id,
+				DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET,
+				NULL)) {
+			fb->plane = &fb->planes[i];
+			ALOGI("Presenting on plane %d", fb->plane->id);
+			return fb0_atomic_commit(fb, fb->plane, fb_id,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
 		}
-		return errno;
-	} else {
-		fb->next_fb = fb_id;
 	}
 
-	return 0;
+	ALOGE("No plane accepts framebuffer %d", fb_id);
+	errno = EINVAL;
+	return -EINVAL;
 }
 
 static int fb0_enable_crtc(struct drm_framebuffer *fb, uint32_t fb_id)
 {
-	int ret = drmModeSetCrtc(fb->fd, fb->crtc_id, fb_id, 0, 0,
+	int ret;
+
+	if (fb->atomic) {
+		ret = fb0_atomic_enable_crtc(fb, fb_id);
+	} else {
+		ret = drmModeSetCrtc(fb->fd, fb->crtc_id, fb_id, 0, 0,
 			&fb->connector_id, 1, &fb->mode);
+	}
 	if (ret) {
 		ALOGE("Failed to enable CRTC: %d", ret);
 	} else {
 		fb->current_fb = fb_id;
+		fb0_prune_fbs_locked(fb);
 	}
 
 	return ret;
 }
 
+static int fb0_queue_page_flip_locked(struct drm_framebuffer *fb, uint32_t fb_id)
+{
+	if (!fb->next_fb) {
+		return fb0_page_flip_locked(fb, fb_id);
+	}
+
+	/* Queue behind the pending flip, the event thread will issue it */
+	fb0_await_page_flip_locked(fb, false);
+	if (!fb->current_fb) {
+		/* The pending flip failed */
+		return fb0_enable_crtc(fb, fb_id);
+	} else if (!fb->next_fb) {
+		return fb0_page_flip_locked(fb, fb_id);
+	}
+
+	fb->queued_fb = fb_id;
+	return 0;
+}
+
 static int fb0_disable_crtc(struct drm_framebuffer *fb)
 {
 	int ret;
 
-	/* Finish current page flip */
-	fb0_await_page_flip(fb);
+	/* Finish current page flips */
+	fb0_await_page_flip_locked(fb, true);
 
-	ret = drmModeSetCrtc(fb->fd, fb->crtc_id, 0, 0, 0, NULL, 0, NULL);
+	if (fb->atomic && fb->plane) {
+		ret = fb0_atomic_commit(fb, fb->plane, 0, DRM_MODE_ATOMIC_ALLOW_MODESET,
+			NULL);
+	} else {
+		ret = drmModeSetCrtc(fb->fd, fb->crtc_id, 0, 0, 0, NULL, 0, NULL);
+	}
 	if (ret) {
 		ALOGE("Failed to disable CRTC: %d", ret);
 	} else {
 		fb->current_fb = 0;
+		fb0_prune_fbs_locked(fb);
 	}
 
 	return ret;
@@ -238,7 +718,8 @@ static int fb0_post(struct framebuffer_device_t *fbdev, buffer_handle_t buffer)
 {
 	struct drm_framebuffer *fb = (struct drm_framebuffer *) fbdev;
 	cros_gralloc_handle_t handle = cros_gralloc_convert_handle(buffer);
-	uint32_t fb_id;
+	uint32_t fb_id, last_fb;
+	int ret;
 
 	if (!handle) {
 		return -EINVAL;
@@ -250,29 +731,41 @@ static int fb0_post(struct framebuffer_device_t *fbdev, buffer_handle_t buffer)
 		return -EINVAL;
 	}
 
-	if (fb->current_fb == fb_id) {
-		/* Already current */
-		return 0;
-	}
+	pthread_mutex_lock(&fb->lock);
 
-	if (fb->current_fb) {
-		return fb0_page_flip(fb, fb_id);
+	last_fb = fb->queued_fb ? fb->queued_fb :
+		fb->next_fb ? fb->next_fb : fb->current_fb;
+	if (last_fb == fb_id) {
+		/* Already current or about to be */
+		ret = 0;
+	} else if (fb->current_fb) {
+		ret = fb0_queue_page_flip_locked(fb, fb_id);
 	} else {
-		return fb0_enable_crtc(fb, fb_id);
+		ret = fb0_enable_crtc(fb, fb_id);
 	}
+
+	if (!ret) {
+		fb->posted_fb = fb_id;
+	}
+
+	pthread_mutex_unlock(&fb->lock);
+	return ret;
 }
 
 static int fb0_enable_screen(struct framebuffer_device_t *fbdev, int enable)
 {
 	struct drm_framebuffer *fb = (struct drm_framebuffer *) fbdev;
+	int ret = 0;
 	ALOGI("Updating screen state: %d", enable);
 
 	/* Only need to disable screen here, will be re-enabled with next post */
+	pthread_mutex_lock(&fb->lock);
 	if (!enable && fb->current_fb) {
-		return fb0_disable_crtc(fb);
-	} else {
-		return 0;
+		ret = fb0_disable_crtc(fb);
 	}
+	pthread_mutex_unlock(&fb->lock);
+
+	return ret;
 }
 
 static int fb0_composition_complete(__unused struct framebuffer_device_t *dev)
@@ -290,8 +783,67 @@ static int fb0_set_swap_interval(
 	return 0;
 }
 
+static int fb0_start_event_thread(struct drm_framebuffer *fb)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	if (pipe2(fb->wake_fds, O_CLOEXEC)) {
+		return -errno;
+	}
+
+	pthread_mutex_init(&fb->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&fb->flip_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&fb->event_thread, NULL, fb0_event_thread, fb);
+	if (ret) {
+		ALOGE("Failed to start DRM event thread: %d", ret);
+		pthread_cond_destroy(&fb->flip_cond);
+		pthread_mutex_destroy(&fb->lock);
+		close(fb->wake_fds[0]);
+		close(fb->wake_fds[1]);
+		return -ret;
+	}
+
+	return 0;
+}
+
 static int fb0_close(struct hw_device_t *dev)
 {
+	struct drm_framebuffer *fb = (struct drm_framebuffer *) dev;
+	char c = 0;
+	int i;
+
+	/* Let pending flips complete before the event thread goes away */
+	pthread_mutex_lock(&fb->lock);
+	fb0_await_page_flip_locked(fb, true);
+	pthread_mutex_unlock(&fb->lock);
+
+	if (write(fb->wake_fds[1], &c, 1) != 1) {
+		ALOGE("Failed to stop DRM event thread: %d", errno);
+	}
+	pthread_join(fb->event_thread, NULL);
+
+	close(fb->wake_fds[0]);
+	close(fb->wake_fds[1]);
+	pthread_cond_destroy(&fb->flip_cond);
+	pthread_mutex_destroy(&fb->lock);
+
+	for (i = 0; i < fb->num_fbs; i++) {
+		drmModeRmFB(fb->fd, fb->fbs[i].fb_id);
+	}
+	free(fb->fbs);
+
+	if (fb->out_fence >= 0) {
+		close(fb->out_fence);
+	}
+	if (fb->mode_blob_id) {
+		drmModeDestroyPropertyBlob(fb->fd, fb->mode_blob_id);
+	}
+
 	free(dev);
 	return 0;
 }
@@ -313,6 +865,15 @@ int drm_framebuffer_init(int fd, struct drm_framebuffer **fb_out)
 		return ret;
 	}
 
+	ret = fb0_start_event_thread(fb);
+	if (ret) {
+		if (fb->mode_blob_id) {
+			drmModeDestroyPropertyBlob(fb->fd, fb->mode_blob_id);
+		}
+		free(fb);
+		return ret;
+	}
+
 	fb->device.common.tag = HARDWARE_DEVICE_TAG;
 	fb->device.common.version = 0;
 	fb->device.common.close = fb0_close;
@@ -326,7 +887,32 @@ int drm_framebuffer_init(int fd, struct drm_framebuffer **fb_out)
 	return 0;
 }
 
+int drm_framebuffer_get_present_fence(struct drm_framebuffer *fb)
+{
+	int fence = -1;
+
+	pthread_mutex_lock(&fb->lock);
 
+	/* A queued post gets its commit, and fence, once the flip before it is done */
+	fb0_await_page_flip_locked(fb, false);
+	if (fb->out_fence >= 0 && fb->posted_fb && fb->out_fence_fb == fb->posted_fb) {
+		fence = fcntl(fb->out_fence, F_DUPFD_CLOEXEC, 0);
+	}
+	pthread_mutex_unlock(&fb->lock);
+
+	return fence;
+}
+
+void drm_framebuffer_set_flip_callback(struct drm_framebuffer *fb,
+	drm_framebuffer_flip_callback_t callback, void *data)
+{
+	pthread_mutex_lock(&fb->lock);
+	fb->flip_callback = callback;
+	fb->flip_callback_data = data;
+	pthread_mutex_unlock(&fb->lock);
+}
+
+/* Returns 0 for formats that are scanned out as allocated */
 static uint32_t convert_android_to_drm_fb_format(uint32_t format)
 {
 	switch (format) {
@@ -342,41 +928,149 @@ static uint32_t convert_android_to_drm_fb_format(uint32_t format)
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 		return DRM_FORMAT_ARGB8888;
 	default:
-		ALOGE("Unsupported framebuffer format: %u", format);
 		return 0;
 	}
 }
 
-static int fb0_add_fb(struct drm_framebuffer *fb, cros_gralloc_handle_t handle, uint32_t handle_id)
+/*
+ * Adds a framebuffer with all planes of the buffer. Modifiers other than
+ * linear are passed along if the kernel takes them, so tiled and compressed
+ * buffers are scanned out as they are. Otherwise the kernel infers the
+ * tiling, if any.
+ */
+static int fb0_add_fb(struct drm_framebuffer *fb, cros_gralloc_handle_t handle,
+	const uint32_t *gem_handles, int num_planes, uint32_t *fb_id)
 {
-	uint32_t pitches[4] = { handle->strides[0], 0, 0, 0 };
+	uint32_t pitches[4] = { 0, 0, 0, 0 };
 	uint32_t offsets[4] = { 0, 0, 0, 0 };
-	uint32_t handles[4] = { handle_id, 0, 0, 0 };
+	uint32_t handles[4] = { 0, 0, 0, 0 };
+	uint64_t modifiers[4] = { 0, 0, 0, 0 };
+	uint32_t format = convert_android_to_drm_fb_format(handle->droid_format);
+	int i;
+
+	if (!format) {
+		format = handle->format;
+	}
+
+	for (i = 0; i < num_planes; i++) {
+		handles[i] = gem_handles[i];
+		pitches[i] = handle->strides[i];
+		offsets[i] = handle->offsets[i];
+		modifiers[i] = (uint64_t) handle->format_modifiers[2 * i] << 32 |
+			handle->format_modifiers[2 * i + 1];
+	}
+
+	if (fb->has_modifiers && modifiers[0] != DRM_FORMAT_MOD_INVALID &&
+			modifiers[0] != DRM_FORMAT_MOD_LINEAR) {
+		return drmModeAddFB2WithModifiers(fb->fd, handle->width, handle->height,
+			format, handles, pitches, offsets, modifiers, fb_id,
+			DRM_MODE_FB_MODIFIERS);
+	}
 
-	return drmModeAddFB2(fb->fd, handle->width, handle->height,
-		convert_android_to_drm_fb_format(handle->droid_format),
-		handles, pitches, offsets, (uint32_t*) &handle->fb_id, 0);
+	return drmModeAddFB2(fb->fd, handle->width, handle->height, format,
+		handles, pitches, offsets, fb_id, 0);
+}
+
+static struct fb0_fb *fb0_find_fb_locked(struct drm_framebuffer *fb,
+	uint32_t gem_handle, uint32_t fb_id)
+{
+	int i;
+
+	for (i = 0; i < fb->num_fbs; i++) {
+		if (gem_handle ? fb->fbs[i].gem_handle == gem_handle :
+				fb->fbs[i].fb_id == fb_id) {
+			return &fb->fbs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns the framebuffer of the buffer, adding one if it has none yet */
+static int fb0_get_fb_locked(struct drm_framebuffer *fb, cros_gralloc_handle_t handle,
+	const uint32_t *gem_handles, int num_planes, uint32_t *fb_id)
+{
+	struct fb0_fb *entry = fb0_find_fb_locked(fb, gem_handles[0], 0);
+	struct fb0_fb *fbs;
+	int max_fbs;
+
+	if (entry) {
+		entry->refcount++;
+		*fb_id = entry->fb_id;
+		return 0;
+	}
+
+	if (fb->num_fbs == fb->max_fbs) {
+		max_fbs = fb->max_fbs ? 2 * fb->max_fbs : 4;
+		fbs = realloc(fb->fbs, max_fbs * sizeof(*fbs));
+		if (!fbs) {
+			return -ENOMEM;
+		}
+
+		fb->fbs = fbs;
+		fb->max_fbs = max_fbs;
+	}
+
+	if (fb0_add_fb(fb, handle, gem_handles, num_planes, fb_id)) {
+		return -errno;
+	}
+
+	entry = &fb->fbs[fb->num_fbs++];
+	entry->gem_handle = gem_handles[0];
+	entry->fb_id = *fb_id;
+	entry->refcount = 1;
+	return 0;
 }
 
 void drm_framebuffer_import(struct drm_framebuffer *fb, buffer_handle_t buffer)
 {
 	cros_gralloc_handle_t handle = cros_gralloc_convert_handle(buffer);
-	uint32_t handle_id;
+	uint32_t gem_handles[DRV_MAX_PLANES];
+	uint32_t fb_id = 0;
+	int i, num_planes, ret;
 
 	/* Ignore buffers that are not intended for usage with the framebuffer */
 	if (!(handle->usage & GRALLOC_USAGE_HW_FB)) {
 		return;
 	}
 
-	/* Lookup the handle for the prime fd.
+	/* Lookup the handles for the prime fds.
 	 * (The buffer should have already been imported by the gralloc HAL) */
-	if (drmPrimeFDToHandle(fb->fd, handle->fds[0], &handle_id)) {
-		ALOGE("Failed to get handle from prime fd: %d", errno);
+	num_planes = handle->base.numFds < DRV_MAX_PLANES ? handle->base.numFds : DRV_MAX_PLANES;
+	for (i = 0; i < num_planes; i++) {
+		if (drmPrimeFDToHandle(fb->fd, handle->fds[i], &gem_handles[i])) {
+			ALOGE("Failed to get handle from prime fd: %d", errno);
+			return;
+		}
+	}
+
+	/* Share the framebuffer of earlier registrations, or add one */
+	pthread_mutex_lock(&fb->lock);
+	ret = fb0_get_fb_locked(fb, handle, gem_handles, num_planes, &fb_id);
+	pthread_mutex_unlock(&fb->lock);
+
+	if (ret) {
+		ALOGE("Failed to add framebuffer to handle: %d", ret);
+		return;
+	}
+
+	*(uint32_t*) &handle->fb_id = fb_id;
+}
+
+void drm_framebuffer_release(struct drm_framebuffer *fb, buffer_handle_t buffer)
+{
+	cros_gralloc_handle_t handle = cros_gralloc_convert_handle(buffer);
+	struct fb0_fb *entry;
+
+	if (!handle || !handle->fb_id) {
 		return;
 	}
 
-	/* Add a framebuffer to the handle */
-	if (fb0_add_fb(fb, handle, handle_id)) {
-		ALOGE("Failed to add framebuffer to handle: %d", errno);
+	pthread_mutex_lock(&fb->lock);
+	entry = fb0_find_fb_locked(fb, 0, handle->fb_id);
+	if (entry && !--entry->refcount) {
+		entry->gem_handle = 0;
+		fb0_prune_fbs_locked(fb);
 	}
+	pthread_mutex_unlock(&fb->lock);
 }
@@ -23,6 +23,7 @@
 #ifndef _DRM_FRAMEBUFFER_H_
 #define _DRM_FRAMEBUFFER_H_
 
+#include <stdint.h>
 #include <sys/cdefs.h>
 #include <hardware/fb.h>
 
@@ -30,8 +31,29 @@ __BEGIN_DECLS
 
 struct drm_framebuffer;
 
+/*
+ * Called from the DRM event thread once a posted buffer is on screen, with the
+ * vblank sequence and CLOCK_MONOTONIC timestamp of the flip.
+ */
+typedef void (*drm_framebuffer_flip_callback_t)(void *data, uint32_t fb_id,
+	unsigned int sequence, int64_t timestamp_ns);
+
 int drm_framebuffer_init(int fd, struct drm_framebuffer **fb);
+/*
+ * Gives a registered buffer a framebuffer, shared with other registrations
+ * of the same buffer, and drops it again when the buffer is unregistered.
+ */
 void drm_framebuffer_import(struct drm_framebuffer *fb, buffer_handle_t handle);
+void drm_framebuffer_release(struct drm_framebuffer *fb, buffer_handle_t handle);
+void drm_framebuffer_set_flip_callback(struct drm_framebuffer *fb,
+	drm_framebuffer_flip_callback_t callback, void *data);
+
+/*
+ * Returns a new fd for the out-fence of the commit of the last post, which
+ * signals once that buffer is on screen. A post queued behind a pending flip
+ * is issued first. Returns -1 if there is none, e.g. with legacy modesetting.
+ */
+int drm_framebuffer_get_present_fence(struct drm_framebuffer *fb);
 
 __END_DECLS
 
@@ -35,6 +35,26 @@ enum {
 	GRALLOC_DRM_GET_DIMENSIONS,
 	GRALLOC_DRM_GET_BACKING_STORE,
 };
+
+/*
+ * Our own additions, in a range of their own ("mg" in the top half) so that ops later added to
+ * <gralloc_drm.h> can't collide with them.
+ */
+enum {
+	/* (char *buf, size_t size): text summary of the allocator statistics. */
+	GRALLOC_MINIGBM_DUMP_STATS = 0x6d670000,
+	/* (uint64_t *bytes, uint64_t *budget): bytes of live buffers, and their budget or 0. */
+	GRALLOC_MINIGBM_GET_MEMORY_USAGE,
+	/* (uint64_t budget): caps the bytes of live buffers, allocations past it get -EDQUOT. */
+	GRALLOC_MINIGBM_SET_MEMORY_BUDGET,
+	/* (int *fence): out-fence of the last framebuffer post, or -1. The caller owns it. */
+	GRALLOC_MINIGBM_GET_PRESENT_FENCE,
+	/*
+	 * (drm_framebuffer_flip_callback_t callback, void *data): called from the DRM event thread
+	 * once a posted buffer is on screen, see <drm_framebuffer.h>. NULL removes it.
+	 */
+	GRALLOC_MINIGBM_SET_FLIP_CALLBACK,
+};
 // clang-format on
 
 static uint64_t gralloc0_convert_usage(int usage)
@@ -257,6 +277,9 @@ static int gralloc0_register_buffer(struct gralloc_module_t const *module, buffe
 static int gralloc0_unregister_buffer(struct gralloc_module_t const *module, buffer_handle_t handle)
 {
 	auto mod = (struct gralloc0_module const *)module;
+
+	if (mod->fb)
+		drm_framebuffer_release(mod->fb, handle);
 	return mod->driver->release(handle);
 }
 
@@ -268,17 +291,8 @@ static int gralloc0_lock(struct gralloc_module_t const *module, buffer_handle_t
 
 static int gralloc0_unlock(struct gralloc_module_t const *module, buffer_handle_t handle)
 {
-	int32_t fence_fd, ret;
 	auto mod = (struct gralloc0_module const *)module;
-	ret = mod->driver->unlock(handle, &fence_fd);
-	if (ret)
-		return ret;
-
-	ret = cros_gralloc_sync_wait(fence_fd);
-	if (ret)
-		return ret;
-
-	return 0;
+	return mod->driver->unlock(handle, nullptr);
 }
 
 static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
@@ -298,6 +312,11 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	case GRALLOC_DRM_GET_FORMAT:
 	case GRALLOC_DRM_GET_DIMENSIONS:
 	case GRALLOC_DRM_GET_BACKING_STORE:
+	case GRALLOC_MINIGBM_DUMP_STATS:
+	case GRALLOC_MINIGBM_GET_MEMORY_USAGE:
+	case GRALLOC_MINIGBM_SET_MEMORY_BUDGET:
+	case GRALLOC_MINIGBM_GET_PRESENT_FENCE:
+	case GRALLOC_MINIGBM_SET_FLIP_CALLBACK:
 		break;
 	default:
 		return -EINVAL;
@@ -318,6 +337,35 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	case GRALLOC_MODULE_PERFORM_LEAVE_VT:
 		ret = drmDropMaster(mod->driver->get_fd());
 		break;
+	case GRALLOC_MINIGBM_DUMP_STATS: {
+		char *buf = va_arg(args, char *);
+		size_t size = va_arg(args, size_t);
+		ret = mod->driver->dump_stats(buf, size);
+		break;
+	}
+	case GRALLOC_MINIGBM_GET_MEMORY_USAGE: {
+		uint64_t *bytes = va_arg(args, uint64_t *);
+		uint64_t *budget = va_arg(args, uint64_t *);
+		mod->driver->get_memory_usage(bytes, budget);
+		break;
+	}
+	case GRALLOC_MINIGBM_SET_MEMORY_BUDGET:
+		mod->driver->set_memory_budget(va_arg(args, uint64_t));
+		break;
+	case GRALLOC_MINIGBM_GET_PRESENT_FENCE: {
+		int *fence = va_arg(args, int *);
+		*fence = mod->fb ? drm_framebuffer_get_present_fence(mod->fb) : -1;
+		break;
+	}
+	case GRALLOC_MINIGBM_SET_FLIP_CALLBACK: {
+		auto callback = va_arg(args, drm_framebuffer_flip_callback_t);
+		void *data = va_arg(args, void *);
+		if (mod->fb)
+			drm_framebuffer_set_flip_callback(mod->fb, callback, data);
+		else
+			ret = -ENODEV;
+		break;
+	}
 	default:
 		goto other;
 	}
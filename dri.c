@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -87,20 +88,23 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 }
 
 /*
- * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ * Loads the DRI driver and creates the screen and context. This costs tens of milliseconds and
+ * several MB, so it only happens once the first bo actually needs DRI.
  */
-int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+static int dri_load(struct driver *drv)
 {
 	char fname[128];
 	const __DRIextension **(*get_extensions)();
 	const __DRIextension *loader_extensions[] = { NULL };
 
 	struct dri_driver *dri = drv->priv;
-	dri->driver_handle = dlopen(dri_so_path, RTLD_NOW | RTLD_GLOBAL);
-	if (!dri->driver_handle)
+	dri->driver_handle = dlopen(dri->so_path, RTLD_NOW | RTLD_GLOBAL);
+	if (!dri->driver_handle) {
+		drv_log("Failed to load %s: %s\n", dri->so_path, dlerror());
 		return -ENODEV;
+	}
 
-	snprintf(fname, sizeof(fname), __DRI_DRIVER_GET_EXTENSIONS "_%s", driver_suffix);
+	snprintf(fname, sizeof(fname), __DRI_DRIVER_GET_EXTENSIONS "_%s", dri->driver_suffix);
 	get_extensions = dlsym(dri->driver_handle, fname);
 	if (!get_extensions)
 		goto free_handle;
@@ -149,6 +153,44 @@ free_handle:
 	return -ENODEV;
 }
 
+static int dri_get(struct dri_driver *dri, struct driver *drv)
+{
+	int ret;
+
+	if (__atomic_load_n(&dri->loaded, __ATOMIC_ACQUIRE))
+		return dri->load_ret;
+
+	pthread_mutex_lock(&dri->context_lock);
+	if (!dri->loaded) {
+		dri->load_ret = dri_load(drv);
+		__atomic_store_n(&dri->loaded, true, __ATOMIC_RELEASE);
+	}
+	ret = dri->load_ret;
+	pthread_mutex_unlock(&dri->context_lock);
+
+	return ret;
+}
+
+/*
+ * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ * Only checks that the DRI driver is there; it is loaded on first use.
+ */
+int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+{
+	struct dri_driver *dri = drv->priv;
+
+	if (access(dri_so_path, R_OK))
+		return -ENODEV;
+
+	if (pthread_mutex_init(&dri->context_lock, NULL))
+		return -ENOMEM;
+
+	dri->so_path = dri_so_path;
+	dri->driver_suffix = driver_suffix;
+	dri->loaded = false;
+	return 0;
+}
+
 /*
  * The caller is responsible for freeing drv->priv.
  */
@@ -156,10 +198,14 @@ void dri_close(struct driver *drv)
 {
 	struct dri_driver *dri = drv->priv;
 
-	dri->core_extension->destroyContext(dri->context);
-	dri->core_extension->destroyScreen(dri->device);
-	dlclose(dri->driver_handle);
-	dri->driver_handle = NULL;
+	if (dri->loaded && !dri->load_ret) {
+		dri->core_extension->destroyContext(dri->context);
+		dri->core_extension->destroyScreen(dri->device);
+		dlclose(dri->driver_handle);
+		dri->driver_handle = NULL;
+	}
+
+	pthread_mutex_destroy(&dri->context_lock);
 }
 
 int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
@@ -170,6 +216,11 @@ int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t forma
 	struct dri_driver *dri = bo->drv->priv;
 
 	assert(bo->num_planes == 1);
+
+	ret = dri_get(dri, bo->drv);
+	if (ret)
+		return ret;
+
 	dri_format = drm_format_to_dri_format(format);
 
 	/* Gallium drivers require shared to get the handle and stride. */
@@ -220,6 +271,10 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 
 	assert(bo->num_planes == 1);
 
+	ret = dri_get(dri, bo->drv);
+	if (ret)
+		return ret;
+
 	// clang-format off
 	bo->priv = dri->image_extension->createImageFromFds(dri->device, data->width, data->height,
 							    data->format, data->fds, bo->num_planes,
@@ -254,17 +309,18 @@ int dri_bo_destroy(struct bo *bo)
  * This relies on the underlying driver to do a decompressing and/or de-tiling
  * blit if necessary,
  *
- * This function itself is not thread-safe; we rely on the fact that the caller
- * locks a per-driver mutex.
+ * The DRI context is not thread-safe, so all users of it take the context lock.
  */
 void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	struct dri_driver *dri = bo->drv->priv;
 
+	pthread_mutex_lock(&dri->context_lock);
 	/* GBM flags and DRI flags are the same. */
 	vma->addr =
 	    dri->image_extension->mapImage(dri->context, bo->priv, 0, 0, bo->width, bo->height,
 					   map_flags, (int *)&vma->map_strides[plane], &vma->priv);
+	pthread_mutex_unlock(&dri->context_lock);
 	if (!vma->addr)
 		return MAP_FAILED;
 
@@ -276,6 +332,7 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	struct dri_driver *dri = bo->drv->priv;
 
 	assert(vma->priv);
+	pthread_mutex_lock(&dri->context_lock);
 	dri->image_extension->unmapImage(dri->context, bo->priv, vma->priv);
 
 	/*
@@ -287,6 +344,25 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	 */
 
 	dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+	pthread_mutex_unlock(&dri->context_lock);
+	return 0;
+}
+
+/*
+ * Blit between two images on the GPU, which detiles or decompresses as needed. The blit is only
+ * flushed, not waited for.
+ */
+int dri_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	struct dri_driver *dri = dst->drv->priv;
+
+	assert(dst->priv);
+	assert(src->priv);
+	pthread_mutex_lock(&dri->context_lock);
+	dri->image_extension->blitImage(dri->context, dst->priv, src->priv, rect->x, rect->y,
+					rect->width, rect->height, rect->x, rect->y, rect->width,
+					rect->height, __BLIT_FLAG_FLUSH);
+	pthread_mutex_unlock(&dri->context_lock);
 	return 0;
 }
 
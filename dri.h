@@ -10,13 +10,21 @@ typedef int GLint;
 typedef unsigned int GLuint;
 typedef unsigned char GLboolean;
 
+#include <pthread.h>
+#include <stdbool.h>
+
 #include "GL/internal/dri_interface.h"
 #include "drv.h"
 
 struct dri_driver {
+	const char *so_path;
+	const char *driver_suffix;
+	bool loaded; /* dri_load() has run, with load_ret as the result. */
+	int load_ret;
 	void *driver_handle;
 	__DRIscreen *device;
 	__DRIcontext *context; /* Needed for map/unmap operations. */
+	pthread_mutex_t context_lock;
 	const __DRIextension **extensions;
 	const __DRIcoreExtension *core_extension;
 	const __DRIdri2Extension *dri2_extension;
@@ -33,5 +41,6 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 int dri_bo_destroy(struct bo *bo);
 void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int dri_bo_unmap(struct bo *bo, struct vma *vma);
+int dri_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect);
 
 #endif
@@ -7,11 +7,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
@@ -22,6 +24,7 @@
 #endif
 
 #include "drv_priv.h"
+#include "drv_trace.h"
 #include "helpers.h"
 #include "util.h"
 
@@ -64,6 +67,32 @@ extern const struct backend backend_vc4;
 extern const struct backend backend_vgem;
 extern const struct backend backend_virtio_gpu;
 
+/* Small direct-mapped cache of recent drv_get_combination() results. */
+#define DRV_COMBO_CACHE_SIZE 32
+
+struct combo_bucket {
+	uint32_t format;
+	uint32_t num_combos;
+	/* Sorted by descending priority. */
+	struct combination **combos;
+};
+
+struct combo_cache_entry {
+	/* Odd while an update is in progress, see drv_combo_cache_lookup(). */
+	uint32_t seq;
+	uint32_t format;
+	uint64_t use_flags;
+	struct combination *combo;
+};
+
+struct combo_index {
+	uint32_t num_buckets;
+	/* Sorted by format. */
+	struct combo_bucket *buckets;
+	struct combination **combos;
+	struct combo_cache_entry cache[DRV_COMBO_CACHE_SIZE];
+};
+
 static const struct backend *drv_get_backend(int fd)
 {
 	drmVersionPtr drm_version;
@@ -124,8 +153,204 @@ static const struct backend *drv_get_backend(int fd)
 	return NULL;
 }
 
+static bool drv_combo_before(const struct combination *a, const struct combination *b)
+{
+	if (a->format != b->format)
+		return a->format < b->format;
+
+	return a->metadata.priority > b->metadata.priority;
+}
+
+/*
+ * The combinations do not change once the backend has been initialized, so they are grouped by
+ * format and sorted by priority. The first match in a bucket is then the best combination.
+ */
+static int drv_build_combo_index(struct driver *drv)
+{
+	uint32_t i, num_combos = drv_array_size(drv->combos);
+	struct combo_index *index;
+	struct combo_bucket *bucket = NULL;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+
+	index->combos = calloc(MAX(num_combos, 1), sizeof(*index->combos));
+	index->buckets = calloc(MAX(num_combos, 1), sizeof(*index->buckets));
+	if (!index->combos || !index->buckets) {
+		free(index->combos);
+		free(index->buckets);
+		free(index);
+		return -ENOMEM;
+	}
+
+	/*
+	 * Insertion sort keeps equal-priority combinations in the order the backend added them, so
+	 * ties resolve the same way as with a linear scan.
+	 */
+	for (i = 0; i < num_combos; i++) {
+		struct combination *combo = drv_array_at_idx(drv->combos, i);
+		uint32_t j = i;
+
+		while (j > 0 && drv_combo_before(combo, index->combos[j - 1])) {
+			index->combos[j] = index->combos[j - 1];
+			j--;
+		}
+
+		index->combos[j] = combo;
+	}
+
+	for (i = 0; i < num_combos; i++) {
+		if (!bucket || bucket->format != index->combos[i]->format) {
+			bucket = &index->buckets[index->num_buckets++];
+			bucket->format = index->combos[i]->format;
+			bucket->combos = &index->combos[i];
+		}
+
+		bucket->num_combos++;
+	}
+
+	drv->combo_index = index;
+	return 0;
+}
+
+static void drv_destroy_combo_index(struct driver *drv)
+{
+	if (!drv->combo_index)
+		return;
+
+	free(drv->combo_index->combos);
+	free(drv->combo_index->buckets);
+	free(drv->combo_index);
+	drv->combo_index = NULL;
+}
+
+static struct combo_bucket *drv_find_combo_bucket(struct combo_index *index, uint32_t format)
+{
+	uint32_t lo = 0, hi = index->num_buckets;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		struct combo_bucket *bucket = &index->buckets[mid];
+
+		if (bucket->format < format)
+			lo = mid + 1;
+		else if (bucket->format > format)
+			hi = mid;
+		else
+			return bucket;
+	}
+
+	return NULL;
+}
+
+static struct combo_cache_entry *drv_combo_cache_entry(struct combo_index *index, uint32_t format,
+						       uint64_t use_flags)
+{
+	uint64_t hash = (format ^ use_flags ^ (use_flags >> 32)) * 0x9e3779b97f4a7c15ull;
+	return &index->cache[(hash >> 32) % DRV_COMBO_CACHE_SIZE];
+}
+
+/*
+ * Readers never block: an entry is only trusted if its sequence number is even and unchanged
+ * after reading it. Writers that lose the race for an entry simply don't cache their result.
+ */
+static bool drv_combo_cache_lookup(struct combo_cache_entry *entry, uint32_t format,
+				   uint64_t use_flags, struct combination **combo)
+{
+	uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+	uint32_t cached_format;
+	uint64_t cached_use_flags;
+	struct combination *cached_combo;
+
+	if (seq & 1)
+		return false;
+
+	cached_format = __atomic_load_n(&entry->format, __ATOMIC_RELAXED);
+	cached_use_flags = __atomic_load_n(&entry->use_flags, __ATOMIC_RELAXED);
+	cached_combo = __atomic_load_n(&entry->combo, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+		return false;
+
+	if (cached_format != format || cached_use_flags != use_flags)
+		return false;
+
+	*combo = cached_combo;
+	return true;
+}
+
+static void drv_combo_cache_store(struct combo_cache_entry *entry, uint32_t format,
+				  uint64_t use_flags, struct combination *combo)
+{
+	uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false,
+						      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&entry->format, format, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->use_flags, use_flags, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->combo, combo, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void drv_destroy_shards(struct driver *drv, uint32_t count)
+{
+	unsigned long handle;
+	void *mappings;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		struct drv_shard *shard = &drv->shards[i];
+
+		/* Free the per-handle mapping arrays of any buffers that were leaked. */
+		if (drmHashFirst(shard->mappings, &handle, &mappings)) {
+			do {
+				drv_array_destroy(mappings);
+			} while (drmHashNext(shard->mappings, &handle, &mappings));
+		}
+
+		drmHashDestroy(shard->mappings);
+		drmHashDestroy(shard->imports);
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+static int drv_init_shards(struct driver *drv)
+{
+	uint32_t i;
+
+	for (i = 0; i < DRV_NUM_SHARDS; i++) {
+		struct drv_shard *shard = &drv->shards[i];
+
+		if (pthread_mutex_init(&shard->lock, NULL))
+			goto fail;
+
+		shard->mappings = drmHashCreate();
+		shard->imports = drmHashCreate();
+		if (!shard->mappings || !shard->imports) {
+			if (shard->mappings)
+				drmHashDestroy(shard->mappings);
+			if (shard->imports)
+				drmHashDestroy(shard->imports);
+			pthread_mutex_destroy(&shard->lock);
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	drv_destroy_shards(drv, i);
+	return -ENOMEM;
+}
+
 struct driver *drv_create(int fd)
 {
+	DRV_TRACE_SCOPE(__func__);
 	struct driver *drv;
 	int ret;
 
@@ -140,37 +365,66 @@ struct driver *drv_create(int fd)
 	if (!drv->backend)
 		goto free_driver;
 
-	if (pthread_mutex_init(&drv->driver_lock, NULL))
+	if (drv_init_shards(drv))
 		goto free_driver;
 
-	drv->buffer_table = drmHashCreate();
-	if (!drv->buffer_table)
-		goto free_lock;
+	if (drv_init_reference_counts(drv))
+		goto free_shards;
+
+	if (drv_pool_init(drv))
+		goto free_reference_counts;
+
+	if (drv_parallel_init(drv))
+		goto destroy_pool;
+
+	if (drv_record_init(drv))
+		goto destroy_parallel;
 
-	drv->mappings = drv_array_init(sizeof(struct mapping));
-	if (!drv->mappings)
-		goto free_buffer_table;
+	drv_heap_init(drv);
 
 	drv->combos = drv_array_init(sizeof(struct combination));
 	if (!drv->combos)
-		goto free_mappings;
+		goto free_pool;
 
 	if (drv->backend->init) {
+		DRV_TRACE_BEGIN("backend init");
 		ret = drv->backend->init(drv);
+		DRV_TRACE_END();
 		if (ret) {
 			drv_array_destroy(drv->combos);
-			goto free_mappings;
+			goto free_pool;
 		}
 	}
 
+	/* Backends that don't look at the planes themselves still get them for scanout queries. */
+	drv_query_kms(drv);
+
+	if (drv_build_combo_index(drv))
+		goto close_backend;
+
 	return drv;
 
-free_mappings:
-	drv_array_destroy(drv->mappings);
-free_buffer_table:
-	drmHashDestroy(drv->buffer_table);
-free_lock:
-	pthread_mutex_destroy(&drv->driver_lock);
+close_backend:
+	if (drv->backend->close) {
+		DRV_TRACE_BEGIN("backend close");
+		drv->backend->close(drv);
+		DRV_TRACE_END();
+	}
+
+	drv_array_destroy(drv->combos);
+free_pool:
+	if (drv->kms_items)
+		drv_array_destroy(drv->kms_items);
+	drv_heap_destroy(drv);
+	drv_record_destroy(drv);
+destroy_parallel:
+	drv_parallel_destroy(drv);
+destroy_pool:
+	drv_pool_destroy(drv);
+free_reference_counts:
+	drv_destroy_reference_counts(drv);
+free_shards:
+	drv_destroy_shards(drv, DRV_NUM_SHARDS);
 free_driver:
 	free(drv);
 	return NULL;
@@ -178,17 +432,27 @@ free_driver:
 
 void drv_destroy(struct driver *drv)
 {
-	pthread_mutex_lock(&drv->driver_lock);
+	DRV_TRACE_SCOPE(__func__);
+	drv_record_destroy(drv);
+	drv_pool_destroy(drv);
+	drv_parallel_destroy(drv);
 
-	if (drv->backend->close)
+	if (drv->backend->close) {
+		DRV_TRACE_BEGIN("backend close");
 		drv->backend->close(drv);
+		DRV_TRACE_END();
+	}
 
-	drmHashDestroy(drv->buffer_table);
-	drv_array_destroy(drv->mappings);
+	drv_destroy_shards(drv, DRV_NUM_SHARDS);
+	drv_destroy_reference_counts(drv);
+	drv_destroy_combo_index(drv);
 	drv_array_destroy(drv->combos);
+	if (drv->kms_items)
+		drv_array_destroy(drv->kms_items);
+	drv_heap_destroy(drv);
 
-	pthread_mutex_unlock(&drv->driver_lock);
-	pthread_mutex_destroy(&drv->driver_lock);
+	if (drv->owns_fd)
+		close(drv->fd);
 
 	free(drv);
 }
@@ -206,22 +470,83 @@ const char *drv_get_name(struct driver *drv)
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	struct combination *curr, *best;
+	struct combo_index *index = drv->combo_index;
+	struct combo_cache_entry *entry;
+	struct combo_bucket *bucket;
+	uint32_t i;
 
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
 	best = NULL;
-	uint32_t i;
-	for (i = 0; i < drv_array_size(drv->combos); i++) {
-		curr = drv_array_at_idx(drv->combos, i);
-		if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
-			if (!best || best->metadata.priority < curr->metadata.priority)
-				best = curr;
+
+	/* Backends may look up combinations while they are still adding them. */
+	if (!index) {
+		for (i = 0; i < drv_array_size(drv->combos); i++) {
+			curr = drv_array_at_idx(drv->combos, i);
+			if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
+				if (!best || best->metadata.priority < curr->metadata.priority)
+					best = curr;
+		}
+
+		return best;
 	}
 
+	entry = drv_combo_cache_entry(index, format, use_flags);
+	if (drv_combo_cache_lookup(entry, format, use_flags, &best))
+		return best;
+
+	bucket = drv_find_combo_bucket(index, format);
+	for (i = 0; bucket && i < bucket->num_combos; i++) {
+		curr = bucket->combos[i];
+		if (use_flags == (curr->use_flags & use_flags)) {
+			best = curr;
+			break;
+		}
+	}
+
+	drv_combo_cache_store(entry, format, use_flags, best);
 	return best;
 }
 
+uint32_t drv_get_format_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+				  uint64_t *modifiers, uint32_t count)
+{
+	struct combination *combo;
+	struct combo_bucket *bucket;
+	uint32_t i, j, num_modifiers = 0;
+
+	bucket = drv_find_combo_bucket(drv->combo_index, format);
+	if (!bucket)
+		return 0;
+
+	/* The bucket is sorted by priority, so the preferred modifiers come first. */
+	for (i = 0; i < bucket->num_combos; i++) {
+		combo = bucket->combos[i];
+		if (use_flags != (combo->use_flags & use_flags))
+			continue;
+
+		if (!drv_kms_supports(drv, format, combo->metadata.modifier, use_flags))
+			continue;
+
+		for (j = 0; j < i; j++) {
+			if (bucket->combos[j]->metadata.modifier == combo->metadata.modifier &&
+			    use_flags == (bucket->combos[j]->use_flags & use_flags))
+				break;
+		}
+
+		if (j < i)
+			continue;
+
+		if (num_modifiers < count)
+			modifiers[num_modifiers] = combo->metadata.modifier;
+
+		num_modifiers++;
+	}
+
+	return num_modifiers;
+}
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags)
 {
@@ -247,45 +572,171 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	return bo;
 }
 
-struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
-			 uint64_t use_flags)
+/* Destroys a bo whose handles got no references. */
+static void drv_bo_destroy_unreferenced(struct bo *bo)
+{
+	if (bo->heap_allocated)
+		drv_heap_bo_destroy(bo);
+	else
+		bo->drv->backend->bo_destroy(bo);
+
+	drv_heap_bo_release(bo);
+	free(bo);
+}
+
+/* Allocates a bo that holds references to its handles, but isn't accounted in the stats yet. */
+static struct bo *drv_bo_alloc(struct driver *drv, uint32_t width, uint32_t height,
+			       uint32_t format, uint64_t use_flags)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
+	struct drv_pool_stats stats;
 
 	bo = drv_bo_new(drv, width, height, format, use_flags);
 
 	if (!bo)
 		return NULL;
 
-	ret = drv->backend->bo_create(bo, width, height, format, use_flags);
+	ret = drv_heap_bo_create(bo, width, height, format, use_flags);
+	if (ret) {
+		DRV_TRACE_BEGIN("backend bo_create");
+		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
+		DRV_TRACE_END();
+	}
+
+	/* Give the memory held by the pool back and try again. */
+	if (ret == -ENOMEM) {
+		drv_pool_get_stats(drv, &stats);
+		if (stats.num_bos || stats.num_queued) {
+			drv_pool_trim(drv, 0);
+			DRV_TRACE_BEGIN("backend bo_create");
+			ret = drv->backend->bo_create(bo, width, height, format, use_flags);
+			DRV_TRACE_END();
+		}
+	}
 
 	if (ret) {
 		free(bo);
 		return NULL;
 	}
 
-	pthread_mutex_lock(&drv->driver_lock);
+	for (plane = 1; plane < bo->num_planes; plane++)
+		assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
 
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		if (plane > 0)
-			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+	if (drv_bo_acquire_references(bo)) {
+		drv_bo_destroy_unreferenced(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			 uint64_t use_flags)
+{
+	DRV_TRACE_SCOPE(__func__);
+	struct bo *bo;
+	uint64_t start;
+
+	bo = drv_pool_get(drv, width, height, format, use_flags);
+	if (bo)
+		return bo;
 
-		drv_increment_reference_count(drv, bo, plane);
+	start = drv_stats_start();
+	bo = drv_bo_alloc(drv, width, height, format, use_flags);
+	drv_stats_record(drv, DRV_STATS_CREATE, start);
+
+	if (!bo)
+		return NULL;
+
+	drv_stats_bo_added(bo);
+
+	if (!drv_stats_within_budget(drv, 0)) {
+		drv_bo_reclaim(bo);
+		errno = EDQUOT;
+		return NULL;
 	}
 
-	pthread_mutex_unlock(&drv->driver_lock);
+	bo->poolable = 1;
 
 	return bo;
 }
 
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count, struct bo **bos)
+{
+	DRV_TRACE_SCOPE(__func__);
+	int ret = 0;
+	uint32_t i, j, pooled;
+	uint64_t start;
+
+	if (!drv_get_combination(drv, format, use_flags))
+		return -EINVAL;
+
+	/* Pooled bos are still accounted as live, so they need neither stats nor budget. */
+	pooled = drv_pool_get_batch(drv, width, height, format, use_flags, count, bos);
+	if (pooled == count)
+		return 0;
+
+	/*
+	 * The layout comes out of the backend's create ioctl(s), so each bo still goes through
+	 * bo_create. But the layout is a function of the key, so the first bo tells what the whole
+	 * batch takes, and the budget is checked for it before any more memory is committed.
+	 */
+	start = drv_stats_start();
+	for (i = pooled; i < count; i++) {
+		bos[i] = drv_bo_alloc(drv, width, height, format, use_flags);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (i == pooled &&
+		    !drv_stats_within_budget(drv, bos[i]->total_size * (count - pooled))) {
+			ret = -EDQUOT;
+			i++;
+			break;
+		}
+	}
+	drv_stats_record_batch(drv, DRV_STATS_CREATE, start, i - pooled + (ret == -ENOMEM));
+
+	if (!ret) {
+		drv_stats_bos_added(bos + pooled, count - pooled);
+
+		/* Concurrent creations may still have pushed live_bytes over. */
+		if (drv_stats_within_budget(drv, 0)) {
+			for (j = pooled; j < count; j++)
+				bos[j]->poolable = 1;
+
+			return 0;
+		}
+
+		ret = -EDQUOT;
+	}
+
+	for (j = pooled; j < i; j++) {
+		drv_bo_reclaim(bos[j]);
+		bos[j] = NULL;
+	}
+
+	for (j = 0; j < pooled; j++) {
+		drv_bo_destroy(bos[j]);
+		bos[j] = NULL;
+	}
+
+	errno = -ret;
+	return ret;
+}
+
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
+	DRV_TRACE_SCOPE(__func__);
 	int ret;
 	size_t plane;
 	struct bo *bo;
+	uint64_t start;
 
 	if (!drv->backend->bo_create_with_modifiers) {
 		errno = ENOENT;
@@ -297,82 +748,302 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 	if (!bo)
 		return NULL;
 
+	start = drv_stats_start();
+	DRV_TRACE_BEGIN("backend bo_create_with_modifiers");
 	ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers, count);
+	DRV_TRACE_END();
+	drv_stats_record(drv, DRV_STATS_CREATE, start);
 
 	if (ret) {
 		free(bo);
 		return NULL;
 	}
 
-	pthread_mutex_lock(&drv->driver_lock);
+	for (plane = 1; plane < bo->num_planes; plane++)
+		assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+
+	if (drv_bo_acquire_references(bo)) {
+		drv_bo_destroy_unreferenced(bo);
+		return NULL;
+	}
+
+	drv_stats_bo_added(bo);
+
+	if (!drv_stats_within_budget(drv, 0)) {
+		drv_bo_reclaim(bo);
+		errno = EDQUOT;
+		return NULL;
+	}
+
+	return bo;
+}
+
+static bool drv_same_file(int fd, int other)
+{
+	struct stat st, other_st;
+
+	if (fd == other)
+		return true;
+
+	if (fstat(fd, &st) || fstat(other, &other_st))
+		return false;
+
+	return st.st_dev == other_st.st_dev && st.st_ino == other_st.st_ino;
+}
+
+static bool drv_bo_import_matches(struct bo *bo, struct drv_import_fd_data *data)
+{
+	size_t plane;
+
+	if (bo->format != data->format || bo->width != data->width ||
+	    bo->height != data->height || bo->use_flags != data->use_flags)
+		return false;
+
+	/* Some backends read the tiling from the kernel, so it only has to match if it was given. */
+	if (data->tiling && bo->tiling != data->tiling)
+		return false;
+
+	if (bo->num_planes !=
+	    drv_num_planes_from_modifier(bo->drv, data->format, data->format_modifiers[0]))
+		return false;
 
 	for (plane = 0; plane < bo->num_planes; plane++) {
-		if (plane > 0)
-			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+		if (bo->strides[plane] != data->strides[plane] ||
+		    bo->offsets[plane] != data->offsets[plane] ||
+		    bo->format_modifiers[plane] != data->format_modifiers[plane])
+			return false;
 
-		drv_increment_reference_count(drv, bo, plane);
+		if (data->sizes[plane] && bo->sizes[plane] != data->sizes[plane])
+			return false;
+
+		/* Cached bos are a single buffer, so all their planes come from one dma-buf. */
+		if (plane && !drv_same_file(data->fds[plane], data->fds[0]))
+			return false;
 	}
 
-	pthread_mutex_unlock(&drv->driver_lock);
+	return true;
+}
+
+/*
+ * Compositors import the same client dma-bufs over and over. As long as a bo imported from a
+ * dma-buf is alive, a new import of it with the same layout is copied from that bo instead of
+ * going through the backend and probing the plane sizes again. Bos are looked up by the inode
+ * of their dma-buf, so a lookup costs one fstat() and takes no GEM handle that a miss would have
+ * to close again.
+ *
+ * Only bos in a single buffer and without backend state in bo->priv are cached, anything else
+ * couldn't be copied.
+ */
+static struct bo *drv_bo_import_cached(struct driver *drv, struct drv_import_fd_data *data)
+{
+	struct stat st;
+	void *value;
+	struct bo *cached, *bo = NULL;
+	struct drv_shard *shard;
+
+	if (fstat(data->fds[0], &st))
+		return NULL;
+
+	shard = drv_get_shard(drv, (uint32_t)st.st_ino);
+	pthread_mutex_lock(&shard->lock);
+
+	if (drmHashLookup(shard->imports, (unsigned long)st.st_ino, &value))
+		goto out;
+
+	cached = value;
+	if (cached->import_dev != st.st_dev || cached->import_ino != st.st_ino ||
+	    !drv_bo_import_matches(cached, data))
+		goto out;
 
+	bo = malloc(sizeof(*bo));
+	if (!bo)
+		goto out;
+
+	memcpy(bo, cached, sizeof(*bo));
+	bo->import_cached = 0;
+	bo->stats_counted = 0;
+	if (bo->dmabuf_map) {
+		bo->dmabuf_fd = fcntl(cached->dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+		bo->dmabuf_map = bo->dmabuf_fd >= 0;
+	}
+
+	/* The cached bo still holds the handles, so there is nothing to close on failure. */
+	if (drv_bo_acquire_references(bo)) {
+		drv_heap_bo_release(bo);
+		free(bo);
+		bo = NULL;
+	}
+
+out:
+	pthread_mutex_unlock(&shard->lock);
 	return bo;
 }
 
+static void drv_bo_cache_import(struct bo *bo, int fd)
+{
+	struct stat st;
+	void *value;
+	struct drv_shard *shard;
+
+	if (bo->priv || drv_num_buffers_per_bo(bo) != 1 || fstat(fd, &st))
+		return;
+
+	bo->import_dev = st.st_dev;
+	bo->import_ino = st.st_ino;
+	shard = drv_get_shard(bo->drv, (uint32_t)st.st_ino);
+
+	pthread_mutex_lock(&shard->lock);
+	if (drmHashLookup(shard->imports, (unsigned long)st.st_ino, &value) &&
+	    !drmHashInsert(shard->imports, (unsigned long)st.st_ino, bo))
+		bo->import_cached = 1;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void drv_bo_uncache_import(struct bo *bo)
+{
+	struct drv_shard *shard = drv_get_shard(bo->drv, (uint32_t)bo->import_ino);
+
+	pthread_mutex_lock(&shard->lock);
+	drmHashDelete(shard->imports, (unsigned long)bo->import_ino);
+	bo->import_cached = 0;
+	pthread_mutex_unlock(&shard->lock);
+}
+
 void drv_bo_destroy(struct bo *bo)
 {
-	size_t plane;
-	uintptr_t total = 0;
-	struct driver *drv = bo->drv;
+	DRV_TRACE_SCOPE(__func__);
 
-	pthread_mutex_lock(&drv->driver_lock);
+	if (drv_pool_put(bo))
+		return;
 
-	for (plane = 0; plane < bo->num_planes; plane++)
-		drv_decrement_reference_count(drv, bo, plane);
+	drv_bo_discard(bo);
+}
 
-	for (plane = 0; plane < bo->num_planes; plane++)
-		total += drv_get_reference_count(drv, bo, plane);
+/* Destroys a bo that isn't pooled, on the reclaim thread with async destroy. */
+void drv_bo_discard(struct bo *bo)
+{
+	/* Before the references are dropped, so no import can copy the bo afterwards. */
+	if (bo->import_cached)
+		drv_bo_uncache_import(bo);
 
-	pthread_mutex_unlock(&drv->driver_lock);
+	if (drv_pool_defer(bo))
+		return;
 
-	if (total == 0) {
-		assert(drv_mapping_destroy(bo) == 0);
-		bo->drv->backend->bo_destroy(bo);
+	drv_bo_reclaim(bo);
+}
+
+void drv_bo_reclaim(struct bo *bo)
+{
+	DRV_TRACE_SCOPE(__func__);
+	uint64_t start;
+
+	drv_stats_bo_removed(bo);
+
+	if (drv_bo_release_references(bo) == 0) {
+		drv_bo_lock_shards(bo);
+		drv_mapping_destroy(bo);
+		drv_bo_unlock_shards(bo);
+
+		start = drv_stats_start();
+		DRV_TRACE_BEGIN("backend bo_destroy");
+		if (bo->heap_allocated)
+			drv_heap_bo_destroy(bo);
+		else
+			bo->drv->backend->bo_destroy(bo);
+		DRV_TRACE_END();
+		drv_stats_record(bo->drv, DRV_STATS_DESTROY, start);
 	}
 
+	drv_heap_bo_release(bo);
 	free(bo);
 }
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 {
+	DRV_TRACE_SCOPE(__func__);
 	int ret;
 	size_t plane;
 	struct bo *bo;
 	off_t seek_end;
+	bool sizes_known;
+	uint64_t start;
+	struct stat st;
+	dev_t dev = 0;
+	ino_t ino = 0;
+
+	start = drv_stats_start();
+	bo = drv_bo_import_cached(drv, data);
+	if (bo) {
+		drv_stats_record(drv, DRV_STATS_IMPORT, start);
+		drv_stats_bo_added(bo);
+		return bo;
+	}
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags);
 
 	if (!bo)
 		return NULL;
 
+	bo->num_planes = drv_num_planes_from_modifier(drv, data->format, data->format_modifiers[0]);
+	if (!bo->num_planes) {
+		drv_log("Unsupported format and modifier for import\n");
+		free(bo);
+		return NULL;
+	}
+
+	bo->tiling = data->tiling;
+
+	start = drv_stats_start();
+	DRV_TRACE_BEGIN("backend bo_import");
 	ret = drv->backend->bo_import(bo, data);
+	DRV_TRACE_END();
+	drv_stats_record(drv, DRV_STATS_IMPORT, start);
 	if (ret) {
 		free(bo);
 		return NULL;
 	}
 
+	/*
+	 * The exporter may already have told us the plane sizes. They are still checked against
+	 * the size of the dma-buf, which is only queried once for planes that share it. Gralloc dups
+	 * the fd for each plane, so planes are matched by the inode, not by the fd number.
+	 */
+	sizes_known = true;
+	for (plane = 0; plane < bo->num_planes; plane++)
+		sizes_known &= data->sizes[plane] != 0;
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		bo->strides[plane] = data->strides[plane];
 		bo->offsets[plane] = data->offsets[plane];
 		bo->format_modifiers[plane] = data->format_modifiers[plane];
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
-		if (seek_end == (off_t)(-1)) {
-			drv_log("lseek() failed with %s\n", strerror(errno));
-			goto destroy_bo;
+		if (!plane || data->fds[plane] != data->fds[plane - 1]) {
+			if (fstat(data->fds[plane], &st)) {
+				drv_log("fstat() failed with %s\n", strerror(errno));
+				goto destroy_bo;
+			}
+		}
+
+		if (!plane || st.st_dev != dev || st.st_ino != ino) {
+			dev = st.st_dev;
+			ino = st.st_ino;
+
+			/* dma-buf reports its size as the inode size, older kernels only to lseek(). */
+			seek_end = st.st_size;
+			if (seek_end <= 0) {
+				seek_end = lseek(data->fds[plane], 0, SEEK_END);
+				if (seek_end == (off_t)(-1)) {
+					drv_log("lseek() failed with %s\n", strerror(errno));
+					goto destroy_bo;
+				}
+
+				lseek(data->fds[plane], 0, SEEK_SET);
+			}
 		}
 
-		lseek(data->fds[plane], 0, SEEK_SET);
-		if (plane == bo->num_planes - 1 || data->offsets[plane + 1] == 0)
+		if (sizes_known)
+			bo->sizes[plane] = data->sizes[plane];
+		else if (plane == bo->num_planes - 1 || data->offsets[plane + 1] == 0)
 			bo->sizes[plane] = seek_end - data->offsets[plane];
 		else
 			bo->sizes[plane] = data->offsets[plane + 1] - data->offsets[plane];
@@ -385,6 +1056,9 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->total_size += bo->sizes[plane];
 	}
 
+	drv_heap_bo_import(bo, data);
+	drv_bo_cache_import(bo, data->fds[0]);
+	drv_stats_bo_added(bo);
 	return bo;
 
 destroy_bo:
@@ -392,12 +1066,73 @@ destroy_bo:
 	return NULL;
 }
 
+static void drv_rect_union(struct rectangle *dst, const struct rectangle *src)
+{
+	uint32_t x1, y1;
+
+	if (!src->width || !src->height)
+		return;
+
+	if (!dst->width || !dst->height) {
+		*dst = *src;
+		return;
+	}
+
+	x1 = MAX(dst->x + dst->width, src->x + src->width);
+	y1 = MAX(dst->y + dst->height, src->y + src->height);
+	dst->x = MIN(dst->x, src->x);
+	dst->y = MIN(dst->y, src->y);
+	dst->width = x1 - dst->x;
+	dst->height = y1 - dst->y;
+}
+
+/* Returns 1 if mapping the plane with map_flags would wait for the GPU, see BO_MAP_NONBLOCK. */
+static int drv_bo_busy(struct bo *bo, size_t plane, uint32_t map_flags)
+{
+	const struct backend *backend = drv_bo_cpu_backend(bo);
+	int ret, fd;
+
+	if (backend->bo_busy)
+		return backend->bo_busy(bo, map_flags);
+
+	/* Buffers that can't be exported can't be polled, and are taken to be idle. */
+	if (drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC, &fd))
+		return 0;
+
+	ret = drv_dmabuf_busy(fd, map_flags);
+	close(fd);
+	return ret;
+}
+
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane)
 {
+	DRV_TRACE_SCOPE(__func__);
+	int ret;
 	uint32_t i;
+	size_t map_plane;
 	uint8_t *addr;
 	struct mapping mapping;
+	struct drv_array *mappings;
+	struct driver *drv = bo->drv;
+	uint32_t handle = bo->handles[plane].u32;
+	struct drv_shard *shard = drv_get_shard(drv, handle);
+	struct rectangle whole = { 0, 0, bo->width, bo->height };
+	uint32_t dirty_rect = map_flags & BO_MAP_DIRTY_RECT;
+	uint32_t nonblock = map_flags & BO_MAP_NONBLOCK;
+	uint64_t start = drv_stats_start();
+
+	/* Rectangles of other planes aren't in bo coordinates, so don't track those. */
+	if (plane || !rect->width || !rect->height)
+		dirty_rect = 0;
+
+	/*
+	 * There is one vma per GEM object, whichever of its planes is mapped. The mapping is made
+	 * through the first of them, and the others are reached by their offsets.
+	 */
+	map_plane = drv_bo_first_plane_of_handle(bo, plane);
+
+	map_flags &= BO_MAP_READ_WRITE;
 
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
@@ -407,16 +1142,38 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	/* No CPU access for protected buffers. */
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
 
+	/* Before any mapping is made or reused, so a busy bo leaves nothing to undo. */
+	if (nonblock) {
+		ret = drv_bo_busy(bo, plane, map_flags);
+		if (ret) {
+			errno = ret < 0 ? -ret : EAGAIN;
+			*map_data = NULL;
+			return MAP_FAILED;
+		}
+	}
+
 	memset(&mapping, 0, sizeof(mapping));
 	mapping.rect = *rect;
 	mapping.refcount = 1;
 
-	pthread_mutex_lock(&bo->drv->driver_lock);
+	pthread_mutex_lock(&shard->lock);
+
+	/*
+	 * Only the mappings of this GEM handle need to be looked at. An exact match reuses the
+	 * mapping, otherwise a vma with at least the map flags is shared with the new mapping,
+	 * preferably one with the same flags. Flushes only write back what was written through a
+	 * mapping, so reading through a writable vma costs nothing extra.
+	 */
+	mappings = drv_get_mappings(drv, handle);
+	for (i = 0; mappings && i < drv_array_size(mappings); i++) {
+		struct mapping *prior = (struct mapping *)drv_array_at_idx(mappings, i);
+		if ((prior->vma->map_flags & map_flags) != map_flags)
+			continue;
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
+		if (!mapping.vma || prior->vma->map_flags == map_flags)
+			mapping.vma = prior->vma;
+
+		if (prior->vma->map_flags != map_flags)
 			continue;
 
 		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
@@ -425,89 +1182,193 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 
 		prior->refcount++;
 		*map_data = prior;
+		__atomic_fetch_add(&drv->stats.map_exact_hits, 1, __ATOMIC_RELAXED);
 		goto exact_match;
 	}
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
-			continue;
+	if (!mappings) {
+		mappings = drv_array_init(sizeof(struct mapping));
+		if (!mappings)
+			goto fail;
 
-		prior->vma->refcount++;
-		mapping.vma = prior->vma;
+		drmHashInsert(shard->mappings, handle, mappings);
+	}
+
+	if (mapping.vma) {
+		mapping.vma->refcount++;
+		__atomic_fetch_add(&drv->stats.map_vma_hits, 1, __ATOMIC_RELAXED);
 		goto success;
 	}
 
 	mapping.vma = calloc(1, sizeof(*mapping.vma));
+	if (!mapping.vma)
+		goto fail;
+
 	memcpy(mapping.vma->map_strides, bo->strides, sizeof(mapping.vma->map_strides));
-	addr = bo->drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
+	DRV_TRACE_BEGIN("backend bo_map");
+	addr = drv_bo_cpu_backend(bo)->bo_map(bo, mapping.vma, map_plane, map_flags);
+	DRV_TRACE_END();
 	if (addr == MAP_FAILED) {
-		*map_data = NULL;
 		free(mapping.vma);
-		pthread_mutex_unlock(&bo->drv->driver_lock);
-		return MAP_FAILED;
+		goto fail;
 	}
 
 	mapping.vma->refcount = 1;
 	mapping.vma->addr = addr;
-	mapping.vma->handle = bo->handles[plane].u32;
+	mapping.vma->handle = handle;
 	mapping.vma->map_flags = map_flags;
+	__atomic_fetch_add(&drv->stats.map_misses, 1, __ATOMIC_RELAXED);
 
 success:
-	*map_data = drv_array_append(bo->drv->mappings, &mapping);
+	*map_data = drv_array_append(mappings, &mapping);
 exact_match:
+	if (map_flags & BO_MAP_WRITE)
+		drv_rect_union(&(*map_data)->dirty_rect, dirty_rect ? rect : &whole);
+
 	drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
-	pthread_mutex_unlock(&bo->drv->driver_lock);
+	pthread_mutex_unlock(&shard->lock);
+	drv_stats_record(drv, DRV_STATS_MAP, start);
 	return (void *)addr;
+
+fail:
+	if (mappings && !drv_array_size(mappings)) {
+		drmHashDelete(shard->mappings, handle);
+		drv_array_destroy(mappings);
+	}
+
+	*map_data = NULL;
+	pthread_mutex_unlock(&shard->lock);
+	return MAP_FAILED;
 }
 
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 {
+	DRV_TRACE_SCOPE(__func__);
 	uint32_t i;
 	int ret = 0;
+	struct drv_array *mappings;
+	struct driver *drv = bo->drv;
+	uint32_t handle = mapping->vma->handle;
+	struct drv_shard *shard = drv_get_shard(drv, handle);
 
-	pthread_mutex_lock(&bo->drv->driver_lock);
+	pthread_mutex_lock(&shard->lock);
 
 	if (--mapping->refcount)
 		goto out;
 
 	if (!--mapping->vma->refcount) {
-		ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
+		DRV_TRACE_BEGIN("backend bo_unmap");
+		ret = drv_bo_cpu_backend(bo)->bo_unmap(bo, mapping->vma);
+		DRV_TRACE_END();
 		free(mapping->vma);
 	}
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		if (mapping == (struct mapping *)drv_array_at_idx(bo->drv->mappings, i)) {
-			drv_array_remove(bo->drv->mappings, i);
+	mappings = drv_get_mappings(drv, handle);
+	assert(mappings);
+
+	for (i = 0; i < drv_array_size(mappings); i++) {
+		if (mapping == (struct mapping *)drv_array_at_idx(mappings, i)) {
+			drv_array_remove(mappings, i);
 			break;
 		}
 	}
 
+	if (!drv_array_size(mappings)) {
+		drmHashDelete(shard->mappings, handle);
+		drv_array_destroy(mappings);
+	}
+
 out:
-	pthread_mutex_unlock(&bo->drv->driver_lock);
+	pthread_mutex_unlock(&shard->lock);
 	return ret;
 }
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
+	DRV_TRACE_SCOPE(__func__);
 	int ret = 0;
+	uint32_t map_flags, domain;
+	const struct backend *backend = drv_bo_cpu_backend(bo);
 
 	assert(mapping);
 	assert(mapping->vma);
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_invalidate)
-		ret = bo->drv->backend->bo_invalidate(bo, mapping);
+	/*
+	 * Only a device can make the CPU view of a vma stale, so a vma that was invalidated once
+	 * stays valid if no device ever accesses the bo. Implicit fences would only tell whether a
+	 * device still is, not whether one did since, so every other bo is invalidated each time.
+	 */
+	map_flags = mapping->vma->map_flags & BO_MAP_READ_WRITE;
+	domain = __atomic_load_n(&mapping->vma->domain, __ATOMIC_RELAXED);
+	if ((domain & map_flags) == map_flags) {
+		__atomic_fetch_add(&bo->drv->stats.invalidates_skipped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (backend->bo_invalidate) {
+		DRV_TRACE_BEGIN("backend bo_invalidate");
+		ret = backend->bo_invalidate(bo, mapping);
+		DRV_TRACE_END();
+	}
 
+	if (!ret && drv_use_flags_cpu_only(bo->use_flags))
+		__atomic_fetch_or(&mapping->vma->domain, map_flags, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+void drv_bo_mark_dirty(struct bo *bo, struct mapping *mapping, const struct rectangle *rect)
+{
+	struct drv_shard *shard = drv_get_shard(bo->drv, mapping->vma->handle);
+
+	pthread_mutex_lock(&shard->lock);
+	drv_rect_union(&mapping->dirty_rect, rect);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+int drv_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	DRV_TRACE_SCOPE(__func__);
+	int ret = 0;
+	struct drv_shard *shard;
+	uint64_t start;
+	const struct backend *backend = drv_bo_cpu_backend(bo);
+
+	assert(mapping);
+	assert(mapping->vma);
+	assert(mapping->refcount > 0);
+	assert(mapping->vma->refcount > 0);
+	assert(!(bo->use_flags & BO_USE_PROTECTED));
+
+	if (!backend->bo_flush)
+		return 0;
+
+	shard = drv_get_shard(bo->drv, mapping->vma->handle);
+	pthread_mutex_lock(&shard->lock);
+
+	/* Nothing was written through the mapping since the last flush. */
+	if (mapping->dirty_rect.width && mapping->dirty_rect.height) {
+		start = drv_stats_start();
+		DRV_TRACE_BEGIN("backend bo_flush");
+		ret = backend->bo_flush(bo, mapping);
+		DRV_TRACE_END();
+		drv_stats_record(bo->drv, DRV_STATS_FLUSH, start);
+	}
+
+	if (!ret)
+		memset(&mapping->dirty_rect, 0, sizeof(mapping->dirty_rect));
+
+	pthread_mutex_unlock(&shard->lock);
 	return ret;
 }
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 {
+	DRV_TRACE_SCOPE(__func__);
 	int ret = 0;
 
 	assert(mapping);
@@ -516,14 +1377,24 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
+	if (drv_bo_cpu_backend(bo)->bo_flush)
+		ret = drv_bo_flush(bo, mapping);
 	else
 		ret = drv_bo_unmap(bo, mapping);
 
 	return ret;
 }
 
+int drv_bo_unmap_writes_back(struct bo *bo)
+{
+	const struct backend *backend = drv_bo_cpu_backend(bo);
+
+	if (backend->bo_flush || !backend->bo_unmap_writes_back)
+		return 0;
+
+	return backend->bo_unmap_writes_back(bo);
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->width;
@@ -539,6 +1410,11 @@ uint32_t drv_bo_get_stride_or_tiling(struct bo *bo)
 	return bo->tiling ? bo->tiling : drv_bo_get_plane_stride(bo, 0);
 }
 
+uint32_t drv_bo_get_tiling(struct bo *bo)
+{
+	return bo->tiling;
+}
+
 size_t drv_bo_get_num_planes(struct bo *bo)
 {
 	return bo->num_planes;
@@ -555,10 +1431,16 @@ union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 {
-
+	DRV_TRACE_SCOPE(__func__);
 	int ret, fd;
 	assert(plane < bo->num_planes);
 
+	/* Other processes may still use the buffer after it is destroyed here. */
+	bo->poolable = 0;
+
+	if (bo->dmabuf_map)
+		return drv_heap_bo_get_fd(bo);
+
 	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
 
 	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
@@ -605,6 +1487,16 @@ uint32_t drv_resolve_format(struct driver *drv, uint32_t format, uint64_t use_fl
 	return format;
 }
 
+size_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier)
+{
+	size_t num_planes = drv_num_planes_from_format(format);
+
+	if (num_planes && drv->backend->num_planes_from_modifier)
+		return drv->backend->num_planes_from_modifier(drv, format, modifier);
+
+	return num_planes;
+}
+
 uint32_t drv_num_buffers_per_bo(struct bo *bo)
 {
 	uint32_t count = 0;
@@ -46,6 +46,10 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/* Only the mapped rectangle will be written, so flushes may be limited to it. */
+#define BO_MAP_DIRTY_RECT (1 << 2)
+/* Fail with EAGAIN instead of waiting for the GPU to be done with the bo. */
+#define BO_MAP_NONBLOCK (1 << 3)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -75,10 +79,14 @@ struct drv_import_fd_data {
 	uint32_t strides[DRV_MAX_PLANES];
 	uint32_t offsets[DRV_MAX_PLANES];
 	uint64_t format_modifiers[DRV_MAX_PLANES];
+	/* Optional. If every plane has a size, the fds are not probed for theirs. */
+	uint32_t sizes[DRV_MAX_PLANES];
 	uint32_t width;
 	uint32_t height;
 	uint32_t format;
 	uint64_t use_flags;
+	/* Backend specific, what drv_bo_get_tiling() returned for the exported bo. */
+	uint32_t tiling;
 };
 
 struct vma {
@@ -89,6 +97,11 @@ struct vma {
 	int32_t refcount;
 	uint32_t map_strides[DRV_MAX_PLANES];
 	void *priv;
+	/*
+	 * The BO_MAP_READ/WRITE bits drv_bo_invalidate() last synchronized the CPU view for, 0
+	 * once a device (or the kernel on its behalf) may have taken the bo away from the CPU.
+	 */
+	uint32_t domain;
 };
 
 struct rectangle {
@@ -102,24 +115,140 @@ struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
 	uint32_t refcount;
+	/* Union of the rectangles written since the last flush, empty if there were none. */
+	struct rectangle dirty_rect;
 };
 
+struct drv_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint32_t num_bos;
+	uint64_t num_bytes;
+	/* Destroyed bos handed out again before the reclaim thread got to them. */
+	uint64_t resurrections;
+	uint32_t num_queued;
+};
+
+enum drv_stats_op {
+	DRV_STATS_CREATE,
+	DRV_STATS_IMPORT,
+	DRV_STATS_MAP,
+	DRV_STATS_FLUSH,
+	DRV_STATS_DESTROY,
+	DRV_STATS_NUM_OPS,
+};
+
+/* Bucket i counts calls that took less than 2^i us, the last one all slower calls. */
+#define DRV_STATS_NUM_BUCKETS 20
+#define DRV_STATS_MAX_FORMATS 32
+/* The BO_USE_* bits up to BO_USE_FRAMEBUFFER. */
+#define DRV_STATS_NUM_USE_FLAGS 20
+
+struct drv_op_stats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[DRV_STATS_NUM_BUCKETS];
+};
+
+struct drv_format_stats {
+	uint32_t format;
+	uint64_t live_bos;
+	uint64_t live_bytes;
+};
+
+struct drv_stats {
+	/* Created and imported bos, including the ones kept by the pool. */
+	uint64_t live_bos;
+	uint64_t live_bytes;
+	/* drv_bo_map() reused a mapping, shared the vma of another mapping or mapped anew. */
+	uint64_t map_exact_hits;
+	uint64_t map_vma_hits;
+	uint64_t map_misses;
+	/* Invalidates left out because the vma was still in the CPU domain. */
+	uint64_t invalidates_skipped;
+	struct drv_op_stats ops[DRV_STATS_NUM_OPS];
+	/* Formats past DRV_STATS_MAX_FORMATS are only counted in the totals. */
+	uint32_t num_formats;
+	struct drv_format_stats formats[DRV_STATS_MAX_FORMATS];
+	/* Bytes of live bos by BO_USE_* bit, so a bo counts towards each of its use flags. */
+	uint64_t use_bytes[DRV_STATS_NUM_USE_FLAGS];
+	/* The soft limit on live_bytes (0 for none), and the creations that failed on it. */
+	uint64_t budget_bytes;
+	uint64_t budget_failures;
+};
+
+/* The calls of the allocator front ends that are recorded, see drv_record.c. */
+enum drv_record_op {
+	DRV_RECORD_CREATE,
+	DRV_RECORD_IMPORT,
+	DRV_RECORD_MAP,
+	DRV_RECORD_UNMAP,
+	DRV_RECORD_DESTROY,
+	DRV_RECORD_NUM_OPS
+};
+
+/* One recorded call, as written to the log. */
+struct drv_record {
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	uint64_t use_flags;
+	/* Pairs a map with its unmap. */
+	uint64_t map_id;
+	uint32_t op;
+	uint32_t tid;
+	/* The GEM handle of the first plane, which names the bo while it is alive. */
+	uint32_t id;
+	uint32_t format;
+	/* The size of the bo, or of the mapped rectangle for maps. */
+	uint32_t width;
+	uint32_t height;
+	uint32_t x;
+	uint32_t y;
+	uint32_t map_flags;
+	uint32_t plane;
+	int32_t result;
+	uint32_t pad;
+};
+
+/* Called for each replayed call with its result and how long it took. */
+typedef void (*drv_replay_fn)(void *data, const struct drv_record *record, int result,
+			      uint64_t duration_ns);
+
 struct driver *drv_create(int fd);
 
 void drv_destroy(struct driver *drv);
 
+/*
+ * Creates a driver on the device picked by selector (see drv_device.c), or by use_flags when it
+ * is NULL. The driver closes the device when destroyed.
+ */
+struct driver *drv_create_for_usage(const char *selector, uint64_t use_flags);
+
 int drv_get_fd(struct driver *drv);
 
 const char *drv_get_name(struct driver *drv);
 
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
 
+/*
+ * Stores up to count modifiers that buffers of format can be allocated with for use_flags, the
+ * preferred ones first, and returns how many there are in total.
+ */
+uint32_t drv_get_format_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+				  uint64_t *modifiers, uint32_t count);
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags);
 
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags);
 
+/* Creates count identical bos, or none at all. Returns 0 or a negative errno. */
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count, struct bo **bos);
+
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 
@@ -134,14 +263,44 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
+/* Adds rect to the region of the mapping that the next flush writes back. */
+void drv_bo_mark_dirty(struct bo *bo, struct mapping *mapping, const struct rectangle *rect);
+
+/* Only does cache maintenance, the mapping stays valid. */
+int drv_bo_flush(struct bo *bo, struct mapping *mapping);
+
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+/* Whether only drv_bo_unmap() writes back CPU writes, e.g. for DRI bos. */
+int drv_bo_unmap_writes_back(struct bo *bo);
+
+/*
+ * Copy rect of a plane, in pixels of the first plane, from or to linear memory. Streaming loads
+ * and stores keep this fast on write-combined mappings.
+ */
+int drv_bo_write_rect(struct bo *bo, size_t plane, const struct rectangle *rect, const void *src,
+		      uint32_t src_stride);
+int drv_bo_read_rect(struct bo *bo, size_t plane, const struct rectangle *rect, void *dst,
+		     uint32_t dst_stride);
+
+/*
+ * Copy rect, in pixels of the first plane, of all planes from src to dst. The GPU does the copy
+ * where the backend can, and it may still be running on return. Mapping dst waits for it, as do
+ * devices that follow implicit fences.
+ *
+ * Bos of different formats are converted by the CPU, between NV12, NV21, YVU420 and 32-bit RGB,
+ * except from RGB to RGB. rect has to start at even coordinates then.
+ */
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
 
 uint32_t drv_bo_get_stride_or_tiling(struct bo *bo);
 
+uint32_t drv_bo_get_tiling(struct bo *bo);
+
 size_t drv_bo_get_num_planes(struct bo *bo);
 
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane);
@@ -166,8 +325,66 @@ uint32_t drv_resolve_format(struct driver *drv, uint32_t format, uint64_t use_fl
 
 size_t drv_num_planes_from_format(uint32_t format);
 
+size_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier);
+
 uint32_t drv_num_buffers_per_bo(struct bo *bo);
 
+/* A max_bytes of 0 disables the pool. A max_age_ms of 0 keeps bos until they are evicted by size. */
+void drv_pool_set_limits(struct driver *drv, uint64_t max_bytes, uint32_t max_age_ms);
+
+void drv_pool_trim(struct driver *drv, uint64_t max_bytes);
+
+void drv_pool_get_stats(struct driver *drv, struct drv_pool_stats *stats);
+
+/*
+ * With async destroy, drv_bo_destroy() queues bos that aren't pooled for a reclaim thread, which
+ * unmaps and closes them. Disabling it waits for the queue to drain.
+ */
+int drv_pool_set_async_destroy(struct driver *drv, int enable);
+
+/* Caps the threads, counting the caller, that large CPU work on a bo is split across. */
+void drv_set_max_threads(struct driver *drv, uint32_t max_threads);
+
+void drv_get_stats(struct driver *drv, struct drv_stats *stats);
+
+/* Writes a text summary of the stats, returns its length or -ENOSPC if it was truncated. */
+int drv_stats_dump(struct driver *drv, char *buf, size_t size);
+
+/*
+ * Caps the bytes of live bos, 0 for no limit. A creation that would go over it first empties the
+ * pool and the reclaim queue, and then fails with errno set to EDQUOT. Imports are counted, but
+ * never fail on the budget.
+ */
+void drv_set_memory_budget(struct driver *drv, uint64_t max_bytes);
+
+/* Returns the bytes of all live bos for a use_flag of 0, otherwise of those with that flag. */
+uint64_t drv_get_allocated_bytes(struct driver *drv, uint64_t use_flag);
+
+/*
+ * Records the calls of the front ends to the log at path, replacing any earlier log, until
+ * drv_record_stop(). Recording also starts at creation if MINIGBM_RECORD is set, to the path it
+ * names with ".<pid>.<n>" appended, n counting the drivers that the process created.
+ */
+int drv_record_start(struct driver *drv, const char *path);
+void drv_record_stop(struct driver *drv);
+
+/*
+ * A front end call is recorded by drv_record_begin(), which returns 0 if nothing is recorded,
+ * then drv_record_bo() and any fields of its own, and finally drv_record_end() with its result.
+ * drv_record_end_batch() records a call that created count bos at once as one creation each.
+ */
+int drv_record_begin(struct driver *drv, struct drv_record *record, uint32_t op);
+void drv_record_bo(struct drv_record *record, struct bo *bo);
+void drv_record_end(struct driver *drv, struct drv_record *record, int result);
+void drv_record_end_batch(struct driver *drv, struct drv_record *record, struct bo **bos,
+			  uint32_t count);
+
+/*
+ * Runs the calls of a log in order and passes each to fn. Returns the number of calls replayed,
+ * or a negative errno if the log can't be read.
+ */
+int drv_replay(struct driver *drv, const char *path, drv_replay_fn fn, void *data);
+
 #define drv_log(format, ...)                                                                       \
 	do {                                                                                       \
 		drv_log_prefix("minigbm", __FILE__, __LINE__, format, ##__VA_ARGS__);              \
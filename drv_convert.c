@@ -0,0 +1,679 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DRV_CONVERT_X86
+#endif
+
+#include "drv_priv.h"
+#include "drv_trace.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Copies between bos of different formats, for producers and consumers that disagree on the
+ * layout of a flexible YCbCr buffer, like a camera writing YV12 for an encoder that reads NV12.
+ * The 4:2:0 formats are repacked into each other, and 32-bit RGB is converted to and from them
+ * with the BT.601 limited range coefficients that Android uses for its YUV formats.
+ *
+ * Images are converted in pairs of rows, which share a row of chroma, and the pairs are split
+ * across the workers of drv_parallel_for(). The source rows of a pair are first copied out with
+ * drv_copy_from_wc(), so uncached mappings are read in full cache lines. SSE2 converts 16 or 8
+ * pixels at a time on x86, and the scalar code converts the rest and runs everywhere else.
+ */
+
+struct drv_convert_format {
+	uint32_t format;
+	bool rgb;
+	/* Whether the pixels of RGB formats are B, G, R, X in memory rather than R, G, B, X. */
+	bool bgr;
+	/* The planes of U and V of YUV formats, their offsets in them, and their sample step. */
+	uint8_t u_plane;
+	uint8_t u_offset;
+	uint8_t v_plane;
+	uint8_t v_offset;
+	uint8_t uv_step;
+};
+
+static const struct drv_convert_format drv_convert_formats[] = {
+	{ DRM_FORMAT_ABGR8888, true, false },
+	{ DRM_FORMAT_XBGR8888, true, false },
+	{ DRM_FORMAT_ARGB8888, true, true },
+	{ DRM_FORMAT_XRGB8888, true, true },
+	{ DRM_FORMAT_NV12, false, false, 1, 0, 1, 1, 2 },
+	{ DRM_FORMAT_NV21, false, false, 1, 1, 1, 0, 2 },
+	{ DRM_FORMAT_YVU420, false, false, 2, 0, 1, 0, 1 },
+	{ DRM_FORMAT_YVU420_ANDROID, false, false, 2, 0, 1, 0, 1 },
+};
+
+/* The samples of one bo, at the origin of the converted rectangle. */
+struct drv_convert_image {
+	const struct drv_convert_format *format;
+	/* The pixels of RGB formats, or the luma of YUV ones. */
+	uint8_t *data;
+	uint32_t stride;
+	uint8_t *u;
+	uint8_t *v;
+	uint32_t uv_stride;
+};
+
+struct drv_convert {
+	struct drv_convert_image dst;
+	struct drv_convert_image src;
+	uint32_t width;
+	uint32_t height;
+};
+
+static const struct drv_convert_format *drv_convert_get_format(uint32_t format)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(drv_convert_formats); i++) {
+		if (drv_convert_formats[i].format == format)
+			return &drv_convert_formats[i];
+	}
+
+	return NULL;
+}
+
+static inline uint8_t drv_convert_clamp(int32_t value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline uint8_t drv_convert_luma(int32_t r, int32_t g, int32_t b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+/*
+ * Converts the pixels from x on of one or two rows of RGB, with rgb1 == rgb0 and y1 NULL for
+ * the last row of an odd height. Chroma is taken from the average of each 2x2 block.
+ */
+static void drv_convert_rgb_to_yuv_c(const uint8_t *rgb0, const uint8_t *rgb1, bool bgr,
+				     uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+				     uint32_t uv_step, uint32_t x, uint32_t width)
+{
+	uint32_t i, x1, ro = bgr ? 2 : 0, bo = bgr ? 0 : 2;
+	int32_t r, g, b;
+	const uint8_t *p[4];
+
+	for (; x < width; x += 2) {
+		/* An odd last column is its own pair. */
+		x1 = x + 1 < width ? x + 1 : x;
+		p[0] = rgb0 + 4 * x;
+		p[1] = rgb0 + 4 * x1;
+		p[2] = rgb1 + 4 * x;
+		p[3] = rgb1 + 4 * x1;
+
+		y0[x] = drv_convert_luma(p[0][ro], p[0][1], p[0][bo]);
+		y0[x1] = drv_convert_luma(p[1][ro], p[1][1], p[1][bo]);
+		if (y1) {
+			y1[x] = drv_convert_luma(p[2][ro], p[2][1], p[2][bo]);
+			y1[x1] = drv_convert_luma(p[3][ro], p[3][1], p[3][bo]);
+		}
+
+		r = g = b = 2;
+		for (i = 0; i < 4; i++) {
+			r += p[i][ro];
+			g += p[i][1];
+			b += p[i][bo];
+		}
+
+		r >>= 2;
+		g >>= 2;
+		b >>= 2;
+		u[x / 2 * uv_step] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+		v[x / 2 * uv_step] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+}
+
+static inline void drv_convert_store_rgb(uint8_t *rgb, bool bgr, int32_t c, int32_t d, int32_t e)
+{
+	uint8_t r = drv_convert_clamp((c + 409 * e) >> 8);
+	uint8_t g = drv_convert_clamp((c - 100 * d - 208 * e) >> 8);
+	uint8_t b = drv_convert_clamp((c + 516 * d) >> 8);
+
+	rgb[0] = bgr ? b : r;
+	rgb[1] = g;
+	rgb[2] = bgr ? r : b;
+	rgb[3] = 0xff;
+}
+
+/* Converts the pixels from x on of one or two rows of YUV, with rgb1 NULL for an odd last row. */
+static void drv_convert_yuv_to_rgb_c(const uint8_t *y0, const uint8_t *y1, const uint8_t *u,
+				     const uint8_t *v, uint32_t uv_step, uint8_t *rgb0,
+				     uint8_t *rgb1, bool bgr, uint32_t x, uint32_t width)
+{
+	int32_t d, e;
+
+	for (; x < width; x++) {
+		d = u[x / 2 * uv_step] - 128;
+		e = v[x / 2 * uv_step] - 128;
+		drv_convert_store_rgb(rgb0 + 4 * x, bgr, 298 * (y0[x] - 16) + 128, d, e);
+		if (rgb1)
+			drv_convert_store_rgb(rgb1 + 4 * x, bgr, 298 * (y1[x] - 16) + 128, d, e);
+	}
+}
+
+static void drv_convert_deinterleave_c(const uint8_t *src, uint8_t *a, uint8_t *b, uint32_t x,
+				       uint32_t count)
+{
+	for (; x < count; x++) {
+		a[x] = src[2 * x];
+		b[x] = src[2 * x + 1];
+	}
+}
+
+static void drv_convert_interleave_c(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint32_t x,
+				     uint32_t count)
+{
+	for (; x < count; x++) {
+		dst[2 * x] = a[x];
+		dst[2 * x + 1] = b[x];
+	}
+}
+
+#ifdef DRV_CONVERT_X86
+/* Splits 4 RGBX pixels into their 32-bit channels, with r0 and b0 the first and third bytes. */
+__attribute__((target("sse2"))) static inline void
+drv_convert_split_rgb_sse2(__m128i px, __m128i *r0, __m128i *g, __m128i *b0)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+
+	*r0 = _mm_and_si128(px, mask);
+	*g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+	*b0 = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+}
+
+/* Loads 8 pixels of RGB as 16-bit channels. */
+__attribute__((target("sse2"))) static inline void
+drv_convert_load_rgb_sse2(const uint8_t *rgb, bool bgr, __m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi, tmp;
+
+	drv_convert_split_rgb_sse2(_mm_loadu_si128((const __m128i *)rgb), &r_lo, &g_lo, &b_lo);
+	drv_convert_split_rgb_sse2(_mm_loadu_si128((const __m128i *)(rgb + 16)), &r_hi, &g_hi,
+				   &b_hi);
+
+	*r = _mm_packs_epi32(r_lo, r_hi);
+	*g = _mm_packs_epi32(g_lo, g_hi);
+	*b = _mm_packs_epi32(b_lo, b_hi);
+	if (bgr) {
+		tmp = *r;
+		*r = *b;
+		*b = tmp;
+	}
+}
+
+__attribute__((target("sse2"))) static inline __m128i drv_convert_luma_sse2(__m128i r, __m128i g,
+									    __m128i b)
+{
+	__m128i y = _mm_mullo_epi16(r, _mm_set1_epi16(66));
+
+	y = _mm_add_epi16(y, _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+	y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+	y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+	return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+/* Averages the 2x2 blocks of a channel of 8 pixels in two rows, into 4 16-bit samples. */
+__attribute__((target("sse2"))) static inline __m128i drv_convert_average_sse2(__m128i row0,
+									       __m128i row1)
+{
+	const __m128i ones = _mm_set1_epi16(1);
+
+	return _mm_add_epi32(_mm_madd_epi16(row0, ones), _mm_madd_epi16(row1, ones));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+drv_convert_chroma_sse2(__m128i r, __m128i g, __m128i b, int16_t cr, int16_t cg, int16_t cb)
+{
+	__m128i c = _mm_mullo_epi16(r, _mm_set1_epi16(cr));
+
+	c = _mm_add_epi16(c, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+	c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+	c = _mm_srai_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+	return _mm_add_epi16(c, _mm_set1_epi16(128));
+}
+
+/* Converts 16 pixels at a time, and returns the first pixel it left to the scalar code. */
+__attribute__((target("sse2"))) static uint32_t
+drv_convert_rgb_to_yuv_sse2(const uint8_t *rgb0, const uint8_t *rgb1, bool bgr, uint8_t *y0,
+			    uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t uv_step, uint32_t width)
+{
+	const __m128i two = _mm_set1_epi16(2);
+	__m128i r[2][2], g[2][2], b[2][2], sums[3][2], avg[3], lo, hi, luma[2], cu, cv;
+	uint32_t x, i;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		for (i = 0; i < 2; i++) {
+			drv_convert_load_rgb_sse2(rgb0 + 4 * (x + 8 * i), bgr, &r[0][i], &g[0][i],
+						  &b[0][i]);
+			drv_convert_load_rgb_sse2(rgb1 + 4 * (x + 8 * i), bgr, &r[1][i], &g[1][i],
+						  &b[1][i]);
+			sums[0][i] = drv_convert_average_sse2(r[0][i], r[1][i]);
+			sums[1][i] = drv_convert_average_sse2(g[0][i], g[1][i]);
+			sums[2][i] = drv_convert_average_sse2(b[0][i], b[1][i]);
+		}
+
+		for (i = 0; i < 2; i++) {
+			lo = drv_convert_luma_sse2(r[i][0], g[i][0], b[i][0]);
+			hi = drv_convert_luma_sse2(r[i][1], g[i][1], b[i][1]);
+			luma[i] = _mm_packus_epi16(lo, hi);
+		}
+
+		_mm_storeu_si128((__m128i *)(y0 + x), luma[0]);
+		if (y1)
+			_mm_storeu_si128((__m128i *)(y1 + x), luma[1]);
+
+		for (i = 0; i < 3; i++)
+			avg[i] = _mm_srli_epi16(
+			    _mm_add_epi16(_mm_packs_epi32(sums[i][0], sums[i][1]), two), 2);
+
+		cu = drv_convert_chroma_sse2(avg[0], avg[1], avg[2], -38, -74, 112);
+		cv = drv_convert_chroma_sse2(avg[0], avg[1], avg[2], 112, -94, -18);
+		cu = _mm_packus_epi16(cu, cu);
+		cv = _mm_packus_epi16(cv, cv);
+
+		if (uv_step == 1) {
+			_mm_storel_epi64((__m128i *)(u + x / 2), cu);
+			_mm_storel_epi64((__m128i *)(v + x / 2), cv);
+		} else if (u < v) {
+			_mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(cu, cv));
+		} else {
+			_mm_storeu_si128((__m128i *)(v + x), _mm_unpacklo_epi8(cv, cu));
+		}
+	}
+
+	return x;
+}
+
+/* Computes a channel of 8 pixels from their luma terms and the chroma terms of 4 samples. */
+__attribute__((target("sse2"))) static inline __m128i
+drv_convert_channel_sse2(__m128i c_lo, __m128i c_hi, __m128i chroma)
+{
+	__m128i lo = _mm_add_epi32(c_lo, _mm_unpacklo_epi32(chroma, chroma));
+	__m128i hi = _mm_add_epi32(c_hi, _mm_unpackhi_epi32(chroma, chroma));
+
+	lo = _mm_srai_epi32(lo, 8);
+	hi = _mm_srai_epi32(hi, 8);
+	return _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+}
+
+/* Stores 8 pixels of RGBX from the channels in the low 8 bytes of r, g and b. */
+__attribute__((target("sse2"))) static inline void drv_convert_store_rgb_sse2(uint8_t *rgb,
+									      bool bgr, __m128i r,
+									      __m128i g, __m128i b)
+{
+	__m128i rg = _mm_unpacklo_epi8(bgr ? b : r, g);
+	__m128i ba = _mm_unpacklo_epi8(bgr ? r : b, _mm_set1_epi8((char)0xff));
+
+	_mm_storeu_si128((__m128i *)rgb, _mm_unpacklo_epi16(rg, ba));
+	_mm_storeu_si128((__m128i *)(rgb + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+/* Converts a row of 8 pixels from the luma in the low 8 bytes of y. */
+__attribute__((target("sse2"))) static inline void
+drv_convert_yuv_row_sse2(uint8_t *rgb, bool bgr, __m128i y, __m128i rv, __m128i guv, __m128i bu)
+{
+	const __m128i luma_coeffs = _mm_set_epi16(128, 298, 128, 298, 128, 298, 128, 298);
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i c, c_lo, c_hi;
+
+	c = _mm_sub_epi16(_mm_unpacklo_epi8(y, _mm_setzero_si128()), _mm_set1_epi16(16));
+	c_lo = _mm_madd_epi16(_mm_unpacklo_epi16(c, ones), luma_coeffs);
+	c_hi = _mm_madd_epi16(_mm_unpackhi_epi16(c, ones), luma_coeffs);
+
+	drv_convert_store_rgb_sse2(rgb, bgr, drv_convert_channel_sse2(c_lo, c_hi, rv),
+				   drv_convert_channel_sse2(c_lo, c_hi, guv),
+				   drv_convert_channel_sse2(c_lo, c_hi, bu));
+}
+
+/* The coefficients of U and V for _mm_madd_epi16() on pairs of chroma samples. */
+__attribute__((target("sse2"))) static inline __m128i
+drv_convert_coeffs_sse2(bool u_first, int16_t cu, int16_t cv)
+{
+	return u_first ? _mm_set_epi16(cv, cu, cv, cu, cv, cu, cv, cu)
+		       : _mm_set_epi16(cu, cv, cu, cv, cu, cv, cu, cv);
+}
+
+/* Converts 8 pixels at a time, and returns the first pixel it left to the scalar code. */
+__attribute__((target("sse2"))) static uint32_t
+drv_convert_yuv_to_rgb_sse2(const uint8_t *y0, const uint8_t *y1, const uint8_t *u,
+			    const uint8_t *v, uint32_t uv_step, uint8_t *rgb0, uint8_t *rgb1,
+			    bool bgr, uint32_t width)
+{
+	/* The chroma samples come in pairs of the first and second in memory. */
+	bool u_first = uv_step == 1 || u < v;
+	const uint8_t *first = u_first ? u : v;
+	__m128i rv_coeffs = drv_convert_coeffs_sse2(u_first, 0, 409);
+	__m128i guv_coeffs = drv_convert_coeffs_sse2(u_first, -100, -208);
+	__m128i bu_coeffs = drv_convert_coeffs_sse2(u_first, 516, 0);
+	__m128i uv, u4, v4, y0_8, y1_8, rv, guv, bu;
+	uint32_t x, pair_u, pair_v;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		if (uv_step == 1) {
+			memcpy(&pair_u, u + x / 2, sizeof(pair_u));
+			memcpy(&pair_v, v + x / 2, sizeof(pair_v));
+			u4 = _mm_cvtsi32_si128(pair_u);
+			v4 = _mm_cvtsi32_si128(pair_v);
+			uv = _mm_unpacklo_epi8(u4, v4);
+		} else {
+			uv = _mm_loadl_epi64((const __m128i *)(first + x));
+		}
+
+		uv = _mm_sub_epi16(_mm_unpacklo_epi8(uv, _mm_setzero_si128()), _mm_set1_epi16(128));
+		rv = _mm_madd_epi16(uv, rv_coeffs);
+		guv = _mm_madd_epi16(uv, guv_coeffs);
+		bu = _mm_madd_epi16(uv, bu_coeffs);
+
+		y0_8 = _mm_loadl_epi64((const __m128i *)(y0 + x));
+		drv_convert_yuv_row_sse2(rgb0 + 4 * x, bgr, y0_8, rv, guv, bu);
+		if (rgb1) {
+			y1_8 = _mm_loadl_epi64((const __m128i *)(y1 + x));
+			drv_convert_yuv_row_sse2(rgb1 + 4 * x, bgr, y1_8, rv, guv, bu);
+		}
+	}
+
+	return x;
+}
+
+__attribute__((target("sse2"))) static uint32_t
+drv_convert_deinterleave_sse2(const uint8_t *src, uint8_t *a, uint8_t *b, uint32_t count)
+{
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i lo, hi;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= count; x += 16) {
+		lo = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+		hi = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+		_mm_storeu_si128((__m128i *)(a + x), _mm_packus_epi16(_mm_and_si128(lo, mask),
+								      _mm_and_si128(hi, mask)));
+		_mm_storeu_si128((__m128i *)(b + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+								      _mm_srli_epi16(hi, 8)));
+	}
+
+	return x;
+}
+
+__attribute__((target("sse2"))) static uint32_t
+drv_convert_interleave_sse2(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint32_t count)
+{
+	__m128i va, vb;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= count; x += 16) {
+		va = _mm_loadu_si128((const __m128i *)(a + x));
+		vb = _mm_loadu_si128((const __m128i *)(b + x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(va, vb));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(va, vb));
+	}
+
+	return x;
+}
+#endif
+
+static bool drv_convert_has_sse2(void)
+{
+#ifdef DRV_CONVERT_X86
+	return __builtin_cpu_supports("sse2");
+#else
+	return false;
+#endif
+}
+
+static void drv_convert_rgb_to_yuv(const uint8_t *rgb0, const uint8_t *rgb1, bool bgr,
+				   uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+				   uint32_t uv_step, uint32_t width)
+{
+	uint32_t x = 0;
+
+#ifdef DRV_CONVERT_X86
+	if (drv_convert_has_sse2())
+		x = drv_convert_rgb_to_yuv_sse2(rgb0, rgb1, bgr, y0, y1, u, v, uv_step, width);
+#endif
+	drv_convert_rgb_to_yuv_c(rgb0, rgb1, bgr, y0, y1, u, v, uv_step, x, width);
+}
+
+static void drv_convert_yuv_to_rgb(const uint8_t *y0, const uint8_t *y1, const uint8_t *u,
+				   const uint8_t *v, uint32_t uv_step, uint8_t *rgb0,
+				   uint8_t *rgb1, bool bgr, uint32_t width)
+{
+	uint32_t x = 0;
+
+#ifdef DRV_CONVERT_X86
+	if (drv_convert_has_sse2())
+		x = drv_convert_yuv_to_rgb_sse2(y0, y1, u, v, uv_step, rgb0, rgb1, bgr, width);
+#endif
+	drv_convert_yuv_to_rgb_c(y0, y1, u, v, uv_step, rgb0, rgb1, bgr, x, width);
+}
+
+/* Repacks count samples of chroma, where a step of 2 means U and V are interleaved. */
+static void drv_convert_chroma(const uint8_t *su, const uint8_t *sv, uint32_t src_step,
+			       uint8_t *du, uint8_t *dv, uint32_t dst_step, uint32_t count)
+{
+	uint32_t x = 0;
+	/* Interleaved chroma are pairs of the first and second sample in memory. */
+	const uint8_t *src_pairs = MIN(su, sv);
+	const uint8_t *src_first = du < dv ? su : sv, *src_second = du < dv ? sv : su;
+	uint8_t *dst_pairs = MIN(du, dv);
+	uint8_t *dst_first = su < sv ? du : dv, *dst_second = su < sv ? dv : du;
+
+	if (src_step == 1 && dst_step == 1) {
+		memcpy(du, su, count);
+		memcpy(dv, sv, count);
+	} else if (src_step == 2 && dst_step == 1) {
+#ifdef DRV_CONVERT_X86
+		if (drv_convert_has_sse2())
+			x = drv_convert_deinterleave_sse2(src_pairs, dst_first, dst_second, count);
+#endif
+		drv_convert_deinterleave_c(src_pairs, dst_first, dst_second, x, count);
+	} else if (src_step == 1) {
+#ifdef DRV_CONVERT_X86
+		if (drv_convert_has_sse2())
+			x = drv_convert_interleave_sse2(src_first, src_second, dst_pairs, count);
+#endif
+		drv_convert_interleave_c(src_first, src_second, dst_pairs, x, count);
+	} else if ((su < sv) == (du < dv)) {
+		memcpy(dst_pairs, src_pairs, 2 * count);
+	} else {
+		for (; x < count; x++) {
+			du[2 * x] = su[2 * x];
+			dv[2 * x] = sv[2 * x];
+		}
+	}
+}
+
+/* Copies size bytes at src out to the scratch buffer, and returns where they are now. */
+static uint8_t *drv_convert_stage(uint8_t **scratch, const uint8_t *src, size_t size)
+{
+	uint8_t *staged = *scratch;
+
+	drv_copy_from_wc(staged, src, size);
+	*scratch += size;
+	return staged;
+}
+
+/*
+ * Converts the two rows of pair, or the last one of an odd height. With a scratch buffer, the
+ * source rows are read from it once copied out of the mapping.
+ */
+static void drv_convert_pair(const struct drv_convert *convert, uint32_t pair, uint8_t *scratch)
+{
+	const struct drv_convert_image *src = &convert->src, *dst = &convert->dst;
+	uint32_t width = convert->width, chroma_width = DIV_ROUND_UP(convert->width, 2);
+	uint32_t row = 2 * pair, src_step = src->format->uv_step;
+	bool last = row + 1 == convert->height;
+	const uint8_t *s0 = src->data + row * src->stride;
+	const uint8_t *s1 = last ? s0 : s0 + src->stride;
+	const uint8_t *su = NULL, *sv = NULL;
+	uint8_t *d0 = dst->data + row * dst->stride;
+	uint8_t *d1 = last ? NULL : d0 + dst->stride;
+	uint8_t *du = NULL, *dv = NULL;
+	size_t row_size = src->format->rgb ? 4 * width : width;
+	ptrdiff_t uv_delta;
+
+	if (!src->format->rgb) {
+		su = src->u + pair * src->uv_stride;
+		sv = src->v + pair * src->uv_stride;
+	}
+
+	if (!dst->format->rgb) {
+		du = dst->u + pair * dst->uv_stride;
+		dv = dst->v + pair * dst->uv_stride;
+	}
+
+	/* Luma only moves between YUV formats, so it isn't staged. */
+	if (!src->format->rgb && !dst->format->rgb) {
+		drv_copy_from_wc(d0, s0, width);
+		if (d1)
+			drv_copy_from_wc(d1, s1, width);
+	} else if (scratch) {
+		s0 = drv_convert_stage(&scratch, s0, row_size);
+		s1 = last ? s0 : drv_convert_stage(&scratch, s1, row_size);
+	}
+
+	if (su && scratch && src_step == 2) {
+		uv_delta = su < sv ? sv - su : su - sv;
+		if (su < sv) {
+			su = drv_convert_stage(&scratch, su, 2 * chroma_width);
+			sv = su + uv_delta;
+		} else {
+			sv = drv_convert_stage(&scratch, sv, 2 * chroma_width);
+			su = sv + uv_delta;
+		}
+	} else if (su && scratch) {
+		su = drv_convert_stage(&scratch, su, chroma_width);
+		sv = drv_convert_stage(&scratch, sv, chroma_width);
+	}
+
+	if (src->format->rgb)
+		drv_convert_rgb_to_yuv(s0, s1, src->format->bgr, d0, d1, du, dv,
+				       dst->format->uv_step, width);
+	else if (dst->format->rgb)
+		drv_convert_yuv_to_rgb(s0, s1, su, sv, src_step, d0, d1, dst->format->bgr, width);
+	else
+		drv_convert_chroma(su, sv, src_step, du, dv, dst->format->uv_step, chroma_width);
+}
+
+static void drv_convert_pairs(void *data, size_t begin, size_t end)
+{
+	const struct drv_convert *convert = data;
+	size_t pair, row_size = convert->src.format->rgb ? 4 * convert->width : convert->width;
+	/* Two rows and their chroma, which is at most a row of luma and a sample more. */
+	uint8_t *scratch = malloc(3 * row_size + 2);
+
+	/* Without a scratch buffer the rows are converted straight from the mapping. */
+	for (pair = begin; pair < end; pair++)
+		drv_convert_pair(convert, pair, scratch);
+
+	free(scratch);
+}
+
+/* Maps rect of every plane of bo, and describes where its samples are. */
+static int drv_convert_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+			   struct mapping **mappings, struct drv_convert_image *image)
+{
+	size_t plane;
+	uint8_t *addr[DRV_MAX_PLANES];
+	uint32_t strides[DRV_MAX_PLANES];
+	struct rectangle plane_rect;
+	const struct drv_convert_format *format = image->format;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		addr[plane] = drv_bo_map(bo, rect, map_flags, &mappings[plane], plane);
+		if (addr[plane] == MAP_FAILED) {
+			while (plane--)
+				drv_bo_unmap(bo, mappings[plane]);
+			return -EFAULT;
+		}
+
+		strides[plane] = mappings[plane]->vma->map_strides[plane];
+		drv_rect_to_plane(bo->format, plane, rect, &plane_rect);
+		addr[plane] += plane_rect.y * strides[plane] + plane_rect.x;
+	}
+
+	image->data = addr[0];
+	image->stride = strides[0];
+	if (!format->rgb) {
+		image->u = addr[format->u_plane] + format->u_offset;
+		image->v = addr[format->v_plane] + format->v_offset;
+		image->uv_stride = strides[format->u_plane];
+	}
+
+	return 0;
+}
+
+/* Flushes the mappings of dst, which may be shared by its planes, and unmaps them. */
+static int drv_convert_unmap(struct bo *bo, struct mapping **mappings, bool flush)
+{
+	int ret = 0;
+	size_t plane, prior;
+	bool flushed;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		flushed = false;
+		for (prior = 0; prior < plane; prior++)
+			flushed = flushed || mappings[prior] == mappings[plane];
+
+		if (flush && !flushed && !ret)
+			ret = drv_bo_flush(bo, mappings[plane]);
+	}
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		drv_bo_unmap(bo, mappings[plane]);
+
+	return ret;
+}
+
+int drv_bo_convert(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	DRV_TRACE_SCOPE(__func__);
+	int ret;
+	struct drv_convert convert;
+	struct mapping *dst_mappings[DRV_MAX_PLANES], *src_mappings[DRV_MAX_PLANES];
+
+	memset(&convert, 0, sizeof(convert));
+	convert.dst.format = drv_convert_get_format(dst->format);
+	convert.src.format = drv_convert_get_format(src->format);
+	convert.width = rect->width;
+	convert.height = rect->height;
+
+	/* Chroma is sampled at even coordinates, which the rectangle has to start at. */
+	if (!convert.dst.format || !convert.src.format ||
+	    (convert.dst.format->rgb && convert.src.format->rgb) || (rect->x & 1) || (rect->y & 1))
+		return -EINVAL;
+
+	ret = drv_convert_map(src, rect, BO_MAP_READ, src_mappings, &convert.src);
+	if (ret)
+		return ret;
+
+	ret = drv_convert_map(dst, rect, BO_MAP_WRITE | BO_MAP_DIRTY_RECT, dst_mappings,
+			      &convert.dst);
+	if (ret) {
+		drv_convert_unmap(src, src_mappings, false);
+		return ret;
+	}
+
+	drv_parallel_for(dst->drv, DIV_ROUND_UP(rect->height, 2), 2 * 4 * rect->width,
+			 drv_convert_pairs, &convert);
+
+	ret = drv_convert_unmap(dst, dst_mappings, true);
+	drv_convert_unmap(src, src_mappings, false);
+	return ret;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DRV_COPY_X86
+#endif
+
+#include "drv_priv.h"
+#include "drv_trace.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Write-combined and uncached mappings (i915 WC mmaps, amdgpu USWC) only perform well on full
+ * cache line accesses. Plain loads from them are uncached and each one stalls, and stores are
+ * only combined when a line is written completely and in order. On x86 the streaming instructions
+ * avoid both: MOVNTDQA fetches a whole line into a streaming buffer, MOVNTDQ writes full lines
+ * without reading them first. Other architectures use memcpy(), which already does wide loads and
+ * stores there.
+ */
+
+#ifdef DRV_COPY_X86
+__attribute__((target("sse4.1"))) static void drv_copy_from_wc_sse41(void *dst, const void *src,
+								      size_t size)
+{
+	uint8_t *d = dst;
+	/* Some versions of _mm_stream_load_si128() take a non-const pointer. */
+	uint8_t *s = (uint8_t *)(uintptr_t)src;
+	size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+
+	if (head > size)
+		head = size;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i x0 = _mm_stream_load_si128((__m128i *)(s + 0));
+		__m128i x1 = _mm_stream_load_si128((__m128i *)(s + 16));
+		__m128i x2 = _mm_stream_load_si128((__m128i *)(s + 32));
+		__m128i x3 = _mm_stream_load_si128((__m128i *)(s + 48));
+
+		_mm_storeu_si128((__m128i *)(d + 0), x0);
+		_mm_storeu_si128((__m128i *)(d + 16), x1);
+		_mm_storeu_si128((__m128i *)(d + 32), x2);
+		_mm_storeu_si128((__m128i *)(d + 48), x3);
+	}
+
+	for (; size >= 16; size -= 16, s += 16, d += 16)
+		_mm_storeu_si128((__m128i *)d, _mm_stream_load_si128((__m128i *)s));
+
+	memcpy(d, s, size);
+}
+
+__attribute__((target("sse2"))) static void drv_copy_to_wc_sse2(void *dst, const void *src,
+								 size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+	if (head > size)
+		head = size;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(s + 0));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)(d + 0), x0);
+		_mm_stream_si128((__m128i *)(d + 16), x1);
+		_mm_stream_si128((__m128i *)(d + 32), x2);
+		_mm_stream_si128((__m128i *)(d + 48), x3);
+	}
+
+	for (; size >= 16; size -= 16, s += 16, d += 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+
+	memcpy(d, s, size);
+
+	/* Streaming stores are weakly ordered, make them visible before the flush. */
+	_mm_sfence();
+}
+#endif
+
+void drv_copy_from_wc(void *dst, const void *src, size_t size)
+{
+#ifdef DRV_COPY_X86
+	if (__builtin_cpu_supports("sse4.1")) {
+		drv_copy_from_wc_sse41(dst, src, size);
+		return;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+void drv_copy_to_wc(void *dst, const void *src, size_t size)
+{
+#ifdef DRV_COPY_X86
+	if (__builtin_cpu_supports("sse2")) {
+		drv_copy_to_wc_sse2(dst, src, size);
+		return;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+/*
+ * Maps rect of the given plane, with rect in pixels of the first plane like for drv_bo_map(), and
+ * copies it row by row from src or into dst, whichever is given.
+ */
+static int drv_bo_transfer_rect(struct bo *bo, size_t plane, const struct rectangle *rect,
+				const uint8_t *src, uint8_t *dst, uint32_t mem_stride)
+{
+	DRV_TRACE_SCOPE(src ? "drv_bo_write_rect" : "drv_bo_read_rect");
+	uint32_t map_flags = src ? BO_MAP_WRITE | BO_MAP_DIRTY_RECT : BO_MAP_READ;
+	int ret;
+	uint8_t *addr;
+	uint32_t row, map_stride;
+	struct mapping *mapping;
+	struct rectangle plane_rect;
+
+	if (plane >= bo->num_planes || !rect->width || !rect->height ||
+	    rect->x + rect->width > bo->width || rect->y + rect->height > bo->height)
+		return -EINVAL;
+
+	addr = drv_bo_map(bo, rect, map_flags, &mapping, plane);
+	if (addr == MAP_FAILED)
+		return -EFAULT;
+
+	map_stride = mapping->vma->map_strides[plane];
+	drv_rect_to_plane(bo->format, plane, rect, &plane_rect);
+	addr += plane_rect.y * map_stride + plane_rect.x;
+
+	for (row = 0; row < plane_rect.height; row++, addr += map_stride) {
+		if (src) {
+			drv_copy_to_wc(addr, src, plane_rect.width);
+			src += mem_stride;
+		} else {
+			drv_copy_from_wc(dst, addr, plane_rect.width);
+			dst += mem_stride;
+		}
+	}
+
+	ret = src ? drv_bo_flush(bo, mapping) : 0;
+	drv_bo_unmap(bo, mapping);
+	return ret;
+}
+
+struct drv_copy_rows {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_stride;
+	uint32_t src_stride;
+	uint32_t width;
+};
+
+static void drv_copy_rows(void *data, size_t begin, size_t end)
+{
+	size_t row;
+	struct drv_copy_rows *rows = data;
+
+	for (row = begin; row < end; row++)
+		drv_copy_from_wc(rows->dst + row * rows->dst_stride,
+				 rows->src + row * rows->src_stride, rows->width);
+}
+
+static void drv_copy_rows_to_wc(void *data, size_t begin, size_t end)
+{
+	size_t row;
+	struct drv_copy_rows *rows = data;
+
+	for (row = begin; row < end; row++)
+		drv_copy_to_wc(rows->dst + row * rows->dst_stride,
+			       rows->src + row * rows->src_stride, rows->width);
+}
+
+void drv_bo_copy_shadow_rect(struct bo *bo, uint8_t *shadow, uint8_t *mapped,
+			     const struct rectangle *rect, bool to_shadow)
+{
+	DRV_TRACE_SCOPE(__func__);
+	size_t plane;
+	uint32_t offset;
+	struct rectangle plane_rect;
+	struct drv_copy_rows rows;
+
+	if (!rect->width || !rect->height)
+		return;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		drv_rect_to_plane(bo->format, plane, rect, &plane_rect);
+		offset = bo->offsets[plane] + plane_rect.y * bo->strides[plane] + plane_rect.x;
+		rows.dst = (to_shadow ? shadow : mapped) + offset;
+		rows.src = (to_shadow ? mapped : shadow) + offset;
+		rows.dst_stride = bo->strides[plane];
+		rows.src_stride = bo->strides[plane];
+		rows.width = plane_rect.width;
+
+		drv_parallel_for(bo->drv, plane_rect.height, plane_rect.width,
+				 to_shadow ? drv_copy_rows : drv_copy_rows_to_wc, &rows);
+	}
+}
+
+/* Copies rect of the given plane by mapping both bos, in rows split across the workers. */
+static int drv_bo_copy_plane(struct bo *dst, struct bo *src, size_t plane,
+			     const struct rectangle *rect)
+{
+	int ret;
+	uint8_t *dst_addr, *src_addr;
+	struct mapping *dst_mapping, *src_mapping;
+	struct rectangle plane_rect;
+	struct drv_copy_rows rows;
+
+	src_addr = drv_bo_map(src, rect, BO_MAP_READ, &src_mapping, plane);
+	if (src_addr == MAP_FAILED)
+		return -EFAULT;
+
+	dst_addr = drv_bo_map(dst, rect, BO_MAP_WRITE | BO_MAP_DIRTY_RECT, &dst_mapping, plane);
+	if (dst_addr == MAP_FAILED) {
+		drv_bo_unmap(src, src_mapping);
+		return -EFAULT;
+	}
+
+	drv_rect_to_plane(dst->format, plane, rect, &plane_rect);
+	rows.dst_stride = dst_mapping->vma->map_strides[plane];
+	rows.src_stride = src_mapping->vma->map_strides[plane];
+	rows.dst = dst_addr + plane_rect.y * rows.dst_stride + plane_rect.x;
+	rows.src = src_addr + plane_rect.y * rows.src_stride + plane_rect.x;
+	rows.width = plane_rect.width;
+
+	drv_parallel_for(dst->drv, plane_rect.height, plane_rect.width, drv_copy_rows, &rows);
+
+	ret = drv_bo_flush(dst, dst_mapping);
+	drv_bo_unmap(dst, dst_mapping);
+	drv_bo_unmap(src, src_mapping);
+	return ret;
+}
+
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	DRV_TRACE_SCOPE(__func__);
+	int ret;
+	size_t plane;
+	const struct backend *backend = dst->drv->backend;
+
+	if (dst == src || !rect->width || !rect->height ||
+	    rect->x + rect->width > MIN(dst->width, src->width) ||
+	    rect->y + rect->height > MIN(dst->height, src->height))
+		return -EINVAL;
+
+	if (dst->format != src->format)
+		return drv_bo_convert(dst, src, rect);
+
+	if (dst->num_planes != src->num_planes)
+		return -EINVAL;
+
+	/*
+	 * Bos that only the CPU uses are left to the CPU, since their mappings are trusted to stay
+	 * valid between invalidates, see drv_bo_invalidate().
+	 */
+	if (dst->drv == src->drv && backend->bo_copy && !drv_use_flags_cpu_only(dst->use_flags) &&
+	    !drv_use_flags_cpu_only(src->use_flags)) {
+		DRV_TRACE_BEGIN("backend bo_copy");
+		ret = backend->bo_copy(dst, src, rect);
+		DRV_TRACE_END();
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+
+	for (plane = 0; plane < dst->num_planes; plane++) {
+		ret = drv_bo_copy_plane(dst, src, plane, rect);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int drv_bo_write_rect(struct bo *bo, size_t plane, const struct rectangle *rect, const void *src,
+		      uint32_t src_stride)
+{
+	return drv_bo_transfer_rect(bo, plane, rect, src, NULL, src_stride);
+}
+
+int drv_bo_read_rect(struct bo *bo, size_t plane, const struct rectangle *rect, void *dst,
+		     uint32_t dst_stride)
+{
+	return drv_bo_transfer_rect(bo, plane, rect, NULL, dst, dst_stride);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Picks the device a driver allocates from. A selector names it explicitly:
+ *
+ *   "/dev/dri/renderD129"  the node at that path
+ *   "pci:8086:3e9b"        the PCI device with that vendor and device id, in hex
+ *   "driver:i915"          the devices of that kernel driver
+ *   "scanout"              the devices with connectors, i.e. that drive a display
+ *   "render"               the devices without any, like the discrete GPU of a laptop
+ *
+ * Without a selector, MINIGBM_DEVICE is used. Without either, or if the selector matches nothing,
+ * scanout use flags prefer devices that drive a display. Otherwise the render nodes are taken in
+ * order, except vgem, which is left for last since it can't render.
+ *
+ * Only render nodes are considered, unless a node is given by path, and whether a device drives
+ * a display is read from sysfs, so probing never opens a primary node and becomes DRM master.
+ */
+
+#define DRV_MAX_DEVICES 64
+
+struct drv_candidate {
+	const char *node;
+	int rank;
+};
+
+/* Whether the device has connectors, which show up as cardN-<connector> in sysfs. */
+static bool drv_device_has_display(drmDevicePtr device)
+{
+	const char *card;
+	struct dirent *entry;
+	bool has_display = false;
+	size_t len;
+	DIR *dir;
+
+	if (!(device->available_nodes & (1 << DRM_NODE_PRIMARY)))
+		return false;
+
+	card = strrchr(device->nodes[DRM_NODE_PRIMARY], '/');
+	card = card ? card + 1 : device->nodes[DRM_NODE_PRIMARY];
+	len = strlen(card);
+
+	dir = opendir("/sys/class/drm");
+	if (!dir)
+		return false;
+
+	while (!has_display && (entry = readdir(dir)))
+		has_display = !strncmp(entry->d_name, card, len) && entry->d_name[len] == '-';
+
+	closedir(dir);
+	return has_display;
+}
+
+/* Returns the kernel driver name of node, which the caller frees, or NULL. */
+static char *drv_device_driver_name(const char *node)
+{
+	drmVersionPtr version;
+	char *name;
+	int fd;
+
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	version = drmGetVersion(fd);
+	close(fd);
+	if (!version)
+		return NULL;
+
+	name = strdup(version->name);
+	drmFreeVersion(version);
+	return name;
+}
+
+/* Returns how well the device fits, higher is better, or -1 if it doesn't fit at all. */
+static int drv_device_rank(drmDevicePtr device, const char *selector, uint64_t use_flags)
+{
+	const char *node = device->nodes[DRM_NODE_RENDER];
+	unsigned int vendor_id, device_id;
+	char *name;
+	int rank;
+
+	if (!(device->available_nodes & (1 << DRM_NODE_RENDER)))
+		return -1;
+
+	if (selector) {
+		if (sscanf(selector, "pci:%x:%x", &vendor_id, &device_id) == 2) {
+			if (device->bustype != DRM_BUS_PCI)
+				return -1;
+
+			return device->deviceinfo.pci->vendor_id == vendor_id &&
+				       device->deviceinfo.pci->device_id == device_id
+				   ? 1
+				   : -1;
+		}
+
+		if (!strcmp(selector, "scanout"))
+			return drv_device_has_display(device) ? 1 : -1;
+
+		if (!strcmp(selector, "render"))
+			return drv_device_has_display(device) ? -1 : 1;
+
+		if (strncmp(selector, "driver:", strlen("driver:")))
+			return -1;
+
+		name = drv_device_driver_name(node);
+		rank = name && !strcmp(name, selector + strlen("driver:")) ? 1 : -1;
+		free(name);
+		return rank;
+	}
+
+	name = drv_device_driver_name(node);
+	if (!name)
+		return -1;
+
+	rank = strcmp(name, "vgem") ? 1 : 0;
+	free(name);
+
+	if (rank && (use_flags & BO_USE_SCANOUT) && drv_device_has_display(device))
+		rank = 2;
+
+	return rank;
+}
+
+static struct driver *drv_create_for_node(const char *node)
+{
+	struct driver *drv;
+	int fd;
+
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	drv = drv_create(fd);
+	if (!drv) {
+		close(fd);
+		return NULL;
+	}
+
+	drv->owns_fd = true;
+	return drv;
+}
+
+/* Ranks the render nodes into candidates, best first, and returns how many fit. */
+static int drv_rank_devices(drmDevicePtr *devices, int num_devices, const char *selector,
+			    uint64_t use_flags, struct drv_candidate *candidates)
+{
+	struct drv_candidate candidate;
+	int i, j, count = 0;
+
+	for (i = 0; i < num_devices; i++) {
+		candidate.rank = drv_device_rank(devices[i], selector, use_flags);
+		if (candidate.rank < 0)
+			continue;
+
+		/* Keeps the enumeration order among equally ranked devices. */
+		candidate.node = devices[i]->nodes[DRM_NODE_RENDER];
+		for (j = count; j > 0 && candidates[j - 1].rank < candidate.rank; j--)
+			candidates[j] = candidates[j - 1];
+
+		candidates[j] = candidate;
+		count++;
+	}
+
+	return count;
+}
+
+struct driver *drv_create_for_usage(const char *selector, uint64_t use_flags)
+{
+	drmDevicePtr devices[DRV_MAX_DEVICES];
+	struct drv_candidate candidates[DRV_MAX_DEVICES];
+	struct driver *drv = NULL;
+	int i, num_devices, count;
+
+	if (!selector || !selector[0])
+		selector = getenv("MINIGBM_DEVICE");
+
+	if (selector && !selector[0])
+		selector = NULL;
+
+	if (selector && selector[0] == '/')
+		return drv_create_for_node(selector);
+
+	num_devices = drmGetDevices2(0, devices, ARRAY_SIZE(devices));
+	if (num_devices < 0)
+		return NULL;
+
+	count = drv_rank_devices(devices, num_devices, selector, use_flags, candidates);
+	if (!count && selector) {
+		drv_log("No device matches %s, picking one by use flags\n", selector);
+		count = drv_rank_devices(devices, num_devices, NULL, use_flags, candidates);
+	}
+
+	/* Devices without a backend are passed over for the next best one. */
+	for (i = 0; i < count && !drv; i++)
+		drv = drv_create_for_node(candidates[i].node);
+
+	drmFreeDevices(devices, num_devices);
+	return drv;
+}
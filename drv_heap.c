@@ -0,0 +1,273 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Buffers that only the CPU touches don't need GPU memory. They are allocated from the system
+ * dma-buf heap, which hands out cached pages, and imported into the DRM device so they have GEM
+ * handles like any other bo. CPU access then goes through the dma-buf itself instead of the
+ * backend's (often write-combined) mapping, with DMA_BUF_IOCTL_SYNC around it for coherency.
+ *
+ * Imports are only mapped through their dma-buf if the system heap exported them, as read from
+ * the dma-buf's fdinfo. Any other exporter may need the backend to detile or to move data to and
+ * from a host, so those imports keep the backend's mapping.
+ */
+
+/* From <linux/dma-heap.h>, which older sysroots don't have. */
+struct drv_dma_heap_allocation_data {
+	uint64_t len;
+	uint32_t fd;
+	uint32_t fd_flags;
+	uint64_t heap_flags;
+};
+
+#define DRV_DMA_HEAP_IOCTL_ALLOC _IOWR('H', 0x0, struct drv_dma_heap_allocation_data)
+
+#define DRV_HEAP_STRIDE_ALIGN 64
+
+#ifndef DRM_RDWR
+#define DRM_RDWR O_RDWR
+#endif
+
+/* The exporter name of buffers from /dev/dma_heap/system. */
+#define DRV_HEAP_EXPORTER "system"
+
+#define BO_USE_CPU_ONLY_MASK                                                                       \
+	(BO_USE_LINEAR | BO_USE_SW_READ_NEVER | BO_USE_SW_WRITE_NEVER | BO_USE_SW_MASK)
+
+void drv_heap_init(struct driver *drv)
+{
+	drv->heap_fd = open("/dev/dma_heap/system", O_RDONLY | O_CLOEXEC);
+}
+
+void drv_heap_destroy(struct driver *drv)
+{
+	if (drv->heap_fd >= 0)
+		close(drv->heap_fd);
+}
+
+bool drv_use_flags_cpu_only(uint64_t use_flags)
+{
+	return (use_flags & (BO_USE_SW_MASK)) && !(use_flags & ~BO_USE_CPU_ONLY_MASK);
+}
+
+int drv_heap_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+		       uint64_t use_flags)
+{
+	int ret;
+	size_t plane;
+	uint32_t stride, handle;
+	struct drv_dma_heap_allocation_data alloc;
+	struct driver *drv = bo->drv;
+
+	if (drv->heap_fd < 0 || !drv_use_flags_cpu_only(use_flags))
+		return -ENODEV;
+
+	stride = ALIGN(drv_stride_from_format(format, width, 0), DRV_HEAP_STRIDE_ALIGN);
+	drv_bo_from_format(bo, stride, height, format);
+
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.len = ALIGN(bo->total_size, (size_t)getpagesize());
+	alloc.fd_flags = O_RDWR | O_CLOEXEC;
+	if (ioctl(drv->heap_fd, DRV_DMA_HEAP_IOCTL_ALLOC, &alloc))
+		return -errno;
+
+	ret = drmPrimeFDToHandle(drv->fd, alloc.fd, &handle);
+	if (ret) {
+		drv_log("failed to import dma-heap buffer with %d\n", ret);
+		close(alloc.fd);
+		return ret;
+	}
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		bo->handles[plane].u32 = handle;
+		bo->format_modifiers[plane] = DRM_FORMAT_MOD_LINEAR;
+	}
+
+	bo->dmabuf_fd = alloc.fd;
+	bo->dmabuf_map = 1;
+	bo->heap_allocated = 1;
+	return 0;
+}
+
+static bool drv_heap_exported(int fd)
+{
+	char path[64], line[128];
+	bool exported = false;
+	FILE *fdinfo;
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	fdinfo = fopen(path, "re");
+	if (!fdinfo)
+		return false;
+
+	while (fgets(line, sizeof(line), fdinfo)) {
+		if (!strcmp(line, "exp_name:\t" DRV_HEAP_EXPORTER "\n")) {
+			exported = true;
+			break;
+		}
+	}
+
+	fclose(fdinfo);
+	return exported;
+}
+
+void drv_heap_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	if (bo->dmabuf_map || !drv_use_flags_cpu_only(data->use_flags) ||
+	    drv_num_buffers_per_bo(bo) != 1)
+		return;
+
+	if (data->format_modifiers[0] != DRM_FORMAT_MOD_LINEAR || data->tiling ||
+	    !drv_heap_exported(data->fds[0]))
+		return;
+
+	bo->dmabuf_fd = fcntl(data->fds[0], F_DUPFD_CLOEXEC, 0);
+	bo->dmabuf_map = bo->dmabuf_fd >= 0;
+}
+
+/*
+ * Has the CPU access a backend's bo through its dma-buf, for bos the backend allocated cached.
+ * Returns a negative errno, leaving the bo to the backend, if the bo can't be exported or the
+ * kernel lacks DMA_BUF_IOCTL_SYNC, which keeps such a mapping coherent.
+ */
+int drv_heap_bo_map_dmabuf(struct bo *bo)
+{
+	struct dma_buf_sync sync;
+	int ret, fd;
+
+	if (bo->dmabuf_map || drv_num_buffers_per_bo(bo) != 1)
+		return -EINVAL;
+
+	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[0].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
+	if (ret)
+		ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[0].u32, DRM_CLOEXEC, &fd);
+	if (ret)
+		return ret;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+	if (drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+	drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+	bo->dmabuf_fd = fd;
+	bo->dmabuf_map = 1;
+	return 0;
+}
+
+int drv_heap_bo_destroy(struct bo *bo)
+{
+	struct drm_gem_close gem_close;
+	int ret;
+
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = bo->handles[0].u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	if (ret)
+		drv_log("DRM_IOCTL_GEM_CLOSE failed (handle=%x) error %d\n", gem_close.handle, ret);
+
+	return ret;
+}
+
+void drv_heap_bo_release(struct bo *bo)
+{
+	if (bo->dmabuf_map)
+		close(bo->dmabuf_fd);
+}
+
+int drv_heap_bo_get_fd(struct bo *bo)
+{
+	return fcntl(bo->dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static void *drv_heap_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	size_t p, length = 0;
+	void *addr;
+
+	for (p = 0; p < bo->num_planes; p++)
+		length = MAX(length, (size_t)bo->offsets[p] + bo->sizes[p]);
+
+	addr = drv_mmap(length, map_flags, bo->dmabuf_fd, 0, false);
+	if (addr != MAP_FAILED) {
+		vma->length = length;
+		return addr;
+	}
+
+	if (bo->heap_allocated)
+		return MAP_FAILED;
+
+	/* The exporter of this import can't be mapped through its dma-buf, use the backend. */
+	close(bo->dmabuf_fd);
+	bo->dmabuf_map = 0;
+	return bo->drv->backend->bo_map(bo, vma, plane, map_flags);
+}
+
+static int drv_heap_bo_sync(struct bo *bo, struct mapping *mapping, uint64_t flags)
+{
+	struct dma_buf_sync sync;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = flags;
+	if (mapping->vma->map_flags & BO_MAP_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (mapping->vma->map_flags & BO_MAP_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	if (drmIoctl(bo->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync))
+		return -errno;
+
+	return 0;
+}
+
+static int drv_heap_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	return drv_heap_bo_sync(bo, mapping, DMA_BUF_SYNC_START);
+}
+
+static int drv_heap_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return drv_heap_bo_sync(bo, mapping, DMA_BUF_SYNC_END);
+}
+
+static int drv_heap_bo_busy(struct bo *bo, uint32_t map_flags)
+{
+	return drv_dmabuf_busy(bo->dmabuf_fd, map_flags);
+}
+
+static const struct backend drv_heap_cpu_access = {
+	.name = "dma-heap",
+	.bo_map = drv_heap_bo_map,
+	.bo_unmap = drv_bo_munmap,
+	.bo_invalidate = drv_heap_bo_invalidate,
+	.bo_flush = drv_heap_bo_flush,
+	.bo_busy = drv_heap_bo_busy,
+};
+
+const struct backend *drv_bo_cpu_backend(struct bo *bo)
+{
+	return bo->dmabuf_map ? &drv_heap_cpu_access : bo->drv->backend;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drv_priv.h"
+#include "drv_trace.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Some backends do CPU work proportional to the size of a bo when it is mapped or flushed, like
+ * detiling into a shadow buffer or flushing it out of the cache. For large bos that work is split
+ * into ranges that a few persistent worker threads run alongside the caller. The workers are
+ * started lazily by the first job that is large enough, so processes that never map large bos
+ * don't pay for them.
+ *
+ * Only one job runs at a time. A caller that finds the workers busy does its work inline rather
+ * than waiting for them.
+ */
+
+/* Jobs smaller than this stay inline, and no range is smaller than half of it. */
+#define DRV_PARALLEL_MIN_BYTES (2 * 1024 * 1024)
+
+#define DRV_PARALLEL_DEFAULT_THREADS 4
+
+struct drv_parallel_job {
+	drv_parallel_fn fn;
+	void *data;
+	size_t count;
+	size_t items_per_range;
+	size_t num_ranges;
+	size_t next_range;
+};
+
+/* Runs ranges of job until there are none left. */
+static void drv_parallel_run(struct drv_parallel_job *job)
+{
+	size_t range, begin;
+
+	for (;;) {
+		range = __atomic_fetch_add(&job->next_range, 1, __ATOMIC_RELAXED);
+		if (range >= job->num_ranges)
+			return;
+
+		begin = range * job->items_per_range;
+		job->fn(job->data, begin, MIN(begin + job->items_per_range, job->count));
+	}
+}
+
+static void *drv_parallel_worker(void *arg)
+{
+	struct drv_parallel *parallel = arg;
+	struct drv_parallel_job *job;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&parallel->lock);
+	for (;;) {
+		while (!parallel->stop && (!parallel->job || parallel->generation == generation))
+			pthread_cond_wait(&parallel->work, &parallel->lock);
+
+		if (parallel->stop)
+			break;
+
+		/* The caller doesn't return, and free job, while a worker is still active on it. */
+		generation = parallel->generation;
+		job = parallel->job;
+		parallel->active++;
+		pthread_mutex_unlock(&parallel->lock);
+
+		drv_parallel_run(job);
+
+		pthread_mutex_lock(&parallel->lock);
+		if (!--parallel->active)
+			pthread_cond_broadcast(&parallel->done);
+	}
+	pthread_mutex_unlock(&parallel->lock);
+
+	return NULL;
+}
+
+int drv_parallel_init(struct driver *drv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct drv_parallel *parallel = &drv->parallel;
+
+	if (pthread_mutex_init(&parallel->lock, NULL))
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&parallel->job_lock, NULL))
+		goto destroy_lock;
+
+	if (pthread_cond_init(&parallel->work, NULL))
+		goto destroy_job_lock;
+
+	if (pthread_cond_init(&parallel->done, NULL))
+		goto destroy_work;
+
+	parallel->max_threads = cpus > 0 ? MIN(cpus, DRV_PARALLEL_DEFAULT_THREADS) : 1;
+	return 0;
+
+destroy_work:
+	pthread_cond_destroy(&parallel->work);
+destroy_job_lock:
+	pthread_mutex_destroy(&parallel->job_lock);
+destroy_lock:
+	pthread_mutex_destroy(&parallel->lock);
+	return -ENOMEM;
+}
+
+void drv_parallel_destroy(struct driver *drv)
+{
+	uint32_t i;
+	struct drv_parallel *parallel = &drv->parallel;
+
+	pthread_mutex_lock(&parallel->lock);
+	parallel->stop = true;
+	pthread_cond_broadcast(&parallel->work);
+	pthread_mutex_unlock(&parallel->lock);
+
+	for (i = 0; i < parallel->num_threads; i++)
+		pthread_join(parallel->threads[i], NULL);
+
+	pthread_cond_destroy(&parallel->done);
+	pthread_cond_destroy(&parallel->work);
+	pthread_mutex_destroy(&parallel->job_lock);
+	pthread_mutex_destroy(&parallel->lock);
+}
+
+void drv_set_max_threads(struct driver *drv, uint32_t max_threads)
+{
+	__atomic_store_n(&drv->parallel.max_threads,
+			 MAX(1, MIN(max_threads, DRV_PARALLEL_MAX_THREADS)), __ATOMIC_RELAXED);
+}
+
+/* Starts workers up to max_threads, counting the caller. Assumes the job lock is held. */
+static uint32_t drv_parallel_start_workers(struct drv_parallel *parallel, uint32_t max_threads)
+{
+	while (parallel->num_threads + 1 < max_threads) {
+		if (pthread_create(&parallel->threads[parallel->num_threads], NULL,
+				   drv_parallel_worker, parallel))
+			break;
+
+		parallel->num_threads++;
+	}
+
+	return MIN(parallel->num_threads + 1, max_threads);
+}
+
+void drv_parallel_for(struct driver *drv, size_t count, size_t item_size, drv_parallel_fn fn,
+		      void *data)
+{
+	DRV_TRACE_SCOPE(__func__);
+	uint32_t threads;
+	size_t items_per_range;
+	struct drv_parallel_job job;
+	struct drv_parallel *parallel = &drv->parallel;
+	uint32_t max_threads = __atomic_load_n(&parallel->max_threads, __ATOMIC_RELAXED);
+
+	if (!count)
+		return;
+
+	if (max_threads < 2 || count * item_size < DRV_PARALLEL_MIN_BYTES ||
+	    pthread_mutex_trylock(&parallel->job_lock)) {
+		fn(data, 0, count);
+		return;
+	}
+
+	threads = drv_parallel_start_workers(parallel, max_threads);
+	threads = MIN(threads, count * item_size / (DRV_PARALLEL_MIN_BYTES / 2));
+	if (threads < 2) {
+		pthread_mutex_unlock(&parallel->job_lock);
+		fn(data, 0, count);
+		return;
+	}
+
+	items_per_range = DIV_ROUND_UP(count, threads);
+
+	memset(&job, 0, sizeof(job));
+	job.fn = fn;
+	job.data = data;
+	job.count = count;
+	job.items_per_range = items_per_range;
+	job.num_ranges = DIV_ROUND_UP(count, items_per_range);
+
+	pthread_mutex_lock(&parallel->lock);
+	parallel->job = &job;
+	parallel->generation++;
+	pthread_cond_broadcast(&parallel->work);
+	pthread_mutex_unlock(&parallel->lock);
+
+	drv_parallel_run(&job);
+
+	/* Workers that never picked the job up must not find it once it is gone. */
+	pthread_mutex_lock(&parallel->lock);
+	parallel->job = NULL;
+	while (parallel->active)
+		pthread_cond_wait(&parallel->done, &parallel->lock);
+	pthread_mutex_unlock(&parallel->lock);
+
+	pthread_mutex_unlock(&parallel->job_lock);
+}
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+
+/*
+ * The pool keeps bos released by drv_bo_destroy() so that drv_bo_create() can hand them out again
+ * for the same width, height, format and use flags. Since the layout (and with it the modifier) is
+ * a function of those, the key identifies the bo completely. Pooled bos keep their GEM handles
+ * and reference counts; only their mappings are torn down.
+ *
+ * With async destroy, the bos that aren't pooled go to the reclaim queue instead of being torn
+ * down by the caller, and a reclaim thread unmaps and closes them. Until it gets to them, queued
+ * bos that could have been pooled are handed out by drv_pool_get() like pooled ones.
+ */
+
+static uint64_t drv_pool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Cuts the list after the newest bos that fit in max_bytes and are young enough, and returns the
+ * rest. Must be called with the pool lock held.
+ */
+static struct bo *drv_pool_evict_locked(struct drv_pool *pool, uint64_t max_bytes, uint64_t now)
+{
+	uint64_t bytes = 0;
+	struct bo **link = &pool->bos;
+	struct bo *evicted, *bo;
+
+	while (*link) {
+		bytes += (*link)->total_size;
+		if (bytes > max_bytes)
+			break;
+
+		if (pool->max_age_ns && now - (*link)->pool_time > pool->max_age_ns)
+			break;
+
+		link = &(*link)->pool_next;
+	}
+
+	evicted = *link;
+	*link = NULL;
+
+	for (bo = evicted; bo; bo = bo->pool_next) {
+		pool->stats.evictions++;
+		pool->stats.num_bos--;
+		pool->stats.num_bytes -= bo->total_size;
+	}
+
+	return evicted;
+}
+
+static void drv_pool_release(struct bo *bos)
+{
+	struct bo *next;
+
+	while (bos) {
+		next = bos->pool_next;
+		bos->pool_next = NULL;
+		drv_bo_discard(bos);
+		bos = next;
+	}
+}
+
+static void drv_pool_reclaim(struct bo *bos)
+{
+	struct bo *next;
+
+	while (bos) {
+		next = bos->pool_next;
+		bos->pool_next = NULL;
+		drv_bo_reclaim(bos);
+		bos = next;
+	}
+}
+
+static void *drv_pool_reclaim_thread(void *arg)
+{
+	struct drv_pool *pool = arg;
+	struct bo *bo;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->reclaim && pool->async_destroy)
+			pthread_cond_wait(&pool->reclaim_cond, &pool->lock);
+
+		/* The queue is drained before the thread exits. */
+		bo = pool->reclaim;
+		if (!bo)
+			break;
+
+		/* One at a time, so the rest can still be resurrected meanwhile. */
+		pool->reclaim = bo->pool_next;
+		pool->stats.num_queued--;
+		pthread_mutex_unlock(&pool->lock);
+
+		bo->pool_next = NULL;
+		drv_bo_reclaim(bo);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int drv_pool_init(struct driver *drv)
+{
+	if (pthread_mutex_init(&drv->pool.lock, NULL))
+		return -ENOMEM;
+
+	if (pthread_cond_init(&drv->pool.reclaim_cond, NULL)) {
+		pthread_mutex_destroy(&drv->pool.lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void drv_pool_destroy(struct driver *drv)
+{
+	drv_pool_set_limits(drv, 0, 0);
+	drv_pool_set_async_destroy(drv, false);
+	pthread_cond_destroy(&drv->pool.reclaim_cond);
+	pthread_mutex_destroy(&drv->pool.lock);
+}
+
+/* Takes a queued bo matching the key that could have been pooled. Assumes the pool lock is held. */
+static struct bo *drv_pool_resurrect_locked(struct drv_pool *pool, uint32_t width, uint32_t height,
+					    uint32_t format, uint64_t use_flags)
+{
+	struct bo **link, *bo;
+
+	for (link = &pool->reclaim; *link; link = &(*link)->pool_next) {
+		bo = *link;
+		if (bo->width != width || bo->height != height || bo->format != format ||
+		    bo->use_flags != use_flags || !bo->poolable || drv_bo_handles_shared(bo))
+			continue;
+
+		*link = bo->pool_next;
+		bo->pool_next = NULL;
+		pool->stats.num_queued--;
+		pool->stats.resurrections++;
+		return bo;
+	}
+
+	return NULL;
+}
+
+uint32_t drv_pool_get_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags, uint32_t count, struct bo **bos)
+{
+	struct drv_pool *pool = &drv->pool;
+	struct bo **link, *bo, *evicted = NULL;
+	uint32_t i, pooled, num_bos = 0;
+
+	if (!__atomic_load_n(&pool->max_bytes, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&pool->reclaim, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->max_bytes) {
+		link = &pool->bos;
+		while (*link && num_bos < count) {
+			bo = *link;
+			if (bo->width != width || bo->height != height || bo->format != format ||
+			    bo->use_flags != use_flags) {
+				link = &bo->pool_next;
+				continue;
+			}
+
+			*link = bo->pool_next;
+			bo->pool_next = NULL;
+			bos[num_bos++] = bo;
+			pool->stats.num_bos--;
+			pool->stats.num_bytes -= bo->total_size;
+		}
+
+		pool->stats.hits += num_bos;
+		pool->stats.misses += count - num_bos;
+		evicted = drv_pool_evict_locked(pool, pool->max_bytes, drv_pool_now());
+	}
+
+	pooled = num_bos;
+	while (num_bos < count &&
+	       (bos[num_bos] = drv_pool_resurrect_locked(pool, width, height, format, use_flags)))
+		num_bos++;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_pool_release(evicted);
+
+	/* Mappings left behind by the users that destroyed the queued bos. */
+	for (i = pooled; i < num_bos; i++) {
+		drv_bo_lock_shards(bos[i]);
+		drv_mapping_destroy(bos[i]);
+		drv_bo_unlock_shards(bos[i]);
+	}
+
+	return num_bos;
+}
+
+struct bo *drv_pool_get(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags)
+{
+	struct bo *bo;
+
+	return drv_pool_get_batch(drv, width, height, format, use_flags, 1, &bo) ? bo : NULL;
+}
+
+bool drv_pool_put(struct bo *bo)
+{
+	struct drv_pool *pool = &bo->drv->pool;
+	struct bo *evicted;
+
+	if (!bo->poolable || !__atomic_load_n(&pool->max_bytes, __ATOMIC_RELAXED))
+		return false;
+
+	/* Imports of the same buffer still use the handles. */
+	if (drv_bo_handles_shared(bo))
+		return false;
+
+	drv_bo_lock_shards(bo);
+	drv_mapping_destroy(bo);
+	drv_bo_unlock_shards(bo);
+
+	pthread_mutex_lock(&pool->lock);
+
+	bo->pool_time = drv_pool_now();
+	bo->pool_next = pool->bos;
+	pool->bos = bo;
+	pool->stats.num_bos++;
+	pool->stats.num_bytes += bo->total_size;
+
+	evicted = drv_pool_evict_locked(pool, pool->max_bytes, bo->pool_time);
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_pool_release(evicted);
+	return true;
+}
+
+bool drv_pool_defer(struct bo *bo)
+{
+	struct drv_pool *pool = &bo->drv->pool;
+
+	if (!__atomic_load_n(&pool->async_destroy, __ATOMIC_RELAXED))
+		return false;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->async_destroy) {
+		pthread_mutex_unlock(&pool->lock);
+		return false;
+	}
+
+	bo->pool_next = pool->reclaim;
+	pool->reclaim = bo;
+	pool->stats.num_queued++;
+	pthread_cond_signal(&pool->reclaim_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return true;
+}
+
+int drv_pool_set_async_destroy(struct driver *drv, int enable)
+{
+	struct drv_pool *pool = &drv->pool;
+	pthread_t thread;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->async_destroy == !!enable) {
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+
+	if (enable) {
+		ret = -pthread_create(&pool->reclaim_thread, NULL, drv_pool_reclaim_thread, pool);
+		if (!ret)
+			__atomic_store_n(&pool->async_destroy, true, __ATOMIC_RELAXED);
+
+		pthread_mutex_unlock(&pool->lock);
+		return ret;
+	}
+
+	__atomic_store_n(&pool->async_destroy, false, __ATOMIC_RELAXED);
+	thread = pool->reclaim_thread;
+	pthread_cond_signal(&pool->reclaim_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_join(thread, NULL);
+	return 0;
+}
+
+void drv_pool_set_limits(struct driver *drv, uint64_t max_bytes, uint32_t max_age_ms)
+{
+	struct drv_pool *pool = &drv->pool;
+	struct bo *evicted;
+
+	pthread_mutex_lock(&pool->lock);
+
+	__atomic_store_n(&pool->max_bytes, max_bytes, __ATOMIC_RELAXED);
+	pool->max_age_ns = max_age_ms * 1000000ull;
+	evicted = drv_pool_evict_locked(pool, max_bytes, drv_pool_now());
+
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_pool_release(evicted);
+}
+
+void drv_pool_trim(struct driver *drv, uint64_t max_bytes)
+{
+	struct drv_pool *pool = &drv->pool;
+	struct bo *evicted, *queued;
+
+	pthread_mutex_lock(&pool->lock);
+	evicted = drv_pool_evict_locked(pool, max_bytes, drv_pool_now());
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_pool_release(evicted);
+
+	/* The memory of queued bos isn't free until they are closed, so close them right here. */
+	pthread_mutex_lock(&pool->lock);
+	queued = pool->reclaim;
+	pool->reclaim = NULL;
+	pool->stats.num_queued = 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_pool_reclaim(queued);
+}
+
+void drv_pool_get_stats(struct driver *drv, struct drv_pool_stats *stats)
+{
+	pthread_mutex_lock(&drv->pool.lock);
+	*stats = drv->pool.stats;
+	pthread_mutex_unlock(&drv->pool.lock);
+}
@@ -8,6 +8,7 @@
 #define DRV_PRIV_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -29,6 +30,22 @@ struct bo {
 	uint64_t use_flags;
 	size_t total_size;
 	void *priv;
+	/* Set for bos from drv_bo_create() that were never exported, see drv_pool_put(). */
+	int poolable;
+	uint64_t pool_time;
+	struct bo *pool_next;
+	/* Set while the bo is counted in the live stats of its driver. */
+	int stats_counted;
+	/* Set for bos accessed through their dma-buf, dmabuf_fd, see drv_heap.c. */
+	int dmabuf_map;
+	int dmabuf_fd;
+	/* Set if the memory came from the dma-buf heap instead of the backend. */
+	int heap_allocated;
+	/* Set while later imports of the same dma-buf are copied from this bo. */
+	int import_cached;
+	/* The file of the dma-buf the bo was imported from, see drv_bo_import_cached(). */
+	dev_t import_dev;
+	ino_t import_ino;
 };
 
 struct kms_item {
@@ -49,14 +66,94 @@ struct combination {
 	uint64_t use_flags;
 };
 
+/* Must be a power of two no larger than 32, see drv_bo_lock_shards(). */
+#define DRV_NUM_SHARDS 16
+
+/* The mappings of a GEM handle are kept in the shard selected by the handle. */
+struct drv_shard {
+	pthread_mutex_t lock;
+	void *mappings;
+	/* Live imported bos by the inode of their dma-buf, see drv_bo_import_cached(). */
+	void *imports;
+};
+
+#define DRV_REFCOUNT_LEAF_BITS 12
+#define DRV_REFCOUNT_MID_BITS 10
+#define DRV_REFCOUNT_TOP_BITS (32 - DRV_REFCOUNT_MID_BITS - DRV_REFCOUNT_LEAF_BITS)
+
+/*
+ * GEM handles are allocated densely by the kernel, so reference counts are stored in a radix
+ * table indexed by handle. Nodes are installed with a compare-and-swap and are only freed by
+ * drv_destroy(), which makes every count a plain atomic once its leaf exists.
+ */
+struct drv_refcount_table {
+	/* Serializes the release of bos with more than one distinct handle. */
+	pthread_mutex_t lock;
+	void *nodes[1 << DRV_REFCOUNT_TOP_BITS];
+};
+
+struct drv_pool {
+	pthread_mutex_t lock;
+	uint64_t max_bytes;
+	uint64_t max_age_ns;
+	/* Most recently released first. */
+	struct bo *bos;
+	struct drv_pool_stats stats;
+	/* Destroyed bos waiting for the reclaim thread, see drv_pool_set_async_destroy(). */
+	struct bo *reclaim;
+	bool async_destroy;
+	pthread_t reclaim_thread;
+	pthread_cond_t reclaim_cond;
+};
+
+#define DRV_PARALLEL_MAX_THREADS 8
+
+struct drv_parallel_job;
+
+/* Worker threads for large CPU work on bos, see drv_parallel.c. */
+struct drv_parallel {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	/* Held by the caller of the running job. */
+	pthread_mutex_t job_lock;
+	pthread_t threads[DRV_PARALLEL_MAX_THREADS - 1];
+	uint32_t num_threads;
+	/* Counting the caller of a job, so 1 keeps all work inline. */
+	uint32_t max_threads;
+	uint32_t active;
+	uint64_t generation;
+	struct drv_parallel_job *job;
+	bool stop;
+};
+
 struct driver {
 	int fd;
+	/* Set when the driver opened fd itself, see drv_create_for_usage(). */
+	bool owns_fd;
 	const struct backend *backend;
 	void *priv;
-	void *buffer_table;
-	struct drv_array *mappings;
+	struct drv_shard shards[DRV_NUM_SHARDS];
+	struct drv_refcount_table refcounts;
+	struct drv_pool pool;
+	struct drv_parallel parallel;
+	/* The system dma-buf heap, or -1 if there is none. */
+	int heap_fd;
+	/* Updated with relaxed atomics, see drv_stats.c. */
+	struct drv_stats stats;
+	/* The log calls are recorded to, or -1, and the records not yet written to it. */
+	pthread_mutex_t record_lock;
+	int record_fd;
+	struct drv_record *records;
+	uint32_t num_records;
 	struct drv_array *combos;
-	pthread_mutex_t driver_lock;
+	/* Built from combos once backend->init() returns; combos must not change afterwards. */
+	struct combo_index *combo_index;
+	/* Filled by the first drv_query_kms() call. */
+	bool kms_queried;
+	/* Set if the planes reported their modifiers through IN_FORMATS. */
+	bool kms_has_modifiers;
+	struct drv_array *kms_items;
 };
 
 struct backend {
@@ -73,7 +170,25 @@ struct backend {
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/*
+	 * For backends without bo_flush, whether CPU writes to the bo only reach it in bo_unmap().
+	 * Without it, mappings are taken to be coherent.
+	 */
+	bool (*bo_unmap_writes_back)(struct bo *bo);
+	/*
+	 * Returns 1 if bo_invalidate() would have to wait for the GPU before the CPU can access
+	 * the bo with map_flags, 0 if not, or a negative errno. Without it, the bo's dma-buf is
+	 * polled instead.
+	 */
+	int (*bo_busy)(struct bo *bo, uint32_t map_flags);
+	/*
+	 * Copies rect from src to dst, both of this driver and the same format, on the GPU.
+	 * Returns -EOPNOTSUPP for bos it can't copy, which the CPU then copies instead.
+	 */
+	int (*bo_copy)(struct bo *dst, struct bo *src, const struct rectangle *rect);
 	uint32_t (*resolve_format)(uint32_t format, uint64_t use_flags);
+	/* For modifiers that add planes to the format's, e.g. for compression metadata. */
+	size_t (*num_planes_from_modifier)(struct driver *drv, uint32_t format, uint64_t modifier);
 };
 
 // clang-format off
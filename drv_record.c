@@ -0,0 +1,481 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * The front ends record their calls, creations, imports, maps, unmaps and destroys, with the
+ * parameters and the time each took. The log is a drv_record_header followed by drv_records in
+ * the order the calls returned, in the byte order of the recording machine.
+ *
+ * drv_replay() runs such a log against any device. Bos are named by the GEM handle they had
+ * while recording, imports are replayed on a bo created and exported just before, and maps by
+ * the mapped plane alone. Calls that failed while recording, and calls on bos that were created
+ * before the recording started, are left out.
+ */
+
+#define DRV_RECORD_MAGIC "MGBMREC"
+#define DRV_RECORD_VERSION 1
+
+/* Records are written out in batches of this many, and when recording stops. */
+#define DRV_RECORD_BATCH 256
+
+struct drv_record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+/*
+ * A bo of the replay, with the number of destroys it takes to go away. Bos that the log destroys
+ * while they are mapped stay around until their last mapping is unmapped.
+ */
+struct drv_replay_bo {
+	struct bo *bo;
+	uint32_t refcount;
+	uint32_t num_maps;
+};
+
+/* The live mappings of a map id, most recent first. */
+struct drv_replay_map {
+	struct drv_replay_bo *replay_bo;
+	struct mapping *mapping;
+	struct drv_replay_map *next;
+};
+
+/* Writes out the buffered records. Assumes the record lock is held. */
+static void drv_record_flush_locked(struct driver *drv)
+{
+	size_t size = drv->num_records * sizeof(*drv->records);
+	const uint8_t *buf = (const uint8_t *)drv->records;
+	ssize_t ret;
+
+	drv->num_records = 0;
+	while (size) {
+		ret = write(drv->record_fd, buf, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			drv_log("Failed to write the call log, recording stops: %s\n",
+				strerror(errno));
+			close(drv->record_fd);
+			__atomic_store_n(&drv->record_fd, -1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		buf += ret;
+		size -= ret;
+	}
+}
+
+/* Numbers the logs of the drivers of a process, which must not share a file. */
+static uint32_t drv_record_next_log;
+
+int drv_record_init(struct driver *drv)
+{
+	const char *prefix = getenv("MINIGBM_RECORD");
+	char path[256];
+
+	drv->record_fd = -1;
+	if (pthread_mutex_init(&drv->record_lock, NULL))
+		return -ENOMEM;
+
+	if (prefix && prefix[0]) {
+		snprintf(path, sizeof(path), "%s.%d.%u", prefix, (int)getpid(),
+			 __atomic_fetch_add(&drv_record_next_log, 1, __ATOMIC_RELAXED));
+		drv_record_start(drv, path);
+	}
+
+	return 0;
+}
+
+void drv_record_destroy(struct driver *drv)
+{
+	drv_record_stop(drv);
+	pthread_mutex_destroy(&drv->record_lock);
+}
+
+int drv_record_start(struct driver *drv, const char *path)
+{
+	int fd, ret;
+	struct drv_record_header header;
+	struct drv_record *records;
+
+	records = calloc(DRV_RECORD_BATCH, sizeof(*records));
+	if (!records)
+		return -ENOMEM;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		drv_log("Failed to open %s for the call log: %s\n", path, strerror(-ret));
+		free(records);
+		return ret;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DRV_RECORD_MAGIC, sizeof(DRV_RECORD_MAGIC));
+	header.version = DRV_RECORD_VERSION;
+	header.record_size = sizeof(struct drv_record);
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		free(records);
+		return -EIO;
+	}
+
+	drv_record_stop(drv);
+
+	pthread_mutex_lock(&drv->record_lock);
+	drv->records = records;
+	drv->num_records = 0;
+	__atomic_store_n(&drv->record_fd, fd, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&drv->record_lock);
+	return 0;
+}
+
+void drv_record_stop(struct driver *drv)
+{
+	pthread_mutex_lock(&drv->record_lock);
+	if (drv->record_fd >= 0) {
+		drv_record_flush_locked(drv);
+		if (drv->record_fd >= 0)
+			close(drv->record_fd);
+		__atomic_store_n(&drv->record_fd, -1, __ATOMIC_RELAXED);
+	}
+
+	free(drv->records);
+	drv->records = NULL;
+	pthread_mutex_unlock(&drv->record_lock);
+}
+
+int drv_record_begin(struct driver *drv, struct drv_record *record, uint32_t op)
+{
+	if (__atomic_load_n(&drv->record_fd, __ATOMIC_RELAXED) < 0)
+		return 0;
+
+	memset(record, 0, sizeof(*record));
+	record->op = op;
+	record->start_ns = drv_stats_start();
+	return 1;
+}
+
+void drv_record_bo(struct drv_record *record, struct bo *bo)
+{
+	record->id = bo->handles[0].u32;
+	record->format = bo->format;
+	record->use_flags = bo->use_flags;
+	if (record->op != DRV_RECORD_MAP && record->op != DRV_RECORD_UNMAP) {
+		record->width = bo->width;
+		record->height = bo->height;
+	}
+}
+
+static void drv_record_append(struct driver *drv, const struct drv_record *record)
+{
+	pthread_mutex_lock(&drv->record_lock);
+	if (drv->record_fd >= 0) {
+		drv->records[drv->num_records++] = *record;
+		if (drv->num_records == DRV_RECORD_BATCH)
+			drv_record_flush_locked(drv);
+	}
+	pthread_mutex_unlock(&drv->record_lock);
+}
+
+void drv_record_end(struct driver *drv, struct drv_record *record, int result)
+{
+	record->duration_ns = drv_stats_start() - record->start_ns;
+	record->tid = (uint32_t)syscall(SYS_gettid);
+	record->result = result;
+	drv_record_append(drv, record);
+}
+
+void drv_record_end_batch(struct driver *drv, struct drv_record *record, struct bo **bos,
+			  uint32_t count)
+{
+	uint32_t i;
+
+	if (!count)
+		return;
+
+	record->duration_ns = (drv_stats_start() - record->start_ns) / count;
+	record->tid = (uint32_t)syscall(SYS_gettid);
+	for (i = 0; i < count; i++) {
+		drv_record_bo(record, bos[i]);
+		drv_record_append(drv, record);
+	}
+}
+
+static struct bo *drv_replay_create(struct driver *drv, const struct drv_record *record)
+{
+	return drv_bo_create(drv, record->width, record->height, record->format,
+			     record->use_flags);
+}
+
+/* Imports a bo like the recorded one from the dma-bufs of a bo just created and destroyed. */
+static struct bo *drv_replay_import(struct driver *drv, const struct drv_record *record,
+				    uint64_t *duration_ns)
+{
+	size_t plane, num_planes;
+	uint64_t start;
+	struct bo *src, *bo;
+	struct drv_import_fd_data data;
+
+	src = drv_replay_create(drv, record);
+	if (!src)
+		return NULL;
+
+	memset(&data, 0, sizeof(data));
+	data.width = record->width;
+	data.height = record->height;
+	data.format = record->format;
+	data.use_flags = record->use_flags;
+	data.tiling = drv_bo_get_tiling(src);
+
+	num_planes = drv_bo_get_num_planes(src);
+	for (plane = 0; plane < DRV_MAX_PLANES; plane++) {
+		data.fds[plane] = plane < num_planes ? drv_bo_get_plane_fd(src, plane) : -1;
+		if (plane >= num_planes)
+			continue;
+
+		data.strides[plane] = drv_bo_get_plane_stride(src, plane);
+		data.offsets[plane] = drv_bo_get_plane_offset(src, plane);
+		data.sizes[plane] = drv_bo_get_plane_size(src, plane);
+		data.format_modifiers[plane] = drv_bo_get_plane_format_modifier(src, plane);
+	}
+
+	drv_bo_destroy(src);
+
+	start = drv_stats_start();
+	bo = drv_bo_import(drv, &data);
+	*duration_ns = drv_stats_start() - start;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		if (data.fds[plane] >= 0)
+			close(data.fds[plane]);
+	}
+
+	return bo;
+}
+
+/* Destroys replay_bo if the log is done with it. */
+static void drv_replay_put(struct drv_replay_bo *replay_bo)
+{
+	if (replay_bo->refcount || replay_bo->num_maps)
+		return;
+
+	drv_bo_destroy(replay_bo->bo);
+	free(replay_bo);
+}
+
+/* Replays one call, or returns -ENOENT for calls that are left out. */
+static int drv_replay_call(struct driver *drv, void *bos, void *maps,
+			   const struct drv_record *record, int *result, uint64_t *duration_ns)
+{
+	uint64_t start;
+	void *value;
+	void *addr;
+	struct rectangle rect;
+	struct drv_replay_bo *replay_bo = NULL;
+	struct drv_replay_map *map = NULL;
+	bool live = !drmHashLookup(bos, record->id, &value);
+
+	if (live)
+		replay_bo = value;
+
+	*result = 0;
+	*duration_ns = 0;
+	switch (record->op) {
+	case DRV_RECORD_CREATE:
+	case DRV_RECORD_IMPORT:
+		/* Imports of a live bo only take a reference, like they did while recording. */
+		if (live) {
+			replay_bo->refcount++;
+			return 0;
+		}
+
+		replay_bo = calloc(1, sizeof(*replay_bo));
+		if (!replay_bo)
+			return -ENOMEM;
+
+		if (record->op == DRV_RECORD_CREATE) {
+			start = drv_stats_start();
+			replay_bo->bo = drv_replay_create(drv, record);
+			*duration_ns = drv_stats_start() - start;
+		} else {
+			replay_bo->bo = drv_replay_import(drv, record, duration_ns);
+		}
+
+		if (!replay_bo->bo) {
+			*result = -errno;
+			free(replay_bo);
+			return 0;
+		}
+
+		replay_bo->refcount = 1;
+		drmHashInsert(bos, record->id, replay_bo);
+		return 0;
+	case DRV_RECORD_MAP:
+		if (!live)
+			return -ENOENT;
+
+		map = calloc(1, sizeof(*map));
+		if (!map)
+			return -ENOMEM;
+
+		rect.x = record->x;
+		rect.y = record->y;
+		rect.width = record->width;
+		rect.height = record->height;
+
+		start = drv_stats_start();
+		addr = drv_bo_map(replay_bo->bo, &rect, record->map_flags, &map->mapping,
+				  record->plane);
+		*duration_ns = drv_stats_start() - start;
+		if (addr == MAP_FAILED) {
+			*result = -errno;
+			free(map);
+			return 0;
+		}
+
+		map->replay_bo = replay_bo;
+		replay_bo->num_maps++;
+		if (!drmHashLookup(maps, record->map_id, &value)) {
+			map->next = value;
+			drmHashDelete(maps, record->map_id);
+		}
+
+		drmHashInsert(maps, record->map_id, map);
+		return 0;
+	case DRV_RECORD_UNMAP:
+		if (drmHashLookup(maps, record->map_id, &value))
+			return -ENOENT;
+
+		map = value;
+		drmHashDelete(maps, record->map_id);
+		if (map->next)
+			drmHashInsert(maps, record->map_id, map->next);
+
+		start = drv_stats_start();
+		*result = drv_bo_flush_or_unmap(map->replay_bo->bo, map->mapping);
+		*duration_ns = drv_stats_start() - start;
+		map->replay_bo->num_maps--;
+		drv_replay_put(map->replay_bo);
+		free(map);
+		return 0;
+	case DRV_RECORD_DESTROY:
+		if (!live)
+			return -ENOENT;
+
+		if (--replay_bo->refcount)
+			return 0;
+
+		drmHashDelete(bos, record->id);
+		start = drv_stats_start();
+		drv_replay_put(replay_bo);
+		*duration_ns = drv_stats_start() - start;
+		return 0;
+	default:
+		return -ENOENT;
+	}
+}
+
+/* Unmaps and destroys what the log left behind. */
+static void drv_replay_cleanup(void *bos, void *maps)
+{
+	unsigned long key;
+	void *value;
+	struct drv_replay_map *map, *next;
+	struct drv_replay_bo *replay_bo;
+
+	while (drmHashFirst(maps, &key, &value)) {
+		drmHashDelete(maps, key);
+		for (map = value; map; map = next) {
+			next = map->next;
+			drv_bo_unmap(map->replay_bo->bo, map->mapping);
+			map->replay_bo->num_maps--;
+			drv_replay_put(map->replay_bo);
+			free(map);
+		}
+	}
+
+	while (drmHashFirst(bos, &key, &value)) {
+		drmHashDelete(bos, key);
+		replay_bo = value;
+		replay_bo->refcount = 0;
+		drv_replay_put(replay_bo);
+	}
+}
+
+int drv_replay(struct driver *drv, const char *path, drv_replay_fn fn, void *data)
+{
+	int ret, result, count = 0;
+	uint64_t duration_ns;
+	struct drv_record_header header;
+	struct drv_record record;
+	void *bos = NULL, *maps = NULL;
+	FILE *file;
+
+	file = fopen(path, "rbe");
+	if (!file)
+		return -errno;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, DRV_RECORD_MAGIC, sizeof(DRV_RECORD_MAGIC)) ||
+	    header.version != DRV_RECORD_VERSION || header.record_size != sizeof(record)) {
+		drv_log("%s is not a call log of this version\n", path);
+		ret = -EINVAL;
+		goto close_file;
+	}
+
+	bos = drmHashCreate();
+	maps = drmHashCreate();
+	if (!bos || !maps) {
+		ret = -ENOMEM;
+		goto destroy_hashes;
+	}
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		if (record.result)
+			continue;
+
+		ret = drv_replay_call(drv, bos, maps, &record, &result, &duration_ns);
+		if (ret == -ENOENT)
+			continue;
+
+		if (ret)
+			goto cleanup;
+
+		fn(data, &record, result, duration_ns);
+		count++;
+	}
+
+	ret = count;
+
+cleanup:
+	drv_replay_cleanup(bos, maps);
+destroy_hashes:
+	if (maps)
+		drmHashDestroy(maps);
+	if (bos)
+		drmHashDestroy(bos);
+close_file:
+	fclose(file);
+	return ret;
+}
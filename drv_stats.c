@@ -0,0 +1,338 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * All counters are updated with relaxed atomics and without locks, so they cost a few
+ * instructions on the paths they measure. A snapshot is therefore not consistent across counters,
+ * only each counter on its own is.
+ */
+
+static const char *const drv_stats_op_names[DRV_STATS_NUM_OPS] = {
+	"create", "import", "map", "flush", "destroy",
+};
+
+static const char *const drv_stats_use_names[DRV_STATS_NUM_USE_FLAGS] = {
+	"scanout",	   "cursor",	     "rendering",	 "linear",
+	"sw read never",   "sw read rarely", "sw read often",	 "sw write never",
+	"sw write rarely", "sw write often", "external display", "protected",
+	"video encoder",   "camera write",   "camera read",	 NULL,
+	"renderscript",	   "texture",	     "video decoder",	 "framebuffer",
+};
+
+#define STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_SUB(counter, value) __atomic_fetch_sub(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+uint64_t drv_stats_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void drv_stats_record(struct driver *drv, enum drv_stats_op op, uint64_t start)
+{
+	drv_stats_record_batch(drv, op, start, 1);
+}
+
+void drv_stats_record_batch(struct driver *drv, enum drv_stats_op op, uint64_t start,
+			    uint32_t count)
+{
+	uint64_t total_ns = drv_stats_start() - start;
+	uint64_t ns = count ? total_ns / count : 0;
+	uint64_t us = ns / 1000;
+	uint64_t max;
+	uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+	struct drv_op_stats *stats = &drv->stats.ops[op];
+
+	if (bucket >= DRV_STATS_NUM_BUCKETS)
+		bucket = DRV_STATS_NUM_BUCKETS - 1;
+
+	if (!count)
+		return;
+
+	STATS_ADD(stats->count, count);
+	STATS_ADD(stats->total_ns, total_ns);
+	STATS_ADD(stats->buckets[bucket], count);
+
+	max = STATS_LOAD(stats->max_ns);
+	while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Returns the slot of format, claiming a free one if needed, or NULL if all slots are taken. */
+static struct drv_format_stats *drv_stats_format_slot(struct driver *drv, uint32_t format)
+{
+	uint32_t i, expected;
+	struct drv_format_stats *slot;
+
+	for (i = 0; i < DRV_STATS_MAX_FORMATS; i++) {
+		slot = &drv->stats.formats[i];
+		expected = __atomic_load_n(&slot->format, __ATOMIC_ACQUIRE);
+		if (expected == format)
+			return slot;
+
+		if (expected)
+			continue;
+
+		if (__atomic_compare_exchange_n(&slot->format, &expected, format, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+		    expected == format)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static void drv_stats_use_add(struct driver *drv, uint64_t use_flags, int64_t bytes)
+{
+	uint32_t bit;
+
+	use_flags &= (1ull << DRV_STATS_NUM_USE_FLAGS) - 1;
+	while (use_flags) {
+		bit = __builtin_ctzll(use_flags);
+		STATS_ADD(drv->stats.use_bytes[bit], bytes);
+		use_flags &= use_flags - 1;
+	}
+}
+
+void drv_stats_bo_added(struct bo *bo)
+{
+	drv_stats_bos_added(&bo, 1);
+}
+
+void drv_stats_bos_added(struct bo **bos, uint32_t count)
+{
+	uint32_t i;
+	struct driver *drv;
+	struct drv_format_stats *slot;
+	uint64_t bytes;
+
+	if (!count)
+		return;
+
+	drv = bos[0]->drv;
+	slot = drv_stats_format_slot(drv, bos[0]->format);
+	bytes = bos[0]->total_size * count;
+
+	STATS_ADD(drv->stats.live_bos, count);
+	STATS_ADD(drv->stats.live_bytes, bytes);
+	drv_stats_use_add(drv, bos[0]->use_flags, bytes);
+
+	if (slot) {
+		STATS_ADD(slot->live_bos, count);
+		STATS_ADD(slot->live_bytes, bytes);
+	}
+
+	for (i = 0; i < count; i++)
+		bos[i]->stats_counted = 1;
+}
+
+void drv_stats_bo_removed(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct drv_format_stats *slot;
+
+	if (!bo->stats_counted)
+		return;
+
+	STATS_SUB(drv->stats.live_bos, 1);
+	STATS_SUB(drv->stats.live_bytes, bo->total_size);
+	drv_stats_use_add(drv, bo->use_flags, -(int64_t)bo->total_size);
+
+	slot = drv_stats_format_slot(drv, bo->format);
+	if (slot) {
+		STATS_SUB(slot->live_bos, 1);
+		STATS_SUB(slot->live_bytes, bo->total_size);
+	}
+
+	bo->stats_counted = 0;
+}
+
+void drv_get_stats(struct driver *drv, struct drv_stats *stats)
+{
+	uint32_t i, j, format;
+	struct drv_stats *live = &drv->stats;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->live_bos = STATS_LOAD(live->live_bos);
+	stats->live_bytes = STATS_LOAD(live->live_bytes);
+	stats->map_exact_hits = STATS_LOAD(live->map_exact_hits);
+	stats->map_vma_hits = STATS_LOAD(live->map_vma_hits);
+	stats->map_misses = STATS_LOAD(live->map_misses);
+	stats->invalidates_skipped = STATS_LOAD(live->invalidates_skipped);
+	stats->budget_bytes = STATS_LOAD(live->budget_bytes);
+	stats->budget_failures = STATS_LOAD(live->budget_failures);
+
+	for (i = 0; i < DRV_STATS_NUM_USE_FLAGS; i++)
+		stats->use_bytes[i] = STATS_LOAD(live->use_bytes[i]);
+
+	for (i = 0; i < DRV_STATS_NUM_OPS; i++) {
+		stats->ops[i].count = STATS_LOAD(live->ops[i].count);
+		stats->ops[i].total_ns = STATS_LOAD(live->ops[i].total_ns);
+		stats->ops[i].max_ns = STATS_LOAD(live->ops[i].max_ns);
+		for (j = 0; j < DRV_STATS_NUM_BUCKETS; j++)
+			stats->ops[i].buckets[j] = STATS_LOAD(live->ops[i].buckets[j]);
+	}
+
+	for (i = 0; i < DRV_STATS_MAX_FORMATS; i++) {
+		format = __atomic_load_n(&live->formats[i].format, __ATOMIC_ACQUIRE);
+		if (!format)
+			break;
+
+		stats->formats[i].format = format;
+		stats->formats[i].live_bos = STATS_LOAD(live->formats[i].live_bos);
+		stats->formats[i].live_bytes = STATS_LOAD(live->formats[i].live_bytes);
+	}
+
+	stats->num_formats = i;
+}
+
+void drv_set_memory_budget(struct driver *drv, uint64_t max_bytes)
+{
+	__atomic_store_n(&drv->stats.budget_bytes, max_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t drv_get_allocated_bytes(struct driver *drv, uint64_t use_flag)
+{
+	if (!use_flag)
+		return STATS_LOAD(drv->stats.live_bytes);
+
+	if (__builtin_ctzll(use_flag) >= DRV_STATS_NUM_USE_FLAGS)
+		return 0;
+
+	return STATS_LOAD(drv->stats.use_bytes[__builtin_ctzll(use_flag)]);
+}
+
+bool drv_stats_within_budget(struct driver *drv, uint64_t pending)
+{
+	uint64_t budget = STATS_LOAD(drv->stats.budget_bytes);
+
+	if (!budget || STATS_LOAD(drv->stats.live_bytes) + pending <= budget)
+		return true;
+
+	/* Pooled and queued bos are still counted as live, give them back first. */
+	drv_pool_trim(drv, 0);
+	if (STATS_LOAD(drv->stats.live_bytes) + pending <= budget)
+		return true;
+
+	STATS_ADD(drv->stats.budget_failures, 1);
+	return false;
+}
+
+__attribute__((format(printf, 4, 5))) static void drv_stats_append(char *buf, size_t size,
+								  size_t *len, const char *format,
+								  ...)
+{
+	int ret;
+	va_list args;
+
+	if (*len >= size)
+		return;
+
+	va_start(args, format);
+	ret = vsnprintf(buf + *len, size - *len, format, args);
+	va_end(args);
+
+	if (ret > 0)
+		*len = MIN(*len + ret, size);
+}
+
+int drv_stats_dump(struct driver *drv, char *buf, size_t size)
+{
+	uint32_t i, j;
+	size_t len = 0;
+	struct drv_stats stats;
+	struct drv_pool_stats pool;
+	const struct drv_format_stats *format;
+	const struct drv_op_stats *op;
+	uint64_t maps;
+
+	if (!size)
+		return -EINVAL;
+
+	buf[0] = '\0';
+	drv_get_stats(drv, &stats);
+	drv_pool_get_stats(drv, &pool);
+
+	drv_stats_append(buf, size, &len, "backend %s: %" PRIu64 " bos, %" PRIu64 " bytes\n",
+			 drv_get_name(drv), stats.live_bos, stats.live_bytes);
+
+	if (stats.budget_bytes)
+		drv_stats_append(buf, size, &len,
+				 "budget: %" PRIu64 " bytes, %" PRIu64 " failed creations\n",
+				 stats.budget_bytes, stats.budget_failures);
+
+	for (i = 0; i < stats.num_formats; i++) {
+		format = &stats.formats[i];
+		drv_stats_append(buf, size, &len, "  %.4s: %" PRIu64 " bos, %" PRIu64 " bytes\n",
+				 (const char *)&format->format, format->live_bos,
+				 format->live_bytes);
+	}
+
+	for (i = 0; i < DRV_STATS_NUM_USE_FLAGS; i++) {
+		if (stats.use_bytes[i])
+			drv_stats_append(buf, size, &len, "  %s: %" PRIu64 " bytes\n",
+					 drv_stats_use_names[i], stats.use_bytes[i]);
+	}
+
+	maps = stats.map_exact_hits + stats.map_vma_hits + stats.map_misses;
+	drv_stats_append(buf, size, &len,
+			 "map reuse: %" PRIu64 " exact hits, %" PRIu64 " vma hits, %" PRIu64
+			 " misses (%" PRIu64 "%% hit)\n",
+			 stats.map_exact_hits, stats.map_vma_hits, stats.map_misses,
+			 maps ? 100 * (maps - stats.map_misses) / maps : 0);
+
+	drv_stats_append(buf, size, &len, "invalidates skipped: %" PRIu64 "\n",
+			 stats.invalidates_skipped);
+
+	drv_stats_append(buf, size, &len,
+			 "pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+			 " evictions, %u bos, %" PRIu64 " bytes, %" PRIu64
+			 " resurrections, %u queued\n",
+			 pool.hits, pool.misses, pool.evictions, pool.num_bos, pool.num_bytes,
+			 pool.resurrections, pool.num_queued);
+
+	for (i = 0; i < DRV_STATS_NUM_OPS; i++) {
+		op = &stats.ops[i];
+		if (!op->count)
+			continue;
+
+		drv_stats_append(buf, size, &len,
+				 "%s: %" PRIu64 " calls, avg %" PRIu64 " us, max %" PRIu64 " us\n",
+				 drv_stats_op_names[i], op->count, op->total_ns / op->count / 1000,
+				 op->max_ns / 1000);
+
+		/* Bucket j counts calls that took less than 2^j us, and at least 2^(j-1) us. */
+		for (j = 0; j < DRV_STATS_NUM_BUCKETS; j++) {
+			if (!op->buckets[j])
+				continue;
+
+			if (j == DRV_STATS_NUM_BUCKETS - 1)
+				drv_stats_append(buf, size, &len, "  >= %u us: %" PRIu64 "\n",
+						 1u << (j - 1), op->buckets[j]);
+			else
+				drv_stats_append(buf, size, &len, "  < %u us: %" PRIu64 "\n",
+						 1u << j, op->buckets[j]);
+		}
+	}
+
+	return len >= size ? -ENOSPC : (int)len;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifdef DRV_TRACE
+
+#ifdef __ANDROID__
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include <cutils/trace.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+#include "drv_trace.h"
+
+#ifdef __ANDROID__
+
+void drv_trace_begin(const char *name)
+{
+	ATRACE_BEGIN(name);
+}
+
+void drv_trace_end(void)
+{
+	ATRACE_END();
+}
+
+#else
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int trace_fd = -1;
+static pid_t trace_pid;
+
+static void drv_trace_open(void)
+{
+	trace_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+	if (trace_fd < 0)
+		trace_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+
+	trace_pid = getpid();
+}
+
+/* Markers that don't fit in buf are cut short, and failed writes are dropped. */
+static void drv_trace_write(const char *buf, size_t size, int len)
+{
+	ssize_t ret;
+
+	if (len <= 0)
+		return;
+
+	ret = write(trace_fd, buf, (size_t)len < size ? (size_t)len : size - 1);
+	(void)ret;
+}
+
+/* The atrace marker format, which perfetto and systrace turn into slices of the writing thread. */
+void drv_trace_begin(const char *name)
+{
+	char buf[128];
+	int len;
+
+	pthread_once(&trace_once, drv_trace_open);
+	if (trace_fd < 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "B|%d|%s", trace_pid, name);
+	drv_trace_write(buf, sizeof(buf), len);
+}
+
+void drv_trace_end(void)
+{
+	char buf[32];
+	int len;
+
+	pthread_once(&trace_once, drv_trace_open);
+	if (trace_fd < 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "E|%d", trace_pid);
+	drv_trace_write(buf, sizeof(buf), len);
+}
+
+#endif
+
+#endif
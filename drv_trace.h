@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef DRV_TRACE_H
+#define DRV_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Trace spans for the driver entry points and backend callbacks. They are compiled in only with
+ * -DDRV_TRACE, and go to atrace on Android and to the ftrace trace_marker elsewhere, in the
+ * format systrace and perfetto show as slices. Without DRV_TRACE they compile to nothing.
+ *
+ * DRV_TRACE_SCOPE() declares a variable that ends the span when it goes out of scope, so it has
+ * to be placed with the declarations of a block. DRV_TRACE_BEGIN()/DRV_TRACE_END() bracket a
+ * single call.
+ */
+
+#define DRV_TRACE_CONCAT_(a, b) a##b
+#define DRV_TRACE_CONCAT(a, b) DRV_TRACE_CONCAT_(a, b)
+
+#ifdef DRV_TRACE
+
+void drv_trace_begin(const char *name);
+void drv_trace_end(void);
+
+static inline int drv_trace_scope_begin(const char *name)
+{
+	drv_trace_begin(name);
+	return 0;
+}
+
+static inline void drv_trace_scope_end(int *scope)
+{
+	(void)scope;
+	drv_trace_end();
+}
+
+#define DRV_TRACE_SCOPE(name)                                                                      \
+	int DRV_TRACE_CONCAT(drv_trace_scope_, __LINE__)                                           \
+	    __attribute__((cleanup(drv_trace_scope_end), unused)) = drv_trace_scope_begin(name)
+#define DRV_TRACE_BEGIN(name) drv_trace_begin(name)
+#define DRV_TRACE_END() drv_trace_end()
+
+#else
+
+#define DRV_TRACE_SCOPE(name)                                                                      \
+	int DRV_TRACE_CONCAT(drv_trace_scope_, __LINE__) __attribute__((unused))
+#define DRV_TRACE_BEGIN(name)                                                                      \
+	do {                                                                                       \
+	} while (0)
+#define DRV_TRACE_END()                                                                            \
+	do {                                                                                       \
+	} while (0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
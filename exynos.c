@@ -31,13 +31,18 @@ static int exynos_init(struct driver *drv)
 	drv_add_combinations(drv, texture_source_formats, ARRAY_SIZE(texture_source_formats),
 			     &LINEAR_METADATA, BO_USE_TEXTURE_MASK);
 
+	/* NV12 bos are single allocations, which the MFC decoder can write to. */
+	drv_modify_combination(drv, DRM_FORMAT_NV12, &LINEAR_METADATA, BO_USE_HW_VIDEO_DECODER);
+
 	return drv_modify_linear_combinations(drv);
 }
 
 static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			    uint64_t use_flags)
 {
+	int ret;
 	size_t plane;
+	struct drm_exynos_gem_create gem_create;
 
 	if (format == DRM_FORMAT_NV12) {
 		uint32_t chroma_height;
@@ -49,8 +54,10 @@ static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint
 		/* MFC v8+ requires 64 byte padding in the end of luma and chroma buffers. */
 		bo->sizes[0] = bo->strides[0] * height + 64;
 		bo->sizes[1] = bo->strides[1] * chroma_height + 64;
-		bo->offsets[0] = bo->offsets[1] = 0;
-		bo->total_size = bo->sizes[0] + bo->sizes[1];
+		/* Both planes share one GEM object, with chroma starting on a page of its own. */
+		bo->offsets[0] = 0;
+		bo->offsets[1] = ALIGN(bo->sizes[0], 4096);
+		bo->total_size = bo->offsets[1] + bo->sizes[1];
 	} else if (format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888) {
 		bo->strides[0] = drv_stride_from_format(format, width, 0);
 		bo->total_size = bo->sizes[0] = height * bo->strides[0];
@@ -61,38 +68,30 @@ static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint
 		return -EINVAL;
 	}
 
-	int ret;
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		size_t size = bo->sizes[plane];
-		struct drm_exynos_gem_create gem_create;
+	memset(&gem_create, 0, sizeof(gem_create));
+	gem_create.size = bo->total_size;
+	gem_create.flags = EXYNOS_BO_NONCONTIG;
 
-		memset(&gem_create, 0, sizeof(gem_create));
-		gem_create.size = size;
-		gem_create.flags = EXYNOS_BO_NONCONTIG;
+	/* Decoder output is contiguous when there is room, for MFCs that sit behind no IOMMU. */
+	if (use_flags & BO_USE_HW_VIDEO_DECODER) {
+		gem_create.flags = EXYNOS_BO_CONTIG;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_EXYNOS_GEM_CREATE, &gem_create);
+		if (ret)
+			gem_create.flags = EXYNOS_BO_NONCONTIG;
+	}
 
+	if (gem_create.flags == EXYNOS_BO_NONCONTIG) {
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_EXYNOS_GEM_CREATE, &gem_create);
 		if (ret) {
-			drv_log("DRM_IOCTL_EXYNOS_GEM_CREATE failed (size=%zu)\n", size);
-			goto cleanup_planes;
+			drv_log("DRM_IOCTL_EXYNOS_GEM_CREATE failed (size=%zu)\n", bo->total_size);
+			return ret;
 		}
+	}
 
+	for (plane = 0; plane < bo->num_planes; plane++)
 		bo->handles[plane].u32 = gem_create.handle;
-	}
 
 	return 0;
-
-cleanup_planes:
-	for (; plane != 0; plane--) {
-		struct drm_gem_close gem_close;
-		memset(&gem_close, 0, sizeof(gem_close));
-		gem_close.handle = bo->handles[plane - 1].u32;
-		int gem_close_ret = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		if (gem_close_ret) {
-			drv_log("DRM_IOCTL_GEM_CLOSE failed: %d\n", gem_close_ret);
-		}
-	}
-
-	return ret;
 }
 
 /*
@@ -5,6 +5,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -41,6 +42,16 @@ PUBLIC int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t forma
 	return (drv_get_combination(gbm->drv, format, use_flags) != NULL);
 }
 
+PUBLIC int gbm_device_get_format_modifiers(struct gbm_device *gbm, uint32_t format, uint32_t usage,
+					   uint64_t *modifiers, uint32_t count)
+{
+	if (usage & GBM_BO_USE_CURSOR && usage & GBM_BO_USE_RENDERING)
+		return 0;
+
+	return drv_get_format_modifiers(gbm->drv, format, gbm_convert_usage(usage), modifiers,
+					count);
+}
+
 PUBLIC struct gbm_device *gbm_create_device(int fd)
 {
 	struct gbm_device *gbm;
@@ -59,35 +70,223 @@ PUBLIC struct gbm_device *gbm_create_device(int fd)
 	return gbm;
 }
 
+PUBLIC struct gbm_device *gbm_create_device_for_usage(const char *selector, uint32_t usage)
+{
+	struct gbm_device *gbm;
+
+	gbm = (struct gbm_device *)malloc(sizeof(*gbm));
+
+	if (!gbm)
+		return NULL;
+
+	gbm->drv = drv_create_for_usage(selector, gbm_convert_usage(usage));
+	if (!gbm->drv) {
+		free(gbm);
+		return NULL;
+	}
+
+	return gbm;
+}
+
 PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 {
 	drv_destroy(gbm->drv);
 	free(gbm);
 }
 
+PUBLIC void gbm_device_set_bo_pool(struct gbm_device *gbm, uint64_t max_bytes, uint32_t max_age_ms)
+{
+	drv_pool_set_limits(gbm->drv, max_bytes, max_age_ms);
+}
+
+PUBLIC int gbm_device_set_async_destroy(struct gbm_device *gbm, int enable)
+{
+	return drv_pool_set_async_destroy(gbm->drv, enable);
+}
+
+PUBLIC void gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t max_bytes)
+{
+	drv_set_memory_budget(gbm->drv, max_bytes);
+}
+
+PUBLIC uint64_t gbm_device_get_allocated_bytes(struct gbm_device *gbm, uint32_t usage)
+{
+	return drv_get_allocated_bytes(gbm->drv, gbm_convert_usage(usage));
+}
+
+PUBLIC void gbm_device_trim_bo_pool(struct gbm_device *gbm)
+{
+	drv_pool_trim(gbm->drv, 0);
+}
+
+PUBLIC void gbm_device_set_max_threads(struct gbm_device *gbm, uint32_t max_threads)
+{
+	drv_set_max_threads(gbm->drv, max_threads);
+}
+
+PUBLIC int gbm_device_dump_stats(struct gbm_device *gbm, char *buf, size_t size)
+{
+	return drv_stats_dump(gbm->drv, buf, size);
+}
+
+PUBLIC int gbm_device_record(struct gbm_device *gbm, const char *path)
+{
+	if (!path) {
+		drv_record_stop(gbm->drv);
+		return 0;
+	}
+
+	return drv_record_start(gbm->drv, path);
+}
+
+struct gbm_replay {
+	gbm_replay_callback callback;
+	void *data;
+};
+
+static void gbm_replay_call(void *data, const struct drv_record *record, int result,
+			    uint64_t duration_ns)
+{
+	struct gbm_replay *replay = data;
+
+	replay->callback(replay->data, record->op, result, record->duration_ns, duration_ns);
+}
+
+PUBLIC int gbm_device_replay(struct gbm_device *gbm, const char *path,
+			     gbm_replay_callback callback, void *data)
+{
+	struct gbm_replay replay = { callback, data };
+
+	return drv_replay(gbm->drv, path, gbm_replay_call, &replay);
+}
+
 PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
 					      uint32_t height, uint32_t format, uint32_t usage)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	size_t i;
+	struct gbm_surface *surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
 
 	if (!surface)
 		return NULL;
 
+	/* The whole ring is allocated up front, so presenting a frame never allocates. */
+	if (gbm_bo_create_array(gbm, width, height, format, usage, GBM_SURFACE_NUM_BUFFERS,
+				surface->bos))
+		goto free_surface;
+
+	if (pthread_mutex_init(&surface->lock, NULL))
+		goto destroy_bos;
+
 	return surface;
+
+destroy_bos:
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		gbm_bo_destroy(surface->bos[i]);
+free_surface:
+	free(surface);
+	return NULL;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
+	size_t i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		gbm_bo_destroy(surface->bos[i]);
+
+	pthread_mutex_destroy(&surface->lock);
 	free(surface);
 }
 
+static int gbm_surface_find(struct gbm_surface *surface, enum gbm_surface_buffer_state state)
+{
+	int i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		if (surface->state[i] == state)
+			return i;
+
+	return -1;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_get_back_buffer(struct gbm_surface *surface)
+{
+	int i;
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+
+	i = gbm_surface_find(surface, GBM_SURFACE_BUFFER_BACK);
+	if (i < 0)
+		i = gbm_surface_find(surface, GBM_SURFACE_BUFFER_FREE);
+
+	if (i >= 0) {
+		surface->state[i] = GBM_SURFACE_BUFFER_BACK;
+		bo = surface->bos[i];
+	}
+
+	pthread_mutex_unlock(&surface->lock);
+	return bo;
+}
+
 PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
 {
-	return NULL;
+	int i;
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+
+	i = gbm_surface_find(surface, GBM_SURFACE_BUFFER_BACK);
+	if (i >= 0) {
+		surface->state[i] = GBM_SURFACE_BUFFER_LOCKED;
+		bo = surface->bos[i];
+	}
+
+	pthread_mutex_unlock(&surface->lock);
+	return bo;
 }
 
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	size_t i;
+
+	pthread_mutex_lock(&surface->lock);
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		if (surface->bos[i] == bo && surface->state[i] == GBM_SURFACE_BUFFER_LOCKED)
+			surface->state[i] = GBM_SURFACE_BUFFER_FREE;
+
+	pthread_mutex_unlock(&surface->lock);
+}
+
+PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
+{
+	size_t i;
+	int count = 0;
+
+	pthread_mutex_lock(&surface->lock);
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		if (surface->state[i] == GBM_SURFACE_BUFFER_FREE)
+			count++;
+
+	pthread_mutex_unlock(&surface->lock);
+	return count;
+}
+
+/* The result recorded for a failed call, which not every path reports through errno. */
+static int gbm_record_error(void)
+{
+	return errno ? -errno : -EINVAL;
+}
+
+/* Ends the record of a call that created bo, or failed to if it is NULL. */
+static void gbm_record_end(struct gbm_device *gbm, struct drv_record *record, struct bo *bo)
+{
+	if (bo)
+		drv_record_bo(record, bo);
+
+	drv_record_end(gbm->drv, record, bo ? 0 : gbm_record_error());
 }
 
 static struct gbm_bo *gbm_bo_new(struct gbm_device *gbm, uint32_t format)
@@ -108,6 +307,8 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 				    uint32_t format, uint32_t usage)
 {
 	struct gbm_bo *bo;
+	struct drv_record record;
+	int recording;
 
 	if (!gbm_device_is_format_supported(gbm, format, usage))
 		return NULL;
@@ -117,7 +318,10 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 	if (!bo)
 		return NULL;
 
+	recording = drv_record_begin(gbm->drv, &record, DRV_RECORD_CREATE);
 	bo->bo = drv_bo_create(gbm->drv, width, height, format, gbm_convert_usage(usage));
+	if (recording)
+		gbm_record_end(gbm, &record, bo->bo);
 
 	if (!bo->bo) {
 		free(bo);
@@ -127,18 +331,71 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 	return bo;
 }
 
+PUBLIC int gbm_bo_create_array(struct gbm_device *gbm, uint32_t width, uint32_t height,
+				uint32_t format, uint32_t usage, uint32_t count, struct gbm_bo **bos)
+{
+	int ret, recording;
+	uint32_t i;
+	struct bo **drv_bos;
+	struct drv_record record;
+
+	if (!gbm_device_is_format_supported(gbm, format, usage))
+		return -EINVAL;
+
+	drv_bos = (struct bo **)calloc(count, sizeof(*drv_bos));
+	if (!drv_bos)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		bos[i] = gbm_bo_new(gbm, format);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto free_bos;
+		}
+	}
+
+	recording = drv_record_begin(gbm->drv, &record, DRV_RECORD_CREATE);
+	ret = drv_bo_create_batch(gbm->drv, width, height, format, gbm_convert_usage(usage), count,
+				  drv_bos);
+	if (ret)
+		goto free_bos;
+
+	if (recording)
+		drv_record_end_batch(gbm->drv, &record, drv_bos, count);
+
+	for (i = 0; i < count; i++)
+		bos[i]->bo = drv_bos[i];
+
+	free(drv_bos);
+	return 0;
+
+free_bos:
+	while (i--) {
+		free(bos[i]);
+		bos[i] = NULL;
+	}
+
+	free(drv_bos);
+	return ret;
+}
+
 PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 						   uint32_t height, uint32_t format,
 						   const uint64_t *modifiers, uint32_t count)
 {
 	struct gbm_bo *bo;
+	struct drv_record record;
+	int recording;
 
 	bo = gbm_bo_new(gbm, format);
 
 	if (!bo)
 		return NULL;
 
+	recording = drv_record_begin(gbm->drv, &record, DRV_RECORD_CREATE);
 	bo->bo = drv_bo_create_with_modifiers(gbm->drv, width, height, format, modifiers, count);
+	if (recording)
+		gbm_record_end(gbm, &record, bo->bo);
 
 	if (!bo->bo) {
 		free(bo);
@@ -150,13 +407,23 @@ PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint3
 
 PUBLIC void gbm_bo_destroy(struct gbm_bo *bo)
 {
+	struct drv_record record;
+	int recording;
+
 	if (bo->destroy_user_data) {
 		bo->destroy_user_data(bo, bo->user_data);
 		bo->destroy_user_data = NULL;
 		bo->user_data = NULL;
 	}
 
+	recording = drv_record_begin(bo->gbm->drv, &record, DRV_RECORD_DESTROY);
+	if (recording)
+		drv_record_bo(&record, bo->bo);
+
 	drv_bo_destroy(bo->bo);
+	if (recording)
+		drv_record_end(bo->gbm->drv, &record, 0);
+
 	free(bo);
 }
 
@@ -169,6 +436,8 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	struct gbm_import_fd_planar_data *fd_planar_data = buffer;
 	uint32_t gbm_format;
 	size_t num_planes, i;
+	struct drv_record record;
+	int recording;
 
 	memset(&drv_data, 0, sizeof(drv_data));
 	drv_data.use_flags = gbm_convert_usage(usage);
@@ -186,9 +455,10 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 		drv_data.width = fd_planar_data->width;
 		drv_data.height = fd_planar_data->height;
 		drv_data.format = fd_planar_data->format;
-		num_planes = drv_num_planes_from_format(drv_data.format);
-
-		assert(num_planes);
+		num_planes = drv_num_planes_from_modifier(gbm->drv, drv_data.format,
+							  fd_planar_data->format_modifiers[0]);
+		if (!num_planes)
+			return NULL;
 
 		for (i = 0; i < num_planes; i++) {
 			drv_data.fds[i] = fd_planar_data->fds[i];
@@ -213,7 +483,10 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	if (!bo)
 		return NULL;
 
+	recording = drv_record_begin(gbm->drv, &record, DRV_RECORD_IMPORT);
 	bo->bo = drv_bo_import(gbm->drv, &drv_data);
+	if (recording)
+		gbm_record_end(gbm, &record, bo->bo);
 
 	if (!bo->bo) {
 		free(bo);
@@ -229,14 +502,31 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 	void *addr;
 	off_t offset;
 	uint32_t map_flags;
+	struct drv_record record;
+	int recording;
 	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
 	if (!bo || width == 0 || height == 0 || !stride || !map_data)
 		return NULL;
 
 	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
 	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_DIRTY_RECT) ? BO_MAP_DIRTY_RECT : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_NONBLOCK) ? BO_MAP_NONBLOCK : BO_MAP_NONE;
 
+	recording = drv_record_begin(bo->gbm->drv, &record, DRV_RECORD_MAP);
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
+	if (recording) {
+		drv_record_bo(&record, bo->bo);
+		record.map_id = addr == MAP_FAILED ? 0 : (uintptr_t)*map_data;
+		record.x = x;
+		record.y = y;
+		record.width = width;
+		record.height = height;
+		record.map_flags = map_flags;
+		record.plane = plane;
+		drv_record_end(bo->gbm->drv, &record, addr == MAP_FAILED ? gbm_record_error() : 0);
+	}
+
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
@@ -249,8 +539,47 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 
 PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 {
+	struct drv_record record;
+	int ret, recording;
+
 	assert(bo);
-	drv_bo_flush_or_unmap(bo->bo, map_data);
+	recording = drv_record_begin(bo->gbm->drv, &record, DRV_RECORD_UNMAP);
+	ret = drv_bo_flush_or_unmap(bo->bo, map_data);
+	if (recording) {
+		drv_record_bo(&record, bo->bo);
+		record.map_id = (uintptr_t)map_data;
+		drv_record_end(bo->gbm->drv, &record, ret);
+	}
+}
+
+PUBLIC int gbm_bo_write_rect(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			     uint32_t height, const void *src, uint32_t src_stride, size_t plane)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	if (!bo || !src)
+		return -EINVAL;
+
+	return drv_bo_write_rect(bo->bo, plane, &rect, src, src_stride);
+}
+
+PUBLIC int gbm_bo_read_rect(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			    uint32_t height, void *dst, uint32_t dst_stride, size_t plane)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	if (!bo || !dst)
+		return -EINVAL;
+
+	return drv_bo_read_rect(bo->bo, plane, &rect, dst, dst_stride);
+}
+
+PUBLIC int gbm_bo_blit(struct gbm_bo *dst, struct gbm_bo *src, uint32_t x, uint32_t y,
+			uint32_t width, uint32_t height)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	if (!dst || !src)
+		return -EINVAL;
+
+	return drv_bo_copy(dst->bo, src->bo, &rect);
 }
 
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
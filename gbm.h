@@ -284,14 +284,137 @@ gbm_device_is_format_supported(struct gbm_device *gbm,
 void
 gbm_device_destroy(struct gbm_device *gbm);
 
+/*
+ * Stores up to count format modifiers that buffers of the given format can be
+ * created with for usage, the preferred ones first, and returns how many there
+ * are in total. Scanout and cursor usage only report modifiers the display
+ * planes accept. Pass a count of 0 to query the number of modifiers. (minigbm
+ * extension)
+ */
+int
+gbm_device_get_format_modifiers(struct gbm_device *gbm, uint32_t format,
+                                uint32_t usage, uint64_t *modifiers,
+                                uint32_t count);
+
+/*
+ * Keeps up to max_bytes of destroyed buffers, for at most max_age_ms (0 for
+ * no limit), so gbm_bo_create() can reuse them for the same width, height,
+ * format and flags. The contents of a reused buffer are undefined. Buffers
+ * that were exported with gbm_bo_get_fd() are never kept. A max_bytes of 0
+ * disables the pool.
+ */
+void
+gbm_device_set_bo_pool(struct gbm_device *gbm, uint64_t max_bytes,
+                       uint32_t max_age_ms);
+
+/* Releases all buffers kept by the pool, e.g. under memory pressure. */
+void
+gbm_device_trim_bo_pool(struct gbm_device *gbm);
+
+/*
+ * With enable set, gbm_bo_destroy() hands buffers that aren't kept by the
+ * pool to a reclaim thread, which unmaps and closes them, and returns right
+ * away. gbm_bo_create() may hand a queued buffer out again instead. Clearing
+ * enable waits for the queued buffers to be closed. Returns 0 or a negative
+ * errno. (minigbm extension)
+ */
+int
+gbm_device_set_async_destroy(struct gbm_device *gbm, int enable);
+
+/*
+ * Caps the bytes of live buffers, including the ones kept by the pool, at
+ * max_bytes (0 for no limit). A gbm_bo_create() that would go over it first
+ * releases the pool, and then fails with errno set to EDQUOT. Imported
+ * buffers are counted but never refused. (minigbm extension)
+ */
+void
+gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t max_bytes);
+
+/*
+ * Returns the bytes of all live buffers for a usage of 0, otherwise of the
+ * ones created or imported with that single GBM_BO_USE_* flag among their
+ * flags. (minigbm extension)
+ */
+uint64_t
+gbm_device_get_allocated_bytes(struct gbm_device *gbm, uint32_t usage);
+
+/*
+ * Caps the threads, counting the calling one, that CPU work on large buffers
+ * like detiling and cache flushes is split across. A max_threads of 1 keeps
+ * all of it in the calling thread, e.g. to save power. (minigbm extension)
+ */
+void
+gbm_device_set_max_threads(struct gbm_device *gbm, uint32_t max_threads);
+
+/*
+ * Writes a text summary of the device's buffer statistics: live buffers and
+ * bytes per format, mapping reuse, pool usage and the latency histograms of
+ * create, import, map, flush and destroy. Returns the length written, or
+ * -ENOSPC if buf was too small and the summary was truncated. (minigbm
+ * extension)
+ */
+int
+gbm_device_dump_stats(struct gbm_device *gbm, char *buf, size_t size);
+
+/*
+ * Records the buffer creations, imports, maps, unmaps and destroys of the
+ * device, with how long each took, to the log at path until called again with
+ * a NULL path. Setting MINIGBM_RECORD records every device of the process to
+ * a log of its own, that path with ".<pid>.<n>" appended. (minigbm extension)
+ */
+int
+gbm_device_record(struct gbm_device *gbm, const char *path);
+
+enum gbm_replay_op {
+   GBM_REPLAY_CREATE,
+   GBM_REPLAY_IMPORT,
+   GBM_REPLAY_MAP,
+   GBM_REPLAY_UNMAP,
+   GBM_REPLAY_DESTROY,
+};
+
+typedef void (*gbm_replay_callback)(void *data, uint32_t op, int result,
+                                    uint64_t recorded_ns, uint64_t replayed_ns);
+
+/*
+ * Replays a log of gbm_device_record() on the device, calling callback with
+ * the result and both latencies of each call. Returns the number of calls
+ * replayed, or a negative errno if the log can't be read. (minigbm extension)
+ */
+int
+gbm_device_replay(struct gbm_device *gbm, const char *path,
+                  gbm_replay_callback callback, void *data);
+
 struct gbm_device *
 gbm_create_device(int fd);
 
+/*
+ * Creates a device on the DRM device picked by selector: a node path,
+ * "pci:<vendor>:<device>" in hex, "driver:<name>", "scanout" for one that
+ * drives a display or "render" for one that doesn't. With a NULL selector,
+ * MINIGBM_DEVICE is used, and without that GBM_BO_USE_SCANOUT in usage
+ * prefers a device that drives a display. The DRM device is closed with the
+ * gbm device. (minigbm extension)
+ */
+struct gbm_device *
+gbm_create_device_for_usage(const char *selector, uint32_t usage);
+
 struct gbm_bo *
 gbm_bo_create(struct gbm_device *gbm,
               uint32_t width, uint32_t height,
               uint32_t format, uint32_t flags);
 
+/*
+ * Creates count identical buffers in one call, e.g. for a swapchain or a
+ * decoder pool. Either all of them are created or none is. Returns 0 or a
+ * negative errno.
+ */
+int
+gbm_bo_create_array(struct gbm_device *gbm,
+                    uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t flags,
+                    uint32_t count, struct gbm_bo **bos);
+
 struct gbm_bo *
 gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t width, uint32_t height,
@@ -350,6 +473,19 @@ enum gbm_bo_transfer_flags {
     * Read/modify/write
     */
    GBM_BO_TRANSFER_READ_WRITE = (GBM_BO_TRANSFER_READ | GBM_BO_TRANSFER_WRITE),
+   /**
+    * Only the mapped rectangle is written, so write back at unmap time can
+    * be limited to it (minigbm extension)
+    */
+   GBM_BO_TRANSFER_DIRTY_RECT = (1 << 2),
+   /**
+    * Fail with errno set to EAGAIN instead of waiting for the GPU to finish
+    * with the buffer. The dma-buf of the buffer becomes readable (for
+    * GBM_BO_TRANSFER_READ) or writable (for GBM_BO_TRANSFER_WRITE) once
+    * mapping it won't wait, so it can be polled before retrying (minigbm
+    * extension)
+    */
+   GBM_BO_TRANSFER_NONBLOCK = (1 << 3),
 };
 
 void *
@@ -360,6 +496,38 @@ gbm_bo_map(struct gbm_bo *bo,
 void
 gbm_bo_unmap(struct gbm_bo *bo, void *map_data);
 
+/*
+ * Copy a rectangle of a plane from or to linear memory with the given stride.
+ * The rectangle is in pixels of the first plane, as for gbm_bo_map(). These
+ * use streaming loads and stores where the CPU has them, so reading back
+ * write-combined buffers does not go through uncached loads. Returns 0 or a
+ * negative errno. (minigbm extension)
+ */
+int
+gbm_bo_write_rect(struct gbm_bo *bo,
+                  uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                  const void *src, uint32_t src_stride, size_t plane);
+
+int
+gbm_bo_read_rect(struct gbm_bo *bo,
+                 uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                 void *dst, uint32_t dst_stride, size_t plane);
+
+/*
+ * Copy a rectangle of all planes from src to dst. The GPU does the copy where
+ * the driver can, e.g. to detile into a linear buffer, and mapping dst waits
+ * for it. Other buffers are copied by the CPU. Returns 0 or a negative errno.
+ *
+ * Buffers of different formats are converted by the CPU, e.g. from YV12 to
+ * NV12 or from ABGR8888 to NV12, with the BT.601 limited range coefficients.
+ * NV12, NV21, YV12 and the 32-bit RGB formats convert into each other, except
+ * RGB into RGB, and the rectangle has to start at even coordinates.
+ * (minigbm extension)
+ */
+int
+gbm_bo_blit(struct gbm_bo *dst, struct gbm_bo *src,
+            uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
 uint32_t
 gbm_bo_get_width(struct gbm_bo *bo);
 
@@ -424,12 +592,25 @@ gbm_surface_create(struct gbm_device *gbm,
                    uint32_t width, uint32_t height,
 		   uint32_t format, uint32_t flags);
 
+/*
+ * Returns the buffer to render the next frame into, the same one until it is
+ * locked as the front buffer. Returns NULL if all buffers are locked.
+ * (minigbm extension)
+ */
+struct gbm_bo *
+gbm_surface_get_back_buffer(struct gbm_surface *surface);
+
+/*
+ * Makes the current back buffer the front buffer and locks it, e.g. for a
+ * page flip. Returns NULL if no back buffer was taken since the last call.
+ */
 struct gbm_bo *
 gbm_surface_lock_front_buffer(struct gbm_surface *surface);
 
 void
 gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo);
 
+/* Returns the number of buffers that are neither locked nor the back buffer. */
 int
 gbm_surface_has_free_buffers(struct gbm_surface *surface);
 
@@ -7,6 +7,7 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +19,19 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+#define GBM_SURFACE_NUM_BUFFERS 3
+
+enum gbm_surface_buffer_state {
+	GBM_SURFACE_BUFFER_FREE = 0,
+	GBM_SURFACE_BUFFER_BACK,
+	GBM_SURFACE_BUFFER_LOCKED,
+};
+
 struct gbm_surface {
+	/* Protects state, buffers are usually released from a page flip handler. */
+	pthread_mutex_t lock;
+	struct gbm_bo *bos[GBM_SURFACE_NUM_BUFFERS];
+	enum gbm_surface_buffer_state state[GBM_SURFACE_NUM_BUFFERS];
 };
 
 struct gbm_bo {
@@ -9,148 +9,179 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include "drv_priv.h"
+#include "drv_trace.h"
 #include "helpers.h"
 #include "util.h"
 
-struct planar_layout {
-	size_t num_planes;
-	int horizontal_subsampling[DRV_MAX_PLANES];
-	int vertical_subsampling[DRV_MAX_PLANES];
-	int bytes_per_pixel[DRV_MAX_PLANES];
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+#define DRV_HUGEPAGE_SIZE (2 * 1024 * 1024)
+/* Below this, rounding up to a huge page could waste more than an eighth of the allocation. */
+#define DRV_HUGEPAGE_MIN_ALLOC (8 * DRV_HUGEPAGE_SIZE)
+
+enum drv_layout_id {
+	LAYOUT_NONE,
+	LAYOUT_PACKED_1BPP,
+	LAYOUT_PACKED_2BPP,
+	LAYOUT_PACKED_3BPP,
+	LAYOUT_PACKED_4BPP,
+	LAYOUT_BIPLANAR_YUV_420,
+	LAYOUT_TRIPLANAR_YUV_420,
 };
 
 // clang-format off
 
-static const struct planar_layout packed_1bpp_layout = {
-	.num_planes = 1,
-	.horizontal_subsampling = { 1 },
-	.vertical_subsampling = { 1 },
-	.bytes_per_pixel = { 1 }
+static const struct drv_format_layout layouts[] = {
+	[LAYOUT_PACKED_1BPP] = {
+		.num_planes = 1,
+		.horizontal_subsampling = { 1 },
+		.vertical_subsampling = { 1 },
+		.stride_subsampling = { 1 },
+		.bytes_per_pixel = { 1 }
+	},
+	[LAYOUT_PACKED_2BPP] = {
+		.num_planes = 1,
+		.horizontal_subsampling = { 1 },
+		.vertical_subsampling = { 1 },
+		.stride_subsampling = { 1 },
+		.bytes_per_pixel = { 2 }
+	},
+	[LAYOUT_PACKED_3BPP] = {
+		.num_planes = 1,
+		.horizontal_subsampling = { 1 },
+		.vertical_subsampling = { 1 },
+		.stride_subsampling = { 1 },
+		.bytes_per_pixel = { 3 }
+	},
+	[LAYOUT_PACKED_4BPP] = {
+		.num_planes = 1,
+		.horizontal_subsampling = { 1 },
+		.vertical_subsampling = { 1 },
+		.stride_subsampling = { 1 },
+		.bytes_per_pixel = { 4 }
+	},
+	[LAYOUT_BIPLANAR_YUV_420] = {
+		.num_planes = 2,
+		.horizontal_subsampling = { 1, 2 },
+		.vertical_subsampling = { 1, 2 },
+		.stride_subsampling = { 1, 1 },
+		.bytes_per_pixel = { 1, 2 }
+	},
+	[LAYOUT_TRIPLANAR_YUV_420] = {
+		.num_planes = 3,
+		.horizontal_subsampling = { 1, 2, 2 },
+		.vertical_subsampling = { 1, 2, 2 },
+		.stride_subsampling = { 1, 2, 2 },
+		.bytes_per_pixel = { 1, 1, 1 }
+	},
 };
 
-static const struct planar_layout packed_2bpp_layout = {
-	.num_planes = 1,
-	.horizontal_subsampling = { 1 },
-	.vertical_subsampling = { 1 },
-	.bytes_per_pixel = { 2 }
-};
-
-static const struct planar_layout packed_3bpp_layout = {
-	.num_planes = 1,
-	.horizontal_subsampling = { 1 },
-	.vertical_subsampling = { 1 },
-	.bytes_per_pixel = { 3 }
-};
-
-static const struct planar_layout packed_4bpp_layout = {
-	.num_planes = 1,
-	.horizontal_subsampling = { 1 },
-	.vertical_subsampling = { 1 },
-	.bytes_per_pixel = { 4 }
+/*
+ * The formats are looked up in a table indexed by a multiplicative hash of the fourcc. The
+ * multiplier was picked by searching odd numbers until every format below landed in its own slot,
+ * so a lookup is one multiply and one compare. A format added later that collides would override
+ * an existing slot, so that is made a compile error below; search for a new multiplier then.
+ */
+#define FORMAT_HASH_BITS 7
+#define FORMAT_HASH_MULTIPLIER 1608151u
+#define FORMAT_HASH(format) ((uint32_t)((format)*FORMAT_HASH_MULTIPLIER) >> (32 - FORMAT_HASH_BITS))
+
+#define FORMAT_LAYOUT(format, layout) [FORMAT_HASH(format)] = { (format), (layout) }
+
+/* Not part of -Wall, and clang takes it as an alias of -Winitializer-overrides. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct {
+	uint32_t format;
+	uint32_t layout;
+} format_layouts[1 << FORMAT_HASH_BITS] = {
+	FORMAT_LAYOUT(DRM_FORMAT_BGR233,         LAYOUT_PACKED_1BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_C8,             LAYOUT_PACKED_1BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_R8,             LAYOUT_PACKED_1BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGB332,         LAYOUT_PACKED_1BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_YVU420,         LAYOUT_TRIPLANAR_YUV_420),
+	FORMAT_LAYOUT(DRM_FORMAT_YVU420_ANDROID, LAYOUT_TRIPLANAR_YUV_420),
+	FORMAT_LAYOUT(DRM_FORMAT_NV12,           LAYOUT_BIPLANAR_YUV_420),
+	FORMAT_LAYOUT(DRM_FORMAT_NV21,           LAYOUT_BIPLANAR_YUV_420),
+	FORMAT_LAYOUT(DRM_FORMAT_ABGR1555,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ABGR4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ARGB1555,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ARGB4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGR565,         LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRA4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRA5551,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRX4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRX5551,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_GR88,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RG88,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGB565,         LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBA4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBA5551,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBX4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBX5551,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_UYVY,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_VYUY,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XBGR1555,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XBGR4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XRGB1555,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XRGB4444,       LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_YUYV,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_YVYU,           LAYOUT_PACKED_2BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGR888,         LAYOUT_PACKED_3BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGB888,         LAYOUT_PACKED_3BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ABGR2101010,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ABGR8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ARGB2101010,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_ARGB8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_AYUV,           LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRA1010102,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRA8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRX1010102,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_BGRX8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBA1010102,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBA8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBX1010102,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_RGBX8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XBGR2101010,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XBGR8888,       LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XRGB2101010,    LAYOUT_PACKED_4BPP),
+	FORMAT_LAYOUT(DRM_FORMAT_XRGB8888,       LAYOUT_PACKED_4BPP),
 };
 
-static const struct planar_layout biplanar_yuv_420_layout = {
-	.num_planes = 2,
-	.horizontal_subsampling = { 1, 2 },
-	.vertical_subsampling = { 1, 2 },
-	.bytes_per_pixel = { 1, 2 }
-};
-
-static const struct planar_layout triplanar_yuv_420_layout = {
-	.num_planes = 3,
-	.horizontal_subsampling = { 1, 2, 2 },
-	.vertical_subsampling = { 1, 2, 2 },
-	.bytes_per_pixel = { 1, 1, 1 }
-};
+#pragma GCC diagnostic pop
 
 // clang-format on
 
-static const struct planar_layout *layout_from_format(uint32_t format)
-{
-	switch (format) {
-	case DRM_FORMAT_BGR233:
-	case DRM_FORMAT_C8:
-	case DRM_FORMAT_R8:
-	case DRM_FORMAT_RGB332:
-		return &packed_1bpp_layout;
-
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return &triplanar_yuv_420_layout;
-
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_NV21:
-		return &biplanar_yuv_420_layout;
-
-	case DRM_FORMAT_ABGR1555:
-	case DRM_FORMAT_ABGR4444:
-	case DRM_FORMAT_ARGB1555:
-	case DRM_FORMAT_ARGB4444:
-	case DRM_FORMAT_BGR565:
-	case DRM_FORMAT_BGRA4444:
-	case DRM_FORMAT_BGRA5551:
-	case DRM_FORMAT_BGRX4444:
-	case DRM_FORMAT_BGRX5551:
-	case DRM_FORMAT_GR88:
-	case DRM_FORMAT_RG88:
-	case DRM_FORMAT_RGB565:
-	case DRM_FORMAT_RGBA4444:
-	case DRM_FORMAT_RGBA5551:
-	case DRM_FORMAT_RGBX4444:
-	case DRM_FORMAT_RGBX5551:
-	case DRM_FORMAT_UYVY:
-	case DRM_FORMAT_VYUY:
-	case DRM_FORMAT_XBGR1555:
-	case DRM_FORMAT_XBGR4444:
-	case DRM_FORMAT_XRGB1555:
-	case DRM_FORMAT_XRGB4444:
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-		return &packed_2bpp_layout;
-
-	case DRM_FORMAT_BGR888:
-	case DRM_FORMAT_RGB888:
-		return &packed_3bpp_layout;
-
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_ARGB2101010:
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_AYUV:
-	case DRM_FORMAT_BGRA1010102:
-	case DRM_FORMAT_BGRA8888:
-	case DRM_FORMAT_BGRX1010102:
-	case DRM_FORMAT_BGRX8888:
-	case DRM_FORMAT_RGBA1010102:
-	case DRM_FORMAT_RGBA8888:
-	case DRM_FORMAT_RGBX1010102:
-	case DRM_FORMAT_RGBX8888:
-	case DRM_FORMAT_XBGR2101010:
-	case DRM_FORMAT_XBGR8888:
-	case DRM_FORMAT_XRGB2101010:
-	case DRM_FORMAT_XRGB8888:
-		return &packed_4bpp_layout;
-
-	default:
+const struct drv_format_layout *drv_get_format_layout(uint32_t format)
+{
+	uint32_t slot = FORMAT_HASH(format);
+
+	if (format_layouts[slot].format != format || !format_layouts[slot].layout) {
 		drv_log("UNKNOWN FORMAT %d\n", format);
 		return NULL;
 	}
+
+	return &layouts[format_layouts[slot].layout];
 }
 
 size_t drv_num_planes_from_format(uint32_t format)
 {
-	const struct planar_layout *layout = layout_from_format(format);
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
 
 	/*
 	 * drv_bo_new calls this function early to query number of planes and
 	 * considers 0 planes to mean unknown format, so we have to support
-	 * that.  All other layout_from_format() queries can assume that the
+	 * that.  All other drv_get_format_layout() queries can assume that the
 	 * format is supported and that the return value is non-NULL.
 	 */
 
@@ -159,7 +190,7 @@ size_t drv_num_planes_from_format(uint32_t format)
 
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane)
 {
-	const struct planar_layout *layout = layout_from_format(format);
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
 
 	assert(plane < layout->num_planes);
 
@@ -168,7 +199,7 @@ uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane)
 
 uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane)
 {
-	const struct planar_layout *layout = layout_from_format(format);
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
 
 	assert(plane < layout->num_planes);
 
@@ -180,7 +211,7 @@ uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane)
  */
 uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane)
 {
-	const struct planar_layout *layout = layout_from_format(format);
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
 	assert(plane < layout->num_planes);
 
 	uint32_t plane_width = DIV_ROUND_UP(width, layout->horizontal_subsampling[plane]);
@@ -196,23 +227,33 @@ uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane)
 	return stride;
 }
 
-uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane)
+/*
+ * Converts a rectangle in pixels of the first plane into the rows and the byte range within each
+ * row that it covers in the given plane.
+ */
+void drv_rect_to_plane(uint32_t format, size_t plane, const struct rectangle *rect,
+		       struct rectangle *out)
 {
-	return stride * drv_height_from_format(format, height, plane);
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
+	uint32_t hsub, vsub, bpp, x1, y1;
+
+	assert(plane < layout->num_planes);
+
+	hsub = layout->horizontal_subsampling[plane];
+	vsub = layout->vertical_subsampling[plane];
+	bpp = layout->bytes_per_pixel[plane];
+
+	x1 = DIV_ROUND_UP(rect->x + rect->width, hsub) * bpp;
+	y1 = DIV_ROUND_UP(rect->y + rect->height, vsub);
+	out->x = rect->x / hsub * bpp;
+	out->y = rect->y / vsub;
+	out->width = x1 - out->x;
+	out->height = y1 - out->y;
 }
 
-static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
+uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane)
 {
-	if (plane != 0) {
-		switch (format) {
-		case DRM_FORMAT_YVU420:
-		case DRM_FORMAT_YVU420_ANDROID:
-			stride = DIV_ROUND_UP(stride, 2);
-			break;
-		}
-	}
-
-	return stride;
+	return stride * drv_height_from_format(format, height, plane);
 }
 
 /*
@@ -223,11 +264,11 @@ static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format)
 {
 
-	size_t p, num_planes;
+	size_t p;
 	uint32_t offset = 0;
+	const struct drv_format_layout *layout = drv_get_format_layout(format);
 
-	num_planes = drv_num_planes_from_format(format);
-	assert(num_planes);
+	assert(layout);
 
 	/*
 	 * HAL_PIXEL_FORMAT_YV12 requires that (see <system/graphics.h>):
@@ -240,9 +281,10 @@ int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 		assert(stride == ALIGN(stride, 32));
 	}
 
-	for (p = 0; p < num_planes; p++) {
-		bo->strides[p] = subsample_stride(stride, format, p);
-		bo->sizes[p] = drv_size_from_format(format, bo->strides[p], aligned_height, p);
+	for (p = 0; p < layout->num_planes; p++) {
+		bo->strides[p] = DIV_ROUND_UP(stride, layout->stride_subsampling[p]);
+		bo->sizes[p] =
+		    bo->strides[p] * DIV_ROUND_UP(aligned_height, layout->vertical_subsampling[p]);
 		bo->offsets[p] = offset;
 		offset += bo->sizes[p];
 	}
@@ -276,7 +318,7 @@ int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 	memset(&create_dumb, 0, sizeof(create_dumb));
 	create_dumb.height = aligned_height;
 	create_dumb.width = aligned_width;
-	create_dumb.bpp = layout_from_format(format)->bytes_per_pixel[0] * 8;
+	create_dumb.bpp = drv_get_format_layout(format)->bytes_per_pixel[0] * 8;
 	create_dumb.flags = 0;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
@@ -342,8 +384,9 @@ int drv_gem_bo_destroy(struct bo *bo)
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
 	int ret;
-	size_t plane;
+	size_t plane, i;
 	struct drm_prime_handle prime_handle;
+	struct drm_gem_close gem_close;
 
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		memset(&prime_handle, 0, sizeof(prime_handle));
@@ -368,10 +411,23 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 		bo->handles[plane].u32 = prime_handle.handle;
 	}
 
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		pthread_mutex_lock(&bo->drv->driver_lock);
-		drv_increment_reference_count(bo->drv, bo, plane);
-		pthread_mutex_unlock(&bo->drv->driver_lock);
+	ret = drv_bo_acquire_references(bo);
+	if (ret) {
+		/* Only close the handles that no other bo holds, each once. */
+		for (plane = 0; plane < bo->num_planes; plane++) {
+			for (i = 0; i < plane; i++)
+				if (bo->handles[i].u32 == bo->handles[plane].u32)
+					break;
+
+			if (i < plane || drv_get_reference_count(bo->drv, bo, plane))
+				continue;
+
+			memset(&gem_close, 0, sizeof(gem_close));
+			gem_close.handle = bo->handles[plane].u32;
+			drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
+
+		return ret;
 	}
 
 	return 0;
@@ -380,7 +436,6 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
-	size_t i;
 	struct drm_mode_map_dumb map_dumb;
 
 	memset(&map_dumb, 0, sizeof(map_dumb));
@@ -392,17 +447,83 @@ void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map
 		return MAP_FAILED;
 	}
 
+	/* Dumb buffers are shmem backed on most drivers, where the hint gets them huge pages. */
+	vma->length = drv_bo_handle_length(bo, plane);
+	return drv_mmap(vma->length, map_flags, bo->drv->fd, map_dumb.offset, true);
+}
+
+int drv_bo_munmap(struct bo *bo, struct vma *vma)
+{
+	return munmap(vma->addr, vma->length);
+}
+
+/* Returns the first plane of bo that lives in the same GEM object as plane. */
+size_t drv_bo_first_plane_of_handle(struct bo *bo, size_t plane)
+{
+	size_t i;
+
+	for (i = 0; i < plane; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			return i;
+
+	return plane;
+}
+
+/* Returns how much of the GEM object of plane a mapping needs to cover every plane in it. */
+size_t drv_bo_handle_length(struct bo *bo, size_t plane)
+{
+	size_t i, length = 0;
+
 	for (i = 0; i < bo->num_planes; i++)
 		if (bo->handles[i].u32 == bo->handles[plane].u32)
-			vma->length += bo->sizes[i];
+			length = MAX(length, (size_t)bo->offsets[i] + bo->sizes[i]);
 
-	return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    map_dumb.offset);
+	return length;
 }
 
-int drv_bo_munmap(struct bo *bo, struct vma *vma)
+struct drv_shard *drv_get_shard(struct driver *drv, uint32_t handle)
 {
-	return munmap(vma->addr, vma->length);
+	return &drv->shards[handle % DRV_NUM_SHARDS];
+}
+
+static uint32_t drv_bo_shard_mask(struct bo *bo)
+{
+	uint32_t mask = 0;
+	size_t plane;
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		mask |= 1u << (bo->handles[plane].u32 % DRV_NUM_SHARDS);
+
+	return mask;
+}
+
+void drv_bo_lock_shards(struct bo *bo)
+{
+	uint32_t i, mask = drv_bo_shard_mask(bo);
+
+	/* Always lock in ascending order so that bos sharing handles can't deadlock. */
+	for (i = 0; i < DRV_NUM_SHARDS; i++)
+		if (mask & (1u << i))
+			pthread_mutex_lock(&bo->drv->shards[i].lock);
+}
+
+void drv_bo_unlock_shards(struct bo *bo)
+{
+	uint32_t i, mask = drv_bo_shard_mask(bo);
+
+	for (i = 0; i < DRV_NUM_SHARDS; i++)
+		if (mask & (1u << i))
+			pthread_mutex_unlock(&bo->drv->shards[i].lock);
+}
+
+struct drv_array *drv_get_mappings(struct driver *drv, uint32_t handle)
+{
+	void *mappings;
+
+	if (drmHashLookup(drv_get_shard(drv, handle)->mappings, handle, &mappings))
+		return NULL;
+
+	return mappings;
 }
 
 int drv_mapping_destroy(struct bo *bo)
@@ -410,6 +531,7 @@ int drv_mapping_destroy(struct bo *bo)
 	int ret;
 	size_t plane;
 	struct mapping *mapping;
+	struct drv_array *mappings;
 	uint32_t idx;
 
 	/*
@@ -417,17 +539,17 @@ int drv_mapping_destroy(struct bo *bo)
 	 * associated with the buffer.
 	 */
 
-	idx = 0;
 	for (plane = 0; plane < bo->num_planes; plane++) {
-		while (idx < drv_array_size(bo->drv->mappings)) {
-			mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, idx);
-			if (mapping->vma->handle != bo->handles[plane].u32) {
-				idx++;
-				continue;
-			}
+		mappings = drv_get_mappings(bo->drv, bo->handles[plane].u32);
+		if (!mappings)
+			continue;
 
+		while ((idx = drv_array_size(mappings))) {
+			mapping = (struct mapping *)drv_array_at_idx(mappings, idx - 1);
 			if (!--mapping->vma->refcount) {
-				ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
+				DRV_TRACE_BEGIN("backend bo_unmap");
+				ret = drv_bo_cpu_backend(bo)->bo_unmap(bo, mapping->vma);
+				DRV_TRACE_END();
 				if (ret) {
 					drv_log("munmap failed\n");
 					return ret;
@@ -436,9 +558,12 @@ int drv_mapping_destroy(struct bo *bo)
 				free(mapping->vma);
 			}
 
-			/* This shrinks and shifts the array, so don't increment idx. */
-			drv_array_remove(bo->drv->mappings, idx);
+			drv_array_remove(mappings, idx - 1);
 		}
+
+		drmHashDelete(drv_get_shard(bo->drv, bo->handles[plane].u32)->mappings,
+			      bo->handles[plane].u32);
+		drv_array_destroy(mappings);
 	}
 
 	return 0;
@@ -449,34 +574,272 @@ int drv_get_prot(uint32_t map_flags)
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+/*
+ * Polls a dma-buf without waiting. It is readable once the last write to it is done, and writable
+ * once all access to it is, which is what the CPU has to wait for to read or to write it. Returns
+ * 1 if that would take waiting, 0 if not, or a negative errno.
+ */
+int drv_dmabuf_busy(int fd, uint32_t map_flags)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = (map_flags & BO_MAP_WRITE) ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, 0);
+	if (ret < 0)
+		return -errno;
+
+	return !(pfd.revents & pfd.events);
+}
+
+/* Rounds the size of a large allocation up to whole huge pages, so its last one can be huge too. */
+size_t drv_hugepage_align(size_t size)
+{
+	return size >= DRV_HUGEPAGE_MIN_ALLOC ? ALIGN(size, DRV_HUGEPAGE_SIZE) : size;
+}
+
+/* Asks for transparent huge pages on a mapping of shmem backed memory, which is only a hint. */
+void drv_advise_hugepage(void *addr, size_t length)
+{
+	if (length >= DRV_HUGEPAGE_SIZE)
+		madvise(addr, length, MADV_HUGEPAGE);
+}
+
+/*
+ * Maps length bytes of fd like mmap(), but places mappings of a huge page or more at a huge page
+ * aligned address, which is what lets the kernel back them with huge pages at all. That takes
+ * reserving a huge page more of address space and trimming it around the mapping. thp is set when
+ * the memory is shmem backed and can take the MADV_HUGEPAGE hint.
+ */
+void *drv_mmap(size_t length, uint32_t map_flags, int fd, off_t offset, bool thp)
+{
+	uint8_t *reserved, *aligned, *end;
+	size_t reserved_length;
+	void *addr;
+	int prot = drv_get_prot(map_flags);
+
+	if (length < DRV_HUGEPAGE_SIZE)
+		return mmap(0, length, prot, MAP_SHARED, fd, offset);
+
+	reserved_length = ALIGN(length, (size_t)getpagesize()) + DRV_HUGEPAGE_SIZE;
+	reserved = mmap(0, reserved_length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1, 0);
+	if (reserved == MAP_FAILED)
+		return mmap(0, length, prot, MAP_SHARED, fd, offset);
+
+	aligned = (uint8_t *)ALIGN((uintptr_t)reserved, DRV_HUGEPAGE_SIZE);
+	addr = mmap(aligned, length, prot, MAP_SHARED | MAP_FIXED, fd, offset);
+	if (addr == MAP_FAILED) {
+		munmap(reserved, reserved_length);
+		return MAP_FAILED;
+	}
+
+	end = aligned + ALIGN(length, (size_t)getpagesize());
+	if (aligned > reserved)
+		munmap(reserved, aligned - reserved);
+	if (reserved + reserved_length > end)
+		munmap(end, reserved + reserved_length - end);
+
+	if (thp)
+		drv_advise_hugepage(addr, length);
+
+	return addr;
+}
+
+int drv_init_reference_counts(struct driver *drv)
+{
+	return pthread_mutex_init(&drv->refcounts.lock, NULL) ? -ENOMEM : 0;
+}
+
+void drv_destroy_reference_counts(struct driver *drv)
+{
+	size_t i, j;
+	void **mids;
+
+	for (i = 0; i < ARRAY_SIZE(drv->refcounts.nodes); i++) {
+		mids = drv->refcounts.nodes[i];
+		if (!mids)
+			continue;
+
+		for (j = 0; j < (1 << DRV_REFCOUNT_MID_BITS); j++)
+			free(mids[j]);
+
+		free(mids);
+	}
+
+	pthread_mutex_destroy(&drv->refcounts.lock);
+}
+
+static void *drv_get_refcount_node(void **slot, size_t size, bool create)
+{
+	void *expected = NULL;
+	void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+	if (node || !create)
+		return node;
+
+	node = calloc(1, size);
+	if (!node)
+		return NULL;
+
+	/* Another thread may have installed the node in the meantime. */
+	if (!__atomic_compare_exchange_n(slot, &expected, node, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		free(node);
+		node = expected;
+	}
+
+	return node;
+}
+
+static uint32_t *drv_get_refcount(struct driver *drv, uint32_t handle, bool create)
+{
+	void **mids;
+	uint32_t *counts;
+	uint32_t top = handle >> (DRV_REFCOUNT_MID_BITS + DRV_REFCOUNT_LEAF_BITS);
+	uint32_t mid = (handle >> DRV_REFCOUNT_LEAF_BITS) & ((1 << DRV_REFCOUNT_MID_BITS) - 1);
+	uint32_t leaf = handle & ((1 << DRV_REFCOUNT_LEAF_BITS) - 1);
+
+	mids = drv_get_refcount_node(&drv->refcounts.nodes[top],
+				     sizeof(void *) << DRV_REFCOUNT_MID_BITS, create);
+	if (!mids)
+		return NULL;
+
+	counts = drv_get_refcount_node(&mids[mid], sizeof(uint32_t) << DRV_REFCOUNT_LEAF_BITS,
+				       create);
+	if (!counts)
+		return NULL;
+
+	return &counts[leaf];
+}
+
+/*
+ * Returns how many planes of the bo use the handle of the given plane, or 0 if an earlier plane
+ * already uses it. This way each distinct handle is adjusted with a single atomic operation.
+ */
+static uint32_t drv_bo_handle_uses(struct bo *bo, size_t plane)
+{
+	size_t i;
+	uint32_t uses = 1;
+
+	for (i = 0; i < plane; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			return 0;
+
+	for (i = plane + 1; i < bo->num_planes; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			uses++;
+
+	return uses;
+}
+
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	void *count;
-	uintptr_t num = 0;
+	uint32_t *count = drv_get_refcount(drv, bo->handles[plane].u32, false);
 
-	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
-		num = (uintptr_t)(count);
+	return count ? __atomic_load_n(count, __ATOMIC_ACQUIRE) : 0;
+}
 
-	return num;
+/* Drops uses references of a handle, never below zero. Returns the references left. */
+static uint32_t drv_release_handle_references(uint32_t handle, uint32_t *count, uint32_t uses)
+{
+	uint32_t left, old = __atomic_load_n(count, __ATOMIC_RELAXED);
+
+	do {
+		left = old > uses ? old - uses : 0;
+	} while (!__atomic_compare_exchange_n(count, &old, left, true, __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+
+	if (old < uses)
+		drv_log("Released more references than were taken (handle=%x)\n", handle);
+
+	return left;
 }
 
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+int drv_bo_acquire_references(struct bo *bo)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	size_t plane;
+	uint32_t uses, *count;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		uses = drv_bo_handle_uses(bo, plane);
+		if (!uses)
+			continue;
+
+		count = drv_get_refcount(bo->drv, bo->handles[plane].u32, true);
+		if (!count) {
+			drv_log("Failed to allocate reference count (handle=%x)\n",
+				bo->handles[plane].u32);
+			goto release;
+		}
+
+		__atomic_add_fetch(count, uses, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+
+release:
+	/* The counts of the earlier planes exist, they were just incremented. */
+	while (plane--) {
+		uses = drv_bo_handle_uses(bo, plane);
+		if (uses)
+			drv_release_handle_references(
+			    bo->handles[plane].u32,
+			    drv_get_refcount(bo->drv, bo->handles[plane].u32, false), uses);
+	}
+
+	return -ENOMEM;
+}
+
+uintptr_t drv_bo_release_references(struct bo *bo)
+{
+	size_t plane;
+	uintptr_t total = 0;
+	uint32_t uses, num_handles = 0, *count;
+	struct driver *drv = bo->drv;
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		if (drv_bo_handle_uses(bo, plane))
+			num_handles++;
+
+	/*
+	 * If two bos with the same set of handles were released concurrently, each could drop a
+	 * different handle to zero and neither would see a total of zero.
+	 */
+	if (num_handles > 1)
+		pthread_mutex_lock(&drv->refcounts.lock);
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		uses = drv_bo_handle_uses(bo, plane);
+		if (!uses)
+			continue;
+
+		count = drv_get_refcount(drv, bo->handles[plane].u32, false);
+		if (count)
+			total += drv_release_handle_references(bo->handles[plane].u32, count, uses);
+	}
+
+	if (num_handles > 1)
+		pthread_mutex_unlock(&drv->refcounts.lock);
 
-	/* If a value isn't in the table, drmHashDelete is a no-op */
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
-	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+	return total;
 }
 
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+bool drv_bo_handles_shared(struct bo *bo)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	size_t plane;
+	uint32_t uses;
 
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		uses = drv_bo_handle_uses(bo, plane);
+		if (uses && drv_get_reference_count(bo->drv, bo, plane) != uses)
+			return true;
+	}
 
-	if (num > 0)
-		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
+	return false;
 }
 
 uint32_t drv_log_base2(uint32_t value)
@@ -517,12 +880,68 @@ void drv_modify_combination(struct driver *drv, uint32_t format, struct format_m
 	}
 }
 
-struct drv_array *drv_query_kms(struct driver *drv)
+static void drv_add_kms_item(struct drv_array *kms_items, uint32_t format, uint64_t modifier,
+			     uint64_t use_flag)
+{
+	uint32_t i;
+	struct kms_item *item;
+	struct kms_item new_item = { .format = format,
+				     .modifier = modifier,
+				     .use_flags = use_flag };
+
+	for (i = 0; i < drv_array_size(kms_items); i++) {
+		item = drv_array_at_idx(kms_items, i);
+		if (item->format == format && item->modifier == modifier) {
+			item->use_flags |= use_flag;
+			return;
+		}
+	}
+
+	drv_array_append(kms_items, &new_item);
+}
+
+/*
+ * Adds the (format, modifier) pairs of an IN_FORMATS blob. Each modifier comes with a bitmask
+ * selecting up to 64 formats of the format list, starting at its offset.
+ */
+static bool drv_add_kms_in_formats(struct driver *drv, struct drv_array *kms_items,
+				   uint32_t blob_id, uint64_t use_flag)
+{
+	uint32_t i, j, index;
+	drmModePropertyBlobPtr blob;
+	const struct drm_format_modifier_blob *header;
+	const struct drm_format_modifier *modifiers;
+	const uint32_t *formats;
+
+	blob = drmModeGetPropertyBlob(drv->fd, blob_id);
+	if (!blob)
+		return false;
+
+	header = blob->data;
+	formats = (const uint32_t *)((const char *)header + header->formats_offset);
+	modifiers = (const struct drm_format_modifier *)((const char *)header +
+							 header->modifiers_offset);
+
+	for (i = 0; i < header->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			index = modifiers[i].offset + j;
+			if (!(modifiers[i].formats & (1ull << j)) || index >= header->count_formats)
+				continue;
+
+			drv_add_kms_item(kms_items, formats[index], modifiers[i].modifier,
+					 use_flag);
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return true;
+}
+
+static struct drv_array *drv_walk_kms_planes(struct driver *drv)
 {
 	struct drv_array *kms_items;
-	uint64_t plane_type = UINT64_MAX;
-        uint64_t use_flag;
-	uint32_t i, j, k;
+	uint64_t plane_type, use_flag;
+	uint32_t i, j, in_formats;
 
 	drmModePlanePtr plane;
 	drmModePropertyPtr prop;
@@ -531,7 +950,7 @@ struct drv_array *drv_query_kms(struct driver *drv)
 
 	kms_items = drv_array_init(sizeof(struct kms_item));
 	if (!kms_items)
-		goto out;
+		return NULL;
 
 	/*
 	 * The ability to return universal planes is only complete on
@@ -545,23 +964,28 @@ struct drv_array *drv_query_kms(struct driver *drv)
 
 	resources = drmModeGetPlaneResources(drv->fd);
 	if (!resources)
-		goto out;
+		return kms_items;
 
 	for (i = 0; i < resources->count_planes; i++) {
 		plane = drmModeGetPlane(drv->fd, resources->planes[i]);
 		if (!plane)
-			goto out;
+			break;
 
 		props = drmModeObjectGetProperties(drv->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
-		if (!props)
-			goto out;
+		if (!props) {
+			drmModeFreePlane(plane);
+			break;
+		}
 
+		plane_type = DRM_PLANE_TYPE_OVERLAY;
+		in_formats = 0;
 		for (j = 0; j < props->count_props; j++) {
 			prop = drmModeGetProperty(drv->fd, props->props[j]);
 			if (prop) {
-				if (strcmp(prop->name, "type") == 0) {
+				if (strcmp(prop->name, "type") == 0)
 					plane_type = props->prop_values[j];
-				}
+				else if (strcmp(prop->name, "IN_FORMATS") == 0)
+					in_formats = props->prop_values[j];
 
 				drmModeFreeProperty(prop);
 			}
@@ -577,27 +1001,16 @@ struct drv_array *drv_query_kms(struct driver *drv)
 			break;
 		default:
 			assert(0);
+			use_flag = BO_USE_NONE;
 		}
 
-		for (j = 0; j < plane->count_formats; j++) {
-			bool found = false;
-			for (k = 0; k < drv_array_size(kms_items); k++) {
-				struct kms_item *item = drv_array_at_idx(kms_items, k);
-				if (item->format == plane->formats[j] &&
-				    item->modifier == DRM_FORMAT_MOD_LINEAR) {
-					item->use_flags |= use_flag;
-					found = true;
-					break;
-				}
-			}
-
-			if (!found) {
-				struct kms_item item = { .format = plane->formats[j],
-							 .modifier = DRM_FORMAT_MOD_LINEAR,
-							 .use_flags = use_flag };
-
-				drv_array_append(kms_items, &item);
-			}
+		/* Without IN_FORMATS, planes can only be assumed to scan out linear buffers. */
+		if (in_formats && drv_add_kms_in_formats(drv, kms_items, in_formats, use_flag)) {
+			drv->kms_has_modifiers = true;
+		} else {
+			for (j = 0; j < plane->count_formats; j++)
+				drv_add_kms_item(kms_items, plane->formats[j],
+						 DRM_FORMAT_MOD_LINEAR, use_flag);
 		}
 
 		drmModeFreeObjectProperties(props);
@@ -605,13 +1018,52 @@ struct drv_array *drv_query_kms(struct driver *drv)
 	}
 
 	drmModeFreePlaneResources(resources);
-out:
-	if (kms_items && !drv_array_size(kms_items)) {
-		drv_array_destroy(kms_items);
-		return NULL;
+	return kms_items;
+}
+
+/*
+ * Returns the (format, modifier) pairs the planes of the device can scan out, or NULL if there
+ * are none. The planes are only walked on the first call, the result is kept by the driver and
+ * must not be destroyed by the caller.
+ */
+struct drv_array *drv_query_kms(struct driver *drv)
+{
+	if (drv->kms_queried)
+		return drv->kms_items;
+
+	drv->kms_queried = true;
+	drv->kms_items = drv_walk_kms_planes(drv);
+	if (drv->kms_items && !drv_array_size(drv->kms_items)) {
+		drv_array_destroy(drv->kms_items);
+		drv->kms_items = NULL;
 	}
 
-	return kms_items;
+	return drv->kms_items;
+}
+
+/*
+ * Whether KMS can scan out format with modifier for the scanout and cursor flags in use_flags.
+ * When the kernel doesn't report modifiers, only the format is checked.
+ */
+bool drv_kms_supports(struct driver *drv, uint32_t format, uint64_t modifier, uint64_t use_flags)
+{
+	uint32_t i;
+	struct kms_item *item;
+	uint64_t kms_flags = use_flags & (BO_USE_SCANOUT | BO_USE_CURSOR);
+
+	if (!kms_flags || !drv->kms_items)
+		return true;
+
+	for (i = 0; i < drv_array_size(drv->kms_items); i++) {
+		item = drv_array_at_idx(drv->kms_items, i);
+		if (item->format != format || (item->use_flags & kms_flags) != kms_flags)
+			continue;
+
+		if (!drv->kms_has_modifiers || item->modifier == modifier)
+			return true;
+	}
+
+	return false;
 }
 
 int drv_modify_linear_combinations(struct driver *drv)
@@ -641,12 +1093,12 @@ int drv_modify_linear_combinations(struct driver *drv)
 		item = (struct kms_item *)drv_array_at_idx(kms_items, i);
 		for (j = 0; j < drv_array_size(drv->combos); j++) {
 			combo = drv_array_at_idx(drv->combos, j);
-			if (item->format == combo->format)
+			if (item->format == combo->format &&
+			    item->modifier == combo->metadata.modifier)
 				combo->use_flags |= BO_USE_SCANOUT;
 		}
 	}
 
-	drv_array_destroy(kms_items);
 	return 0;
 }
 
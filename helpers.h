@@ -7,11 +7,43 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 
+#include <stdbool.h>
+
 #include "drv.h"
 #include "helpers_array.h"
 
+/* The plane layout of a format, with one entry per plane in each array. */
+struct drv_format_layout {
+	uint32_t num_planes;
+	uint8_t horizontal_subsampling[DRV_MAX_PLANES];
+	uint8_t vertical_subsampling[DRV_MAX_PLANES];
+	/* The stride of the first plane divided by the stride of this plane. */
+	uint8_t stride_subsampling[DRV_MAX_PLANES];
+	uint8_t bytes_per_pixel[DRV_MAX_PLANES];
+};
+
+const struct drv_format_layout *drv_get_format_layout(uint32_t format);
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
+void drv_rect_to_plane(uint32_t format, size_t plane, const struct rectangle *rect,
+		       struct rectangle *out);
+void drv_copy_from_wc(void *dst, const void *src, size_t size);
+void drv_copy_to_wc(void *dst, const void *src, size_t size);
+/*
+ * Copies rect, in pixels of the first plane, of every plane between the uncached mapping of a
+ * single-buffer bo and a shadow copy laid out the same way.
+ */
+void drv_bo_copy_shadow_rect(struct bo *bo, uint8_t *shadow, uint8_t *mapped,
+			     const struct rectangle *rect, bool to_shadow);
+/* The CPU copy of drv_bo_copy() between bos of different formats, see drv_convert.c. */
+int drv_bo_convert(struct bo *dst, struct bo *src, const struct rectangle *rect);
+
+/* Called with the items [begin, end) of a drv_parallel_for() job. */
+typedef void (*drv_parallel_fn)(void *data, size_t begin, size_t end);
+int drv_parallel_init(struct driver *drv);
+void drv_parallel_destroy(struct driver *drv);
+void drv_parallel_for(struct driver *drv, size_t count, size_t item_size, drv_parallel_fn fn,
+		      void *data);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format);
 int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags);
@@ -20,11 +52,67 @@ int drv_gem_bo_destroy(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
+size_t drv_bo_first_plane_of_handle(struct bo *bo, size_t plane);
+size_t drv_bo_handle_length(struct bo *bo, size_t plane);
+struct drv_shard *drv_get_shard(struct driver *drv, uint32_t handle);
+void drv_bo_lock_shards(struct bo *bo);
+void drv_bo_unlock_shards(struct bo *bo);
+struct drv_array *drv_get_mappings(struct driver *drv, uint32_t handle);
 int drv_mapping_destroy(struct bo *bo);
 int drv_get_prot(uint32_t map_flags);
+size_t drv_hugepage_align(size_t size);
+void drv_advise_hugepage(void *addr, size_t length);
+void *drv_mmap(size_t length, uint32_t map_flags, int fd, off_t offset, bool thp);
+int drv_dmabuf_busy(int fd, uint32_t map_flags);
+int drv_init_reference_counts(struct driver *drv);
+void drv_destroy_reference_counts(struct driver *drv);
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+int drv_bo_acquire_references(struct bo *bo);
+/* Returns the number of references left on the bo's handles; the caller destroys the bo at 0. */
+uintptr_t drv_bo_release_references(struct bo *bo);
+bool drv_bo_handles_shared(struct bo *bo);
+int drv_pool_init(struct driver *drv);
+void drv_pool_destroy(struct driver *drv);
+struct bo *drv_pool_get(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags);
+/* Takes up to count bos matching the key under a single lock; returns how many it took. */
+uint32_t drv_pool_get_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags, uint32_t count, struct bo **bos);
+/* Returns true if the pool took ownership of the bo. */
+bool drv_pool_put(struct bo *bo);
+/* Returns true if the bo was queued for the reclaim thread. */
+bool drv_pool_defer(struct bo *bo);
+void drv_bo_discard(struct bo *bo);
+void drv_bo_reclaim(struct bo *bo);
+/* True if only the CPU accesses bos with these use flags, and no device does. */
+bool drv_use_flags_cpu_only(uint64_t use_flags);
+void drv_heap_init(struct driver *drv);
+void drv_heap_destroy(struct driver *drv);
+int drv_heap_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+		       uint64_t use_flags);
+void drv_heap_bo_import(struct bo *bo, struct drv_import_fd_data *data);
+int drv_heap_bo_map_dmabuf(struct bo *bo);
+int drv_heap_bo_destroy(struct bo *bo);
+void drv_heap_bo_release(struct bo *bo);
+int drv_heap_bo_get_fd(struct bo *bo);
+/* The callbacks for CPU access to the bo: the backend's, or the dma-buf ones. */
+const struct backend *drv_bo_cpu_backend(struct bo *bo);
+int drv_record_init(struct driver *drv);
+void drv_record_destroy(struct driver *drv);
+uint64_t drv_stats_start(void);
+void drv_stats_record(struct driver *drv, enum drv_stats_op op, uint64_t start);
+/* Records count ops that took the time since start between them, each at the average. */
+void drv_stats_record_batch(struct driver *drv, enum drv_stats_op op, uint64_t start,
+			    uint32_t count);
+void drv_stats_bo_added(struct bo *bo);
+/* Accounts count bos sharing the key, and with it the size, of bos[0]. */
+void drv_stats_bos_added(struct bo **bos, uint32_t count);
+void drv_stats_bo_removed(struct bo *bo);
+/*
+ * Whether live_bytes, plus pending bytes not accounted yet, is within the budget, after trimming
+ * the pool if it wasn't.
+ */
+bool drv_stats_within_budget(struct driver *drv, uint64_t pending);
 uint32_t drv_log_base2(uint32_t value);
 int drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			uint64_t usage);
@@ -33,6 +121,7 @@ void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t
 void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			    uint64_t usage);
 struct drv_array *drv_query_kms(struct driver *drv);
+bool drv_kms_supports(struct driver *drv, uint32_t format, uint64_t modifier, uint64_t use_flags);
 int drv_modify_linear_combinations(struct driver *drv);
 uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
 			   const uint64_t *modifier_order, uint32_t order_count);
@@ -5,17 +5,33 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 
+/* Elements live in slabs that never move, so pointers to them stay valid. */
+#define DRV_ARRAY_MIN_SLAB_ITEMS 2
+#define DRV_ARRAY_MAX_SLAB_ITEMS 64
+
+struct drv_array_slab {
+	struct drv_array_slab *next;
+	uint32_t num_items;
+	uint64_t data[];
+};
+
 struct drv_array {
 	void **items;
 	uint32_t size;
 	uint32_t item_size;
 	uint32_t allocations;
+	uint32_t slot_size;
+	uint32_t slab_items;
+	struct drv_array_slab *slabs;
+	/* Free slots are chained through their first bytes. */
+	void *free_slots;
 };
 
 struct drv_array *drv_array_init(uint32_t item_size)
@@ -23,14 +39,51 @@ struct drv_array *drv_array_init(uint32_t item_size)
 	struct drv_array *array;
 
 	array = calloc(1, sizeof(*array));
+	if (!array)
+		return NULL;
 
 	/* Start with a power of 2 number of allocations. */
 	array->allocations = 2;
 	array->items = calloc(array->allocations, sizeof(*array->items));
+	if (!array->items) {
+		free(array);
+		return NULL;
+	}
+
 	array->item_size = item_size;
+	array->slot_size = ALIGN(MAX(item_size, sizeof(void *)), sizeof(uint64_t));
+	array->slab_items = DRV_ARRAY_MIN_SLAB_ITEMS;
 	return array;
 }
 
+static int drv_array_grow_slots(struct drv_array *array)
+{
+	int32_t i;
+	struct drv_array_slab *slab;
+	void *slot;
+
+	slab = malloc(sizeof(*slab) + (size_t)array->slot_size * array->slab_items);
+	if (!slab)
+		return -ENOMEM;
+
+	slab->num_items = array->slab_items;
+	slab->next = array->slabs;
+	array->slabs = slab;
+
+	/* Chain the slots backwards so that they are handed out in address order. */
+	for (i = slab->num_items - 1; i >= 0; i--) {
+		slot = (uint8_t *)slab->data + (size_t)i * array->slot_size;
+		*(void **)slot = array->free_slots;
+		array->free_slots = slot;
+	}
+
+	/* Grow the slabs with the array, but keep small arrays small. */
+	if (array->slab_items < DRV_ARRAY_MAX_SLAB_ITEMS)
+		array->slab_items *= 2;
+
+	return 0;
+}
+
 void *drv_array_append(struct drv_array *array, void *data)
 {
 	void *item;
@@ -43,7 +96,12 @@ void *drv_array_append(struct drv_array *array, void *data)
 		array->items = new_items;
 	}
 
-	item = calloc(1, array->item_size);
+	if (!array->free_slots && drv_array_grow_slots(array))
+		return NULL;
+
+	item = array->free_slots;
+	array->free_slots = *(void **)item;
+
 	memcpy(item, data, array->item_size);
 	array->items[array->size] = item;
 	array->size++;
@@ -57,7 +115,8 @@ void drv_array_remove(struct drv_array *array, uint32_t idx)
 	assert(array);
 	assert(idx < array->size);
 
-	free(array->items[idx]);
+	*(void **)array->items[idx] = array->free_slots;
+	array->free_slots = array->items[idx];
 	array->items[idx] = NULL;
 
 	for (i = idx + 1; i < array->size; i++)
@@ -86,10 +145,13 @@ uint32_t drv_array_size(struct drv_array *array)
 
 void drv_array_destroy(struct drv_array *array)
 {
-	uint32_t i;
+	struct drv_array_slab *slab;
 
-	for (i = 0; i < array->size; i++)
-		free(array->items[i]);
+	while (array->slabs) {
+		slab = array->slabs;
+		array->slabs = slab->next;
+		free(slab);
+	}
 
 	free(array->items);
 	free(array);
@@ -8,10 +8,16 @@ struct drv_array;
 
 struct drv_array *drv_array_init(uint32_t item_size);
 
-/* The data will be copied and appended to the array. */
+/*
+ * The data will be copied and appended to the array. The returned pointer stays valid until the
+ * item is removed or the array is destroyed.
+ */
 void *drv_array_append(struct drv_array *array, void *data);
 
-/* The data at the specified index will be freed -- the array will shrink. */
+/*
+ * The data at the specified index will be released -- the array will shrink. Its storage is reused
+ * by later appends.
+ */
 void drv_array_remove(struct drv_array *array, uint32_t idx);
 
 void *drv_array_at_idx(struct drv_array *array, uint32_t idx);
@@ -7,6 +7,7 @@
 #ifdef DRV_I915
 
 #include <assert.h>
+#include <cpuid.h>
 #include <errno.h>
 #include <i915_drm.h>
 #include <stdbool.h>
@@ -16,12 +17,24 @@
 #include <xf86drm.h>
 
 #include "drv_priv.h"
+#include "drv_trace.h"
 #include "helpers.h"
 #include "util.h"
 
 #define I915_CACHELINE_SIZE 64
 #define I915_CACHELINE_MASK (I915_CACHELINE_SIZE - 1)
 
+/*
+ * Flushes of at least this many bytes are left to the kernel by moving the bo out of the CPU
+ * domain. It flushes through its own mapping of the pages, which is cheaper than taking a TLB miss
+ * on every page of ours.
+ */
+#define I915_KERNEL_FLUSH_MIN_BYTES (8 * 1024 * 1024)
+
+#ifndef I915_FORMAT_MOD_Y_TILED_CCS
+#define I915_FORMAT_MOD_Y_TILED_CCS fourcc_mod_code(INTEL, 4)
+#endif
+
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888,    DRM_FORMAT_ARGB1555,
 						  DRM_FORMAT_ARGB8888,    DRM_FORMAT_BGR888,
 						  DRM_FORMAT_RGB565,      DRM_FORMAT_XBGR2101010,
@@ -34,9 +47,22 @@ static const uint32_t tileable_texture_source_formats[] = { DRM_FORMAT_GR88, DRM
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID,
 						   DRM_FORMAT_NV12 };
 
+/* Render compression only covers 32bpp RGB formats. */
+static const uint32_t ccs_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
+					DRM_FORMAT_XBGR8888, DRM_FORMAT_XRGB8888 };
+
+enum i915_flush_insn {
+	I915_FLUSH_CLFLUSH,
+	I915_FLUSH_CLFLUSHOPT,
+	I915_FLUSH_CLWB,
+};
+
 struct i915_device {
 	uint32_t gen;
 	int32_t has_llc;
+	/* Set if the display reports I915_FORMAT_MOD_Y_TILED_CCS, i.e. on gen9 and later. */
+	bool has_ccs;
+	enum i915_flush_insn flush_insn;
 };
 
 static uint32_t i915_get_gen(int device_id)
@@ -76,10 +102,26 @@ static bool format_compatible(const struct combination *combo, uint32_t format)
 	}
 }
 
+static bool i915_ccs_format(uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_SIZE(ccs_formats); i++) {
+		if (ccs_formats[i] == format)
+			return true;
+	}
+
+	return false;
+}
+
 static int i915_add_kms_item(struct driver *drv, const struct kms_item *item)
 {
 	uint32_t i;
 	struct combination *combo;
+	struct i915_device *i915 = drv->priv;
+
+	if (item->modifier == I915_FORMAT_MOD_Y_TILED_CCS)
+		i915->has_ccs = true;
 
 	/*
 	 * Older hardware can't scanout Y-tiled formats. Newer devices can, and
@@ -90,13 +132,20 @@ static int i915_add_kms_item(struct driver *drv, const struct kms_item *item)
 		if (!format_compatible(combo, item->format))
 			continue;
 
+		/*
+		 * Y-tiled scanout stays with clients that pass modifiers, see
+		 * i915_add_combinations(). NV12 is only Y-tiled for video, so it is kept.
+		 */
+		if (combo->metadata.tiling == I915_TILING_Y && item->format != DRM_FORMAT_NV12)
+			continue;
+
 		if (item->modifier == DRM_FORMAT_MOD_LINEAR &&
 		    combo->metadata.tiling == I915_TILING_X) {
 			/*
-			 * FIXME: drv_query_kms() does not report the available modifiers
-			 * yet, but we know that all hardware can scanout from X-tiled
-			 * buffers, so let's add this to our combinations, except for
-			 * cursor, which must not be tiled.
+			 * Kernels without IN_FORMATS only report linear scanout, but we know
+			 * that all hardware can scanout from X-tiled buffers, so let's add
+			 * this to our combinations, except for cursor, which must not be
+			 * tiled.
 			 */
 			combo->use_flags |= item->use_flags & ~BO_USE_CURSOR;
 		}
@@ -105,8 +154,12 @@ static int i915_add_kms_item(struct driver *drv, const struct kms_item *item)
 		if (item->format == DRM_FORMAT_NV12)
 			combo->use_flags |= item->use_flags;
 
-		if (combo->metadata.modifier == item->modifier)
+		/* The gralloc framebuffer is added with its modifier, like any scanout bo. */
+		if (combo->metadata.modifier == item->modifier) {
 			combo->use_flags |= item->use_flags;
+			if (item->use_flags & BO_USE_SCANOUT)
+				combo->use_flags |= BO_USE_FRAMEBUFFER;
+		}
 	}
 
 	return 0;
@@ -171,7 +224,11 @@ static int i915_add_combinations(struct driver *drv)
 			     ARRAY_SIZE(tileable_texture_source_formats), &metadata,
 			     texture_use_flags);
 
-	/* TODO: Y tiling does not seem to work for framebuffers */
+	/*
+	 * Y-tiled combinations never get scanout. Clients that add framebuffers without modifiers
+	 * would have them rejected, since the kernel then only accepts X tiling. Y tiling and CCS
+	 * can still be scanned out through bo_create_with_modifiers when the caller lists them.
+	 */
 	render_use_flags &= ~BO_USE_FRAMEBUFFER;
 
 	metadata.tiling = I915_TILING_Y;
@@ -196,13 +253,10 @@ static int i915_add_combinations(struct driver *drv)
 
 	for (i = 0; i < drv_array_size(kms_items); i++) {
 		ret = i915_add_kms_item(drv, (struct kms_item *)drv_array_at_idx(kms_items, i));
-		if (ret) {
-			drv_array_destroy(kms_items);
+		if (ret)
 			return ret;
-		}
 	}
 
-	drv_array_destroy(kms_items);
 	return 0;
 }
 
@@ -259,18 +313,108 @@ static int i915_align_dimensions(struct bo *bo, uint32_t tiling, uint32_t *strid
 	return 0;
 }
 
+/*
+ * CLFLUSHOPT and CLWB are only ordered by fences, so unlike CLFLUSH they don't wait for each other
+ * and a whole flush needs a single fence at the end, see i915_flush_end(). CLWB also keeps the
+ * written back lines in the cache, which the next CPU write to the buffer hits.
+ */
+static enum i915_flush_insn i915_get_flush_insn(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return I915_FLUSH_CLFLUSH;
+
+	if (ebx & (1u << 24))
+		return I915_FLUSH_CLWB;
+	if (ebx & (1u << 23))
+		return I915_FLUSH_CLFLUSHOPT;
+
+	return I915_FLUSH_CLFLUSH;
+}
+
 static void i915_clflush(void *start, size_t size)
 {
 	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
 	void *end = (void *)((uintptr_t)start + size);
 
-	__builtin_ia32_mfence();
 	while (p < end) {
 		__builtin_ia32_clflush(p);
 		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
 	}
 }
 
+__attribute__((target("clflushopt"))) static void i915_clflushopt(void *start, size_t size)
+{
+	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
+	void *end = (void *)((uintptr_t)start + size);
+
+	while (p < end) {
+		__builtin_ia32_clflushopt(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+__attribute__((target("clwb"))) static void i915_clwb(void *start, size_t size)
+{
+	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
+	void *end = (void *)((uintptr_t)start + size);
+
+	while (p < end) {
+		__builtin_ia32_clwb(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+static void i915_flush_range(struct i915_device *i915, void *start, size_t size)
+{
+	switch (i915->flush_insn) {
+	case I915_FLUSH_CLWB:
+		i915_clwb(start, size);
+		break;
+	case I915_FLUSH_CLFLUSHOPT:
+		i915_clflushopt(start, size);
+		break;
+	default:
+		i915_clflush(start, size);
+		break;
+	}
+}
+
+/* Bracket all i915_flush_range() calls of one flush. */
+static void i915_flush_begin(struct i915_device *i915)
+{
+	if (i915->flush_insn == I915_FLUSH_CLFLUSH)
+		__builtin_ia32_mfence();
+}
+
+static void i915_flush_end(struct i915_device *i915)
+{
+	if (i915->flush_insn != I915_FLUSH_CLFLUSH)
+		__builtin_ia32_sfence();
+}
+
+struct i915_flush_job {
+	struct i915_device *i915;
+	uint8_t *addr;
+	size_t length;
+};
+
+/*
+ * Flushes the cache lines [begin, end) of a whole-bo flush. Fences only order the thread that
+ * issues them, so every range is bracketed on its own.
+ */
+static void i915_flush_lines(void *data, size_t begin, size_t end)
+{
+	struct i915_flush_job *job = data;
+	size_t offset = begin * I915_CACHELINE_SIZE;
+
+	i915_flush_begin(job->i915);
+	i915_flush_range(job->i915, job->addr + offset,
+			 MIN(end * I915_CACHELINE_SIZE, job->length) - offset);
+	i915_flush_end(job->i915);
+}
+
 static int i915_init(struct driver *drv)
 {
 	int ret;
@@ -293,6 +437,7 @@ static int i915_init(struct driver *drv)
 	}
 
 	i915->gen = i915_get_gen(device_id);
+	i915->flush_insn = i915_get_flush_insn();
 
 	memset(&get_param, 0, sizeof(get_param));
 	get_param.param = I915_PARAM_HAS_LLC;
@@ -338,6 +483,33 @@ static int i915_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, u
 	return 0;
 }
 
+/*
+ * Render compressed surfaces are followed by a color control surface (CCS), which has one Y tile
+ * for every 32x16 Y tiles of the main surface. Y tiles are 128 bytes wide and 32 rows tall, and
+ * both surfaces start on a tile boundary.
+ */
+static void i915_bo_from_ccs_format(struct bo *bo, uint32_t width, uint32_t height,
+				    uint32_t format)
+{
+	uint32_t stride = drv_stride_from_format(format, width, 0);
+	uint32_t width_in_tiles = DIV_ROUND_UP(stride, 128);
+	uint32_t height_in_tiles = DIV_ROUND_UP(height, 32);
+	uint32_t ccs_width_in_tiles = DIV_ROUND_UP(width_in_tiles, 32);
+	uint32_t ccs_height_in_tiles = DIV_ROUND_UP(height_in_tiles, 16);
+
+	bo->num_planes = 2;
+
+	bo->strides[0] = width_in_tiles * 128;
+	bo->sizes[0] = width_in_tiles * height_in_tiles * 4096;
+	bo->offsets[0] = 0;
+
+	bo->strides[1] = ccs_width_in_tiles * 128;
+	bo->sizes[1] = ccs_width_in_tiles * ccs_height_in_tiles * 4096;
+	bo->offsets[1] = bo->sizes[0];
+
+	bo->total_size = bo->offsets[1] + bo->sizes[1];
+}
+
 static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
 				       uint32_t format, uint64_t modifier)
 {
@@ -354,13 +526,14 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 		bo->tiling = I915_TILING_X;
 		break;
 	case I915_FORMAT_MOD_Y_TILED:
+	case I915_FORMAT_MOD_Y_TILED_CCS:
 		bo->tiling = I915_TILING_Y;
 		break;
 	}
 
-	bo->format_modifiers[0] = modifier;
-
-	if (format == DRM_FORMAT_YVU420_ANDROID) {
+	if (modifier == I915_FORMAT_MOD_Y_TILED_CCS) {
+		i915_bo_from_ccs_format(bo, width, height, format);
+	} else if (format == DRM_FORMAT_YVU420_ANDROID) {
 		/*
 		 * We only need to be able to use this as a linear texture,
 		 * which doesn't put any HW restrictions on how we lay it
@@ -376,7 +549,7 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 	}
 
 	memset(&gem_create, 0, sizeof(gem_create));
-	gem_create.size = bo->total_size;
+	gem_create.size = drv_hugepage_align(bo->total_size);
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_CREATE, &gem_create);
 	if (ret) {
@@ -384,8 +557,10 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 		return ret;
 	}
 
-	for (plane = 0; plane < bo->num_planes; plane++)
+	for (plane = 0; plane < bo->num_planes; plane++) {
 		bo->handles[plane].u32 = gem_create.handle;
+		bo->format_modifiers[plane] = modifier;
+	}
 
 	memset(&gem_set_tiling, 0, sizeof(gem_set_tiling));
 	gem_set_tiling.handle = bo->handles[0].u32;
@@ -422,17 +597,39 @@ static int i915_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 					 uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
 	static const uint64_t modifier_order[] = {
+		I915_FORMAT_MOD_Y_TILED_CCS,
 		I915_FORMAT_MOD_Y_TILED,
 		I915_FORMAT_MOD_X_TILED,
 		DRM_FORMAT_MOD_LINEAR,
 	};
+	struct i915_device *i915 = bo->drv->priv;
+	const uint64_t *order = modifier_order;
+	uint32_t order_count = ARRAY_SIZE(modifier_order);
 	uint64_t modifier;
 
-	modifier = drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	/* Only offer compression where the display can scan it out, see i915_add_kms_item(). */
+	if (!i915->has_ccs || !i915_ccs_format(format)) {
+		order++;
+		order_count--;
+	}
+
+	modifier = drv_pick_modifier(modifiers, count, order, order_count);
 
 	return i915_bo_create_for_modifier(bo, width, height, format, modifier);
 }
 
+static size_t i915_num_planes_from_modifier(struct driver *drv, uint32_t format,
+					    uint64_t modifier)
+{
+	size_t num_planes = drv_num_planes_from_format(format);
+
+	/* CCS only exists for single-plane formats, fail imports that claim otherwise. */
+	if (modifier == I915_FORMAT_MOD_Y_TILED_CCS)
+		return num_planes == 1 ? 2 : 0;
+
+	return num_planes;
+}
+
 static void i915_close(struct driver *drv)
 {
 	free(drv->priv);
@@ -463,6 +660,11 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
+static bool i915_bo_use_wc(struct bo *bo)
+{
+	return (bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT);
+}
+
 static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -472,7 +674,7 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		struct drm_i915_gem_mmap gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
 
-		if ((bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT))
+		if (i915_bo_use_wc(bo))
 			gem_map.flags = I915_MMAP_WC;
 
 		gem_map.handle = bo->handles[0].u32;
@@ -485,7 +687,9 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 			return MAP_FAILED;
 		}
 
+		/* The kernel places this mapping itself, so it can only be hinted. */
 		addr = (void *)(uintptr_t)gem_map.addr_ptr;
+		drv_advise_hugepage(addr, bo->total_size);
 	} else {
 		struct drm_i915_gem_mmap_gtt gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
@@ -498,8 +702,7 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 			return MAP_FAILED;
 		}
 
-		addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			    gem_map.offset);
+		addr = drv_mmap(bo->total_size, map_flags, bo->drv->fd, gem_map.offset, false);
 	}
 
 	if (addr == MAP_FAILED) {
@@ -528,7 +731,9 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
 	}
 
+	DRV_TRACE_BEGIN("DRM_IOCTL_I915_GEM_SET_DOMAIN");
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+	DRV_TRACE_END();
 	if (ret) {
 		drv_log("DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
 		return ret;
@@ -537,11 +742,95 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+/*
+ * The low 16 bits of busy name the engine writing the bo, the high ones the engines reading it,
+ * and SET_DOMAIN waits for the writer before reads and for all of them before writes.
+ */
+static int i915_bo_busy(struct bo *bo, uint32_t map_flags)
+{
+	int ret;
+	struct drm_i915_gem_busy gem_busy;
+
+	memset(&gem_busy, 0, sizeof(gem_busy));
+	gem_busy.handle = bo->handles[0].u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_BUSY, &gem_busy);
+	if (ret) {
+		drv_log("DRM_IOCTL_I915_GEM_BUSY failed with %d\n", ret);
+		return -errno;
+	}
+
+	if (map_flags & BO_MAP_WRITE)
+		return gem_busy.busy != 0;
+
+	return (gem_busy.busy & 0xffff) != 0;
+}
+
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	DRV_TRACE_SCOPE("i915_clflush");
+	int ret;
+	size_t plane;
+	uint32_t row;
+	uint8_t *start;
+	struct rectangle range;
+	struct drm_i915_gem_set_domain set_domain;
+	struct i915_flush_job job;
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+	const struct rectangle *dirty = &mapping->dirty_rect;
+
+	if (i915->has_llc || bo->tiling != I915_TILING_NONE)
+		return 0;
+
+	/* Write-combined stores don't go through the cache, they only need to be drained. */
+	if (i915_bo_use_wc(bo)) {
+		__builtin_ia32_sfence();
+		return 0;
+	}
+
+	if (dirty->width == bo->width && dirty->height == bo->height) {
+		if (mapping->vma->length >= I915_KERNEL_FLUSH_MIN_BYTES) {
+			/* Leaving the CPU write domain makes the kernel flush the whole bo. */
+			memset(&set_domain, 0, sizeof(set_domain));
+			set_domain.handle = bo->handles[0].u32;
+			set_domain.read_domains = I915_GEM_DOMAIN_GTT;
+			DRV_TRACE_BEGIN("DRM_IOCTL_I915_GEM_SET_DOMAIN");
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+			DRV_TRACE_END();
+			if (!ret) {
+				/*
+				 * The bo left the CPU domain, so the next invalidate has to move
+				 * it back or the kernel won't know to flush it again.
+				 */
+				__atomic_store_n(&mapping->vma->domain, 0, __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+
+		job.i915 = i915;
+		job.addr = mapping->vma->addr;
+		job.length = mapping->vma->length;
+		drv_parallel_for(bo->drv, DIV_ROUND_UP(job.length, I915_CACHELINE_SIZE),
+				 I915_CACHELINE_SIZE, i915_flush_lines, &job);
+		return 0;
+	}
+
+	/* Only flush the cache lines of the rows and columns that were written. */
+	i915_flush_begin(i915);
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		drv_rect_to_plane(bo->format, plane, dirty, &range);
+		start = (uint8_t *)mapping->vma->addr + bo->offsets[plane] + range.x;
+
+		if (range.width == bo->strides[plane]) {
+			i915_flush_range(i915, start + range.y * bo->strides[plane],
+					 range.height * bo->strides[plane]);
+			continue;
+		}
+
+		for (row = range.y; row < range.y + range.height; row++)
+			i915_flush_range(i915, start + row * bo->strides[plane], range.width);
+	}
+	i915_flush_end(i915);
 
 	return 0;
 }
@@ -583,7 +872,9 @@ const struct backend backend_i915 = {
 	.bo_unmap = drv_bo_munmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
+	.bo_busy = i915_bo_busy,
 	.resolve_format = i915_resolve_format,
+	.num_planes_from_modifier = i915_num_planes_from_modifier,
 };
 
 #endif
@@ -87,8 +87,7 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		return MAP_FAILED;
 	}
 
-	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			  gem_map.offset);
+	void *addr = drv_mmap(bo->total_size, map_flags, bo->drv->fd, gem_map.offset, false);
 
 	vma->length = bo->total_size;
 
@@ -120,7 +119,8 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	if (mapping->vma->priv) {
 		struct mediatek_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
+		drv_bo_copy_shadow_rect(bo, priv->cached_addr, priv->gem_addr, &mapping->rect,
+					true);
 	}
 
 	return 0;
@@ -130,7 +130,8 @@ static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
 	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
+		drv_bo_copy_shadow_rect(bo, priv->cached_addr, priv->gem_addr,
+					&mapping->dirty_rect, false);
 
 	return 0;
 }
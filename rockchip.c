@@ -30,25 +30,119 @@ static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMA
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_NV12,
 						   DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID };
 
-static int afbc_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, uint32_t format)
+/* From newer <drm_fourcc.h>. */
+#ifndef DRM_FORMAT_MOD_ARM_AFBC
+#define DRM_FORMAT_MOD_ARM_AFBC(__afbc_mode) fourcc_mod_code(ARM, __afbc_mode)
+#endif
+
+#ifndef AFBC_FORMAT_MOD_BLOCK_SIZE_MASK
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_MASK 0xf
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 (1ULL)
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 (2ULL)
+#define AFBC_FORMAT_MOD_YTR (1ULL << 4)
+#define AFBC_FORMAT_MOD_SPLIT (1ULL << 5)
+#define AFBC_FORMAT_MOD_SPARSE (1ULL << 6)
+#endif
+
+#define AFBC_16X16 DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16)
+#define AFBC_32X8 DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_32x8)
+
+/*
+ * The AFBC layouts we can allocate, best first. Older kernels report
+ * DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC instead, which is 16x16 blocks of 32bpp RGB.
+ */
+static const uint64_t afbc_modifiers[] = {
+	AFBC_16X16 | AFBC_FORMAT_MOD_YTR | AFBC_FORMAT_MOD_SPLIT | AFBC_FORMAT_MOD_SPARSE,
+	AFBC_16X16 | AFBC_FORMAT_MOD_YTR | AFBC_FORMAT_MOD_SPARSE,
+	AFBC_16X16 | AFBC_FORMAT_MOD_SPARSE,
+	AFBC_16X16 | AFBC_FORMAT_MOD_YTR,
+	AFBC_16X16,
+	AFBC_32X8 | AFBC_FORMAT_MOD_YTR | AFBC_FORMAT_MOD_SPARSE,
+	AFBC_32X8 | AFBC_FORMAT_MOD_SPARSE,
+	AFBC_32X8 | AFBC_FORMAT_MOD_YTR,
+	AFBC_32X8,
+	DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC,
+};
+
+/* The kernel checks AFBC framebuffers with body blocks aligned to this. */
+#define AFBC_BODY_BLOCK_ALIGNMENT 128
+
+/*
+ * RenderScript reads its buffers often, which is slow through the write-combined GEM mapping.
+ * Kernels that know ROCKCHIP_BO_CACHABLE allocate them cached instead, and the CPU accesses them
+ * through their dma-buf with DMA_BUF_IOCTL_SYNC for coherency. Other kernels, and those without
+ * DMA_BUF_IOCTL_SYNC, copy the locked rectangle through a shadow in rockchip_bo_map().
+ */
+static void rockchip_bo_map_cached(struct bo *bo)
 {
-	/* We've restricted ourselves to four bytes per pixel. */
-	const uint32_t pixel_size = 4;
-
-	const uint32_t clump_width = 4;
-	const uint32_t clump_height = 4;
-
-#define AFBC_NARROW 1
-#if AFBC_NARROW == 1
-	const uint32_t block_width = 4 * clump_width;
-	const uint32_t block_height = 4 * clump_height;
-#else
-	const uint32_t block_width = 8 * clump_width;
-	const uint32_t block_height = 2 * clump_height;
+#ifdef ROCKCHIP_BO_CACHABLE
+	if ((bo->use_flags & BO_USE_RENDERSCRIPT) && (bo->tiling & ROCKCHIP_BO_CACHABLE))
+		drv_heap_bo_map_dmabuf(bo);
 #endif
+}
+
+static bool has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
+{
+	uint32_t i;
+	for (i = 0; i < count; i++)
+		if (list[i] == modifier)
+			return true;
+
+	return false;
+}
+
+static bool rockchip_is_afbc(uint64_t modifier)
+{
+	/* AFBC is type zero of the ARM modifiers, the type being bits 52 to 55. */
+	return modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC ||
+	       (modifier >> 52) == (DRM_FORMAT_MOD_VENDOR_ARM << 4);
+}
+
+static bool rockchip_afbc_supported(uint32_t format, uint64_t modifier)
+{
+	uint32_t bytes_per_pixel;
+
+	if (!has_modifier(afbc_modifiers, ARRAY_SIZE(afbc_modifiers), modifier))
+		return false;
+
+	/*
+	 * Only RGB is compressed. KMS pairs AFBC with DRM_FORMAT_YUV420_8BIT for YUV, and the
+	 * decoders write linear NV12.
+	 */
+	bytes_per_pixel = drv_bytes_per_pixel_from_format(format, 0);
+	if (modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC || (modifier & AFBC_FORMAT_MOD_SPLIT))
+		return bytes_per_pixel == 4;
+
+	return bytes_per_pixel >= 2 && bytes_per_pixel <= 4;
+}
+
+/* Returns the best AFBC layout of format in modifiers, or DRM_FORMAT_MOD_INVALID. */
+static uint64_t rockchip_afbc_modifier(uint32_t format, const uint64_t *modifiers, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_SIZE(afbc_modifiers); i++)
+		if (has_modifier(modifiers, count, afbc_modifiers[i]) &&
+		    rockchip_afbc_supported(format, afbc_modifiers[i]))
+			return afbc_modifiers[i];
+
+	return DRM_FORMAT_MOD_INVALID;
+}
+
+static int afbc_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			       uint64_t modifier)
+{
+	const bool wide =
+	    modifier != DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC &&
+	    (modifier & AFBC_FORMAT_MOD_BLOCK_SIZE_MASK) == AFBC_FORMAT_MOD_BLOCK_SIZE_32x8;
+	const uint32_t block_width = wide ? 32 : 16;
+	const uint32_t block_height = wide ? 8 : 16;
+
+	const uint32_t pixel_size = drv_bytes_per_pixel_from_format(format, 0);
 
 	const uint32_t header_block_size = 16;
-	const uint32_t body_block_size = block_width * block_height * pixel_size;
+	const uint32_t body_block_size =
+	    ALIGN(block_width * block_height * pixel_size, AFBC_BODY_BLOCK_ALIGNMENT);
 	const uint32_t width_in_blocks = DIV_ROUND_UP(width, block_width);
 	const uint32_t height_in_blocks = DIV_ROUND_UP(height, block_height);
 	const uint32_t total_blocks = width_in_blocks * height_in_blocks;
@@ -69,7 +163,7 @@ static int afbc_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, u
 
 	bo->total_size = total_size;
 
-	bo->format_modifiers[0] = DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC;
+	bo->format_modifiers[0] = modifier;
 
 	return 0;
 }
@@ -81,25 +175,38 @@ static int rockchip_add_kms_item(struct driver *drv, const struct kms_item *item
 	struct combination *combo;
 	struct format_metadata metadata;
 
+	if (rockchip_is_afbc(item->modifier)) {
+		/* Only add AFBC layouts we can allocate, for formats we otherwise support. */
+		if (!rockchip_afbc_supported(item->format, item->modifier))
+			return 0;
+
+		for (i = 0; i < drv_array_size(drv->combos); i++) {
+			combo = (struct combination *)drv_array_at_idx(drv->combos, i);
+			if (combo->format == item->format)
+				break;
+		}
+
+		if (i == drv_array_size(drv->combos))
+			return 0;
+
+		use_flags = BO_USE_RENDERING | BO_USE_SCANOUT | BO_USE_TEXTURE;
+		metadata.modifier = item->modifier;
+		metadata.tiling = 0;
+		metadata.priority = 2;
+
+		for (j = 0; j < ARRAY_SIZE(texture_source_formats); j++) {
+			if (item->format == texture_source_formats[j])
+				use_flags &= ~BO_USE_RENDERING;
+		}
+
+		drv_add_combinations(drv, &item->format, 1, &metadata, use_flags);
+		return 0;
+	}
+
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
 		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
-		if (combo->format == item->format) {
-			if (item->modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC) {
-				use_flags = BO_USE_RENDERING | BO_USE_SCANOUT | BO_USE_TEXTURE;
-				metadata.modifier = item->modifier;
-				metadata.tiling = 0;
-				metadata.priority = 2;
-
-				for (j = 0; j < ARRAY_SIZE(texture_source_formats); j++) {
-					if (item->format == texture_source_formats[j])
-						use_flags &= ~BO_USE_RENDERING;
-				}
-
-				drv_add_combinations(drv, &item->format, 1, &metadata, use_flags);
-			} else {
-				combo->use_flags |= item->use_flags;
-			}
-		}
+		if (combo->format == item->format && combo->metadata.modifier == item->modifier)
+			combo->use_flags |= item->use_flags;
 	}
 
 	return 0;
@@ -141,35 +248,28 @@ static int rockchip_init(struct driver *drv)
 
 	for (i = 0; i < drv_array_size(kms_items); i++) {
 		ret = rockchip_add_kms_item(drv, (struct kms_item *)drv_array_at_idx(kms_items, i));
-		if (ret) {
-			drv_array_destroy(kms_items);
+		if (ret)
 			return ret;
-		}
 	}
 
-	drv_array_destroy(kms_items);
 	return 0;
 }
 
-static bool has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
-{
-	uint32_t i;
-	for (i = 0; i < count; i++)
-		if (list[i] == modifier)
-			return true;
-
-	return false;
-}
-
 static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					     uint32_t format, const uint64_t *modifiers,
 					     uint32_t count)
 {
 	int ret;
 	size_t plane;
+	uint64_t afbc_modifier;
 	struct drm_rockchip_gem_create gem_create;
 
-	if (format == DRM_FORMAT_NV12) {
+	afbc_modifier = rockchip_afbc_modifier(format, modifiers, count);
+	if (width <= 2560 && afbc_modifier != DRM_FORMAT_MOD_INVALID) {
+		/* If the caller has decided they can use AFBC, always
+		 * pick that */
+		afbc_bo_from_format(bo, width, height, format, afbc_modifier);
+	} else if (format == DRM_FORMAT_NV12) {
 		uint32_t w_mbs = DIV_ROUND_UP(ALIGN(width, 16), 16);
 		uint32_t h_mbs = DIV_ROUND_UP(ALIGN(height, 16), 16);
 
@@ -178,11 +278,6 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 
 		drv_bo_from_format(bo, aligned_width, height, format);
 		bo->total_size = bo->strides[0] * aligned_height + w_mbs * h_mbs * 128;
-	} else if (width <= 2560 &&
-		   has_modifier(modifiers, count, DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC)) {
-		/* If the caller has decided they can use AFBC, always
-		 * pick that */
-		afbc_bo_from_format(bo, width, height, format);
 	} else {
 		if (!has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR)) {
 			errno = EINVAL;
@@ -208,6 +303,10 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 
 	memset(&gem_create, 0, sizeof(gem_create));
 	gem_create.size = bo->total_size;
+#ifdef ROCKCHIP_BO_CACHABLE
+	if ((bo->use_flags & BO_USE_RENDERSCRIPT) && !rockchip_is_afbc(bo->format_modifiers[0]))
+		gem_create.flags = ROCKCHIP_BO_CACHABLE;
+#endif
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_ROCKCHIP_GEM_CREATE, &gem_create);
 
@@ -217,9 +316,13 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 		return ret;
 	}
 
+	/* The tiling travels with the handle, so importers know to map it cached too. */
+	bo->tiling = gem_create.flags;
+
 	for (plane = 0; plane < bo->num_planes; plane++)
 		bo->handles[plane].u32 = gem_create.handle;
 
+	rockchip_bo_map_cached(bo);
 	return 0;
 }
 
@@ -231,6 +334,18 @@ static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static int rockchip_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret)
+		return ret;
+
+	rockchip_bo_map_cached(bo);
+	return 0;
+}
+
 static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -239,7 +354,7 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 
 	/* We can only map buffers created with SW access flags, which should
 	 * have no modifiers (ie, not AFBC). */
-	if (bo->format_modifiers[0] == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC)
+	if (rockchip_is_afbc(bo->format_modifiers[0]))
 		return MAP_FAILED;
 
 	memset(&gem_map, 0, sizeof(gem_map));
@@ -251,8 +366,7 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		return MAP_FAILED;
 	}
 
-	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			  gem_map.offset);
+	void *addr = drv_mmap(bo->total_size, map_flags, bo->drv->fd, gem_map.offset, false);
 
 	vma->length = bo->total_size;
 
@@ -284,7 +398,8 @@ static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	if (mapping->vma->priv) {
 		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
+		drv_bo_copy_shadow_rect(bo, priv->cached_addr, priv->gem_addr, &mapping->rect,
+					true);
 	}
 
 	return 0;
@@ -294,7 +409,8 @@ static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
 	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
+		drv_bo_copy_shadow_rect(bo, priv->cached_addr, priv->gem_addr,
+					&mapping->dirty_rect, false);
 
 	return 0;
 }
@@ -321,7 +437,7 @@ const struct backend backend_rockchip = {
 	.bo_create = rockchip_bo_create,
 	.bo_create_with_modifiers = rockchip_bo_create_with_modifiers,
 	.bo_destroy = drv_gem_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = rockchip_bo_import,
 	.bo_map = rockchip_bo_map,
 	.bo_unmap = rockchip_bo_unmap,
 	.bo_invalidate = rockchip_bo_invalidate,
@@ -13,6 +13,10 @@
 #include <tegra_drm.h>
 #include <xf86drm.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -24,6 +28,7 @@
  */
 #define NV_BLOCKLINEAR_GOB_HEIGHT 8
 #define NV_BLOCKLINEAR_GOB_WIDTH 64
+#define NV_BLOCKLINEAR_SECTOR_SIZE 16
 #define NV_DEFAULT_BLOCK_HEIGHT_LOG2 4
 #define NV_PREFERRED_PAGE_SIZE (128 * 1024)
 
@@ -135,46 +140,129 @@ static void transfer_tile(struct bo *bo, uint8_t *tiled, uint8_t *untiled, enum
 	}
 }
 
+static inline void transfer_sector(uint8_t *dst, const uint8_t *src)
+{
+#ifdef __ARM_NEON
+	vst1q_u8(dst, vld1q_u8(src));
+#else
+	memcpy(dst, src, NV_BLOCKLINEAR_SECTOR_SIZE);
+#endif
+}
+
+/*
+ * Within a GOB, each 64 byte row is split into four 16 byte sectors, and the sectors of each pair
+ * of rows are interleaved. The n-th sector of a tile therefore holds the bytes
+ * [s * 16, s * 16 + 16) of row y, where s and y are decoded from the bits of n below. Walking the
+ * tiled side in memory order keeps the accesses to the uncached mapping sequential.
+ */
+static void transfer_tile_sectors(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
+				  enum tegra_map_type type, uint32_t tile_top, uint32_t tile_left,
+				  uint32_t tile_size_bytes, uint32_t row_bytes, uint8_t *tiled_last)
+{
+	uint32_t n, x, y, len;
+	uint8_t *line;
+
+	for (n = 0; n < tile_size_bytes / NV_BLOCKLINEAR_SECTOR_SIZE;
+	     n++, tiled += NV_BLOCKLINEAR_SECTOR_SIZE) {
+		y = tile_top + (((n >> 5) << 3) | (((n >> 2) & 3) << 1) | (n & 1));
+		x = tile_left + ((((n >> 4) & 1) << 5) | (((n >> 1) & 1) << 4));
+
+		if (tiled >= tiled_last)
+			return;
+
+		if (x >= row_bytes || y >= bo->height)
+			continue;
+
+		line = untiled + y * bo->strides[0] + x;
+		len = MIN(NV_BLOCKLINEAR_SECTOR_SIZE, row_bytes - x);
+
+		if (len == NV_BLOCKLINEAR_SECTOR_SIZE && type == TEGRA_READ_TILED_BUFFER)
+			transfer_sector(line, tiled);
+		else if (len == NV_BLOCKLINEAR_SECTOR_SIZE)
+			transfer_sector(tiled, line);
+		else if (type == TEGRA_READ_TILED_BUFFER)
+			memcpy(line, tiled, len);
+		else
+			memcpy(tiled, line, len);
+	}
+}
+
+struct tegra_transfer {
+	struct bo *bo;
+	uint8_t *tiled;
+	uint8_t *untiled;
+	uint8_t *tiled_last;
+	enum tegra_map_type type;
+	uint32_t bytes_per_pixel;
+	uint32_t gob_width;
+	uint32_t gob_height;
+	uint32_t gob_size_bytes;
+	uint32_t gob_size_pixels;
+	uint32_t gob_count_x;
+};
+
+/* Transfers the GOB rows [begin, end), which are independent of each other. */
+static void transfer_gob_rows(void *data, size_t begin, size_t end)
+{
+	struct tegra_transfer *t = data;
+	struct bo *bo = t->bo;
+	uint32_t i, gob_top;
+	size_t j, offset;
+	uint8_t *tmp;
+
+	for (j = begin; j < end; j++) {
+		gob_top = j * t->gob_height;
+		offset = j * t->gob_count_x * t->gob_size_bytes;
+		for (i = 0; i < t->gob_count_x; i++) {
+			tmp = t->tiled + offset;
+
+			/* Pixels never straddle sectors unless the pixel size doesn't divide 16. */
+			if (NV_BLOCKLINEAR_SECTOR_SIZE % t->bytes_per_pixel == 0)
+				transfer_tile_sectors(bo, tmp, t->untiled, t->type, gob_top,
+						      i * NV_BLOCKLINEAR_GOB_WIDTH, t->gob_size_bytes,
+						      bo->width * t->bytes_per_pixel, t->tiled_last);
+			else
+				transfer_tile(bo, tmp, t->untiled, t->type, t->bytes_per_pixel,
+					      gob_top, i * t->gob_width, t->gob_size_pixels,
+					      t->tiled_last);
+
+			offset += t->gob_size_bytes;
+		}
+	}
+}
+
 static void transfer_tiled_memory(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
 				  enum tegra_map_type type)
 {
-	uint32_t gob_width, gob_height, gob_size_bytes, gob_size_pixels, gob_count_x, gob_count_y,
-	    gob_top, gob_left;
-	uint32_t i, j, offset;
-	uint8_t *tmp, *tiled_last;
-	uint32_t bytes_per_pixel = drv_stride_from_format(bo->format, 1, 0);
+	uint32_t gob_count_y;
+	struct tegra_transfer t;
+
+	t.bo = bo;
+	t.tiled = tiled;
+	t.untiled = untiled;
+	t.type = type;
+	t.bytes_per_pixel = drv_stride_from_format(bo->format, 1, 0);
 
 	/*
 	 * The blocklinear format consists of 8*(2^n) x 64 byte sized tiles,
 	 * where 0 <= n <= 4.
 	 */
-	gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, bytes_per_pixel);
-	gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
+	t.gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, t.bytes_per_pixel);
+	t.gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
 	/* Calculate the height from maximum possible gob height */
-	while (gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && gob_height >= 2 * bo->height)
-		gob_height /= 2;
+	while (t.gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && t.gob_height >= 2 * bo->height)
+		t.gob_height /= 2;
 
-	gob_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
-	gob_size_pixels = gob_height * gob_width;
+	t.gob_size_bytes = t.gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
+	t.gob_size_pixels = t.gob_height * t.gob_width;
 
-	gob_count_x = DIV_ROUND_UP(bo->strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
-	gob_count_y = DIV_ROUND_UP(bo->height, gob_height);
+	t.gob_count_x = DIV_ROUND_UP(bo->strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
+	gob_count_y = DIV_ROUND_UP(bo->height, t.gob_height);
 
-	tiled_last = tiled + bo->total_size;
+	t.tiled_last = tiled + bo->total_size;
 
-	offset = 0;
-	for (j = 0; j < gob_count_y; j++) {
-		gob_top = j * gob_height;
-		for (i = 0; i < gob_count_x; i++) {
-			tmp = tiled + offset;
-			gob_left = i * gob_width;
-
-			transfer_tile(bo, tmp, untiled, type, bytes_per_pixel, gob_top, gob_left,
-				      gob_size_pixels, tiled_last);
-
-			offset += gob_size_bytes;
-		}
-	}
+	drv_parallel_for(bo->drv, gob_count_y, t.gob_count_x * t.gob_size_bytes, transfer_gob_rows,
+			 &t);
 }
 
 static int tegra_init(struct driver *drv)
@@ -310,8 +398,7 @@ static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		return MAP_FAILED;
 	}
 
-	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			  gem_map.offset);
+	void *addr = drv_mmap(bo->total_size, map_flags, bo->drv->fd, gem_map.offset, false);
 	vma->length = bo->total_size;
 	if ((bo->tiling & 0xFF) == NV_MEM_KIND_C32_2CRA && addr != MAP_FAILED) {
 		priv = calloc(1, sizeof(*priv));
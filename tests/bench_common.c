@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+void bench_sort(uint64_t *samples, size_t count)
+{
+	qsort(samples, count, sizeof(*samples), compare_u64);
+}
+
+double bench_percentile_us(const uint64_t *sorted, size_t count, uint32_t percent)
+{
+	size_t index = count * percent / 100;
+	return (index < count ? sorted[index] : sorted[count - 1]) / 1000.0;
+}
+
+struct gbm_device *bench_open_device(const char *path)
+{
+	struct gbm_device *gbm;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return NULL;
+	}
+
+	gbm = gbm_create_device(fd);
+	if (!gbm) {
+		fprintf(stderr, "failed to create gbm device\n");
+		close(fd);
+		return NULL;
+	}
+
+	return gbm;
+}
+
+void bench_close_device(struct gbm_device *gbm)
+{
+	int fd = gbm_device_get_fd(gbm);
+
+	gbm_device_destroy(gbm);
+	close(fd);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gbm.h"
+
+#define BENCH_DEFAULT_DEVICE "/dev/dri/renderD128"
+
+uint64_t bench_now_ns(void);
+
+/* Sorts count latency samples in ns, so that bench_percentile_us() can pick from them. */
+void bench_sort(uint64_t *samples, size_t count);
+double bench_percentile_us(const uint64_t *sorted, size_t count, uint32_t percent);
+
+/* Creates a gbm device on the node at path, or prints why it couldn't and returns NULL. */
+struct gbm_device *bench_open_device(const char *path);
+/* Destroys a device from bench_open_device() and closes its node. */
+void bench_close_device(struct gbm_device *gbm);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures the cost of mapping and unmapping a buffer while a growing number of other
+ * buffers stay mapped. The probe buffer keeps one mapping alive, so every iteration goes
+ * through the mapping lookup without touching the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "bench_common.h"
+#include "gbm.h"
+
+#define BO_SIZE 64
+#define ITERATIONS 100000
+
+static const uint32_t live_counts[] = { 0, 16, 256, 1024, 4096 };
+
+static struct gbm_bo *create_and_map(struct gbm_device *gbm, void **map_data)
+{
+	uint32_t stride;
+	struct gbm_bo *bo;
+
+	bo = gbm_bo_create(gbm, BO_SIZE, BO_SIZE, GBM_FORMAT_ARGB8888,
+			   GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN);
+	if (!bo)
+		return NULL;
+
+	if (gbm_bo_map(bo, 0, 0, BO_SIZE, BO_SIZE, GBM_BO_TRANSFER_READ_WRITE, &stride, map_data,
+		       0) == MAP_FAILED) {
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+static int run(struct gbm_device *gbm, uint32_t live)
+{
+	uint32_t i, stride;
+	uint64_t start, elapsed;
+	void *map_data, *probe_data;
+	struct gbm_bo *probe;
+	struct gbm_bo **bos;
+	void **bo_data;
+	int ret = 0;
+
+	bos = calloc(live, sizeof(*bos));
+	bo_data = calloc(live, sizeof(*bo_data));
+	if (live && (!bos || !bo_data)) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < live; i++) {
+		bos[i] = create_and_map(gbm, &bo_data[i]);
+		if (!bos[i]) {
+			fprintf(stderr, "failed to create live buffer %u\n", i);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	probe = create_and_map(gbm, &probe_data);
+	if (!probe) {
+		fprintf(stderr, "failed to create probe buffer\n");
+		ret = -1;
+		goto out;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		if (gbm_bo_map(probe, 0, 0, BO_SIZE, BO_SIZE, GBM_BO_TRANSFER_READ_WRITE, &stride,
+			       &map_data, 0) == MAP_FAILED) {
+			fprintf(stderr, "map failed\n");
+			ret = -1;
+			break;
+		}
+
+		gbm_bo_unmap(probe, map_data);
+	}
+	elapsed = bench_now_ns() - start;
+
+	if (!ret)
+		printf("%6u live mappings: %8.1f ns per map/unmap\n", live,
+		       (double)elapsed / ITERATIONS);
+
+	gbm_bo_unmap(probe, probe_data);
+	gbm_bo_destroy(probe);
+
+out:
+	for (i = 0; i < live && bos && bos[i]; i++) {
+		gbm_bo_unmap(bos[i], bo_data[i]);
+		gbm_bo_destroy(bos[i]);
+	}
+
+	free(bos);
+	free(bo_data);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : BENCH_DEFAULT_DEVICE;
+	struct gbm_device *gbm;
+	uint32_t i;
+	int ret = 0;
+
+	gbm = bench_open_device(path);
+	if (!gbm)
+		return EXIT_FAILURE;
+
+	printf("map_bench on %s (%s)\n", path, gbm_device_get_backend_name(gbm));
+	for (i = 0; i < sizeof(live_counts) / sizeof(live_counts[0]) && !ret; i++)
+		ret = run(gbm, live_counts[i]);
+
+	bench_close_device(gbm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures the gbm entry points that allocators and compositors call per frame: create, create
+ * with modifiers, import, map/unmap and destroy, for a few formats and sizes and with a growing
+ * number of threads. Every call is timed on its own, so the report has the throughput of a run as
+ * well as latency percentiles. Formats the device doesn't support are skipped, which lets the same
+ * binary run on vgem and on real hardware.
+ *
+ * Usage: minigbm_bench [-i iterations] [-t max threads] [device]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "gbm.h"
+
+#define MAX_THREADS 64
+#define DEFAULT_ITERATIONS 1000
+#define DEFAULT_MAX_THREADS 8
+
+static const uint32_t bo_flags =
+    GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN;
+
+static const uint32_t formats[] = { GBM_FORMAT_ARGB8888, GBM_FORMAT_RGB565, GBM_FORMAT_NV12 };
+
+static const struct {
+	uint32_t width;
+	uint32_t height;
+} sizes[] = { { 64, 64 }, { 256, 256 }, { 1920, 1080 } };
+
+enum bench_op {
+	BENCH_CREATE,
+	BENCH_CREATE_WITH_MODIFIERS,
+	BENCH_IMPORT,
+	BENCH_MAP,
+};
+
+static const char *const op_names[] = { "create", "create_mod", "import", "map/unmap" };
+
+struct bench {
+	struct gbm_device *gbm;
+	enum bench_op op;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t iterations;
+};
+
+struct thread_data {
+	const struct bench *bench;
+	/* Latency of the measured call, and of the destroy that follows it where there is one. */
+	uint64_t *op_ns;
+	uint64_t *destroy_ns;
+	uint32_t num_destroys;
+	int ret;
+};
+
+static struct gbm_bo *create_bo(const struct bench *bench)
+{
+	static const uint64_t linear = 0; /* DRM_FORMAT_MOD_LINEAR */
+
+	if (bench->op == BENCH_CREATE_WITH_MODIFIERS)
+		return gbm_bo_create_with_modifiers(bench->gbm, bench->width, bench->height,
+						    bench->format, &linear, 1);
+
+	return gbm_bo_create(bench->gbm, bench->width, bench->height, bench->format, bo_flags);
+}
+
+static int export_bo(struct gbm_bo *bo, struct gbm_import_fd_planar_data *data)
+{
+	size_t plane, num_planes = gbm_bo_get_num_planes(bo);
+
+	memset(data, 0, sizeof(*data));
+	for (plane = 0; plane < GBM_MAX_PLANES; plane++)
+		data->fds[plane] = -1;
+
+	data->width = gbm_bo_get_width(bo);
+	data->height = gbm_bo_get_height(bo);
+	data->format = gbm_bo_get_format(bo);
+
+	for (plane = 0; plane < num_planes; plane++) {
+		data->fds[plane] = gbm_bo_get_plane_fd(bo, plane);
+		if (data->fds[plane] < 0)
+			return -1;
+
+		data->strides[plane] = gbm_bo_get_plane_stride(bo, plane);
+		data->offsets[plane] = gbm_bo_get_plane_offset(bo, plane);
+		data->format_modifiers[plane] = gbm_bo_get_plane_format_modifier(bo, plane);
+	}
+
+	return 0;
+}
+
+static void close_fds(struct gbm_import_fd_planar_data *data)
+{
+	size_t plane;
+
+	for (plane = 0; plane < GBM_MAX_PLANES; plane++) {
+		if (data->fds[plane] >= 0)
+			close(data->fds[plane]);
+	}
+}
+
+static int run_create(struct thread_data *data)
+{
+	const struct bench *bench = data->bench;
+	struct gbm_bo *bo;
+	uint64_t start, created;
+	uint32_t i;
+
+	for (i = 0; i < bench->iterations; i++) {
+		start = bench_now_ns();
+		bo = create_bo(bench);
+		created = bench_now_ns();
+		if (!bo)
+			return -1;
+
+		gbm_bo_destroy(bo);
+		data->op_ns[i] = created - start;
+		data->destroy_ns[i] = bench_now_ns() - created;
+	}
+
+	data->num_destroys = bench->iterations;
+	return 0;
+}
+
+static int run_import(struct thread_data *data)
+{
+	const struct bench *bench = data->bench;
+	struct gbm_import_fd_planar_data import;
+	struct gbm_bo *source, *bo;
+	uint64_t start, imported;
+	uint32_t i;
+	int ret = 0;
+
+	source = create_bo(bench);
+	if (!source)
+		return -1;
+
+	if (export_bo(source, &import)) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < bench->iterations; i++) {
+		start = bench_now_ns();
+		bo = gbm_bo_import(bench->gbm, GBM_BO_IMPORT_FD_PLANAR, &import, bo_flags);
+		imported = bench_now_ns();
+		if (!bo) {
+			ret = -1;
+			break;
+		}
+
+		gbm_bo_destroy(bo);
+		data->op_ns[i] = imported - start;
+		data->destroy_ns[i] = bench_now_ns() - imported;
+	}
+
+	data->num_destroys = i;
+
+out:
+	close_fds(&import);
+	gbm_bo_destroy(source);
+	return ret;
+}
+
+static int run_map(struct thread_data *data)
+{
+	const struct bench *bench = data->bench;
+	struct gbm_bo *bo;
+	uint64_t start;
+	uint32_t i, stride;
+	void *map_data;
+	int ret = 0;
+
+	bo = create_bo(bench);
+	if (!bo)
+		return -1;
+
+	for (i = 0; i < bench->iterations; i++) {
+		start = bench_now_ns();
+		if (gbm_bo_map(bo, 0, 0, bench->width, bench->height, GBM_BO_TRANSFER_READ_WRITE,
+			       &stride, &map_data, 0) == MAP_FAILED) {
+			ret = -1;
+			break;
+		}
+
+		gbm_bo_unmap(bo, map_data);
+		data->op_ns[i] = bench_now_ns() - start;
+	}
+
+	gbm_bo_destroy(bo);
+	return ret;
+}
+
+static void *thread_main(void *arg)
+{
+	struct thread_data *data = arg;
+
+	switch (data->bench->op) {
+	case BENCH_CREATE:
+	case BENCH_CREATE_WITH_MODIFIERS:
+		data->ret = run_create(data);
+		break;
+	case BENCH_IMPORT:
+		data->ret = run_import(data);
+		break;
+	case BENCH_MAP:
+		data->ret = run_map(data);
+		break;
+	}
+
+	return NULL;
+}
+
+static void report(const struct bench *bench, const char *name, uint32_t num_threads,
+		   uint64_t *samples, size_t count, uint64_t elapsed)
+{
+	char size[32], rate[32] = "";
+
+	bench_sort(samples, count);
+	snprintf(size, sizeof(size), "%ux%u", bench->width, bench->height);
+	if (elapsed)
+		snprintf(rate, sizeof(rate), "%.0f/s", count * 1e9 / elapsed);
+
+	printf("%-10s %.4s %-9s %2u threads: %10s  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n",
+	       name, (const char *)&bench->format, size, num_threads, rate,
+	       bench_percentile_us(samples, count, 50), bench_percentile_us(samples, count, 90),
+	       bench_percentile_us(samples, count, 99), samples[count - 1] / 1000.0);
+}
+
+/*
+ * The rate counts whole iterations, so for create and import it includes the destroy that follows.
+ * Returns 1 if the device can't allocate the bench's buffers, so the caller can skip it.
+ */
+static int run(const struct bench *bench, uint32_t num_threads)
+{
+	pthread_t threads[MAX_THREADS];
+	struct thread_data data[MAX_THREADS];
+	size_t total = (size_t)bench->iterations * num_threads;
+	uint64_t *op_ns, *destroy_ns, start, elapsed;
+	struct gbm_bo *probe;
+	size_t num_destroys = 0;
+	uint32_t i;
+	int ret = 0;
+
+	probe = create_bo(bench);
+	if (!probe)
+		return 1;
+	gbm_bo_destroy(probe);
+
+	op_ns = calloc(total, sizeof(*op_ns));
+	destroy_ns = calloc(total, sizeof(*destroy_ns));
+	if (!op_ns || !destroy_ns) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < num_threads; i++) {
+		data[i].bench = bench;
+		data[i].op_ns = op_ns + (size_t)i * bench->iterations;
+		data[i].destroy_ns = destroy_ns + (size_t)i * bench->iterations;
+		data[i].num_destroys = 0;
+		data[i].ret = 0;
+
+		if (pthread_create(&threads[i], NULL, thread_main, &data[i])) {
+			num_threads = i;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		ret |= data[i].ret;
+	}
+	elapsed = bench_now_ns() - start;
+
+	if (ret) {
+		fprintf(stderr, "%s of %.4s %ux%u failed with %u threads\n", op_names[bench->op],
+			(const char *)&bench->format, bench->width, bench->height, num_threads);
+		goto out;
+	}
+
+	report(bench, op_names[bench->op], num_threads, op_ns, total, elapsed);
+
+	/* Every thread filled its whole slice, so the destroy samples are contiguous. */
+	for (i = 0; i < num_threads; i++)
+		num_destroys += data[i].num_destroys;
+	if (num_destroys)
+		report(bench, "destroy", num_threads, destroy_ns, num_destroys, 0);
+
+out:
+	free(op_ns);
+	free(destroy_ns);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = BENCH_DEFAULT_DEVICE;
+	uint32_t iterations = DEFAULT_ITERATIONS, max_threads = DEFAULT_MAX_THREADS;
+	uint32_t op, f, s, num_threads;
+	struct gbm_device *gbm;
+	struct bench bench;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "i:t:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i iterations] [-t max threads] [device]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	if (!iterations || !max_threads || max_threads > MAX_THREADS) {
+		fprintf(stderr, "iterations must be positive and threads at most %u\n",
+			MAX_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	gbm = bench_open_device(path);
+	if (!gbm)
+		return EXIT_FAILURE;
+
+	printf("minigbm_bench on %s (%s), %u iterations per thread\n", path,
+	       gbm_device_get_backend_name(gbm), iterations);
+
+	bench.gbm = gbm;
+	bench.iterations = iterations;
+
+	for (op = BENCH_CREATE; op <= BENCH_MAP; op++) {
+		for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+			for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+				bench.op = op;
+				bench.format = formats[f];
+				bench.width = sizes[s].width;
+				bench.height = sizes[s].height;
+
+				for (num_threads = 1; num_threads <= max_threads;
+				     num_threads *= 2) {
+					ret = run(&bench, num_threads);
+					if (ret)
+						break;
+				}
+
+				if (ret > 0) {
+					printf("%-10s %.4s %ux%u: not supported\n", op_names[op],
+					       (const char *)&bench.format, bench.width,
+					       bench.height);
+					ret = 0;
+				}
+
+				if (ret < 0)
+					goto out;
+			}
+		}
+	}
+
+out:
+	bench_close_device(gbm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
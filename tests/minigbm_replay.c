@@ -0,0 +1,149 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Replays a call log that minigbm wrote with MINIGBM_RECORD set, or gbm_device_record(), on a
+ * device, and compares the latencies of each kind of call with the recorded ones. A log recorded
+ * on one device or build and replayed on another shows where the two differ, without the app that
+ * produced it.
+ *
+ * Usage: minigbm_replay log [device]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "gbm.h"
+
+#define NUM_OPS (GBM_REPLAY_DESTROY + 1)
+
+static const char *const op_names[NUM_OPS] = { "create", "import", "map", "unmap", "destroy" };
+
+struct samples {
+	uint64_t *recorded_ns;
+	uint64_t *replayed_ns;
+	size_t count;
+	size_t capacity;
+	size_t failures;
+};
+
+struct replay {
+	struct samples ops[NUM_OPS];
+	int ret;
+};
+
+static void replay_call(void *data, uint32_t op, int result, uint64_t recorded_ns,
+			uint64_t replayed_ns)
+{
+	struct replay *replay = data;
+	struct samples *samples;
+	uint64_t *recorded, *replayed;
+	size_t capacity;
+
+	if (op >= NUM_OPS || replay->ret)
+		return;
+
+	samples = &replay->ops[op];
+	if (result) {
+		samples->failures++;
+		return;
+	}
+
+	if (samples->count == samples->capacity) {
+		capacity = samples->capacity ? 2 * samples->capacity : 1024;
+		recorded = realloc(samples->recorded_ns, capacity * sizeof(*recorded));
+		if (recorded)
+			samples->recorded_ns = recorded;
+
+		replayed = realloc(samples->replayed_ns, capacity * sizeof(*replayed));
+		if (replayed)
+			samples->replayed_ns = replayed;
+
+		if (!recorded || !replayed) {
+			replay->ret = -ENOMEM;
+			return;
+		}
+
+		samples->capacity = capacity;
+	}
+
+	samples->recorded_ns[samples->count] = recorded_ns;
+	samples->replayed_ns[samples->count] = replayed_ns;
+	samples->count++;
+}
+
+static void report_latencies(const char *name, uint64_t *samples, size_t count)
+{
+	bench_sort(samples, count);
+	printf("  %-8s p50 %8.1f  p99 %8.1f  max %8.1f us\n", name,
+	       bench_percentile_us(samples, count, 50), bench_percentile_us(samples, count, 99),
+	       samples[count - 1] / 1000.0);
+}
+
+static void report(const struct replay *replay)
+{
+	const struct samples *samples;
+	uint32_t op;
+
+	for (op = 0; op < NUM_OPS; op++) {
+		samples = &replay->ops[op];
+		if (!samples->count && !samples->failures)
+			continue;
+
+		printf("%-8s %8zu calls, %zu failed\n", op_names[op], samples->count,
+		       samples->failures);
+		if (!samples->count)
+			continue;
+
+		report_latencies("recorded", samples->recorded_ns, samples->count);
+		report_latencies("replayed", samples->replayed_ns, samples->count);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = BENCH_DEFAULT_DEVICE;
+	struct replay replay;
+	struct gbm_device *gbm;
+	uint32_t op;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s log [device]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3)
+		path = argv[2];
+
+	gbm = bench_open_device(path);
+	if (!gbm)
+		return EXIT_FAILURE;
+
+	memset(&replay, 0, sizeof(replay));
+	ret = gbm_device_replay(gbm, argv[1], replay_call, &replay);
+	if (ret < 0)
+		fprintf(stderr, "failed to replay %s: %s\n", argv[1], strerror(-ret));
+	else if (replay.ret)
+		fprintf(stderr, "out of memory for the samples\n");
+
+	if (ret >= 0 && !replay.ret) {
+		printf("minigbm_replay of %s on %s (%s), %d calls\n", argv[1], path,
+		       gbm_device_get_backend_name(gbm), ret);
+		report(&replay);
+	}
+
+	for (op = 0; op < NUM_OPS; op++) {
+		free(replay.ops[op].recorded_ns);
+		free(replay.ops[op].replayed_ns);
+	}
+
+	bench_close_device(gbm);
+	return ret < 0 || replay.ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
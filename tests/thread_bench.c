@@ -0,0 +1,158 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Stresses the driver from several threads at once. Every thread either maps and unmaps its own
+ * buffer, or creates, maps and destroys buffers in a loop. Throughput should scale with the number
+ * of threads as long as the threads don't serialize on a shared lock.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bench_common.h"
+#include "gbm.h"
+
+#define BO_SIZE 64
+#define MAX_THREADS 16
+#define MAP_ITERATIONS 200000
+#define CHURN_ITERATIONS 5000
+
+static const uint32_t bo_flags =
+    GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN;
+
+struct thread_data {
+	struct gbm_device *gbm;
+	int (*work)(struct gbm_device *gbm);
+	int ret;
+};
+
+static int map_unmap(struct gbm_device *gbm)
+{
+	uint32_t i, stride;
+	void *base_data, *map_data;
+	struct gbm_bo *bo;
+	int ret = 0;
+
+	bo = gbm_bo_create(gbm, BO_SIZE, BO_SIZE, GBM_FORMAT_ARGB8888, bo_flags);
+	if (!bo)
+		return -1;
+
+	/* Keep a mapping alive so that the loop only exercises the mapping bookkeeping. */
+	if (gbm_bo_map(bo, 0, 0, BO_SIZE, BO_SIZE, GBM_BO_TRANSFER_READ_WRITE, &stride, &base_data,
+		       0) == MAP_FAILED) {
+		gbm_bo_destroy(bo);
+		return -1;
+	}
+
+	for (i = 0; i < MAP_ITERATIONS; i++) {
+		if (gbm_bo_map(bo, 0, 0, BO_SIZE, BO_SIZE, GBM_BO_TRANSFER_READ_WRITE, &stride,
+			       &map_data, 0) == MAP_FAILED) {
+			ret = -1;
+			break;
+		}
+
+		gbm_bo_unmap(bo, map_data);
+	}
+
+	gbm_bo_unmap(bo, base_data);
+	gbm_bo_destroy(bo);
+	return ret;
+}
+
+static int churn(struct gbm_device *gbm)
+{
+	uint32_t i, stride;
+	void *addr, *map_data;
+	struct gbm_bo *bo;
+
+	for (i = 0; i < CHURN_ITERATIONS; i++) {
+		bo = gbm_bo_create(gbm, BO_SIZE, BO_SIZE, GBM_FORMAT_ARGB8888, bo_flags);
+		if (!bo)
+			return -1;
+
+		addr = gbm_bo_map(bo, 0, 0, BO_SIZE, BO_SIZE, GBM_BO_TRANSFER_WRITE, &stride,
+				  &map_data, 0);
+		if (addr == MAP_FAILED) {
+			gbm_bo_destroy(bo);
+			return -1;
+		}
+
+		memset(addr, 0, stride);
+		gbm_bo_unmap(bo, map_data);
+		gbm_bo_destroy(bo);
+	}
+
+	return 0;
+}
+
+static void *thread_main(void *arg)
+{
+	struct thread_data *data = arg;
+	data->ret = data->work(data->gbm);
+	return NULL;
+}
+
+static int run(struct gbm_device *gbm, const char *name, int (*work)(struct gbm_device *gbm),
+	       uint32_t iterations, uint32_t num_threads)
+{
+	pthread_t threads[MAX_THREADS];
+	struct thread_data data[MAX_THREADS];
+	uint64_t start, elapsed;
+	uint32_t i;
+	int ret = 0;
+
+	start = bench_now_ns();
+	for (i = 0; i < num_threads; i++) {
+		data[i].gbm = gbm;
+		data[i].work = work;
+		data[i].ret = 0;
+		if (pthread_create(&threads[i], NULL, thread_main, &data[i])) {
+			num_threads = i;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		ret |= data[i].ret;
+	}
+	elapsed = bench_now_ns() - start;
+
+	if (ret) {
+		fprintf(stderr, "%s failed with %u threads\n", name, num_threads);
+		return ret;
+	}
+
+	printf("%-10s %2u threads: %10.0f ops/s\n", name, num_threads,
+	       (double)iterations * num_threads * 1e9 / elapsed);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : BENCH_DEFAULT_DEVICE;
+	struct gbm_device *gbm;
+	uint32_t num_threads;
+	int ret = 0;
+
+	gbm = bench_open_device(path);
+	if (!gbm)
+		return EXIT_FAILURE;
+
+	printf("thread_bench on %s (%s)\n", path, gbm_device_get_backend_name(gbm));
+	for (num_threads = 1; num_threads <= MAX_THREADS && !ret; num_threads *= 2)
+		ret = run(gbm, "map/unmap", map_unmap, MAP_ITERATIONS, num_threads);
+	for (num_threads = 1; num_threads <= MAX_THREADS && !ret; num_threads *= 2)
+		ret = run(gbm, "churn", churn, CHURN_ITERATIONS, num_threads);
+
+	bench_close_device(gbm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
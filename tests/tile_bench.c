@@ -0,0 +1,83 @@
+/*
+ * Copyright 2019 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures the cost of mapping and unmapping whole render buffers for reading and writing. On
+ * backends that keep render buffers tiled, such as tegra, every map untiles the buffer into a
+ * shadow copy and every unmap tiles it back, so this mostly times the (un)tiling. Run it against
+ * two builds of the library to compare tiling paths.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "bench_common.h"
+#include "gbm.h"
+
+#define ITERATIONS 50
+
+static const struct {
+	uint32_t width;
+	uint32_t height;
+} sizes[] = { { 256, 256 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+
+static int run(struct gbm_device *gbm, uint32_t width, uint32_t height)
+{
+	uint32_t i, stride;
+	uint64_t start, elapsed;
+	void *map_data;
+	struct gbm_bo *bo;
+	int ret = 0;
+
+	bo = gbm_bo_create(gbm, width, height, GBM_FORMAT_ARGB8888,
+			   GBM_BO_USE_RENDERING | GBM_BO_USE_SW_READ_RARELY |
+			       GBM_BO_USE_SW_WRITE_RARELY);
+	if (!bo) {
+		fprintf(stderr, "failed to create %ux%u buffer\n", width, height);
+		return -1;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		if (gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_READ_WRITE, &stride,
+			       &map_data, 0) == MAP_FAILED) {
+			fprintf(stderr, "map failed\n");
+			ret = -1;
+			break;
+		}
+
+		gbm_bo_unmap(bo, map_data);
+	}
+	elapsed = bench_now_ns() - start;
+
+	if (!ret)
+		printf("%5ux%-5u: %8.3f ms per map/unmap, %8.1f MB/s\n", width, height,
+		       (double)elapsed / ITERATIONS / 1000000.0,
+		       (double)width * height * 4 * ITERATIONS * 1000.0 / elapsed);
+
+	gbm_bo_destroy(bo);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : BENCH_DEFAULT_DEVICE;
+	struct gbm_device *gbm;
+	uint32_t i;
+	int ret = 0;
+
+	gbm = bench_open_device(path);
+	if (!gbm)
+		return EXIT_FAILURE;
+
+	printf("tile_bench on %s (%s)\n", path, gbm_device_get_backend_name(gbm));
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && !ret; i++)
+		ret = run(gbm, sizes[i].width, sizes[i].height);
+
+	bench_close_device(gbm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
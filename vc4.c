@@ -73,8 +73,7 @@ static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t m
 	}
 
 	vma->length = bo->total_size;
-	return mmap(NULL, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    bo_map.offset);
+	return drv_mmap(bo->total_size, map_flags, bo->drv->fd, bo_map.offset, false);
 }
 
 const struct backend backend_vc4 = {
@@ -20,11 +20,75 @@
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 0x1000
 #endif
+#define PIPE_BUFFER 0
 #define PIPE_TEXTURE_2D 2
 
 #define MESA_LLVMPIPE_TILE_ORDER 6
 #define MESA_LLVMPIPE_TILE_SIZE (1 << MESA_LLVMPIPE_TILE_ORDER)
 
+/* From newer <virtgpu_drm.h>. */
+#ifndef DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB
+#define VIRTGPU_PARAM_RESOURCE_BLOB 3
+#define VIRTGPU_PARAM_HOST_VISIBLE 4
+
+#define VIRTGPU_BLOB_MEM_HOST3D 0x0002
+#define VIRTGPU_BLOB_FLAG_USE_MAPPABLE 0x0001
+#define VIRTGPU_BLOB_FLAG_USE_SHAREABLE 0x0002
+
+struct drm_virtgpu_resource_create_blob {
+	uint32_t blob_mem;
+	uint32_t blob_flags;
+	uint32_t bo_handle;
+	uint32_t res_handle;
+	uint64_t size;
+	uint32_t pad;
+	uint32_t cmd_size;
+	uint64_t cmd;
+	uint64_t blob_id;
+};
+
+#define DRM_VIRTGPU_RESOURCE_CREATE_BLOB 0x0a
+#define DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB                                                     \
+	DRM_IOWR(DRM_COMMAND_BASE + DRM_VIRTGPU_RESOURCE_CREATE_BLOB,                              \
+		 struct drm_virtgpu_resource_create_blob)
+#endif
+
+/*
+ * struct drm_virtgpu_resource_info of kernels with blobs, which report the blob memory where
+ * older ones had the stride. Only valid if VIRTGPU_PARAM_RESOURCE_BLOB is set.
+ */
+struct virtio_gpu_resource_info {
+	uint32_t bo_handle;
+	uint32_t res_handle;
+	uint32_t size;
+	uint32_t blob_mem;
+};
+
+/* From the virgl protocol, the command that creates the host resource backing a blob. */
+#define VIRGL_CMD0(cmd, obj, len) ((cmd) | ((obj) << 8) | ((len) << 16))
+#define VIRGL_CCMD_PIPE_RESOURCE_CREATE 48
+#define VIRGL_PIPE_RES_CREATE_SIZE 11
+#define VIRGL_PIPE_RES_CREATE_FORMAT 1
+#define VIRGL_PIPE_RES_CREATE_BIND 2
+#define VIRGL_PIPE_RES_CREATE_TARGET 3
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+#define VIRGL_PIPE_RES_CREATE_HEIGHT 5
+#define VIRGL_PIPE_RES_CREATE_DEPTH 6
+#define VIRGL_PIPE_RES_CREATE_ARRAY_SIZE 7
+#define VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+
+#define VIRGL_CCMD_RESOURCE_COPY_REGION 17
+#define VIRGL_CMD_RESOURCE_COPY_REGION_SIZE 13
+#define VIRGL_CMD_RCR_DST_RES_HANDLE 1
+#define VIRGL_CMD_RCR_DST_X 3
+#define VIRGL_CMD_RCR_DST_Y 4
+#define VIRGL_CMD_RCR_SRC_RES_HANDLE 6
+#define VIRGL_CMD_RCR_SRC_X 8
+#define VIRGL_CMD_RCR_SRC_Y 9
+#define VIRGL_CMD_RCR_SRC_W 11
+#define VIRGL_CMD_RCR_SRC_H 12
+#define VIRGL_CMD_RCR_SRC_D 13
+
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						  DRM_FORMAT_BGR888,   DRM_FORMAT_RGB565,
 						  DRM_FORMAT_XBGR8888, DRM_FORMAT_XRGB8888 };
@@ -36,6 +100,9 @@ static const uint32_t texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_RG8
 
 struct virtio_gpu_priv {
 	int has_3d;
+	int has_blob;
+	int has_host_visible;
+	uint32_t next_blob_id;
 };
 
 static uint32_t translate_format(uint32_t drm_fourcc, uint32_t plane)
@@ -137,13 +204,83 @@ fail:
 	return ret;
 }
 
+/*
+ * CPU accessed bos are blobs in host memory that the guest maps directly, when the host supports
+ * it. Their contents are then coherent between guest and host, so they need no transfers.
+ *
+ * The host lays out its textures as it likes, and the guest has no way to ask for the stride it
+ * picked. Blobs are therefore buffers to the host, laid out by the guest, and only used for bos
+ * that the host doesn't render to or sample from as images.
+ */
+static bool virtio_virgl_use_blob(struct virtio_gpu_priv *priv, uint64_t use_flags)
+{
+	const uint64_t image_use_flags = BO_USE_SCANOUT | BO_USE_CURSOR | BO_USE_RENDERING |
+					 BO_USE_TEXTURE | BO_USE_FRAMEBUFFER;
+
+	return priv->has_blob && priv->has_host_visible && (use_flags & (BO_USE_SW_MASK)) &&
+	       !(use_flags & image_use_flags);
+}
+
+static bool virtio_virgl_is_blob(struct bo *bo)
+{
+	return bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
+}
+
+static int virtio_virgl_blob_bo_create(struct bo *bo, uint32_t width, uint32_t height,
+				       uint32_t format, uint64_t use_flags)
+{
+	int ret;
+	size_t plane;
+	uint32_t stride;
+	uint32_t cmd[VIRGL_PIPE_RES_CREATE_SIZE + 1];
+	struct drm_virtgpu_resource_create_blob res_create;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	stride = drv_stride_from_format(format, width, 0);
+	drv_bo_from_format(bo, stride, height, format);
+	bo->total_size = ALIGN(bo->total_size, PAGE_SIZE);
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, VIRGL_PIPE_RES_CREATE_SIZE);
+	cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_BUFFER;
+	cmd[VIRGL_PIPE_RES_CREATE_FORMAT] = VIRGL_FORMAT_R8_UNORM;
+	cmd[VIRGL_PIPE_RES_CREATE_BIND] = VIRGL_BIND_CUSTOM;
+	cmd[VIRGL_PIPE_RES_CREATE_WIDTH] = bo->total_size;
+	cmd[VIRGL_PIPE_RES_CREATE_HEIGHT] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_DEPTH] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_ARRAY_SIZE] = 1;
+	/* Zero is not a valid blob id. */
+	cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID] = __atomic_add_fetch(&priv->next_blob_id, 1,
+								__ATOMIC_RELAXED);
+
+	memset(&res_create, 0, sizeof(res_create));
+	res_create.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+	res_create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE | VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	res_create.blob_id = cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID];
+	res_create.size = bo->total_size;
+	res_create.cmd = (uint64_t)(uintptr_t)cmd;
+	res_create.cmd_size = sizeof(cmd);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &res_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->handles[plane].u32 = res_create.bo_handle;
+
+	bo->tiling = res_create.blob_flags;
+	return 0;
+}
+
 static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
 	struct drm_virtgpu_map gem_map;
 
 	memset(&gem_map, 0, sizeof(gem_map));
-	gem_map.handle = bo->handles[0].u32;
+	gem_map.handle = bo->handles[plane].u32;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
 	if (ret) {
@@ -151,28 +288,44 @@ static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, u
 		return MAP_FAILED;
 	}
 
-	vma->length = bo->total_size;
-	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	/* Each plane may be a resource of its own. */
+	vma->length = drv_bo_handle_length(bo, plane);
+	/* Guest resources are shmem backed, host visible blobs are not. */
+	return drv_mmap(vma->length, map_flags, bo->drv->fd, gem_map.offset,
+			!virtio_virgl_is_blob(bo));
 }
 
-static int virtio_gpu_init(struct driver *drv)
+static int virtio_gpu_get_param(struct driver *drv, uint64_t param, int *value)
 {
 	int ret;
-	struct virtio_gpu_priv *priv;
 	struct drm_virtgpu_getparam args;
 
-	priv = calloc(1, sizeof(*priv));
-	drv->priv = priv;
-
 	memset(&args, 0, sizeof(args));
-	args.param = VIRTGPU_PARAM_3D_FEATURES;
-	args.value = (uint64_t)(uintptr_t)&priv->has_3d;
+	args.param = param;
+	args.value = (uint64_t)(uintptr_t)value;
 	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args);
 	if (ret) {
-		drv_log("virtio 3D acceleration is not available\n");
 		/* Be paranoid */
-		priv->has_3d = 0;
+		*value = 0;
+	}
+
+	return ret;
+}
+
+static int virtio_gpu_init(struct driver *drv)
+{
+	struct virtio_gpu_priv *priv;
+
+	priv = calloc(1, sizeof(*priv));
+	drv->priv = priv;
+
+	if (virtio_gpu_get_param(drv, VIRTGPU_PARAM_3D_FEATURES, &priv->has_3d))
+		drv_log("virtio 3D acceleration is not available\n");
+
+	/* Older kernels and hosts don't know these, their bos use transfers. */
+	if (priv->has_3d) {
+		virtio_gpu_get_param(drv, VIRTGPU_PARAM_RESOURCE_BLOB, &priv->has_blob);
+		virtio_gpu_get_param(drv, VIRTGPU_PARAM_HOST_VISIBLE, &priv->has_host_visible);
 	}
 
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
@@ -200,10 +353,38 @@ static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height,
 				uint64_t use_flags)
 {
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
-	if (priv->has_3d)
-		return virtio_virgl_bo_create(bo, width, height, format, use_flags);
-	else
+	if (!priv->has_3d)
 		return virtio_dumb_bo_create(bo, width, height, format, use_flags);
+
+	if (virtio_virgl_use_blob(priv, use_flags) &&
+	    !virtio_virgl_blob_bo_create(bo, width, height, format, use_flags))
+		return 0;
+
+	return virtio_virgl_bo_create(bo, width, height, format, use_flags);
+}
+
+/* The kernel tells blobs apart, so they are found without the tiling, as in gbm imports. */
+static int virtio_gpu_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	struct virtio_gpu_resource_info info;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret || !priv->has_blob)
+		return ret;
+
+	memset(&info, 0, sizeof(info));
+	info.bo_handle = bo->handles[0].u32;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info);
+	if (ret) {
+		/* Then only the tiling of the import data, if any, tells. */
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return 0;
+	}
+
+	bo->tiling = info.blob_mem == VIRTGPU_BLOB_MEM_HOST3D ? VIRTGPU_BLOB_FLAG_USE_MAPPABLE : 0;
+	return 0;
 }
 
 static int virtio_gpu_bo_destroy(struct bo *bo)
@@ -227,12 +408,26 @@ static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uin
 static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
+	struct drm_virtgpu_3d_wait wait;
 	struct drm_virtgpu_3d_transfer_from_host xfer;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
 	if (!priv->has_3d)
 		return 0;
 
+	/* Blobs are host memory, only the host rendering to them has to be waited for. */
+	if (virtio_virgl_is_blob(bo)) {
+		memset(&wait, 0, sizeof(wait));
+		wait.handle = mapping->vma->handle;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &wait);
+		if (ret) {
+			drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+			return ret;
+		}
+
+		return 0;
+	}
+
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
 	xfer.box.x = mapping->rect.x;
@@ -259,15 +454,16 @@ static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 	if (!priv->has_3d)
 		return 0;
 
-	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE) || virtio_virgl_is_blob(bo))
 		return 0;
 
+	/* Only the rectangles written since the last flush need to reach the host. */
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
-	xfer.box.x = mapping->rect.x;
-	xfer.box.y = mapping->rect.y;
-	xfer.box.w = mapping->rect.width;
-	xfer.box.h = mapping->rect.height;
+	xfer.box.x = mapping->dirty_rect.x;
+	xfer.box.y = mapping->dirty_rect.y;
+	xfer.box.w = mapping->dirty_rect.width;
+	xfer.box.h = mapping->dirty_rect.height;
 	xfer.box.d = 1;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
@@ -279,6 +475,76 @@ static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+static int virtio_gpu_get_res_handle(struct bo *bo, uint32_t *res_handle)
+{
+	int ret;
+	struct drm_virtgpu_resource_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.bo_handle = bo->handles[0].u32;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	*res_handle = info.res_handle;
+	return 0;
+}
+
+/*
+ * Has the host copy between the resources of two single plane textures. The guest copies of
+ * non-blob resources are brought up to date by the transfers on flush and invalidate as usual.
+ */
+static int virtio_gpu_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	int ret;
+	uint32_t dst_res, src_res;
+	uint32_t bo_handles[2] = { dst->handles[0].u32, src->handles[0].u32 };
+	uint32_t cmd[VIRGL_CMD_RESOURCE_COPY_REGION_SIZE + 1];
+	struct drm_virtgpu_execbuffer exbuf;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)dst->drv->priv;
+
+	if (!priv->has_3d || dst->num_planes != 1 || !translate_format(dst->format, 0) ||
+	    virtio_virgl_is_blob(dst) || virtio_virgl_is_blob(src))
+		return -EOPNOTSUPP;
+
+	ret = virtio_gpu_get_res_handle(dst, &dst_res);
+	if (ret)
+		return ret;
+
+	ret = virtio_gpu_get_res_handle(src, &src_res);
+	if (ret)
+		return ret;
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_RESOURCE_COPY_REGION, 0, VIRGL_CMD_RESOURCE_COPY_REGION_SIZE);
+	cmd[VIRGL_CMD_RCR_DST_RES_HANDLE] = dst_res;
+	cmd[VIRGL_CMD_RCR_DST_X] = rect->x;
+	cmd[VIRGL_CMD_RCR_DST_Y] = rect->y;
+	cmd[VIRGL_CMD_RCR_SRC_RES_HANDLE] = src_res;
+	cmd[VIRGL_CMD_RCR_SRC_X] = rect->x;
+	cmd[VIRGL_CMD_RCR_SRC_Y] = rect->y;
+	cmd[VIRGL_CMD_RCR_SRC_W] = rect->width;
+	cmd[VIRGL_CMD_RCR_SRC_H] = rect->height;
+	cmd[VIRGL_CMD_RCR_SRC_D] = 1;
+
+	memset(&exbuf, 0, sizeof(exbuf));
+	exbuf.command = (uint64_t)(uintptr_t)cmd;
+	exbuf.size = sizeof(cmd);
+	exbuf.bo_handles = (uint64_t)(uintptr_t)bo_handles;
+	exbuf.num_bo_handles = ARRAY_SIZE(bo_handles);
+	exbuf.fence_fd = -1;
+
+	ret = drmIoctl(dst->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exbuf);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
 static uint32_t virtio_gpu_resolve_format(uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -298,10 +564,11 @@ const struct backend backend_virtio_gpu = {
 	.close = virtio_gpu_close,
 	.bo_create = virtio_gpu_bo_create,
 	.bo_destroy = virtio_gpu_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = virtio_gpu_bo_import,
 	.bo_map = virtio_gpu_bo_map,
 	.bo_unmap = drv_bo_munmap,
 	.bo_invalidate = virtio_gpu_bo_invalidate,
 	.bo_flush = virtio_gpu_bo_flush,
+	.bo_copy = virtio_gpu_bo_copy,
 	.resolve_format = virtio_gpu_resolve_format,
 };